@@ -190,6 +190,81 @@ typedef struct {
 } sp_playlist_callbacks;
 
 
+/* Channel flow control statistics, see opensp_session_flowctl_stats() */
+typedef struct {
+	int window;			/* Number of channels allowed in flight */
+	int channels_in_flight;		/* Number of channels currently open */
+	int queue_depth;		/* Requests waiting for the window to open */
+	int rtt_ms;			/* Smoothed time to first reply on a channel */
+	int throughput;			/* Smoothed bytes per second per channel */
+	unsigned int num_completed;	/* Channels closed normally */
+	unsigned int num_failed;	/* Channels closed with an error */
+	unsigned int num_decreases;	/* Times the window was halved */
+} opensp_flowctl_stats;
+
+
+/* Image memory statistics, see opensp_session_image_stats() */
+typedef struct {
+	size_t bytes;			/* Data of all loaded images */
+	size_t max_bytes;		/* Budget for loaded images */
+	int num_unreferenced;		/* Images kept that nobody references */
+	unsigned int num_hits;		/* Images created that were already loaded */
+	unsigned int num_disk_hits;	/* Images read from the cache directory */
+	unsigned int num_misses;	/* Images that had to be downloaded */
+	unsigned int num_evictions;	/* Unreferenced images freed to stay within budget */
+} opensp_image_stats;
+
+
+/* Garbage collector statistics, see opensp_session_gc_stats() */
+typedef struct {
+	unsigned int num_rounds;	/* Sweeps of all objects started */
+	unsigned int num_slices;	/* Times the collector ran, a round takes one or more */
+	unsigned int last_pause_us;	/* Microseconds the last slice took */
+	unsigned int max_pause_us;	/* Microseconds the longest slice took */
+	unsigned int total_pause_ms;	/* Milliseconds all slices took */
+	unsigned int num_retired;	/* Unreferenced objects taken out of their hashtable */
+	unsigned int num_freed;		/* Objects and images freed */
+	int num_pending;		/* Retired objects not yet freed */
+} opensp_gc_stats;
+
+
+/* What the memory of a session is used for, see opensp_session_memory_stats() */
+typedef enum {
+	OPENSP_MEMORY_TRACKS,
+	OPENSP_MEMORY_ALBUMS,
+	OPENSP_MEMORY_ARTISTS,
+	OPENSP_MEMORY_IMAGES,
+	OPENSP_MEMORY_USERS,
+	OPENSP_MEMORY_PLAYLISTS,
+	OPENSP_MEMORY_REQUESTS,
+	OPENSP_MEMORY_CHANNELS,
+	OPENSP_MEMORY_PLAYER,
+	OPENSP_MEMORY_STRINGS,
+	OPENSP_MEMORY_NUM_CATEGORIES
+} opensp_memory_category;
+
+typedef struct {
+	long num_objects;		/* Objects allocated */
+	long bytes;			/* Bytes allocated for them */
+	long peak_bytes;		/* The most bytes ever allocated at once */
+} opensp_memory_usage;
+
+/* Memory statistics, see opensp_session_memory_stats() */
+typedef struct {
+	opensp_memory_usage categories[OPENSP_MEMORY_NUM_CATEGORIES];
+	opensp_memory_usage total;
+} opensp_memory_stats;
+
+
+/* Interned string statistics, see opensp_session_string_stats() */
+typedef struct {
+	int num_strings;		/* Distinct names and country lists */
+	int num_references;		/* Objects' uses of them */
+	size_t bytes;			/* Memory taken by the strings */
+	long bytes_saved;		/* Memory a copy per use would take in addition */
+} opensp_string_stats;
+
+
 /* Typedefs for callbacks */
 typedef void SP_CALLCONV albumbrowse_complete_cb(sp_albumbrowse *result, void *userdata);
 typedef void SP_CALLCONV artistbrowse_complete_cb(sp_artistbrowse *result, void *userdata);
@@ -208,6 +283,15 @@ SP_LIBEXPORT(sp_error) sp_session_logout(sp_session *session);
 SP_LIBEXPORT(sp_connectionstate) sp_session_connectionstate(sp_session *session);
 SP_LIBEXPORT(void *) sp_session_userdata(sp_session *session);
 SP_LIBEXPORT(void) sp_session_process_events(sp_session *session, int *next_timeout);
+SP_LIBEXPORT(void) opensp_session_flowctl_stats(sp_session *session, opensp_flowctl_stats *stats);
+SP_LIBEXPORT(void) opensp_session_set_browse_window(sp_session *session, int window_ms);
+SP_LIBEXPORT(void) opensp_session_set_browse_pipeline(sp_session *session, int max_chunks);
+SP_LIBEXPORT(void) opensp_session_set_image_cache_size(sp_session *session, size_t max_bytes);
+SP_LIBEXPORT(void) opensp_session_set_image_memory_size(sp_session *session, size_t max_bytes);
+SP_LIBEXPORT(void) opensp_session_image_stats(sp_session *session, opensp_image_stats *stats);
+SP_LIBEXPORT(void) opensp_session_gc_stats(sp_session *session, opensp_gc_stats *stats);
+SP_LIBEXPORT(void) opensp_session_memory_stats(sp_session *session, opensp_memory_stats *stats);
+SP_LIBEXPORT(void) opensp_session_string_stats(sp_session *session, opensp_string_stats *stats);
 SP_LIBEXPORT(sp_error) sp_session_player_load(sp_session *session, sp_track *track);
 SP_LIBEXPORT(sp_error) sp_session_player_play(sp_session *session, bool play);
 SP_LIBEXPORT(sp_error) sp_session_player_seek(sp_session *session, int offset);
@@ -5,11 +5,14 @@
 
 #include "ezxml.h"
 
+struct track_xml;
+
 sp_album *sp_album_add(sp_session *session, unsigned char id[16]);
-void osfy_album_free(sp_album *album);
+void osfy_album_free(sp_session *session, sp_album *album);
+int osfy_album_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots);
 int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t album_node);
 int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_t album_node);
-int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t album_node);
+int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, const struct track_xml *tx);
 int osfy_album_browse(sp_session *session, sp_album *album);
 
 #endif
@@ -0,0 +1,59 @@
+/*
+ * Bump allocator for short-lived memory
+ *
+ * Allocations are taken from the end of the newest chunk. Nothing is
+ * freed on its own, arena_free() frees all chunks.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "arena.h"
+
+
+#define ARENA_ROUND(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+
+void arena_init(struct arena *arena) {
+	arena->head = NULL;
+}
+
+
+void arena_free(struct arena *arena) {
+	struct arena_chunk *chunk;
+
+	while((chunk = arena->head) != NULL) {
+		arena->head = chunk->next;
+		free(chunk);
+	}
+}
+
+
+/* Get size bytes that stay valid until the arena is freed, NULL if memory is out */
+void *arena_alloc(struct arena *arena, size_t size) {
+	struct arena_chunk *chunk = arena->head;
+	size_t chunk_size;
+	void *ptr;
+
+	size = ARENA_ROUND(size);
+
+	if(chunk == NULL || chunk->size - chunk->used < size) {
+		chunk_size = chunk != NULL? 2 * chunk->size: ARENA_CHUNK_SIZE;
+		while(chunk_size < size)
+			chunk_size *= 2;
+
+		chunk = malloc(ARENA_ROUND(sizeof(struct arena_chunk)) + chunk_size);
+		if(chunk == NULL)
+			return NULL;
+
+		chunk->next = arena->head;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->head = chunk;
+	}
+
+	ptr = (char *)chunk + ARENA_ROUND(sizeof(struct arena_chunk)) + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
@@ -0,0 +1,36 @@
+#ifndef LIBOPENSPOTIFY_ARENA_H
+#define LIBOPENSPOTIFY_ARENA_H
+
+#include <stddef.h>
+
+
+/* Bytes of an arena's first chunk, each next one is twice as large */
+#define ARENA_CHUNK_SIZE	(16 * 1024)
+
+/* Allocations are rounded up to a multiple of this */
+#define ARENA_ALIGN		16
+
+
+/* A block allocations are taken from, followed by the memory itself */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+
+/*
+ * Memory that's allocated piecemeal while handling one response and
+ * freed all at once when done with it. Only used by one thread at a time.
+ *
+ */
+struct arena {
+	struct arena_chunk *head;
+};
+
+
+void arena_init(struct arena *arena);
+void arena_free(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+
+#endif
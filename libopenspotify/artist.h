@@ -6,11 +6,15 @@
 #include "ezxml.h"
 
 
+struct track_xml;
+
 sp_artist *osfy_artist_add(sp_session *session, unsigned char id[16]);
-void osfy_artist_free(sp_artist *artist);
+void osfy_artist_free(sp_session *session, sp_artist *artist);
+int osfy_artist_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots);
 int osfy_artist_load_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t artist_node);
 int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t artist_node);
-int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t artist_node);
+int osfy_artist_load_from_track_xml(sp_session *session, sp_artist *artist, const struct track_xml *tx);
+int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artist, const struct track_xml *tx);
 int osfy_artist_browse(sp_session *session, sp_artist *artist);
 
 #endif
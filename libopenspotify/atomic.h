@@ -0,0 +1,71 @@
+#ifndef LIBOPENSPOTIFY_ATOMIC_H
+#define LIBOPENSPOTIFY_ATOMIC_H
+
+/*
+ * Sequentially consistent atomic operations on ints and pointers
+ * Used for the lock-free queues in mpsc.c and the wakeup flags
+ * shared between threads
+ *
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+
+#define osfy_atomic_load_int(p)		InterlockedCompareExchange((volatile LONG *)(p), 0, 0)
+#define osfy_atomic_store_int(p, v)	((void)InterlockedExchange((volatile LONG *)(p), (LONG)(v)))
+#define osfy_atomic_xchg_int(p, v)	InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+
+#define osfy_atomic_load_ptr(p)		InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+#define osfy_atomic_store_ptr(p, v)	((void)InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v)))
+#define osfy_atomic_xchg_ptr(p, v)	InterlockedExchangePointer((PVOID volatile *)(p), (PVOID)(v))
+#else
+#define osfy_atomic_load_int(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define osfy_atomic_store_int(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define osfy_atomic_xchg_int(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+#define osfy_atomic_load_ptr(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define osfy_atomic_store_ptr(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define osfy_atomic_xchg_ptr(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+
+/*
+ * For data read by many threads at once: loads that don't write to the
+ * cache line like the ones above do on Windows, counters, and a fence
+ * keeping plain loads before the ones after it, as used by the finds in
+ * hashtable.c
+ *
+ */
+#ifdef _WIN32
+static __inline LONG osfy_atomic_read_long(volatile LONG *p) {
+	LONG value = *p;
+
+	MemoryBarrier();
+
+	return value;
+}
+
+static __inline PVOID osfy_atomic_read_pvoid(PVOID volatile *p) {
+	PVOID value = *p;
+
+	MemoryBarrier();
+
+	return value;
+}
+
+#define osfy_atomic_read_int(p)		osfy_atomic_read_long((volatile LONG *)(p))
+#define osfy_atomic_read_ptr(p)		osfy_atomic_read_pvoid((PVOID volatile *)(p))
+
+#define osfy_atomic_add_int(p, v)	InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+
+#define osfy_atomic_fence_acquire()	MemoryBarrier()
+#else
+#define osfy_atomic_read_int(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define osfy_atomic_read_ptr(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+
+#define osfy_atomic_add_int(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+
+#define osfy_atomic_fence_acquire()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+
+#endif
@@ -15,11 +15,25 @@
  * |   +--+ handle_channel()
  * |      +--+ channel_process()
  * |         +--+ browse_callback()
- * |            +--- CHANNEL_DATA: Buffer XML-data
- * |            +--+ CHANNEL_END:
- * |               +--- browse_parse_compressed_xml()
- * |               +--+ browse_send_browsetrack_request()
- * |                  +-- Will do request_post_set_result(REQ_TYPE_BROWSE_TRACKS) when done
+ * |            +--- CHANNEL_DATA: decoder_submit_serial() the XML-data
+ * |            +--- CHANNEL_END: decoder_submit_serial() the end of the chunk
+ * .
+ * .
+ * +--+ decoder thread, one job of a chunk at a time
+ * |  +--+ browse_decode()
+ * |  |  +--- Inflate XML-data
+ * |  |  +--- browse_element_callback() for complete elements
+ * |  |  +--- browse_element_decoder for each of them
+ * |  +--- browse_chunk_end() at the end of the chunk
+ * .
+ * .
+ * +--+ decoder_process()
+ * |  +--+ browse_decode_apply(), in the order the jobs were submitted
+ * |     +--- browse_element_parser for each decoded element
+ * |     +--+ browse_chunk_done() at the end of the chunk
+ * |        +--- browse_parse_chunk()
+ * |        +--+ browse_send_browsetrack_request()
+ * |           +-- Will do request_post_set_result(REQ_TYPE_BROWSE_TRACKS) when done
  * .
  * .
  * +--- DONE
@@ -28,29 +42,59 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "album.h"
+#include "arena.h"
 #include "browse.h"
 #include "buf.h"
 #include "channel.h"
 #include "commands.h"
 #include "debug.h"
+#include "decoder.h"
 #include "ezxml.h"
+#include "flowctl.h"
 #include "playlist.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
+#include "xmlstream.h"
 
 
 
+static struct browse_batch *browse_batch_of(sp_session *session, struct request *req);
+static int browse_can_coalesce(sp_session *session, struct request *req);
+static int browse_coalesce(sp_session *session, struct request *req);
+static void browse_coalesce_flush(sp_session *session, struct browse_batch *batch);
 static int browse_send_generic_request(sp_session *session, struct request *req);
+static int browse_return(sp_session *session, struct request *req);
+static int browse_abort(sp_session *session, struct request *req, sp_error error);
+static struct browse_chunk *browse_chunk_new(struct browse_callback_ctx *brctx);
+static void browse_chunk_drop(struct browse_callback_ctx *brctx, int offset, int num);
+static int browse_chunk_is_loaded(struct browse_callback_ctx *brctx, struct browse_chunk *chunk);
+static int browse_send_chunk(sp_session *session, struct browse_callback_ctx *brctx, struct browse_chunk *chunk);
+static int browse_element_callback(char *xml, int len, void *private);
+static struct browse_decode_job *browse_decode_job_new(struct browse_chunk *chunk, unsigned char *payload, int len);
+static void browse_decode_job_free(struct decode_job *job);
+static void browse_decode(struct decode_job *job);
+static void browse_decode_apply(sp_session *session, struct decode_job *job);
+static void browse_chunk_end(struct decode_job *job);
+static void browse_chunk_done_apply(sp_session *session, struct decode_job *job);
+static void browse_chunk_failed(struct browse_callback_ctx *brctx, struct browse_chunk *chunk);
+static void browse_parse_chunk(struct browse_callback_ctx *brctx, struct browse_chunk *chunk);
+static void browse_chunk_done(struct browse_callback_ctx *brctx, struct browse_chunk *chunk);
 static int browse_generic_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
 
 
 /* For giving the channel handler access to things it need to know */
 #define MAX_TRACKS_PER_REQUEST 244
+
+/* Coalesced lookups are sent once they would fill a track browse */
+#define MAX_OBJECTS_PER_BATCH MAX_TRACKS_PER_REQUEST
+
 struct callback_ctx {
 	sp_session *session;
 	struct request *req;
@@ -60,15 +104,113 @@ struct callback_ctx {
 };
 
 
+/* A part of a browse request, sent as a single CMD_BROWSE */
+struct browse_chunk {
+	struct browse_callback_ctx *brctx;
+
+	/* Inflates and parses the XML as it arrives, only used by the decoder jobs of the chunk */
+	struct xml_stream *xs;
+
+	/* Job of the payload being inflated, for browse_element_callback() */
+	struct browse_decode_job *pending;
+
+	/* Completes the chunk once the decoder jobs before it are applied */
+	struct decode_job done;
+
+	/* How the channel ended, for browse_chunk_failed() */
+	int failed;
+	int disconnected;
+	int retry_timeout;
+
+	/* Whatever's left of the document once inflated, for the browse parser */
+	struct buf *doc;
+
+	/* Objects in the chunk */
+	int offset;
+	int num;
+
+	/* Times the chunk was resent after a channel error */
+	int num_retries;
+
+	/* Next failed chunk waiting to be resent */
+	struct browse_chunk *next;
+};
+
+
+/* A payload of a chunk handed to a decoder thread, and the elements it completed */
+struct browse_decode_job {
+	struct decode_job job;
+
+	struct browse_chunk *chunk;
+	browse_element_decoder decoder;
+
+	/* Copy of the elements' text, each one NUL terminated */
+	struct buf *xml;
+	int *offsets;
+	int num_elements;
+	int max_elements;
+
+	/* Filled in by browse_decode(), from the arena */
+	void **elements;
+	struct arena arena;
+
+	/* Copy of the payload */
+	int len;
+	unsigned char data[1];
+};
+
+
+void browse_coalescer_init(sp_session *session) {
+	struct browse_coalescer *co = &session->browse;
+	int i;
+
+	for(i = 0; i < BROWSE_BATCH_NUM; i++) {
+		co->batches[i].waiting = NULL;
+		co->batches[i].num_waiting = 0;
+		co->batches[i].max_waiting = 0;
+
+		co->batches[i].objects = NULL;
+		co->batches[i].num_objects = 0;
+	}
+
+	co->window_ms = BROWSE_COALESCE_MS;
+}
+
+
+void browse_coalescer_free(sp_session *session) {
+	struct browse_coalescer *co = &session->browse;
+	int i;
+
+	for(i = 0; i < BROWSE_BATCH_NUM; i++) {
+		free(co->batches[i].waiting);
+		co->batches[i].waiting = NULL;
+
+		free(co->batches[i].objects);
+		co->batches[i].objects = NULL;
+	}
+}
+
+
 int browse_process(sp_session *session, struct request *req) {
+	struct browse_batch *batch;
 	int ret;
 
-        if(req->state == REQ_STATE_NEW)
+        if(req->state == REQ_STATE_NEW) {
+		/* Single object lookups are sent together, see browse_coalesce() */
+		if(browse_can_coalesce(session, req))
+			return browse_coalesce(session, req);
+
                 req->state = REQ_STATE_RUNNING;
+	}
         
 	if(req->next_timeout > get_millisecs())
 		return 0;
 
+	/* The coalescing window has passed, send the batch */
+	if((batch = browse_batch_of(session, req)) != NULL
+		&& batch->num_waiting && batch->waiting[0] == req)
+		browse_coalesce_flush(session, batch);
+
 	/*
 	 * Prevent request from happening again.
 	 * If there's an error the channel callback will reset the timeout
@@ -100,12 +242,208 @@ int browse_process(sp_session *session, struct request *req) {
 }
 
 
+/*
+ * Fail a browse request that can't go on, such as when the session is
+ * no longer logged in. The lookups coalesced into it are returned along
+ * with it, once any chunks in flight are done.
+ *
+ */
+int browse_fail(sp_session *session, struct request *req, sp_error error) {
+	struct browse_batch *batch;
+
+	/* Lookups coalesced into another request are returned by that one */
+	if(*(struct browse_callback_ctx **)req->input == NULL) {
+		req->next_timeout = INT_MAX;
+		return 0;
+	}
+
+	/* The batch still being collected goes down with its first request */
+	if((batch = browse_batch_of(session, req)) != NULL
+		&& batch->num_waiting && batch->waiting[0] == req)
+		browse_coalesce_flush(session, batch);
+
+	req->next_timeout = INT_MAX;
+
+	return browse_abort(session, req, error);
+}
+
+
+/* Get the batch a request's lookups would be coalesced into, if any */
+static struct browse_batch *browse_batch_of(sp_session *session, struct request *req) {
+	switch(req->type) {
+	case REQ_TYPE_BROWSE_TRACK:
+		return &session->browse.batches[BROWSE_BATCH_TRACKS];
+
+	case REQ_TYPE_BROWSE_ALBUM:
+		return &session->browse.batches[BROWSE_BATCH_ALBUMS];
+
+	case REQ_TYPE_BROWSE_ARTIST:
+		return &session->browse.batches[BROWSE_BATCH_ARTISTS];
+
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+
+static int browse_can_coalesce(sp_session *session, struct request *req) {
+	struct browse_callback_ctx *brctx;
+
+	if(browse_batch_of(session, req) == NULL || session->browse.window_ms <= 0)
+		return 0;
+
+	brctx = *(struct browse_callback_ctx **)req->input;
+
+	return brctx->num_total == 1;
+}
+
+
+/*
+ * Add a single track, album or artist lookup to the batch being collected
+ *
+ * The first request in the batch waits for the coalescing window to
+ * pass and then sends the batch, see browse_coalesce_flush(). The
+ * others wait for it to finish. Objects are unique per ID so comparing
+ * pointers is enough to avoid browsing the same object twice.
+ *
+ * Tracks are browsed with up to 244 IDs per CMD_BROWSE. Albums and
+ * artists are browsed one ID at a time but the chunks of a batch are
+ * sent concurrently, see browse_send_generic_request().
+ *
+ */
+static int browse_coalesce(sp_session *session, struct request *req) {
+	struct browse_batch *batch = browse_batch_of(session, req);
+	struct browse_callback_ctx *brctx;
+	struct request **waiting;
+	void *object;
+	int max, i;
+
+	req->state = REQ_STATE_RUNNING;
+
+	brctx = *(struct browse_callback_ctx **)req->input;
+	switch(req->type) {
+	case REQ_TYPE_BROWSE_TRACK:
+		object = brctx->data.tracks[0];
+		break;
+
+	case REQ_TYPE_BROWSE_ALBUM:
+		object = brctx->data.albums[0];
+		break;
+
+	default:
+		object = brctx->data.artists[0];
+		break;
+	}
+
+	if(batch->num_waiting == batch->max_waiting) {
+		max = batch->max_waiting? 2 * batch->max_waiting: 16;
+		waiting = realloc(batch->waiting, max * sizeof(struct request *));
+		if(waiting == NULL)
+			return request_set_result(session, req, SP_ERROR_OTHER_TRANSIENT, NULL);
+
+		batch->waiting = waiting;
+		batch->max_waiting = max;
+	}
+
+	if(batch->objects == NULL) {
+		batch->objects = malloc(MAX_OBJECTS_PER_BATCH * sizeof(void *));
+		if(batch->objects == NULL)
+			return request_set_result(session, req, SP_ERROR_OTHER_TRANSIENT, NULL);
+	}
+
+	batch->waiting[batch->num_waiting++] = req;
+
+	for(i = 0; i < batch->num_objects; i++)
+		if(batch->objects[i] == object)
+			break;
+
+	if(i == batch->num_objects) {
+		batch->objects[batch->num_objects++] = object;
+	}
+	else {
+		/* Already in the batch, drop the reference taken by the caller */
+		switch(req->type) {
+		case REQ_TYPE_BROWSE_TRACK:
+			sp_track_release((sp_track *)object);
+			break;
+
+		case REQ_TYPE_BROWSE_ALBUM:
+			sp_album_release((sp_album *)object);
+			break;
+
+		default:
+			sp_artist_release((sp_artist *)object);
+			break;
+		}
+	}
+
+
+	if(batch->num_waiting == 1) {
+		req->next_timeout = get_millisecs() + session->browse.window_ms;
+	}
+	else {
+		/* The batch now owns the object, returned by the first request */
+		free(brctx->data.tracks);
+		free(brctx);
+		*(struct browse_callback_ctx **)req->input = NULL;
+
+		req->next_timeout = INT_MAX;
+	}
+
+	DSFYDEBUG("Coalesced <type %s> lookup, %d requests waiting for %d objects\n",
+		  REQUEST_TYPE_STR(req->type), batch->num_waiting, batch->num_objects);
+
+	/* Don't wait for the window to pass if the batch is full */
+	if(batch->num_objects == MAX_OBJECTS_PER_BATCH) {
+		req = batch->waiting[0];
+		browse_coalesce_flush(session, batch);
+		request_set_timeout(session, req, 0);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Hand the batch over to its first request, which browses all the
+ * objects and then returns the other requests along with itself
+ *
+ */
+static void browse_coalesce_flush(sp_session *session, struct browse_batch *batch) {
+	struct browse_callback_ctx *brctx;
+	struct request *req;
+
+	req = batch->waiting[0];
+	brctx = *(struct browse_callback_ctx **)req->input;
+
+	/* The data union only holds arrays of pointers */
+	free(brctx->data.tracks);
+	brctx->data.tracks = (sp_track **)batch->objects;
+	brctx->num_total = batch->num_objects;
+
+	memmove(batch->waiting, batch->waiting + 1, (batch->num_waiting - 1) * sizeof(struct request *));
+	brctx->waiters = batch->waiting;
+	brctx->num_waiters = batch->num_waiting - 1;
+
+	DSFYDEBUG("Sending coalesced browse for %d objects on behalf of %d <type %s> requests\n",
+		  batch->num_objects, batch->num_waiting, REQUEST_TYPE_STR(req->type));
+
+	batch->waiting = NULL;
+	batch->num_waiting = 0;
+	batch->max_waiting = 0;
+
+	batch->objects = NULL;
+	batch->num_objects = 0;
+}
+
+
 static int browse_send_generic_request(sp_session *session, struct request *req) {
 	int ret;
 	struct browse_callback_ctx *brctx;
-	int i;
-	unsigned char *idlist;
-	int browse_type;
+	struct browse_chunk *chunk;
+	int max_chunks;
 	
 	brctx = *(struct browse_callback_ctx **)req->input;
 	
@@ -113,94 +451,298 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 	brctx->req = req;
 
 	
+	/*
+	 * Tracks may have been loaded since the request was made, from the
+	 * metadata cache for instance. Chunks of those are done without
+	 * being sent, up to the first one that needs to be browsed.
+	 *
+	 */
+	while(brctx->type == REQ_TYPE_BROWSE_PLAYLIST_TRACKS
+		&& brctx->retry == NULL && brctx->num_sent < brctx->num_total) {
+		if((chunk = browse_chunk_new(brctx)) == NULL)
+			return browse_abort(session, req, SP_ERROR_OTHER_TRANSIENT);
+
+		if(!browse_chunk_is_loaded(brctx, chunk)) {
+			brctx->retry = chunk;
+			break;
+		}
+
+		browse_parse_chunk(brctx, chunk);
+		brctx->num_browsed += chunk->num;
+		free(chunk);
+	}
+
+
 	/* Are we done yet? */
-	if(brctx->num_browsed == brctx->num_total) {
-		DSFYDEBUG("Offset reached total count of %d, returning results for <type %s>!\n", brctx->num_total, REQUEST_TYPE_STR(req->type));
-		switch(brctx->type) {
-			case REQ_TYPE_ALBUMBROWSE:
-				ret = request_set_result(session, req, brctx->data.albumbrowses[0]->error, brctx->data.albumbrowses[0]);
-				break;
+	if(brctx->num_browsed == brctx->num_total)
+		return browse_return(session, req);
 
-			case REQ_TYPE_ARTISTBROWSE:
-				ret = request_set_result(session, req, brctx->data.artistbrowses[0]->error, brctx->data.artistbrowses[0]);
-				break;
 
-			case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
-				brctx->data.playlist->state = PLAYLIST_STATE_LOADED;
-				ret = request_set_result(session, req, SP_ERROR_OK, brctx->data.playlist);
-				break;
-				
-			default:
-				ret = request_set_result(session, req, SP_ERROR_OK, NULL);
-				break;
+	/*
+	 * Keep up to browse_max_chunks chunks of tracks in flight, resending
+	 * failed ones first. Chunks beyond the first one are only sent while
+	 * the flow control window has room for them, which is all that
+	 * limits the small single ID chunks of albums and artists.
+	 *
+	 */
+	if(brctx->type == REQ_TYPE_BROWSE_TRACK || brctx->type == REQ_TYPE_BROWSE_PLAYLIST_TRACKS)
+		max_chunks = session->browse_max_chunks;
+	else
+		max_chunks = INT_MAX;
+
+	while(brctx->num_chunks < max_chunks) {
+		if(brctx->num_chunks > 0 && !flowctl_may_open(session, req->priority))
+			break;
+
+		/* The first chunk is parked until there's room for it */
+		if(brctx->num_chunks == 0 && !flowctl_admit(session, req))
+			break;
+
+		if((chunk = brctx->retry) != NULL) {
+			brctx->retry = chunk->next;
 		}
-		
-		/* Free browse callback context */
-		free(brctx);
-		
-		return ret;
+		else if(brctx->num_sent < brctx->num_total) {
+			chunk = browse_chunk_new(brctx);
+			if(chunk == NULL)
+				return browse_abort(session, req, SP_ERROR_OTHER_TRANSIENT);
+		}
+		else
+			break;
+
+		if((ret = browse_send_chunk(session, brctx, chunk)) != 0) {
+			/* Try again later, after reconnecting */
+			chunk->next = brctx->retry;
+			brctx->retry = chunk;
+			req->next_timeout = get_millisecs() + BROWSE_RETRY_TIMEOUT;
+
+			return ret;
+		}
+
+		brctx->num_chunks++;
 	}
 
+	return 0;
+}
+
+
+/* Return a request that's done, along with the lookups coalesced into it */
+static int browse_return(sp_session *session, struct request *req) {
+	struct browse_callback_ctx *brctx;
+	int i, ret;
+
+	brctx = *(struct browse_callback_ctx **)req->input;
+
+	DSFYDEBUG("Offset reached total count of %d, returning results for <type %s>!\n", brctx->num_total, REQUEST_TYPE_STR(req->type));
+	switch(brctx->type) {
+		case REQ_TYPE_ALBUMBROWSE:
+			ret = request_set_result(session, req, brctx->data.albumbrowses[0]->error, brctx->data.albumbrowses[0]);
+			break;
+
+		case REQ_TYPE_ARTISTBROWSE:
+			ret = request_set_result(session, req, brctx->data.artistbrowses[0]->error, brctx->data.artistbrowses[0]);
+			break;
+
+		case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
+			brctx->data.playlist->state = PLAYLIST_STATE_LOADED;
+			ret = request_set_result(session, req, brctx->error, brctx->data.playlist);
+			break;
+
+		case REQ_TYPE_BROWSE_TRACK:
+		case REQ_TYPE_BROWSE_ALBUM:
+		case REQ_TYPE_BROWSE_ARTIST:
+			/* Return the lookups that were coalesced into this one */
+			for(i = 0; i < brctx->num_waiters; i++)
+				request_set_result(session, brctx->waiters[i], brctx->error, NULL);
+
+			free(brctx->waiters);
+			free(brctx->data.tracks);
+
+			ret = request_set_result(session, req, brctx->error, NULL);
+			break;
+
+		default:
+			ret = request_set_result(session, req, brctx->error, NULL);
+			break;
+	}
+
+	/* Free browse callback context */
+	free(brctx);
+
+	return ret;
+}
+
+
+/*
+ * Give up on the objects that haven't been browsed yet, failing the
+ * request with the error. It's returned right away unless there are
+ * chunks in flight, in which case the last one to finish returns it.
+ *
+ */
+static int browse_abort(sp_session *session, struct request *req, sp_error error) {
+	struct browse_callback_ctx *brctx;
+	struct browse_chunk *chunk;
+
+	brctx = *(struct browse_callback_ctx **)req->input;
+	brctx->req = req;
+
+	DSFYDEBUG("Failing <type %s> with error %d, %d of %d objects browsed, %d chunks in flight\n",
+		  REQUEST_TYPE_STR(req->type), error, brctx->num_browsed, brctx->num_total, brctx->num_chunks);
+
+	if(brctx->error == SP_ERROR_OK)
+		brctx->error = error;
+
+	while((chunk = brctx->retry) != NULL) {
+		brctx->retry = chunk->next;
+
+		browse_chunk_drop(brctx, chunk->offset, chunk->num);
+		brctx->num_browsed += chunk->num;
+		free(chunk);
+	}
+
+	browse_chunk_drop(brctx, brctx->num_sent, brctx->num_total - brctx->num_sent);
+	brctx->num_browsed += brctx->num_total - brctx->num_sent;
+	brctx->num_sent = brctx->num_total;
+
+	if(brctx->num_chunks > 0)
+		return 0;
+
+	return browse_return(session, req);
+}
+
+
+/* Create a chunk for the next objects that haven't been sent yet */
+static struct browse_chunk *browse_chunk_new(struct browse_callback_ctx *brctx) {
+	struct browse_chunk *chunk;
+	int num;
 
 	/* Don't send too many browse requests at once */
-	brctx->num_in_request = brctx->num_total - brctx->num_browsed;
+	num = brctx->num_total - brctx->num_sent;
 	switch(brctx->type) {
 		case REQ_TYPE_ALBUMBROWSE:
 		case REQ_TYPE_ARTISTBROWSE:
 		case REQ_TYPE_BROWSE_ALBUM:
 		case REQ_TYPE_BROWSE_ARTIST:
-			if(brctx->num_in_request > 1)
-				brctx->num_in_request = 1;
+			if(num > 1)
+				num = 1;
 			break;
 
 		case REQ_TYPE_BROWSE_TRACK:
 		case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
-			if(brctx->num_in_request > MAX_TRACKS_PER_REQUEST)
-				brctx->num_in_request = MAX_TRACKS_PER_REQUEST;
+			if(num > MAX_TRACKS_PER_REQUEST)
+				num = MAX_TRACKS_PER_REQUEST;
 			break;
 		default:
 			DSFYDEBUG("Unsupported request!\n");
 			break;
 	}
 
+	chunk = malloc(sizeof(struct browse_chunk));
+	if(chunk == NULL)
+		return NULL;
+
+	chunk->brctx = brctx;
+	chunk->xs = NULL;
+	chunk->pending = NULL;
+	chunk->done.decode = browse_chunk_end;
+	chunk->done.apply = browse_chunk_done_apply;
+	chunk->done.release = NULL;
+	chunk->doc = NULL;
+	chunk->offset = brctx->num_sent;
+	chunk->num = num;
+	chunk->num_retries = 0;
+	chunk->next = NULL;
+
+	brctx->num_sent += num;
+
+	return chunk;
+}
+
+
+/* Release the references taken for objects that won't be browsed */
+static void browse_chunk_drop(struct browse_callback_ctx *brctx, int offset, int num) {
+	int i;
+
+	for(i = offset; i < offset + num; i++) {
+		switch(brctx->type) {
+			case REQ_TYPE_ALBUMBROWSE:
+				brctx->data.albumbrowses[i]->is_loaded = 0;
+				brctx->data.albumbrowses[i]->error = brctx->error;
+				sp_albumbrowse_release(brctx->data.albumbrowses[i]);
+				break;
+
+			case REQ_TYPE_ARTISTBROWSE:
+				brctx->data.artistbrowses[i]->is_loaded = 0;
+				brctx->data.artistbrowses[i]->error = brctx->error;
+				sp_artistbrowse_release(brctx->data.artistbrowses[i]);
+				break;
+
+			case REQ_TYPE_BROWSE_ALBUM:
+				sp_album_release(brctx->data.albums[i]);
+				break;
+
+			case REQ_TYPE_BROWSE_ARTIST:
+				sp_artist_release(brctx->data.artists[i]);
+				break;
+
+			case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
+				sp_track_release(brctx->data.playlist->tracks[i]);
+				break;
+
+			case REQ_TYPE_BROWSE_TRACK:
+				sp_track_release(brctx->data.tracks[i]);
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+
+static int browse_send_chunk(sp_session *session, struct browse_callback_ctx *brctx, struct browse_chunk *chunk) {
+	struct request *req = brctx->req;
+	unsigned char *idlist;
+	int browse_type;
+	int i, ret;
+
 
 	/* Create list of album/artist/track IDs */
-	idlist = (unsigned char *)malloc(16 * brctx->num_in_request);
+	idlist = (unsigned char *)malloc(16 * chunk->num);
 	switch(brctx->type) {
 		case REQ_TYPE_ALBUMBROWSE:
 			browse_type = BROWSE_ALBUM;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.albumbrowses[brctx->num_browsed + i]->album->id, 16);
+			for(i = 0; i < chunk->num; i++)
+				memcpy(idlist + i*16, brctx->data.albumbrowses[chunk->offset + i]->album->id, 16);
 			break;
 
 		case REQ_TYPE_ARTISTBROWSE:
 			browse_type = BROWSE_ARTIST;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.artistbrowses[brctx->num_browsed + i]->artist->id, 16);
+			for(i = 0; i < chunk->num; i++)
+				memcpy(idlist + i*16, brctx->data.artistbrowses[chunk->offset + i]->artist->id, 16);
 			break;
 			
 		case REQ_TYPE_BROWSE_ALBUM:
 			browse_type = BROWSE_ALBUM;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.albums[brctx->num_browsed + i]->id, 16);
+			for(i = 0; i < chunk->num; i++)
+				memcpy(idlist + i*16, brctx->data.albums[chunk->offset + i]->id, 16);
 			break;
 
 		case REQ_TYPE_BROWSE_ARTIST:
 			browse_type = BROWSE_ARTIST;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.artists[brctx->num_browsed + i]->id, 16);
+			for(i = 0; i < chunk->num; i++)
+				memcpy(idlist + i*16, brctx->data.artists[chunk->offset + i]->id, 16);
 			break;
 
 		case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
 			browse_type = BROWSE_TRACK;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.playlist->tracks[brctx->num_browsed + i]->id, 16);
+			for(i = 0; i < chunk->num; i++)
+				memcpy(idlist + i*16, brctx->data.playlist->tracks[chunk->offset + i]->id, 16);
 			break;
 
 		case REQ_TYPE_BROWSE_TRACK:
 			browse_type = BROWSE_TRACK;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.tracks[brctx->num_browsed + i]->id, 16);
+			for(i = 0; i < chunk->num; i++)
+				memcpy(idlist + i*16, brctx->data.tracks[chunk->offset + i]->id, 16);
 			break;
 
 		default:
@@ -212,16 +754,28 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 	/* Need to have a valid browse type */
 	assert(browse_type != 0);
 	
-	/* Buffer to hold data (gzip'd XML) retrieved */
-	assert(brctx->buf == NULL);
-	brctx->buf = buf_new();
+	/* Inflate the gzip'd XML as it's retrieved */
+	assert(chunk->xs == NULL);
+	chunk->failed = 0;
+	chunk->xs = xml_stream_new();
+	if(chunk->xs == NULL) {
+		free(idlist);
+		return -1;
+	}
+
+	if(brctx->browse_element_parser != NULL)
+		xml_stream_set_element(chunk->xs, brctx->browse_element, browse_element_callback, chunk);
 
 	
-	DSFYDEBUG("Sending BROWSE for %d items (from offset %d) on behalf of <type %s, state %s, input %p>\n",
-		  brctx->num_in_request, brctx->num_browsed, REQUEST_TYPE_STR(req->type),
+	DSFYDEBUG("Sending BROWSE for %d items (from offset %d, %d chunks in flight) on behalf of <type %s, state %s, input %p>\n",
+		  chunk->num, chunk->offset, brctx->num_chunks, REQUEST_TYPE_STR(req->type),
 		  REQUEST_STATE_STR(req->state), req->input);
 
-	ret = cmd_browse(session, browse_type, idlist, brctx->num_in_request, browse_generic_callback, brctx);
+	ret = cmd_browse(session, browse_type, idlist, chunk->num, browse_generic_callback, chunk);
+	if(ret != 0) {
+		xml_stream_free(chunk->xs);
+		chunk->xs = NULL;
+	}
 	
 	free(idlist);
 	
@@ -229,66 +783,271 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 }
 
 
-/* Callback for browse requests */
+/* Check if all tracks of a chunk are loaded already */
+static int browse_chunk_is_loaded(struct browse_callback_ctx *brctx, struct browse_chunk *chunk) {
+	int i;
+
+	for(i = 0; i < chunk->num; i++)
+		if(!brctx->data.playlist->tracks[chunk->offset + i]->is_loaded)
+			return 0;
+
+	return 1;
+}
+
+
+/*
+ * Collect an element of a chunk as soon as it's inflated
+ * It's decoded along with the other elements completed by the same
+ * payload, and loaded by browse_decode_apply().
+ *
+ */
+static int browse_element_callback(char *xml, int len, void *private) {
+	struct browse_chunk *chunk = (struct browse_chunk *)private;
+	struct browse_decode_job *bdj = chunk->pending;
+
+	if(bdj->num_elements == bdj->max_elements) {
+		bdj->max_elements = bdj->max_elements? 2 * bdj->max_elements: 16;
+		bdj->offsets = realloc(bdj->offsets, bdj->max_elements * sizeof(int));
+	}
+
+	bdj->offsets[bdj->num_elements++] = bdj->xml->len;
+	buf_append_data(bdj->xml, xml, len);
+	buf_append_u8(bdj->xml, 0);
+
+	return 0;
+}
+
+
+static struct browse_decode_job *browse_decode_job_new(struct browse_chunk *chunk, unsigned char *payload, int len) {
+	struct browse_decode_job *bdj;
+
+	bdj = malloc(sizeof(struct browse_decode_job) + len);
+	if(bdj == NULL)
+		return NULL;
+
+	memcpy(bdj->data, payload, len);
+	bdj->len = len;
+
+	bdj->job.decode = browse_decode;
+	bdj->job.apply = browse_decode_apply;
+	bdj->job.release = browse_decode_job_free;
+
+	bdj->chunk = chunk;
+	bdj->decoder = chunk->brctx->browse_element_decoder;
+
+	bdj->xml = buf_new();
+	bdj->offsets = NULL;
+	bdj->num_elements = 0;
+	bdj->max_elements = 0;
+
+	bdj->elements = NULL;
+	arena_init(&bdj->arena);
+
+	return bdj;
+}
+
+
+static void browse_decode_job_free(struct decode_job *job) {
+	struct browse_decode_job *bdj = (struct browse_decode_job *)job;
+
+	/* The decoded elements, all at once */
+	arena_free(&bdj->arena);
+
+	buf_free(bdj->xml);
+	free(bdj->offsets);
+	free(bdj);
+}
+
+
+/* Inflate a payload and decode the elements it completed, run by a decoder thread */
+static void browse_decode(struct decode_job *job) {
+	struct browse_decode_job *bdj = (struct browse_decode_job *)job;
+	struct browse_chunk *chunk = bdj->chunk;
+	int i, len;
+
+	chunk->pending = bdj;
+	xml_stream_feed(chunk->xs, bdj->data, bdj->len);
+	chunk->pending = NULL;
+
+	if(bdj->num_elements == 0)
+		return;
+
+	bdj->elements = arena_alloc(&bdj->arena, bdj->num_elements * sizeof(void *));
+	if(bdj->elements == NULL)
+		return;
+
+	for(i = 0; i < bdj->num_elements; i++) {
+		if(i + 1 < bdj->num_elements)
+			len = bdj->offsets[i + 1] - bdj->offsets[i] - 1;
+		else
+			len = bdj->xml->len - bdj->offsets[i] - 1;
+
+		bdj->elements[i] = bdj->decoder((char *)bdj->xml->ptr + bdj->offsets[i], len, &bdj->arena);
+	}
+}
+
+
+/* Let the caller's parser load the decoded elements, run by the iothread */
+static void browse_decode_apply(sp_session *session, struct decode_job *job) {
+	struct browse_decode_job *bdj = (struct browse_decode_job *)job;
+	struct browse_chunk *chunk = bdj->chunk;
+	struct browse_callback_ctx *brctx = chunk->brctx;
+	int i;
+
+	brctx->offset = chunk->offset;
+	brctx->num_in_request = chunk->num;
+
+	if(bdj->num_elements && bdj->elements == NULL)
+		DSFYDEBUG("Failed to allocate memory for %d decoded elements\n", bdj->num_elements);
+
+	for(i = 0; bdj->elements != NULL && i < bdj->num_elements; i++) {
+		if(bdj->elements[i] == NULL) {
+			DSFYDEBUG("Failed to decode element %d of %d\n", i + 1, bdj->num_elements);
+			continue;
+		}
+
+		brctx->browse_element_parser(brctx, bdj->elements[i]);
+	}
+
+	browse_decode_job_free(job);
+}
+
+
+/* Done inflating the chunk, run by a decoder thread after the chunk's other jobs */
+static void browse_chunk_end(struct decode_job *job) {
+	struct browse_chunk *chunk;
+
+	chunk = (struct browse_chunk *)((char *)job - offsetof(struct browse_chunk, done));
+
+	if(chunk->failed)
+		xml_stream_free(chunk->xs);
+	else
+		chunk->doc = xml_stream_finish(chunk->xs);
+
+	chunk->xs = NULL;
+}
+
+
+static void browse_chunk_done_apply(sp_session *session, struct decode_job *job) {
+	struct browse_chunk *chunk;
+
+	chunk = (struct browse_chunk *)((char *)job - offsetof(struct browse_chunk, done));
+	if(chunk->failed)
+		browse_chunk_failed(chunk->brctx, chunk);
+	else
+		browse_chunk_done(chunk->brctx, chunk);
+}
+
+
+/* Let the caller's parser handle a chunk, with or without data */
+static void browse_parse_chunk(struct browse_callback_ctx *brctx, struct browse_chunk *chunk) {
+	brctx->buf = chunk->doc;
+	chunk->doc = NULL;
+
+	brctx->offset = chunk->offset;
+	brctx->num_in_request = chunk->num;
+
+	brctx->browse_parser(brctx);
+
+	if(brctx->buf != NULL)
+		buf_free(brctx->buf);
+
+	brctx->buf = NULL;
+}
+
+
+/* Done with a chunk, the next one may be sent */
+static void browse_chunk_done(struct browse_callback_ctx *brctx, struct browse_chunk *chunk) {
+	browse_parse_chunk(brctx, chunk);
+	brctx->num_chunks--;
+	
+	/* Increase number of items processed */
+	brctx->num_browsed += chunk->num;
+	free(chunk);
+	
+	/* Force the next browse request to happen immediately */
+	request_set_timeout(brctx->session, brctx->req, 0);
+}
+
+
+/* A chunk failed, resend it later or give up on its objects */
+static void browse_chunk_failed(struct browse_callback_ctx *brctx, struct browse_chunk *chunk) {
+	brctx->num_chunks--;
+
+	/*
+	 * Artist browsing isn't retried, and neither are chunks
+	 * that keep failing or those of a request given up on.
+	 * A lost connection doesn't count, the chunk is sent
+	 * again from the start once logged in again.
+	 *
+	 */
+	if(brctx->error != SP_ERROR_OK
+		|| (!chunk->disconnected && (brctx->type == REQ_TYPE_ARTISTBROWSE
+			|| ++chunk->num_retries > BROWSE_MAX_RETRIES))) {
+		DSFYDEBUG("Got a channel ERROR, failing %d objects of <type %s>\n",
+			  chunk->num, REQUEST_TYPE_STR(brctx->type));
+
+		if(brctx->error == SP_ERROR_OK)
+			brctx->error = SP_ERROR_OTHER_TRANSIENT;
+
+		browse_chunk_drop(brctx, chunk->offset, chunk->num);
+
+		/* Increase number of items processed */
+		brctx->num_browsed += chunk->num;
+		free(chunk);
+	
+		/* Return the request right away if this was the last chunk */
+		request_set_timeout(brctx->session, brctx->req, 0);
+	}
+	else {
+		DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", BROWSE_RETRY_TIMEOUT);
+
+		/* Resent by browse_send_generic_request() when req->next_timeout expires */
+		chunk->next = brctx->retry;
+		brctx->retry = chunk;
+
+		request_set_timeout(brctx->session, brctx->req, chunk->retry_timeout);
+	}
+}
+
+
+/*
+ * Callback for browse requests
+ * Chunks may complete in any order, the request is returned by
+ * browse_send_generic_request() once all objects have been browsed.
+ *
+ */
 static int browse_generic_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
+	struct browse_decode_job *bdj;
+	struct browse_chunk *chunk;
 	struct browse_callback_ctx *brctx;
-	brctx = (struct browse_callback_ctx *)ch->private;
+	chunk = (struct browse_chunk *)ch->private;
+	brctx = chunk->brctx;
 
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-				
-				if (len == 0)
-					break;
+			/* Inflated on a decoder thread, after the chunk's earlier payloads */
+			if((bdj = browse_decode_job_new(chunk, payload, len)) == NULL) {
+				DSFYDEBUG("Failed to allocate a decoder job for %d bytes\n", len);
+				break;
 			}
-			
-			buf_append_data(brctx->buf, payload, len);
+
+			decoder_submit_serial(brctx->session, &bdj->job, chunk);
 			break;
 			
 		case CHANNEL_ERROR:
-			buf_free(brctx->buf);
-			brctx->buf = NULL;
-
-			if(brctx->type == REQ_TYPE_ARTISTBROWSE) {
-				DSFYDEBUG("Got a channel ERROR, failing artist browse\n");
-
-				/* Force SP_ERROR_OTHER_TRANSIENT and !loaded */
-				brctx->browse_parser(brctx);
-
-				/* Increase number of items processed */
-				brctx->num_browsed += brctx->num_in_request;
-			
-				/* Force the next browse request to happen immediately */
-				brctx->req->next_timeout = 0;
-			}
-			else {
-				DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", BROWSE_RETRY_TIMEOUT);
-
-				/* The request will be retried as soon as req->next_timeout expires */
-				brctx->req->next_timeout = get_millisecs() + BROWSE_RETRY_TIMEOUT;
-			}
+			/* Handled by browse_chunk_failed() once the chunk's decoder jobs are done */
+			chunk->failed = 1;
+			chunk->disconnected = ch->disconnected;
+			chunk->retry_timeout = channel_retry_timeout(ch, BROWSE_RETRY_TIMEOUT);
+			decoder_submit_serial(brctx->session, &chunk->done, chunk);
 			break;
 			
 		case CHANNEL_END:
-			DSFYDEBUG("Got all data, calling parser\n");
-			brctx->browse_parser(brctx);
-			buf_free(brctx->buf);
-			brctx->buf = NULL;
-			
-			/* Increase number of items processed */
-			brctx->num_browsed += brctx->num_in_request;
-			
-			/* Force the next browse request to happen immediately */
-			brctx->req->next_timeout = 0;
-			
+			DSFYDEBUG("Got all data, calling parser once decoded\n");
+
+			/* Complete the chunk once its elements have been loaded */
+			decoder_submit_serial(brctx->session, &chunk->done, chunk);
 			break;
 			
 		default:
@@ -3,6 +3,7 @@
 
 #include <libspotify/api.h>
 
+#include "arena.h"
 #include "buf.h"
 #include "hashtable.h"
 #include "request.h"
@@ -10,9 +11,54 @@
 
 #define BROWSE_RETRY_TIMEOUT	30
 
+/* Times a chunk is resent after a channel error before its objects are given up on */
+#define BROWSE_MAX_RETRIES	5
 
+/* Default time single track lookups are held back to be sent together */
+#define BROWSE_COALESCE_MS	20
+
+/* Default max number of chunks of a single browse request in flight */
+#define BROWSE_MAX_CHUNKS	4
+
+
+/* Kinds of lookups coalesced by browse_process() */
+#define BROWSE_BATCH_TRACKS	0
+#define BROWSE_BATCH_ALBUMS	1
+#define BROWSE_BATCH_ARTISTS	2
+#define BROWSE_BATCH_NUM	3
+
+
+/*
+ * Single track, album or artist lookups collected to be sent together.
+ * The first request in the batch is the one that browses all objects,
+ * the others are returned once it's done.
+ *
+ */
+struct browse_batch {
+	/* Requests waiting for the batch to be sent */
+	struct request **waiting;
+	int num_waiting;
+	int max_waiting;
+
+	/* Distinct tracks, albums or artists in the batch */
+	void **objects;
+	int num_objects;
+};
+
+
+struct browse_coalescer {
+	struct browse_batch batches[BROWSE_BATCH_NUM];
+
+	/* How long to wait for more lookups, zero disables coalescing */
+	int window_ms;
+};
+
+
+struct browse_chunk;
 struct browse_callback_ctx;
 typedef int (*browse_parser) (struct browse_callback_ctx *brctx);
+typedef void *(*browse_element_decoder) (char *xml, int len, struct arena *arena);
+typedef int (*browse_element_parser) (struct browse_callback_ctx *brctx, void *element);
 
 struct browse_callback_ctx {
 	/* Provides access to the session's hashtables among other things */
@@ -21,7 +67,7 @@ struct browse_callback_ctx {
 	/* The request, so we can store the result */
 	struct request *req;
 	
-	/* For keeping the gzip'd XML */
+	/* The inflated XML of the chunk being parsed, NULL on errors */
 	struct buf *buf;
 
 	/* Type of objects, same as request->type */
@@ -42,14 +88,44 @@ struct browse_callback_ctx {
 	/* Total number of objects we've browsed so far */
 	int num_browsed;
 	
-	/* Number of items in the current request */
+	/* Offset and number of items in the chunk being parsed */
+	int offset;
 	int num_in_request;
+
+	/* Number of objects sent so far, chunks in flight and failed ones */
+	int num_sent;
+	int num_chunks;
+	struct browse_chunk *retry;
 	
-	/* Gzip'd XML parser, provided by the caller */
+	/* XML parser called once a chunk is complete, provided by the caller */
 	browse_parser browse_parser;
+
+	/*
+	 * Optional parser for elements with the given name, called as soon
+	 * as each one has been received. These elements are left out of
+	 * the XML given to browse_parser.
+	 *
+	 * The decoder is run by a decoder thread and must not touch the
+	 * session. It returns a structure allocated from the arena, which may
+	 * point into the element's text, for the parser to load on the iothread.
+	 *
+	 */
+	const char *browse_element;
+	browse_element_decoder browse_element_decoder;
+	browse_element_parser browse_element_parser;
+
+	/* Requests merged into this one, returned along with it */
+	struct request **waiters;
+	int num_waiters;
+
+	/* Returned with the request and its waiters, set once objects were given up on */
+	sp_error error;
 };
 
 
+void browse_coalescer_init(sp_session *session);
+void browse_coalescer_free(sp_session *session);
 int browse_process(sp_session *session, struct request *req);
+int browse_fail(sp_session *session, struct request *req, sp_error error);
 
 #endif
@@ -1,26 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
 #include <libspotify/api.h>
 
-#include "hashtable.h"
+#include "cache.h"
+#include "imgcache.h"
+#include "metacache.h"
 #include "request.h"
-#include "track.h"
 #include "util.h"
 
 
+/*
+ * Map metadata and index images saved by earlier sessions
+ * Called by sp_session_init() before the networking thread is started.
+ *
+ */
 void cache_init(sp_session *session) {
-#if 0
-	osfy_track_metadata_load_from_disk(session, "tracks.cache");
+	char filename[1024];
+
+	if(session->cache_location == NULL)
+		return;
+
+#ifdef _WIN32
+	CreateDirectory(session->cache_location, NULL);
+#else
+	mkdir(session->cache_location, 0700);
 #endif
+
+	if(cache_path(session, METACACHE_FILE, filename, sizeof(filename)) == 0)
+		metacache_init(session, filename);
+
+	if(cache_path(session, IMGCACHE_DIR, filename, sizeof(filename)) == 0)
+		imgcache_init(session, filename);
 }
 
 
-int cache_process(sp_session *session, struct request *req) {
-	/* Do some garbage collection */
-	osfy_track_garbage_collect(session);
+/* Save metadata on the way out, called by sp_session_release() */
+void cache_free(sp_session *session) {
+	metacache_flush(session);
+	metacache_free(session);
 
-#if 0
-	/* Save metadata to disk */
-	osfy_track_metadata_save_to_disk(session, "tracks.cache");
-#endif
+	imgcache_free(session);
+}
+
+
+/* Get the path of a file in the cache directory */
+int cache_path(sp_session *session, const char *name, char *path, int len) {
+	if(session->cache_location == NULL)
+		return -1;
+
+	if(strlen(session->cache_location) + 1 + strlen(name) + 1 > (size_t)len)
+		return -1;
+
+	sprintf(path, "%s/%s", session->cache_location, name);
+
+	return 0;
+}
+
+
+int cache_process(sp_session *session, struct request *req) {
+	/* Save metadata to disk, the garbage collector runs on its own, see gc.c */
+	metacache_save(session);
 
 	req->next_timeout = get_millisecs() + 5*60*1000;
 
@@ -4,6 +4,8 @@
 #include "sp_opaque.h"
 
 void cache_init(sp_session *session);
+void cache_free(sp_session *session);
+int cache_path(sp_session *session, const char *name, char *path, int len);
 int cache_process(sp_session *session, struct request *req);
 
 #endif
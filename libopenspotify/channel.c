@@ -13,30 +13,172 @@
 
 #include "debug.h"
 #include "channel.h"
+#include "flowctl.h"
+#include "memstats.h"
+#include "packet.h"
 #include "sp_opaque.h"
 #include "util.h"
 
-CHANNEL *channel_register (sp_session *session, char *name, channel_callback callback,
-			   void *private)
+static int channel_table_grow (struct channel_table *table);
+static int channel_alloc_id (struct channel_table *table);
+static CHANNEL *channel_alloc (sp_session *session);
+
+
+void channel_table_init (sp_session *session)
+{
+	memset (&session->channels, 0, sizeof (struct channel_table));
+}
+
+
+/*
+ * Release the table and the CHANNEL pool
+ * All channels must have been unregistered
+ *
+ */
+void channel_table_free (sp_session *session)
+{
+	struct channel_table *table = &session->channels;
+	struct channel_slab *slab;
+	int i;
+
+	while ((slab = table->slabs) != NULL) {
+		table->slabs = slab->next;
+
+		for (i = 0; i < CHANNEL_SLAB_SIZE; i++) {
+			if (slab->channels[i].open_payload)
+				free (slab->channels[i].open_payload);
+
+			memstats_resize (session, OPENSP_MEMORY_CHANNELS, slab->channels[i].open_size, 0);
+		}
+
+		memstats_resize (session, OPENSP_MEMORY_CHANNELS, sizeof (struct channel_slab), 0);
+		free (slab);
+	}
+
+	free (table->slots);
+	free (table->used);
+
+	memset (table, 0, sizeof (struct channel_table));
+}
+
+
+/* Double the number of ids covered by the table */
+static int channel_table_grow (struct channel_table *table)
+{
+	CHANNEL **slots;
+	unsigned int *used;
+	int size;
+
+	if (table->size == CHANNEL_MAX_IDS)
+		return -1;
+
+	size = table->size ? table->size * 2 : 64;
+
+	slots = realloc (table->slots, size * sizeof (CHANNEL *));
+	if (!slots)
+		return -1;
+
+	memset (slots + table->size, 0, (size - table->size) * sizeof (CHANNEL *));
+	table->slots = slots;
+
+	used = realloc (table->used, size / 32 * sizeof (unsigned int));
+	if (!used)
+		return -1;
+
+	memset (used + table->size / 32, 0, (size - table->size) / 32 * sizeof (unsigned int));
+	table->used = used;
+
+	table->size = size;
+
+	return 0;
+}
+
+
+/* Reserve the lowest free channel id */
+static int channel_alloc_id (struct channel_table *table)
+{
+	unsigned int word;
+	int i, bit;
+
+	for (;;) {
+		for (i = table->free_hint; i < table->size / 32; i++)
+			if (table->used[i] != ~0U)
+				break;
+
+		if (i < table->size / 32)
+			break;
+
+		table->free_hint = i;
+		if (channel_table_grow (table))
+			return -1;
+	}
+
+	word = ~table->used[i];
+#ifdef __GNUC__
+	bit = __builtin_ctz (word);
+#else
+	for (bit = 0; !(word & (1U << bit)); bit++);
+#endif
+
+	table->used[i] |= 1U << bit;
+	table->free_hint = i;
+
+	return i * 32 + bit;
+}
+
+
+/* Get a CHANNEL from the pool, allocating a new slab if it's empty */
+static CHANNEL *channel_alloc (sp_session *session)
 {
+	struct channel_table *table = &session->channels;
+	struct channel_slab *slab;
 	CHANNEL *ch;
-	int id;
+	int i;
 
-	/*
-	 * Pick a channel id and lazily set next to last available + 1
-	 */
-	id = session->next_channel_id++;
-	if ((ch = session->channels) != NULL) {
-		for (; ch; ch = ch->next) {
-			if (ch->channel_id >= session->next_channel_id)
-				session->next_channel_id = ch->channel_id + 1;
+	if (table->free_list == NULL) {
+		slab = malloc (sizeof (struct channel_slab));
+		if (!slab)
+			return NULL;
+
+		memstats_resize (session, OPENSP_MEMORY_CHANNELS, 0, sizeof (struct channel_slab));
+
+		slab->next = table->slabs;
+		table->slabs = slab;
+
+		for (i = 0; i < CHANNEL_SLAB_SIZE; i++) {
+			slab->channels[i].open_payload = NULL;
+			slab->channels[i].open_size = 0;
+
+			slab->channels[i].next = table->free_list;
+			table->free_list = &slab->channels[i];
 		}
 	}
 
-	ch = malloc (sizeof (CHANNEL));
+	ch = table->free_list;
+	table->free_list = ch->next;
+
+	return ch;
+}
+
+
+CHANNEL *channel_register (sp_session *session, char *name, channel_callback callback,
+			   void *private)
+{
+	struct channel_table *table = &session->channels;
+	CHANNEL *ch;
+	int id;
+
+	ch = channel_alloc (session);
 	if (!ch)
 		return NULL;
 
+	id = channel_alloc_id (table);
+	if (id < 0) {
+		ch->next = table->free_list;
+		table->free_list = ch;
+		return NULL;
+	}
+
 	ch->channel_id = id;
 	ch->header_id = 0;
 	ch->state = CHANNEL_HEADER;
@@ -44,19 +186,33 @@ CHANNEL *channel_register (sp_session *session, char *name, channel_callback cal
 	ch->total_header_len = 0;
 	ch->total_data_len = 0;
 
+	ch->open_ms = get_millisecs();
+	ch->reply_ms = 0;
+
+	ch->open_len = -1;
+	ch->resumable = 0;
+	ch->disconnected = 0;
+	ch->replay_header_id = 0;
+	ch->replay_data_len = 0;
+
+#ifdef DEBUG
 	if (name)
 		strncpy (ch->name, name, sizeof (ch->name) - 1);
 	else
 		ch->name[0] = 0;
 	ch->name[sizeof (ch->name) - 1] = 0;
+#else
+	(void)name;
+#endif
 
 	ch->callback = callback;
 	ch->private = private;
+	ch->next = NULL;
 
-	ch->next = session->channels;
-	session->channels = ch;
+	table->slots[id] = ch;
 
 	session->num_channels++;
+	memstats_alloc (session, OPENSP_MEMORY_CHANNELS, 0);
 
 	DSFYDEBUG("Registered channel '%s' with id %d\n", ch->name, ch->channel_id);
 
@@ -65,42 +221,64 @@ CHANNEL *channel_register (sp_session *session, char *name, channel_callback cal
 
 void channel_unregister (sp_session *session, CHANNEL * ch)
 {
-	CHANNEL *tmp;
+	struct channel_table *table = &session->channels;
+	int id = ch->channel_id;
 
 	DSFYDEBUG
 		("channel %d: unregistering, %d headers, %u bytes header, %u bytes payload\n",
 		 ch->channel_id, ch->header_id, ch->total_header_len,
 		 ch->total_data_len);
 
-	if (ch == session->channels)
-		session->channels = ch->next;
-	else {
-		for (tmp = session->channels; tmp; tmp = tmp->next)
-			if (tmp->next == ch)
-				break;
+	assert (id < table->size && table->slots[id] == ch);
 
-		assert (tmp != NULL);
+	flowctl_channel_done (session, ch);
 
-		tmp->next = ch->next;
-	}
-
-	if (ch->channel_id < session->next_channel_id)
-		session->next_channel_id = ch->channel_id;
+	table->slots[id] = NULL;
+	table->used[id / 32] &= ~(1U << (id % 32));
+	if (id / 32 < table->free_hint)
+		table->free_hint = id / 32;
 
-	free (ch);
+	ch->next = table->free_list;
+	table->free_list = ch;
 
 	session->num_channels--;
+	memstats_free (session, OPENSP_MEMORY_CHANNELS, 0);
 }
 
 CHANNEL *channel_by_id (sp_session *session, unsigned short channel_id)
 {
-	CHANNEL *ch;
+	if (channel_id >= session->channels.size)
+		return NULL;
 
-	for (ch = session->channels; ch; ch = ch->next)
-		if (ch->channel_id == channel_id)
-			break;
+	return session->channels.slots[channel_id];
+}
 
-	return ch;
+/*
+ * Send the packet that opens a channel
+ * A copy is kept so the channel can be replayed by channel_replay_all()
+ *
+ */
+int channel_send (sp_session *session, CHANNEL *ch, unsigned char cmd,
+		  unsigned char *payload, unsigned short len)
+{
+	unsigned char *ptr;
+
+	if (ch->open_size < len) {
+		ptr = realloc (ch->open_payload, len);
+		if (!ptr)
+			return -1;
+
+		memstats_resize (session, OPENSP_MEMORY_CHANNELS, ch->open_size, len);
+		ch->open_payload = ptr;
+		ch->open_size = len;
+	}
+
+	memcpy (ch->open_payload, payload, len);
+	ch->open_len = len;
+	ch->open_cmd = cmd;
+	ch->open_state = ch->state;
+
+	return packet_write (session, cmd, payload, len);
 }
 
 int channel_process (sp_session *session, unsigned char *buf, unsigned short len, int error)
@@ -110,6 +288,7 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 	int ret;
 	unsigned char *ptr;
 	unsigned short header_len, consumed_len;
+	unsigned int skip_len;
 	
 	/* Extract channel ID */
 	memcpy(&channel_id, buf, 2);
@@ -118,10 +297,7 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 	len -= 2;
 
 	/* Find a matching channel */
-	for (ch = session->channels; ch; ch = ch->next) {
-		if (ch->channel_id == channel_id)
-			break;
-	}
+	ch = channel_by_id (session, channel_id);
 
 	if (ch == NULL) {
 		DSFYDEBUG
@@ -131,6 +307,11 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 		return 0;
 	}
 
+	if (ch->reply_ms == 0) {
+		ch->reply_ms = get_millisecs();
+		flowctl_channel_reply (session, ch);
+	}
+
 	/*
 	 * If we're in a error state, let the
 	 * callback routine know about it
@@ -167,11 +348,13 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 				return 0;
 			}
 			ch->header_id++;
-			DSFYDEBUG
-				("channel %d: Entering callback (header %d) for channel '%s', %d bytes data\n",
-				 ch->channel_id, ch->header_id, ch->name,
-				 header_len);
-			ch->callback (ch, ptr, header_len);
+			if (ch->header_id > ch->replay_header_id) {
+				DSFYDEBUG
+					("channel %d: Entering callback (header %d) for channel '%s', %d bytes data\n",
+					 ch->channel_id, ch->header_id, ch->name,
+					 header_len);
+				ch->callback (ch, ptr, header_len);
+			}
 
 			ptr += header_len;
 			consumed_len += header_len;
@@ -196,6 +379,20 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 	if (len == 0)
 		ch->state = CHANNEL_END;
 
+	/* Skip data the callback already got before the channel was replayed */
+	if (ch->state == CHANNEL_DATA && ch->total_data_len < ch->replay_data_len) {
+		skip_len = ch->replay_data_len - ch->total_data_len;
+		if (skip_len > len)
+			skip_len = len;
+
+		buf += skip_len;
+		len -= skip_len;
+		ch->total_data_len += skip_len;
+
+		if (len == 0)
+			return 0;
+	}
+
 	DSFYDEBUG
 		("channel %d: Entering callback (state: %s) for channel '%s', %d bytes data\n",
 		 ch->channel_id,
@@ -212,10 +409,105 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 }
 
 
+/*
+ * Called when the connection is lost
+ * Channels that aren't resumable are failed so their owners drop what
+ * they got so far. Their requests are then held back until logged in
+ * again, see channel_retry_timeout(). The others are kept for
+ * channel_replay_all().
+ *
+ */
+void channel_disconnect_all(sp_session *session) {
+	CHANNEL *ch;
+	int id;
+
+	for(id = 0; id < session->channels.size; id++) {
+		if((ch = session->channels.slots[id]) == NULL)
+			continue;
+
+		ch->disconnected = 1;
+		if(ch->resumable && ch->open_len >= 0)
+			continue;
+
+		DSFYDEBUG("channel %d: Connection lost, failing channel '%s'\n",
+			  ch->channel_id, CHANNEL_NAME(ch));
+
+		ch->state = CHANNEL_ERROR;
+		ch->callback(ch, NULL, 0);
+
+		channel_unregister(session, ch);
+	}
+}
+
+
+/*
+ * Send the opening packets of the channels kept by channel_disconnect_all()
+ * again after a reconnect. They pick up where they were, data that was
+ * already delivered to their callbacks is skipped by channel_process().
+ *
+ * Returns the number of channels replayed
+ *
+ */
+int channel_replay_all(sp_session *session) {
+	CHANNEL *ch;
+	int id, num = 0;
+
+	for(id = 0; id < session->channels.size; id++) {
+		if((ch = session->channels.slots[id]) == NULL || !ch->disconnected)
+			continue;
+
+		DSFYDEBUG("channel %d: Replaying channel '%s', skipping %d headers and %u bytes\n",
+			  ch->channel_id, CHANNEL_NAME(ch), ch->header_id, ch->total_data_len);
+
+		/* Channel ids are per connection so the id is kept */
+		if(ch->header_id > ch->replay_header_id)
+			ch->replay_header_id = ch->header_id;
+
+		if(ch->total_data_len > ch->replay_data_len)
+			ch->replay_data_len = ch->total_data_len;
+
+		ch->header_id = 0;
+		ch->total_header_len = 0;
+		ch->total_data_len = 0;
+		ch->state = ch->open_state;
+		ch->disconnected = 0;
+
+		ch->open_ms = get_millisecs();
+		ch->reply_ms = 0;
+
+		if(packet_write(session, ch->open_cmd, ch->open_payload, ch->open_len) != 0)
+			return -1;
+
+		num++;
+	}
+
+	return num;
+}
+
+
+/*
+ * For channel callbacks: When to retry the request of a failed channel
+ * Right away if the connection was lost, the iothread holds the request
+ * back until logged in again. Otherwise after delay_ms.
+ *
+ */
+int channel_retry_timeout(CHANNEL *ch, int delay_ms) {
+	if(ch->disconnected)
+		return get_millisecs();
+
+	return get_millisecs() + delay_ms;
+}
+
+
 void channel_fail_and_unregister_all(sp_session *session) {
 	CHANNEL *ch;
+	int id;
+
+	/* Callbacks might register new channels and grow the table */
+	for(id = 0; id < session->channels.size; id++) {
+		if((ch = session->channels.slots[id]) == NULL)
+			continue;
 
-	while((ch = session->channels) != NULL) {
 		DSFYDEBUG
 			("channel %d: Forcing failure via callback (current state: %s) for channel '%s'\n",
 			 ch->channel_id,
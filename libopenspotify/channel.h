@@ -37,8 +37,42 @@ struct _channel
 	unsigned int total_header_len;
 	unsigned int total_data_len;
 
-	/* for internal use */
+	/* When the channel was opened and the first reply arrived, for flow control */
+	int open_ms;
+	int reply_ms;
+
+	/*
+	 * The packet that opened the channel, kept so it can be sent
+	 * again after a reconnect. The payload buffer stays with the
+	 * CHANNEL object when it's returned to the pool.
+	 *
+	 */
+	unsigned char open_cmd;
+	enum channel_state open_state;
+	unsigned char *open_payload;
+	int open_len;
+	int open_size;
+
+	/*
+	 * Set by the owner if the reply only depends on the opening packet
+	 * and is the same every time, like the content of a file. Such
+	 * channels are sent again after a reconnect and the headers and
+	 * data already delivered are skipped. Others are failed as soon as
+	 * the connection is lost, with disconnected set, and their owners
+	 * start over once logged in again.
+	 *
+	 */
+	int resumable;
+	int disconnected;
+
+	/* Headers and data already delivered before the channel was replayed */
+	unsigned int replay_header_id;
+	unsigned int replay_data_len;
+
+#ifdef DEBUG
+	/* for internal use, only kept in debug builds */
 	char name[256];
+#endif
 
 	/* pointer to private storage */
 	void *private;
@@ -46,12 +80,58 @@ struct _channel
 	/* function pointer */
 	channel_callback callback;
 
+	/* links free channels in the pool */
 	struct _channel *next;
 };
 
+#ifdef DEBUG
+#define CHANNEL_NAME(ch) ((ch)->name)
+#else
+#define CHANNEL_NAME(ch) ""
+#endif
+
+
+/* Channel ids are 16 bits on the wire */
+#define CHANNEL_MAX_IDS 65536
+
+/* Number of CHANNEL objects allocated at once by the pool */
+#define CHANNEL_SLAB_SIZE 32
+
+struct channel_slab
+{
+	struct channel_slab *next;
+	CHANNEL channels[CHANNEL_SLAB_SIZE];
+};
+
+/*
+ * Open channels indexed by channel id
+ * The table and the bitmap of used ids grow on demand and since
+ * the lowest free id is always picked they stay small
+ *
+ */
+struct channel_table
+{
+	CHANNEL **slots;
+	unsigned int *used;
+	int size;
+
+	/* Index of the first bitmap word that may have a free id */
+	int free_hint;
+
+	/* Pool of unused CHANNEL objects */
+	CHANNEL *free_list;
+	struct channel_slab *slabs;
+};
+
+void channel_table_init (sp_session *session);
+void channel_table_free (sp_session *session);
 CHANNEL *channel_register (sp_session *session, char *, channel_callback, void *);
 void channel_unregister (sp_session *session, CHANNEL *);
 CHANNEL *channel_by_id (sp_session *session, unsigned short);
+int channel_send (sp_session *session, CHANNEL *, unsigned char, unsigned char *, unsigned short);
 int channel_process (sp_session *session, unsigned char *, unsigned short, int);
+void channel_disconnect_all(sp_session *session);
+int channel_replay_all(sp_session *session);
+int channel_retry_timeout(CHANNEL *ch, int delay_ms);
 void channel_fail_and_unregister_all(sp_session *session);
 #endif
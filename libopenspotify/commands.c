@@ -39,10 +39,10 @@ static int dump_generic (CHANNEL * ch, unsigned char *buf, unsigned short len)
 	if (ch->state == CHANNEL_HEADER)
 		snprintf (filename, sizeof (filename),
 			  "/tmp/channel-%d-%s.hdr-%d", ch->channel_id,
-			  ch->name, ch->header_id);
+			  CHANNEL_NAME(ch), ch->header_id);
 	else
 		snprintf (filename, sizeof (filename), "/tmp/channel-%d-%s",
-			  ch->channel_id, ch->name);
+			  ch->channel_id, CHANNEL_NAME(ch));
 
 	if ((fd = fopen (filename, "ab")) != NULL) {
 		fwrite (buf, 1, len, fd);
@@ -57,14 +57,13 @@ static int dump_generic (CHANNEL * ch, unsigned char *buf, unsigned short len)
 int cmd_send_cache_hash (sp_session * session)
 {
 	int ret;
-        struct buf* buf = buf_new();
+        struct buf* buf = packet_payload(session);
 	/* FIXME */
 	char cache_hash[] = "\xf4\xc2\xaa\x05\xe8\x25\xa7\xb5\xe4\xe6\x59\x0f\x3d\xd0\xbe\x0a\xef\x20\x51\x95";
 
 	buf_append_data(buf, cache_hash, 20);
 
 	ret = packet_write (session, 0x0f, buf->ptr, buf->len);
-	buf_free(buf);
 
 	return ret;
 }
@@ -79,7 +78,7 @@ int cmd_requestad (sp_session * session, unsigned char ad_type)
 	CHANNEL *ch;
 	int ret;
 	char buf[100];
-        struct buf* b = buf_new();
+        struct buf* b = packet_payload(session);
 
 	snprintf (buf, sizeof (buf), "RequestAd-with-type-%d", ad_type);
 	ch = channel_register (session, buf, dump_generic, NULL);
@@ -91,10 +90,8 @@ int cmd_requestad (sp_session * session, unsigned char ad_type)
         buf_append_u16(b, ch->channel_id);
 	buf_append_u8(b, ad_type);
 
-	ret = packet_write (session, CMD_REQUESTAD, b->ptr, b->len);
-	DSFYDEBUG ("packet_write() returned %d\n", ret);
-
-	buf_free(b);
+	ret = channel_send (session, ch, CMD_REQUESTAD, b->ptr, b->len);
+	DSFYDEBUG ("channel_send() returned %d\n", ret);
 
 	return ret;
 }
@@ -110,7 +107,7 @@ int cmd_request_image (sp_session * session, unsigned char *hash,
 	CHANNEL *ch;
 	int ret;
 	char buf[100];
-        struct buf* b = buf_new();
+        struct buf* b = packet_payload(session);
 
 	strcpy (buf, "image-");
 	hex_bytes_to_ascii (hash, buf + 6, 20);
@@ -123,11 +120,12 @@ int cmd_request_image (sp_session * session, unsigned char *hash,
 	buf_append_u16(b, ch->channel_id);
 	buf_append_data(b, hash, 20);
 
-	ret = packet_write (session, CMD_IMAGE, b->ptr, b->len);
-	DSFYDEBUG ("packet_write() returned %d\n", ret);
-            
-        buf_free(b);
-	
+	/* Images are named by their hash, resent after a reconnect */
+	ch->resumable = 1;
+
+	ret = channel_send (session, ch, CMD_IMAGE, b->ptr, b->len);
+	DSFYDEBUG ("channel_send() returned %d\n", ret);
+
 	return ret;
 }
 
@@ -147,7 +145,7 @@ int cmd_search (sp_session * session, char *searchtext, unsigned int offset,
 
 	assert (limit);
 
-	b = buf_new();
+	b = packet_payload(session);
 
 	snprintf (buf, sizeof (buf), "Search-%s", searchtext);
 	ch = channel_register (session, buf, callback, private);
@@ -164,11 +162,9 @@ int cmd_search (sp_session * session, char *searchtext, unsigned int offset,
 	buf_append_u8(b, searchtext_length);
 	buf_append_data(b, searchtext, searchtext_length);
 
-	ret = packet_write (session, CMD_SEARCH, b->ptr, b->len);
-	DSFYDEBUG ("packet_write() returned %d\n", ret)
+	ret = channel_send (session, ch, CMD_SEARCH, b->ptr, b->len);
+	DSFYDEBUG ("channel_send() returned %d\n", ret)
 
-	buf_free(b);
-	
 	return ret;
 }
 
@@ -187,7 +183,7 @@ int cmd_toplistbrowse (sp_session *session,
 	char buf[100];
 	struct buf *b;
 
-	b = buf_new();
+	b = packet_payload(session);
 
 	snprintf (buf, sizeof (buf), "Toplistbrowse-type-%d-region-%d", type, region);
 	ch = channel_register (session, buf, callback, private);
@@ -242,11 +238,9 @@ int cmd_toplistbrowse (sp_session *session,
 	}
 
 
-	ret = packet_write (session, CMD_TOPLISTBROWSE, b->ptr, b->len);
-	DSFYDEBUG ("packet_write() returned %d\n", ret)
+	ret = channel_send (session, ch, CMD_TOPLISTBROWSE, b->ptr, b->len);
+	DSFYDEBUG ("channel_send() returned %d\n", ret)
 
-	buf_free(b);
-	
 	return ret;
 }
 
@@ -275,7 +269,7 @@ int cmd_aeskey (sp_session * session, unsigned char *file_id,
 	char buf[256];
 
 	/* Request the AES key for this file by sending the file ID and track ID */
-	struct buf* b = buf_new();
+	struct buf* b = packet_payload(session);
 	buf_append_data(b, file_id, 20);
 	buf_append_data(b, track_id, 16);
 	buf_append_u16(b, 0);
@@ -292,10 +286,9 @@ int cmd_aeskey (sp_session * session, unsigned char *file_id,
 	ch->state = CHANNEL_DATA;
 	buf_append_u16(b, ch->channel_id);
 
-	ret = packet_write (session, CMD_REQKEY, b->ptr, b->len);
-	buf_free(b);
+	ret = channel_send (session, ch, CMD_REQKEY, b->ptr, b->len);
 	if (ret != 0) {
-		DSFYDEBUG ("packet_write(cmd=0x0c) returned %d, aborting!\n", ret)
+		DSFYDEBUG ("channel_send(cmd=0x0c) returned %d, aborting!\n", ret)
 	}
 
 	return ret;
@@ -324,9 +317,9 @@ int cmd_getsubstreams (sp_session * session, unsigned char *file_id,
 	ch = channel_register (session, buf, callback, private);
 	DSFYDEBUG
 		("cmd_getsubstreams: allocated channel %d, retrieving song '%s'\n",
-		 ch->channel_id, ch->name);
+		 ch->channel_id, CHANNEL_NAME(ch));
 
-        b = buf_new();
+        b = packet_payload(session);
 	buf_append_u16(b, ch->channel_id);
 
 	/* I have no idea wtf these 10 bytes are for */
@@ -350,13 +343,19 @@ int cmd_getsubstreams (sp_session * session, unsigned char *file_id,
 		("Sending GetSubstreams(file_id=%s, offset=%u [%u bytes], length=%u [%u bytes])\n",
 		 buf, offset, offset << 2, length, length << 2);
 
-	ret = packet_write (session, CMD_GETSUBSTREAM, b->ptr, b->len);
-	buf_free(b);
+	/*
+	 * The same bytes of the same file every time, resent after a reconnect
+	 * once the player asked for the play token and key again
+	 *
+	 */
+	ch->resumable = 1;
+
+	ret = channel_send (session, ch, CMD_GETSUBSTREAM, b->ptr, b->len);
 
 	if (ret != 0) {
 		channel_unregister (session, ch);
 		DSFYDEBUG
-			("packet_write(cmd=0x08) returned %d, aborting!\n",
+			("channel_send(cmd=0x08) returned %d, aborting!\n",
 			 ret);
 	}
 
@@ -398,7 +397,7 @@ int cmd_browse (sp_session * session, unsigned char kind, unsigned char *idlist,
 	hex_bytes_to_ascii(idlist, buf + strlen(buf), 16);
 	ch = channel_register (session, buf, callback, private);
 
-	b = buf_new();
+	b = packet_payload(session);
 	buf_append_u16(b, ch->channel_id);
 	buf_append_u8(b, kind);
 
@@ -411,14 +410,12 @@ int cmd_browse (sp_session * session, unsigned char kind, unsigned char *idlist,
 	}
 
 	if ((ret =
-	     packet_write (session, CMD_BROWSE, b->ptr, b->len)) != 0) {
+	     channel_send (session, ch, CMD_BROWSE, b->ptr, b->len)) != 0) {
 		DSFYDEBUG
-			("packet_write(cmd=0x30) returned %d, aborting!\n",
+			("channel_send(cmd=0x30) returned %d, aborting!\n",
 			 ret)
 	}
 
-	buf_free(b);
-
 	return ret;
 }
 
@@ -434,7 +431,7 @@ int cmd_userinfo (sp_session * session, char *username,
 	sprintf(buf, "user-%.128s", username);
 	ch = channel_register (session, buf, callback, private);
 
-	b = buf_new();
+	b = packet_payload(session);
 	buf_append_u16(b, ch->channel_id);
 
 	len = strlen(username);
@@ -442,14 +439,12 @@ int cmd_userinfo (sp_session * session, char *username,
 	buf_append_data(b, username, len);
 
 	if ((ret =
-	     packet_write (session, CMD_USERINFO, b->ptr, b->len)) != 0) {
+	     channel_send (session, ch, CMD_USERINFO, b->ptr, b->len)) != 0) {
 		DSFYDEBUG
-			("packet_write(cmd=0x57) returned %d, aborting!\n",
+			("channel_send(cmd=0x57) returned %d, aborting!\n",
 			 ret);
 	}
 
-	buf_free(b);
-	
 	return ret;
 }
 
@@ -471,7 +466,7 @@ int cmd_getplaylist (sp_session * session, unsigned char *playlist_id,
 	buf[9 + 2 * 17] = 0;
 	ch = channel_register (session, buf, callback, private);
 
-	b = buf_new();
+	b = packet_payload(session);
 	buf_append_u16(b, ch->channel_id);
 	buf_append_data(b, playlist_id, 17);
 	buf_append_u32(b, revision);
@@ -480,14 +475,12 @@ int cmd_getplaylist (sp_session * session, unsigned char *playlist_id,
 	buf_append_u8(b, 0x1);
 
 	if ((ret =
-	     packet_write (session, CMD_GETPLAYLIST, b->ptr, b->len)) != 0) {
+	     channel_send (session, ch, CMD_GETPLAYLIST, b->ptr, b->len)) != 0) {
 		DSFYDEBUG
-			("packet_write(cmd=0x35) returned %d, aborting!\n",
+			("channel_send(cmd=0x35) returned %d, aborting!\n",
 			 ret);
 	}
 
-	buf_free(b);
-	
 	return ret;
 }
 
@@ -511,7 +504,7 @@ int cmd_changeplaylist (sp_session * session, unsigned char *playlist_id,
 	buf[11 + 2 * 17] = 0;
 	ch = channel_register (session, buf, callback, private);
 
-	b = buf_new();
+	b = packet_payload(session);
 	buf_append_u16(b, ch->channel_id);
 	buf_append_data(b, playlist_id, 17);
 	buf_append_u32(b, revision);
@@ -522,13 +515,11 @@ int cmd_changeplaylist (sp_session * session, unsigned char *playlist_id,
         buf_append_data(b, xml, strlen(xml));
 
 	if ((ret =
-	     packet_write (session, CMD_CHANGEPLAYLIST, b->ptr, b->len)) != 0) {
-		DSFYDEBUG ("packet_write(cmd=0x36) "
+	     channel_send (session, ch, CMD_CHANGEPLAYLIST, b->ptr, b->len)) != 0) {
+		DSFYDEBUG ("channel_send(cmd=0x36) "
 			   "returned %d, aborting!\n", ret);
 	}
 
-	buf_free(b);
-
 	return ret;
 }
 
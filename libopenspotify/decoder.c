@@ -0,0 +1,394 @@
+/*
+ * Decoder threads
+ *
+ * Decompressing and parsing large XML replies on the iothread keeps it
+ * from reading packets, which among other things stalls the audio
+ * substreams. Channel callbacks hand this work to a small pool of
+ * threads instead, with decoder_submit().
+ *
+ * Decoded data can only be loaded into the session's objects by the
+ * iothread, which owns the hashtables. Jobs are therefore returned to
+ * it by decoder_process() in the order they were submitted, no matter
+ * which thread finished first.
+ *
+ * Jobs submitted with the same serial are decoded one at a time, in
+ * order. That's how CHANNEL_DATA payloads are inflated off the iothread
+ * and still fed to their channel's z_stream in the order they arrived.
+ *
+ * Work that needs nothing from the iothread, like reading an image from
+ * the disk cache, is submitted detached by any thread and never goes
+ * through the iothread at all.
+ *
+ * With zero threads, jobs are decoded and applied by the iothread when
+ * they're submitted, and detached jobs by the thread submitting them.
+ *
+ */
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "debug.h"
+#include "decoder.h"
+#include "ioloop.h"
+#include "sp_opaque.h"
+
+
+#ifdef _WIN32
+static DWORD WINAPI decoder_main(LPVOID arg);
+#else
+static void *decoder_main(void *arg);
+#endif
+static struct decode_job *decoder_take(struct decoder *decoder);
+static void decoder_lock(struct decoder *decoder);
+static void decoder_unlock(struct decoder *decoder);
+
+
+int decoder_init(sp_session *session, int num_workers) {
+	struct decoder *decoder;
+	int i;
+
+	decoder = malloc(sizeof(struct decoder));
+	if(decoder == NULL)
+		return -1;
+
+	decoder->session = session;
+
+	decoder->first = NULL;
+	decoder->last = NULL;
+
+	decoder->queue_head = NULL;
+	decoder->queue_tail = NULL;
+
+	decoder->num_busy = 0;
+
+	decoder->shutdown = 0;
+
+	if(num_workers > DECODER_MAX_WORKERS)
+		num_workers = DECODER_MAX_WORKERS;
+
+#ifdef _WIN32
+	decoder->mutex = CreateMutex(NULL, FALSE, NULL);
+	decoder->cond = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+	pthread_mutex_init(&decoder->mutex, NULL);
+	pthread_cond_init(&decoder->cond, NULL);
+#endif
+
+	session->decoder = decoder;
+
+	for(i = 0; i < num_workers; i++) {
+#ifdef _WIN32
+		decoder->workers[i] = CreateThread(NULL, 0, decoder_main, decoder, 0, NULL);
+		if(decoder->workers[i] == NULL)
+			break;
+#else
+		if(pthread_create(&decoder->workers[i], NULL, decoder_main, decoder))
+			break;
+#endif
+	}
+
+	decoder->num_workers = i;
+	DSFYDEBUG("Started %d decoder threads\n", decoder->num_workers);
+
+	return 0;
+}
+
+
+/*
+ * Stop the decoder threads and release jobs that weren't applied
+ * Called by sp_session_release() once the iothread is gone.
+ *
+ */
+void decoder_free(sp_session *session) {
+	struct decoder *decoder = session->decoder;
+	struct decode_job *job;
+	int i;
+
+	decoder_lock(decoder);
+	decoder->shutdown = 1;
+#ifdef _WIN32
+	for(i = 0; i < decoder->num_workers; i++)
+		SetEvent(decoder->cond);
+#else
+	pthread_cond_broadcast(&decoder->cond);
+#endif
+	decoder_unlock(decoder);
+
+	for(i = 0; i < decoder->num_workers; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(decoder->workers[i], INFINITE);
+		CloseHandle(decoder->workers[i]);
+#else
+		pthread_join(decoder->workers[i], NULL);
+#endif
+	}
+
+	/* Detached jobs are only known to the queue */
+	while((job = decoder->queue_head) != NULL) {
+		decoder->queue_head = job->next_queued;
+		if(job->apply == NULL && job->release != NULL)
+			job->release(job);
+	}
+
+	while((job = decoder->first) != NULL) {
+		decoder->first = job->next;
+		if(job->release != NULL)
+			job->release(job);
+	}
+
+#ifdef _WIN32
+	CloseHandle(decoder->cond);
+	CloseHandle(decoder->mutex);
+#else
+	pthread_cond_destroy(&decoder->cond);
+	pthread_mutex_destroy(&decoder->mutex);
+#endif
+
+	free(decoder);
+	session->decoder = NULL;
+}
+
+
+/* Hand a job to the decoder threads, called by the iothread */
+void decoder_submit(sp_session *session, struct decode_job *job) {
+	decoder_submit_serial(session, job, NULL);
+}
+
+
+/* Hand a job over to be decoded after those submitted with the same serial */
+void decoder_submit_serial(sp_session *session, struct decode_job *job, const void *serial) {
+	struct decoder *decoder = session->decoder;
+
+	job->done = job->decode == NULL;
+	job->serial = serial;
+	job->next = NULL;
+	job->next_queued = NULL;
+
+	/* Without threads, or earlier jobs to wait for, there's nothing to hand off */
+	if(decoder->num_workers == 0 && decoder->first == NULL) {
+		if(job->decode != NULL)
+			job->decode(job);
+
+		job->apply(session, job);
+		return;
+	}
+
+	if(decoder->last != NULL)
+		decoder->last->next = job;
+	else
+		decoder->first = job;
+
+	decoder->last = job;
+
+	if(job->done)
+		return;
+
+	decoder_lock(decoder);
+	if(decoder->queue_tail != NULL)
+		decoder->queue_tail->next_queued = job;
+	else
+		decoder->queue_head = job;
+
+	decoder->queue_tail = job;
+#ifdef _WIN32
+	SetEvent(decoder->cond);
+#else
+	pthread_cond_signal(&decoder->cond);
+#endif
+	decoder_unlock(decoder);
+}
+
+
+/*
+ * Hand a job to the decoder threads that finishes on its own
+ * May be called from any thread. The job's decode callback must not
+ * be NULL and it may free the job.
+ *
+ */
+void decoder_submit_detached(sp_session *session, struct decode_job *job) {
+	struct decoder *decoder = session->decoder;
+
+	job->done = 0;
+	job->serial = NULL;
+	job->apply = NULL;
+	job->next = NULL;
+	job->next_queued = NULL;
+
+	if(decoder->num_workers == 0) {
+		job->decode(job);
+		return;
+	}
+
+	decoder_lock(decoder);
+	if(decoder->queue_tail != NULL)
+		decoder->queue_tail->next_queued = job;
+	else
+		decoder->queue_head = job;
+
+	decoder->queue_tail = job;
+#ifdef _WIN32
+	SetEvent(decoder->cond);
+#else
+	pthread_cond_signal(&decoder->cond);
+#endif
+	decoder_unlock(decoder);
+}
+
+
+/*
+ * Apply decoded jobs in the order they were submitted
+ * Called by the iothread whenever it wakes up.
+ *
+ */
+void decoder_process(sp_session *session) {
+	struct decoder *decoder = session->decoder;
+	struct decode_job *job;
+	int done;
+
+	while((job = decoder->first) != NULL) {
+		decoder_lock(decoder);
+		done = job->done;
+		decoder_unlock(decoder);
+
+		if(!done)
+			break;
+
+		decoder->first = job->next;
+		if(decoder->first == NULL)
+			decoder->last = NULL;
+
+		job->apply(session, job);
+	}
+}
+
+
+#ifdef _WIN32
+static DWORD WINAPI decoder_main(LPVOID arg) {
+#else
+static void *decoder_main(void *arg) {
+#endif
+	struct decoder *decoder = (struct decoder *)arg;
+	struct decode_job *job;
+	const void *serial;
+	int i;
+
+	decoder_lock(decoder);
+	for(;;) {
+		job = NULL;
+		while(!decoder->shutdown && (job = decoder_take(decoder)) == NULL) {
+#ifdef _WIN32
+			ReleaseMutex(decoder->mutex);
+			WaitForSingleObject(decoder->cond, INFINITE);
+			WaitForSingleObject(decoder->mutex, INFINITE);
+#else
+			pthread_cond_wait(&decoder->cond, &decoder->mutex);
+#endif
+		}
+
+		if(job == NULL)
+			break;
+
+		decoder_unlock(decoder);
+
+		/* Detached jobs may be free'd by their decode callback */
+		if(job->apply == NULL) {
+			job->decode(job);
+			decoder_lock(decoder);
+			continue;
+		}
+
+		job->decode(job);
+
+		decoder_lock(decoder);
+
+		/* The job may be free'd by the iothread once done */
+		serial = job->serial;
+		job->done = 1;
+
+		/* Have the iothread apply it */
+		ioloop_wakeup(decoder->session);
+
+		if(serial == NULL)
+			continue;
+
+		for(i = 0; decoder->busy[i] != serial; i++)
+			;
+
+		decoder->busy[i] = decoder->busy[--decoder->num_busy];
+
+		/* The next job with this serial may have been passed over */
+#ifdef _WIN32
+		SetEvent(decoder->cond);
+#else
+		pthread_cond_broadcast(&decoder->cond);
+#endif
+	}
+
+	decoder_unlock(decoder);
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+/*
+ * Take the first queued job whose serial isn't being decoded already
+ * Called by the decoder threads with the mutex held.
+ *
+ */
+static struct decode_job *decoder_take(struct decoder *decoder) {
+	struct decode_job *job, *prev;
+	int i;
+
+	for(prev = NULL, job = decoder->queue_head; job != NULL; prev = job, job = job->next_queued) {
+		for(i = 0; job->serial != NULL && i < decoder->num_busy; i++)
+			if(decoder->busy[i] == job->serial)
+				break;
+
+		if(job->serial == NULL || i == decoder->num_busy)
+			break;
+	}
+
+	if(job == NULL)
+		return NULL;
+
+	if(prev != NULL)
+		prev->next_queued = job->next_queued;
+	else
+		decoder->queue_head = job->next_queued;
+
+	if(decoder->queue_tail == job)
+		decoder->queue_tail = prev;
+
+	if(job->serial != NULL)
+		decoder->busy[decoder->num_busy++] = job->serial;
+
+	return job;
+}
+
+
+static void decoder_lock(struct decoder *decoder) {
+#ifdef _WIN32
+	WaitForSingleObject(decoder->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&decoder->mutex);
+#endif
+}
+
+
+static void decoder_unlock(struct decoder *decoder) {
+#ifdef _WIN32
+	ReleaseMutex(decoder->mutex);
+#else
+	pthread_mutex_unlock(&decoder->mutex);
+#endif
+}
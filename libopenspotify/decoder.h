@@ -0,0 +1,99 @@
+#ifndef LIBOPENSPOTIFY_DECODER_H
+#define LIBOPENSPOTIFY_DECODER_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libspotify/api.h>
+
+
+/* Number of decoder threads started by sp_session_init() */
+#define DECODER_NUM_WORKERS	2
+#define DECODER_MAX_WORKERS	16
+
+
+struct decode_job;
+typedef void (*decode_job_cb)(struct decode_job *job);
+typedef void (*decode_apply_cb)(sp_session *session, struct decode_job *job);
+
+
+/*
+ * Work handed off by the iothread, embedded in the caller's structure
+ *
+ * The decode callback is run by a decoder thread and must only touch
+ * the job's own data. The apply callback is then run by the iothread,
+ * in the order the jobs were submitted, to load the decoded data into
+ * the session's objects.
+ *
+ * Jobs submitted with the same serial are also decoded one at a time,
+ * in the order they were submitted, i.e. those feeding one z_stream.
+ *
+ * Jobs submitted with decoder_submit_detached() have no apply callback
+ * and aren't kept in order. Their decode callback finishes the work
+ * itself, e.g. by posting a result to the main thread.
+ *
+ */
+struct decode_job {
+	/* Optional, jobs without it are only kept in order */
+	decode_job_cb decode;
+
+	/* NULL for detached jobs */
+	decode_apply_cb apply;
+
+	/* Called instead of apply for jobs dropped by decoder_free() */
+	decode_job_cb release;
+
+	/* Set by the decoder thread once decode has returned */
+	int done;
+
+	/* Set by decoder_submit_serial(), NULL if it may run alongside any job */
+	const void *serial;
+
+	/* Next job in submission order and next job waiting for a thread */
+	struct decode_job *next;
+	struct decode_job *next_queued;
+};
+
+
+struct decoder {
+	sp_session *session;
+
+	/* Jobs not yet applied, in submission order. Only used by the iothread */
+	struct decode_job *first;
+	struct decode_job *last;
+
+	/* Jobs waiting for a decoder thread */
+	struct decode_job *queue_head;
+	struct decode_job *queue_tail;
+
+	/* Serials of the jobs being decoded */
+	const void *busy[DECODER_MAX_WORKERS];
+	int num_busy;
+
+	/* Set by decoder_free() to stop the threads */
+	int shutdown;
+
+	int num_workers;
+#ifdef _WIN32
+	HANDLE workers[DECODER_MAX_WORKERS];
+	HANDLE mutex;
+	HANDLE cond;
+#else
+	pthread_t workers[DECODER_MAX_WORKERS];
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+
+int decoder_init(sp_session *session, int num_workers);
+void decoder_free(sp_session *session);
+void decoder_submit(sp_session *session, struct decode_job *job);
+void decoder_submit_serial(sp_session *session, struct decode_job *job, const void *serial);
+void decoder_submit_detached(sp_session *session, struct decode_job *job);
+void decoder_process(sp_session *session);
+
+#endif
@@ -113,6 +113,31 @@ struct dns_srv_records *dns_get_service_list(char *hostname) {
 }
 
 
+/*
+ * Create a single entry list from a string on the form "host:port"
+ * for connecting to a specific server instead of the ones in DNS
+ *
+ */
+struct dns_srv_records *dns_service_from_string(char *hostport) {
+	struct dns_srv_records *root = NULL, *entry;
+	char *sep;
+
+	entry = list_insert_by_prio(&root, 0);
+	entry->host = strdup(hostport);
+	if((sep = strrchr(entry->host, ':')) != NULL) {
+		*sep = 0;
+		entry->port = strdup(sep + 1);
+	}
+	else
+		entry->port = strdup(DNS_DEFAULT_PORT);
+
+	entry->prio = 0;
+	entry->tried = 0;
+
+	return root;
+}
+
+
 static struct dns_srv_records *list_insert_by_prio(struct dns_srv_records **root, int prio) {
 	struct dns_srv_records *entry, *walker;
 
@@ -6,6 +6,9 @@
 #ifndef DESPOTIFY_DNS_H
 #define DESPOTIFY_DNS_H
 
+/* Port used if none is given to dns_service_from_string() */
+#define DNS_DEFAULT_PORT "4070"
+
 struct dns_srv_records {
 	char *host;
 	char *port;
@@ -16,6 +19,7 @@ struct dns_srv_records {
 };
 
 struct dns_srv_records *dns_get_service_list(char *);
+struct dns_srv_records *dns_service_from_string(char *);
 void dns_free_list(struct dns_srv_records *);
 
 #endif
@@ -0,0 +1,245 @@
+/*
+ * Flow control for channels
+ *
+ * The number of channels the iothread keeps open is limited by a
+ * window that grows by one for every window's worth of channels that
+ * complete (additive increase) and is halved when a channel fails or
+ * a reply is much slower than the fastest one seen (multiplicative
+ * decrease).
+ *
+ * Growing only pays while the link has room. Once the channel added
+ * last didn't raise the throughput of the whole window by at least half
+ * a channel's worth, the other channels just got slower, and the window
+ * steps back by one instead of growing further, see flowctl_increase().
+ *
+ * Handlers call flowctl_admit() right before they open a channel.
+ * Requests that would open one while the window is full are parked
+ * with request_block(), and flowctl_unblock() releases as many of them
+ * as there's room for at the start of every pass of the iothread.
+ * Requests that never open a channel, or don't open one this time,
+ * are not held back.
+ *
+ */
+
+#include <limits.h>
+
+#include <libspotify/api.h>
+
+#include "channel.h"
+#include "debug.h"
+#include "flowctl.h"
+#include "request.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+
+static int flowctl_limit(struct flowctl *fc, request_priority priority);
+static void flowctl_increase(sp_session *session);
+static void flowctl_decrease(sp_session *session, int now);
+
+
+void flowctl_init(sp_session *session) {
+	struct flowctl *fc = &session->flowctl;
+
+	fc->window = FLOWCTL_INIT_WINDOW;
+	fc->acked = 0;
+	fc->hold_until_ms = 0;
+	fc->srtt_ms = 0;
+	fc->min_rtt_ms = INT_MAX;
+	fc->throughput = 0;
+	fc->grown_rate = 0;
+	fc->num_completed = 0;
+	fc->num_failed = 0;
+	fc->num_decreases = 0;
+}
+
+
+/* Number of channels requests in the given lane may keep in flight */
+static int flowctl_limit(struct flowctl *fc, request_priority priority) {
+	int limit = fc->window;
+
+	if(priority == REQ_PRIO_REALTIME)
+		limit += FLOWCTL_RESERVED;
+	else if(priority == REQ_PRIO_BACKGROUND && limit - FLOWCTL_RESERVED >= 1)
+		limit -= FLOWCTL_RESERVED;
+
+	return limit;
+}
+
+
+/* Check if a new request in the given lane may open a channel right now */
+int flowctl_may_open(sp_session *session, request_priority priority) {
+	return session->num_channels < flowctl_limit(&session->flowctl, priority);
+}
+
+
+/*
+ * Called by request handlers right before they open a channel
+ * Returns 1 if the request may go ahead, or parks it and returns 0 if
+ * the window is full. Parked requests are processed again in the same
+ * state once flowctl_unblock() releases them.
+ *
+ */
+int flowctl_admit(sp_session *session, struct request *req) {
+	if(flowctl_may_open(session, req->priority))
+		return 1;
+
+	DSFYDEBUG("%d channels active (window %d), blocking request <type %s, state %s, input %p>\n",
+		  session->num_channels, session->flowctl.window, REQUEST_TYPE_STR(req->type),
+		  REQUEST_STATE_STR(req->state), req->input);
+
+	request_block(session, req);
+
+	return 0;
+}
+
+
+/*
+ * Called by the iothread at the start of every pass
+ * Releases blocked requests while there's room in the window for them,
+ * highest lane first. Within the reserved slots above the window only
+ * realtime requests are released. The released requests are processed
+ * in the same pass, so the number of open channels is up to date when
+ * this is called again.
+ *
+ */
+void flowctl_unblock(sp_session *session) {
+	struct flowctl *fc = &session->flowctl;
+	int lane, room, num_released;
+
+	/* Held back while reconnecting, see process_request() */
+	if(session->connectionstate != SP_CONNECTION_STATE_LOGGED_IN
+		|| session->requests.num_blocked == 0)
+		return;
+
+	num_released = 0;
+	for(lane = REQ_PRIO_REALTIME; lane < REQ_PRIO_NUM; lane++) {
+		room = flowctl_limit(fc, (request_priority)lane) - session->num_channels - num_released;
+		if(room > 0)
+			num_released += request_unblock(session, room, (request_priority)lane);
+	}
+}
+
+
+/*
+ * Called by channel_process() when the first packet
+ * arrives on a channel to sample the round-trip time
+ *
+ */
+void flowctl_channel_reply(sp_session *session, CHANNEL *ch) {
+	struct flowctl *fc = &session->flowctl;
+	int rtt;
+
+	rtt = ch->reply_ms - ch->open_ms;
+	if(rtt < 1)
+		rtt = 1;
+
+	if(rtt < fc->min_rtt_ms)
+		fc->min_rtt_ms = rtt;
+
+	/* Exponentially weighted moving average, 1/8 of the new sample */
+	if(fc->srtt_ms == 0)
+		fc->srtt_ms = rtt;
+	else
+		fc->srtt_ms += (rtt - fc->srtt_ms) / 8;
+
+	if(rtt > FLOWCTL_RTT_CONGESTION_FACTOR * fc->min_rtt_ms
+		&& rtt > 2 * fc->srtt_ms) {
+		DSFYDEBUG("Channel %d replied after %dms (min %dms, smoothed %dms), backing off\n",
+			ch->channel_id, rtt, fc->min_rtt_ms, fc->srtt_ms);
+		flowctl_decrease(session, ch->reply_ms);
+	}
+}
+
+
+/*
+ * Called by channel_unregister() when a channel is closed
+ * Adjusts the window, blocked requests are released by flowctl_unblock()
+ *
+ */
+void flowctl_channel_done(sp_session *session, CHANNEL *ch) {
+	struct flowctl *fc = &session->flowctl;
+	int now, elapsed, rate;
+
+	/* Failed because the connection was lost, which says nothing about the server */
+	if(ch->disconnected)
+		return;
+
+	now = get_millisecs();
+
+	if(ch->state == CHANNEL_ERROR) {
+		fc->num_failed++;
+		flowctl_decrease(session, now);
+	}
+	else {
+		fc->num_completed++;
+
+		if(ch->reply_ms && ch->total_data_len) {
+			elapsed = now - ch->open_ms;
+			if(elapsed < 1)
+				elapsed = 1;
+
+			rate = (int)((double)ch->total_data_len * 1000 / elapsed);
+			if(fc->throughput == 0)
+				fc->throughput = rate;
+			else
+				fc->throughput += (rate - fc->throughput) / 8;
+		}
+
+		if(++fc->acked >= fc->window) {
+			fc->acked = 0;
+			flowctl_increase(session);
+		}
+	}
+}
+
+
+/*
+ * Grow the window by one, unless growing it the last time didn't get
+ * more through. Then it's shrunk by one, and grown again unchecked the
+ * next time, so it settles where the link is full.
+ *
+ */
+static void flowctl_increase(sp_session *session) {
+	struct flowctl *fc = &session->flowctl;
+	double rate;
+
+	/* Throughput of the whole window, as far as the average channel tells */
+	rate = (double)fc->throughput * fc->window;
+
+	if(fc->grown_rate > 0 && fc->window > FLOWCTL_MIN_WINDOW
+		&& rate < fc->grown_rate + fc->grown_rate / (2 * (fc->window - 1))) {
+		fc->window--;
+
+		DSFYDEBUG("Window shrunk to %d channels, %.0f bytes per second before growing and %.0f after\n",
+			fc->window, fc->grown_rate, rate);
+
+		fc->grown_rate = 0;
+		return;
+	}
+
+	if(fc->window < FLOWCTL_MAX_WINDOW) {
+		fc->window++;
+		fc->grown_rate = rate;
+	}
+}
+
+
+/* Halve the window, at most once per smoothed round-trip time */
+static void flowctl_decrease(sp_session *session, int now) {
+	struct flowctl *fc = &session->flowctl;
+
+	if(now < fc->hold_until_ms)
+		return;
+
+	fc->window /= 2;
+	if(fc->window < FLOWCTL_MIN_WINDOW)
+		fc->window = FLOWCTL_MIN_WINDOW;
+
+	fc->acked = 0;
+	fc->grown_rate = 0;
+	fc->hold_until_ms = now + (fc->srtt_ms? fc->srtt_ms: 100);
+	fc->num_decreases++;
+
+	DSFYDEBUG("Window decreased to %d channels\n", fc->window);
+}
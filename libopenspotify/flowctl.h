@@ -0,0 +1,64 @@
+#ifndef LIBOPENSPOTIFY_FLOWCTL_H
+#define LIBOPENSPOTIFY_FLOWCTL_H
+
+#include <libspotify/api.h>
+
+#include "channel.h"
+#include "request.h"
+
+
+/* Bounds and initial value of the number of channels allowed in flight */
+#define FLOWCTL_MIN_WINDOW	4
+#define FLOWCTL_MAX_WINDOW	128
+#define FLOWCTL_INIT_WINDOW	16
+
+/*
+ * A reply taking this many times longer than the fastest one
+ * seen is treated as a sign of congestion
+ *
+ */
+#define FLOWCTL_RTT_CONGESTION_FACTOR	4
+
+/*
+ * Realtime requests may open this many channels beyond the window,
+ * background requests stop this many channels short of it
+ *
+ */
+#define FLOWCTL_RESERVED	2
+
+
+struct flowctl {
+	/* Number of channels allowed in flight */
+	int window;
+
+	/* Channels completed since the window was last grown */
+	int acked;
+
+	/* Don't shrink the window again until this time */
+	int hold_until_ms;
+
+	/* Smoothed and minimum time to first reply, in milliseconds */
+	int srtt_ms;
+	int min_rtt_ms;
+
+	/* Smoothed throughput of completed channels, in bytes per second */
+	int throughput;
+
+	/* Throughput times the window when the window was last grown, 0 if it wasn't since */
+	double grown_rate;
+
+	/* Counters */
+	unsigned int num_completed;
+	unsigned int num_failed;
+	unsigned int num_decreases;
+};
+
+
+void flowctl_init(sp_session *session);
+int flowctl_may_open(sp_session *session, request_priority priority);
+int flowctl_admit(sp_session *session, struct request *req);
+void flowctl_unblock(sp_session *session);
+void flowctl_channel_reply(sp_session *session, CHANNEL *ch);
+void flowctl_channel_done(sp_session *session, CHANNEL *ch);
+
+#endif
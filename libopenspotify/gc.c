@@ -0,0 +1,141 @@
+/*
+ * Incremental garbage collector
+ *
+ * Unreferenced tracks, albums, artists and users are retired a hashtable
+ * step at a time and freed at the start of the next round, see
+ * reclaim.c. Images are
+ * kept in their LRU, the collector frees the ones that never loaded and
+ * so cost none of its budget.
+ *
+ * Each round starts by freeing what earlier rounds retired. What those
+ * objects release, like the album and artists of a track or the cover
+ * of an album, is collected further along in the same round.
+ *
+ */
+
+#include <limits.h>
+
+#include <libspotify/api.h>
+
+#include "album.h"
+#include "artist.h"
+#include "debug.h"
+#include "gc.h"
+#include "image.h"
+#include "reclaim.h"
+#include "sp_opaque.h"
+#include "track.h"
+#include "user.h"
+#include "util.h"
+
+
+enum gc_phase {
+	GC_PHASE_IDLE = 0,
+	GC_PHASE_FREE,
+	GC_PHASE_TRACKS,
+	GC_PHASE_ALBUMS,
+	GC_PHASE_ARTISTS,
+	GC_PHASE_USERS,
+	GC_PHASE_IMAGES
+};
+
+
+static int gc_step(sp_session *session);
+
+
+void gc_init(sp_session *session) {
+	struct gc *gc = &session->gc;
+
+	gc->phase = GC_PHASE_IDLE;
+	gc->cursor = 0;
+	gc->next_round = get_millisecs() + GC_INTERVAL_MS;
+
+	gc->num_rounds = 0;
+	gc->num_slices = 0;
+	gc->last_pause_us = 0;
+	gc->max_pause_us = 0;
+	gc->total_pause_ms = 0;
+	gc->pause_us = 0;
+}
+
+
+/*
+ * Do a slice of the current round, or start a new one if it's due.
+ * Called by the iothread on every pass.
+ *
+ */
+void gc_process(sp_session *session) {
+	struct gc *gc = &session->gc;
+	unsigned int start, elapsed;
+
+	if(gc->phase == GC_PHASE_IDLE) {
+		if(get_millisecs() < gc->next_round)
+			return;
+
+		gc->phase = GC_PHASE_FREE;
+		gc->cursor = 0;
+		gc->num_rounds++;
+	}
+
+	start = get_microsecs();
+	do {
+		if(gc_step(session) && ++gc->phase > GC_PHASE_IMAGES) {
+			DSFYDEBUG("Round %u done, %u objects freed, %d retired\n",
+					gc->num_rounds, session->reclaim.num_freed, session->reclaim.num_entries);
+
+			gc->phase = GC_PHASE_IDLE;
+			gc->next_round = get_millisecs() + GC_INTERVAL_MS;
+		}
+
+		elapsed = get_microsecs() - start;
+	} while(gc->phase != GC_PHASE_IDLE && elapsed < GC_SLICE_US);
+
+	gc->num_slices++;
+	gc->last_pause_us = elapsed;
+	if(elapsed > gc->max_pause_us)
+		gc->max_pause_us = elapsed;
+
+	gc->pause_us += elapsed;
+	gc->total_pause_ms += gc->pause_us / 1000;
+	gc->pause_us %= 1000;
+}
+
+
+/* When gc_process() has work to do next, for the iothread's sleep */
+int gc_next_timeout(sp_session *session) {
+	struct gc *gc = &session->gc;
+
+	if(gc->phase != GC_PHASE_IDLE)
+		return 0;
+
+	return gc->next_round;
+}
+
+
+/* Returns 1 once the current phase is done */
+static int gc_step(sp_session *session) {
+	struct gc *gc = &session->gc;
+
+	switch(gc->phase) {
+	case GC_PHASE_FREE:
+		return reclaim_process(session, GC_STEP_OBJECTS);
+
+	case GC_PHASE_TRACKS:
+		return osfy_track_garbage_collect(session, &gc->cursor, GC_STEP_SLOTS);
+
+	case GC_PHASE_ALBUMS:
+		return osfy_album_garbage_collect(session, &gc->cursor, GC_STEP_SLOTS);
+
+	case GC_PHASE_ARTISTS:
+		return osfy_artist_garbage_collect(session, &gc->cursor, GC_STEP_SLOTS);
+
+	case GC_PHASE_USERS:
+		return user_garbage_collect(session, &gc->cursor, GC_STEP_SLOTS);
+
+	case GC_PHASE_IMAGES:
+		return image_lru_collect(session, GC_STEP_OBJECTS);
+
+	default:
+		return 1;
+	}
+}
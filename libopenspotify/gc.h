@@ -0,0 +1,50 @@
+#ifndef LIBOPENSPOTIFY_GC_H
+#define LIBOPENSPOTIFY_GC_H
+
+#include <libspotify/api.h>
+
+
+/* Milliseconds between the starts of two rounds */
+#define GC_INTERVAL_MS		(30 * 1000)
+
+/* Microseconds a slice may take, checked after each step */
+#define GC_SLICE_US		1000
+
+/* Hashtable slots swept, or objects freed, in a step */
+#define GC_STEP_SLOTS		256
+#define GC_STEP_OBJECTS		64
+
+
+/*
+ * A round frees the objects retired by the last round and then sweeps
+ * tracks, albums, artists, users and images. It's done in slices of
+ * about GC_SLICE_US, one per pass of the iothread, and a hashtable is
+ * only locked for a step at a time.
+ * Only used by the iothread, read by opensp_session_gc_stats().
+ *
+ */
+struct gc {
+	/* Zero between rounds, otherwise the phase plus one */
+	int phase;
+	unsigned int cursor;
+
+	/* When the next round is due, in get_millisecs() time */
+	int next_round;
+
+	/* Counters for opensp_session_gc_stats() */
+	unsigned int num_rounds;
+	unsigned int num_slices;
+	unsigned int last_pause_us;
+	unsigned int max_pause_us;
+	unsigned int total_pause_ms;
+
+	/* Microseconds not yet added to total_pause_ms */
+	unsigned int pause_us;
+};
+
+
+void gc_init(sp_session *session);
+void gc_process(sp_session *session);
+int gc_next_timeout(sp_session *session);
+
+#endif
@@ -1,6 +1,26 @@
 /*
  * For caching of metadata
- * Assumes key is at least sizeof(unsigned int) bytes
+ *
+ * An open addressing table using Robin Hood hashing: an entry that is
+ * further from the slot its hash points at takes the place of one that
+ * is closer, which keeps probe sequences short and lets a lookup stop
+ * as soon as it meets an entry closer to home than the key would be.
+ * Keys are stored in the slots.
+ *
+ * When the table fills up a larger one is allocated and the entries
+ * of the old one are moved over a few at a time by the following
+ * inserts and removes, so no single call pays for rehashing everything.
+ * Lookups check both tables until the old one is empty.
+ *
+ * Entries removed from the old table, or while the table is being
+ * iterated, are marked deleted instead of shifting their neighbours,
+ * so nothing moves under the migration or an iterator. Deleted entries
+ * are cleared out when the last iterator is freed.
+ *
+ * Finds take no lock. Inserts and removes make the sequence number odd
+ * while they change the slots, and a find that saw it change meanwhile
+ * tries again. Arrays of slots that are done with are only freed once no
+ * find is in progress, as counted per thread in hashtable->readers.
  *
  */
 
@@ -15,26 +35,68 @@
 #include <pthread.h>
 #endif
 
+#include "atomic.h"
 #include "hashtable.h"
 
 
+#define SLOT_AT(hashtable, slots, index) \
+	((struct hashentry *)((slots) + (size_t)(index) * (hashtable)->stride))
+
+#define SLOT(hashtable, table, index)	SLOT_AT(hashtable, (table)->slots, index)
+
+#define SLOT_KEY(entry)	((unsigned char *)((entry) + 1))
+
+#define SLOTS_HEADER(slots)	((struct hashslots_header *)(slots) - 1)
+
+
+static unsigned int hashtable_hash(const unsigned char *key, int len);
+static unsigned int hashtable_reader_slot(const void *local);
+static void hashtable_slots_init(struct hashtable *hashtable, struct hashslots *slots, unsigned int capacity);
+static struct hashentry *hashtable_slots_find(struct hashtable *hashtable, unsigned char *slots, const void *key, unsigned int hash);
+static void hashtable_slots_put(struct hashtable *hashtable, struct hashslots *slots, const void *key, void *value, unsigned int hash);
+static void hashtable_slots_delete(struct hashtable *hashtable, struct hashslots *slots, struct hashentry *entry, int shift);
+static void hashtable_slots_retire(struct hashtable *hashtable, unsigned char *slots);
+static void hashtable_grow(struct hashtable *hashtable);
+static void hashtable_migrate(struct hashtable *hashtable, unsigned int num_slots);
+static void hashtable_purge(struct hashtable *hashtable);
+static void hashtable_lock(struct hashtable *hashtable);
+static void hashtable_unlock(struct hashtable *hashtable);
+static void hashtable_write_begin(struct hashtable *hashtable);
+static void hashtable_write_end(struct hashtable *hashtable);
+
+
 struct hashtable *hashtable_create(int keysize) {
 	struct hashtable *hashtable;
+	int i;
 
-	if(keysize < sizeof(unsigned int))
+	if(keysize <= 0)
 		return NULL;
 
 	hashtable = malloc(sizeof(struct hashtable));
 
-	hashtable->size = 2048;
 	hashtable->keysize = keysize;
-	hashtable->count = 0;
 
-	hashtable->entries = (struct hashentry **)malloc(sizeof(struct hashentry *) * hashtable->size);
-	memset(hashtable->entries, 0, sizeof(struct hashentry *) * hashtable->size);
+	/* Keep the entries aligned */
+	hashtable->stride = sizeof(struct hashentry) + keysize;
+	hashtable->stride = (hashtable->stride + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	hashtable_slots_init(hashtable, &hashtable->table, HASHTABLE_INIT_SIZE);
+
+	hashtable->old.slots = NULL;
+	hashtable->old.capacity = 0;
+	hashtable->old.count = 0;
+	hashtable->old.deleted = 0;
+	hashtable->migrated = 0;
+
+	hashtable->num_iterators = 0;
+
+	hashtable->swap = malloc(2 * keysize);
 
-	hashtable->num_to_free = 0;
-	hashtable->freelist = NULL;
+	hashtable->seq = 0;
+	for(i = 0; i < HASHTABLE_READER_SLOTS; i++)
+		hashtable->readers[i].count = 0;
+
+	hashtable->retired = NULL;
 
 #ifdef _WIN32
 	hashtable->mutex = CreateMutex(NULL, FALSE, NULL);
@@ -49,137 +111,185 @@ struct hashtable *hashtable_create(int keysize) {
 
 
 void hashtable_insert(struct hashtable *hashtable, void *key, void *value) {
-	struct hashentry *entry;
-	int index;
+	struct hashslots *table = &hashtable->table;
+	unsigned int hash;
 
-	index = *(unsigned int *)key & (hashtable->size - 1u);
+	hash = hashtable_hash(key, hashtable->keysize);
 
-#ifdef _WIN32
-	WaitForSingleObject(hashtable->mutex, INFINITE);
-#else
-	pthread_mutex_lock(&hashtable->mutex);
-#endif
+	hashtable_lock(hashtable);
 
-	if((entry = hashtable->entries[index]) == NULL)
-		entry = hashtable->entries[index] = malloc(sizeof(struct hashentry));
-	else {
-		while(entry->next)
-			entry = entry->next;
+	if(hashtable->num_iterators == 0)
+		hashtable_migrate(hashtable, HASHTABLE_MIGRATE_SLOTS);
 
-		entry->next = malloc(sizeof(struct hashentry));
-		entry = entry->next;
+	/*
+	 * Grow at 7/8 full. While iterating, only when there's no other way
+	 * to keep a free slot, since moving entries upsets the iterator.
+	 *
+	 */
+	if(hashtable->num_iterators == 0) {
+		if((table->count + table->deleted + 1) * 8 > table->capacity * 7)
+			hashtable_grow(hashtable);
+	}
+	else if(table->count + table->deleted + 1 >= table->capacity) {
+		hashtable_grow(hashtable);
 	}
 
-	entry->key = malloc(hashtable->keysize);
-	memcpy(entry->key, key, hashtable->keysize);
-	entry->value = value;
+	hashtable_slots_put(hashtable, &hashtable->table, key, value, hash);
 
-	entry->next = NULL;
+	hashtable_unlock(hashtable);
+}
 
-	hashtable->count++;
 
-#ifdef _WIN32
-	ReleaseMutex(hashtable->mutex);
-#else
-	pthread_mutex_unlock(&hashtable->mutex);
-#endif
+void hashtable_remove(struct hashtable *hashtable, void *key) {
+	struct hashentry *entry;
+	unsigned int hash;
 
+	hash = hashtable_hash(key, hashtable->keysize);
+
+	hashtable_lock(hashtable);
+
+	if((entry = hashtable_slots_find(hashtable, hashtable->table.slots, key, hash)) != NULL)
+		hashtable_slots_delete(hashtable, &hashtable->table, entry, hashtable->num_iterators == 0);
+	else if(hashtable->old.slots != NULL
+			&& (entry = hashtable_slots_find(hashtable, hashtable->old.slots, key, hash)) != NULL)
+		hashtable_slots_delete(hashtable, &hashtable->old, entry, 0);
+
+	if(hashtable->num_iterators == 0)
+		hashtable_migrate(hashtable, HASHTABLE_MIGRATE_SLOTS);
+
+	hashtable_unlock(hashtable);
 }
 
 
-void hashtable_remove(struct hashtable *hashtable, void *key) {
-	struct hashentry *entry, *prev;
-	int index;
+/*
+ * Look up a key without taking a lock. Tried again if an insert or
+ * remove changed the slots meanwhile, and with the mutex held if that
+ * keeps happening.
+ *
+ */
+void *hashtable_find(struct hashtable *hashtable, const void *key) {
+	struct hashreaders *readers;
+	struct hashentry *entry;
+	unsigned char *slots;
+	unsigned int hash;
+	void *value = NULL;
+	int seq, tries;
 
-	index = *(unsigned int *)key & (hashtable->size - 1u);
-	if((entry = hashtable->entries[index]) == NULL)
-		return;
+	hash = hashtable_hash(key, hashtable->keysize);
 
-#ifdef _WIN32
-	WaitForSingleObject(hashtable->mutex, INFINITE);
-#else
-	pthread_mutex_lock(&hashtable->mutex);
-#endif
+	/* Keeps the arrays of slots read from around, see hashtable_write_end() */
+	readers = &hashtable->readers[hashtable_reader_slot(&readers)];
+	osfy_atomic_add_int(&readers->count, 1);
 
-	for(prev = NULL; entry; entry = entry->next) {
-		if(!memcmp(entry->key, key, hashtable->keysize))
-			break;
+	for(tries = 0; tries < HASHTABLE_FIND_TRIES; tries++) {
+		seq = osfy_atomic_read_int(&hashtable->seq);
+		if(seq & 1)
+			continue;
 
-		prev = entry;
+		value = NULL;
+		slots = osfy_atomic_read_ptr(&hashtable->table.slots);
+		if((entry = hashtable_slots_find(hashtable, slots, key, hash)) != NULL)
+			value = entry->value;
+		else if((slots = osfy_atomic_read_ptr(&hashtable->old.slots)) != NULL
+				&& (entry = hashtable_slots_find(hashtable, slots, key, hash)) != NULL)
+			value = entry->value;
+
+		/* Nothing was changed while the slots were read */
+		osfy_atomic_fence_acquire();
+		if(osfy_atomic_read_int(&hashtable->seq) == seq)
+			break;
 	}
 
-	if(entry == NULL)
-		return;
+	osfy_atomic_add_int(&readers->count, -1);
 
-	if(prev == NULL)
-		hashtable->entries[index] = entry->next;
-	else
-		prev->next = entry->next;
+	if(tries < HASHTABLE_FIND_TRIES)
+		return value;
 
-	free(entry->key);
-	if(entry->dont_free) {
-		hashtable->freelist = realloc(hashtable->freelist, sizeof(struct hashentry *) * (1 + hashtable->num_to_free));
-		hashtable->freelist[hashtable->num_to_free] = entry;
-		hashtable->num_to_free++;
-	}
-	else {
-		free(entry);
-	}
+	value = NULL;
 
-	hashtable->count--;
+	hashtable_writer_lock(hashtable);
 
-#ifdef _WIN32
-	ReleaseMutex(hashtable->mutex);
-#else
-	pthread_mutex_unlock(&hashtable->mutex);
-#endif
+	if((entry = hashtable_slots_find(hashtable, hashtable->table.slots, key, hash)) != NULL)
+		value = entry->value;
+	else if(hashtable->old.slots != NULL
+			&& (entry = hashtable_slots_find(hashtable, hashtable->old.slots, key, hash)) != NULL)
+		value = entry->value;
+
+	hashtable_writer_unlock(hashtable);
+
+	return value;
 }
 
 
-void *hashtable_find(struct hashtable *hashtable, const void *key) {
+/*
+ * Find a value and pass it to the callback before anything can remove
+ * it, so it can be referenced. Returns NULL if there's no such key.
+ *
+ */
+void *hashtable_find_with(struct hashtable *hashtable, const void *key, void (*callback)(void *value, void *arg), void *arg) {
 	struct hashentry *entry;
-	int index;
-	void *value  = NULL;
+	unsigned int hash;
+	void *value = NULL;
+
+	hash = hashtable_hash(key, hashtable->keysize);
+
+	hashtable_writer_lock(hashtable);
+
+	if((entry = hashtable_slots_find(hashtable, hashtable->table.slots, key, hash)) == NULL
+			&& hashtable->old.slots != NULL)
+		entry = hashtable_slots_find(hashtable, hashtable->old.slots, key, hash);
+
+	if(entry != NULL) {
+		value = entry->value;
+		callback(value, arg);
+	}
+
+	hashtable_writer_unlock(hashtable);
 
-	index = *(unsigned int *)key & (hashtable->size - 1u);
+	return value;
+}
 
+
+/*
+ * Keep other threads from inserting or removing entries, so that a find
+ * and the insert depending on it are done as one. Finds still go on.
+ * Inserts and removes by the same thread are fine, the mutex is recursive.
+ *
+ */
+void hashtable_writer_lock(struct hashtable *hashtable) {
 #ifdef _WIN32
 	WaitForSingleObject(hashtable->mutex, INFINITE);
 #else
 	pthread_mutex_lock(&hashtable->mutex);
 #endif
+}
 
-	if(hashtable->entries[index] != NULL) {
-		for(entry = hashtable->entries[index]; entry; entry = entry->next) {
-			if(memcmp(entry->key, key, hashtable->keysize) == 0) {
-				value = entry->value;
-				break;
-			}
-		}
-	}
 
+void hashtable_writer_unlock(struct hashtable *hashtable) {
 #ifdef _WIN32
 	ReleaseMutex(hashtable->mutex);
 #else
 	pthread_mutex_unlock(&hashtable->mutex);
 #endif
-
-	return value;
 }
 
 
+/*
+ * Entries returned may be removed by the thread iterating,
+ * but nothing should be inserted until the iterator is freed
+ *
+ */
 struct hashiterator *hashtable_iterator_init(struct hashtable *hashtable) {
 	struct hashiterator *iter;
 
-#ifdef _WIN32
-	WaitForSingleObject(hashtable->mutex, INFINITE);
-#else
-	pthread_mutex_lock(&hashtable->mutex);
-#endif
+	hashtable_writer_lock(hashtable);
+
+	hashtable->num_iterators++;
 
 	iter = malloc(sizeof(struct hashiterator));
 	iter->hashtable = hashtable;
 	iter->offset = -1;
+	iter->in_old = 0;
 	iter->entry = NULL;
 
 	return iter;
@@ -187,62 +297,106 @@ struct hashiterator *hashtable_iterator_init(struct hashtable *hashtable) {
 
 
 struct hashentry *hashtable_iterator_next(struct hashiterator *iter) {
-	if(iter->entry != NULL) {
-		iter->entry->dont_free = 0;
+	struct hashtable *hashtable = iter->hashtable;
+	struct hashslots *slots;
 
-		if((iter->entry = iter->entry->next) != NULL) {
-			iter->entry->dont_free = 1;
-			return iter->entry;
-		}
-	}
+	for(;;) {
+		slots = iter->in_old? &hashtable->old: &hashtable->table;
 
-	for(++iter->offset; iter->offset < iter->hashtable->size; iter->offset++) {
-		if((iter->entry = iter->hashtable->entries[iter->offset]) != NULL) {
-			iter->entry->dont_free = 1;
-			return iter->entry;
+		for(++iter->offset; iter->offset < (int)slots->capacity; iter->offset++) {
+			iter->entry = SLOT(hashtable, slots, iter->offset);
+			if(iter->entry->dist && iter->entry->key != NULL)
+				return iter->entry;
 		}
+
+		if(iter->in_old || hashtable->old.slots == NULL)
+			break;
+
+		iter->in_old = 1;
+		iter->offset = -1;
 	}
 
+	iter->entry = NULL;
+
 	return NULL;
 }
 
 
 void hashtable_iterator_free(struct hashiterator *iter) {
-	int i;
+	struct hashtable *hashtable = iter->hashtable;
 
-	for(i = 0; i < iter->hashtable->num_to_free; i++)
-		free(iter->hashtable->freelist[i]);
+	if(--hashtable->num_iterators == 0 && hashtable->table.deleted)
+		hashtable_purge(hashtable);
 
-	iter->hashtable->num_to_free = 0;
-
-#ifdef _WIN32
-	ReleaseMutex(iter->hashtable->mutex);
-#else
-	pthread_mutex_unlock(&iter->hashtable->mutex);
-#endif
+	hashtable_writer_unlock(hashtable);
 
 	free(iter);
 }
 
 
-void hashtable_free(struct hashtable *hashtable) {
-	int i;
-	struct hashentry *entry, *next;
+/*
+ * Visit up to num_slots slots from *cursor on, removing the entries the
+ * callback agrees to, which it's asked while no lookup can run. Lets a
+ * table be swept a little at a time without holding the locks for long.
+ * Returns 1 once the end of the table is reached, *cursor is reset then.
+ *
+ */
+int hashtable_sweep(struct hashtable *hashtable, unsigned int *cursor, unsigned int num_slots,
+			int (*callback)(void *value, void *arg), void *arg) {
+	struct hashslots *table = &hashtable->table;
+	struct hashentry *entry;
+	int shift, done;
 
-	for(i = 0; i < hashtable->num_to_free; i++)
-		free(hashtable->freelist[i]);
+	hashtable_lock(hashtable);
 
-	for(i = 0; i < hashtable->size; i++) {
-		if((entry = hashtable->entries[i]) == NULL)
-			continue;
+	/* Help a migration along, the entries still in the old table are swept next time */
+	shift = hashtable->num_iterators == 0;
+	if(shift)
+		hashtable_migrate(hashtable, num_slots);
+
+	/* The table may have grown since the last call */
+	if(*cursor >= table->capacity)
+		*cursor = 0;
 
-		do {
-			free(entry->key);
-			next = entry->next;
-			free(entry);
-		} while((entry = next) != NULL);
+	for(; num_slots && *cursor < table->capacity; num_slots--) {
+		entry = SLOT(hashtable, table, *cursor);
+
+		if(entry->dist && entry->key != NULL && callback(entry->value, arg)) {
+			hashtable_slots_delete(hashtable, table, entry, shift);
+
+			/* The next entry may have been moved into this slot */
+			if(shift)
+				continue;
+		}
+
+		(*cursor)++;
 	}
 
+	done = *cursor == table->capacity;
+	if(done)
+		*cursor = 0;
+
+	hashtable_unlock(hashtable);
+
+	return done;
+}
+
+
+/* No thread may be using the table anymore */
+void hashtable_free(struct hashtable *hashtable) {
+	unsigned char *slots;
+
+	free(SLOTS_HEADER(hashtable->table.slots));
+	if(hashtable->old.slots != NULL)
+		free(SLOTS_HEADER(hashtable->old.slots));
+
+	while((slots = hashtable->retired) != NULL) {
+		hashtable->retired = SLOTS_HEADER(slots)->next_retired;
+		free(SLOTS_HEADER(slots));
+	}
+
+	free(hashtable->swap);
+
 #ifdef _WIN32
 	CloseHandle(hashtable->mutex);
 #else
@@ -252,3 +406,335 @@ void hashtable_free(struct hashtable *hashtable) {
 
 	free(hashtable);
 }
+
+
+/*
+ * MurmurHash3, four bytes of the key at a time, so keys that only
+ * differ in a few bits still end up far apart in the table
+ *
+ */
+static unsigned int hashtable_hash(const unsigned char *key, int len) {
+	unsigned int hash = 0x9747b28cU;
+	unsigned int k;
+	int i;
+
+	for(i = 0; i + 4 <= len; i += 4) {
+		memcpy(&k, key + i, 4);
+
+		k *= 0xcc9e2d51U;
+		k = (k << 15) | (k >> 17);
+		k *= 0x1b873593U;
+
+		hash ^= k;
+		hash = (hash << 13) | (hash >> 19);
+		hash = hash * 5 + 0xe6546b64U;
+	}
+
+	/* Whatever's left of keys of other sizes */
+	if(i < len) {
+		for(k = 0; i < len; i++)
+			k = (k << 8) | key[i];
+
+		k *= 0xcc9e2d51U;
+		k = (k << 15) | (k >> 17);
+		k *= 0x1b873593U;
+		hash ^= k;
+	}
+
+	hash ^= (unsigned int)len;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+
+/*
+ * Which of hashtable->readers a find counts itself in. Threads have
+ * stacks of their own, so the address of a local variable tells them
+ * apart well enough.
+ *
+ */
+static unsigned int hashtable_reader_slot(const void *local) {
+	unsigned int page = (unsigned int)((size_t)local >> 12);
+
+	return ((page * 2654435761U) >> 16) & (HASHTABLE_READER_SLOTS - 1);
+}
+
+
+static void hashtable_slots_init(struct hashtable *hashtable, struct hashslots *slots, unsigned int capacity) {
+	struct hashslots_header *header;
+
+	header = calloc(1, sizeof(struct hashslots_header) + (size_t)capacity * hashtable->stride);
+	header->capacity = capacity;
+	header->next_retired = NULL;
+
+	/* Finds may read it from now on */
+	osfy_atomic_store_ptr(&slots->slots, (unsigned char *)(header + 1));
+	slots->capacity = capacity;
+	slots->count = 0;
+	slots->deleted = 0;
+}
+
+
+/*
+ * Look for a key in an array of slots. Finds not holding a lock may
+ * see entries being moved, so the capacity is taken from the array and
+ * the table is never gone around more than once.
+ *
+ */
+static struct hashentry *hashtable_slots_find(struct hashtable *hashtable, unsigned char *slots, const void *key, unsigned int hash) {
+	struct hashentry *entry;
+	unsigned int capacity, index, dist;
+
+	capacity = SLOTS_HEADER(slots)->capacity;
+	index = hash & (capacity - 1);
+	for(dist = 1; dist <= capacity; dist++) {
+		entry = SLOT_AT(hashtable, slots, index);
+
+		/* A free slot, or the key would have taken this entry's place */
+		if(entry->dist < dist)
+			return NULL;
+
+		if(entry->hash == hash && entry->key != NULL
+				&& memcmp(SLOT_KEY(entry), key, hashtable->keysize) == 0)
+			return entry;
+
+		index = (index + 1) & (capacity - 1);
+	}
+
+	return NULL;
+}
+
+
+/* Called with the mutex held */
+static void hashtable_slots_put(struct hashtable *hashtable, struct hashslots *slots, const void *key, void *value, unsigned int hash) {
+	struct hashentry *entry;
+	unsigned char *carried_key, *spare_key, *tmp;
+	unsigned int index, dist, tmp_hash, tmp_dist;
+	int deleted, tmp_deleted;
+	void *tmp_value;
+
+	/* The entry being placed, swapped with each one it displaces */
+	carried_key = (unsigned char *)key;
+	spare_key = hashtable->swap;
+	dist = 1;
+	deleted = 0;
+
+	index = hash & (slots->capacity - 1);
+	for(;;) {
+		entry = SLOT(hashtable, slots, index);
+
+		if(entry->dist == 0) {
+			entry->key = deleted? NULL: SLOT_KEY(entry);
+			entry->value = value;
+			entry->hash = hash;
+			entry->dist = dist;
+			memcpy(SLOT_KEY(entry), carried_key, hashtable->keysize);
+			break;
+		}
+
+		if(entry->dist < dist) {
+			tmp_value = entry->value;
+			tmp_hash = entry->hash;
+			tmp_dist = entry->dist;
+			tmp_deleted = entry->key == NULL;
+			memcpy(spare_key, SLOT_KEY(entry), hashtable->keysize);
+
+			entry->key = deleted? NULL: SLOT_KEY(entry);
+			entry->value = value;
+			entry->hash = hash;
+			entry->dist = dist;
+			memcpy(SLOT_KEY(entry), carried_key, hashtable->keysize);
+
+			value = tmp_value;
+			hash = tmp_hash;
+			dist = tmp_dist;
+			deleted = tmp_deleted;
+
+			/* The displaced key is carried on, the other half of the swap buffer is free again */
+			if(carried_key == (unsigned char *)key)
+				carried_key = hashtable->swap + hashtable->keysize;
+
+			tmp = carried_key;
+			carried_key = spare_key;
+			spare_key = tmp;
+		}
+
+		index = (index + 1) & (slots->capacity - 1);
+		dist++;
+	}
+
+	slots->count++;
+}
+
+
+/*
+ * Remove an entry, shifting the following ones back a slot unless
+ * entries must stay where they are. Called with the mutex held.
+ *
+ */
+static void hashtable_slots_delete(struct hashtable *hashtable, struct hashslots *slots, struct hashentry *entry, int shift) {
+	struct hashentry *next;
+	unsigned int index;
+
+	slots->count--;
+
+	if(!shift) {
+		entry->key = NULL;
+		entry->value = NULL;
+		slots->deleted++;
+		return;
+	}
+
+	index = (unsigned int)(((unsigned char *)entry - slots->slots) / hashtable->stride);
+	for(;;) {
+		next = SLOT(hashtable, slots, (index + 1) & (slots->capacity - 1));
+
+		/* Free, or already in the slot it belongs in */
+		if(next->dist <= 1) {
+			entry->dist = 0;
+			break;
+		}
+
+		entry->key = next->key == NULL? NULL: SLOT_KEY(entry);
+		entry->value = next->value;
+		entry->hash = next->hash;
+		entry->dist = next->dist - 1;
+		memcpy(SLOT_KEY(entry), SLOT_KEY(next), hashtable->keysize);
+
+		entry = next;
+		index = (index + 1) & (slots->capacity - 1);
+	}
+}
+
+
+/* An array of slots no longer in the table, which finds may still be reading */
+static void hashtable_slots_retire(struct hashtable *hashtable, unsigned char *slots) {
+	SLOTS_HEADER(slots)->next_retired = hashtable->retired;
+	hashtable->retired = slots;
+}
+
+
+/*
+ * Start moving the entries into a larger table. Small ones grow faster,
+ * so a library being loaded has its entries moved fewer times.
+ *
+ */
+static void hashtable_grow(struct hashtable *hashtable) {
+	unsigned int capacity;
+
+	/* Still growing from the last time, finish that first */
+	if(hashtable->old.slots != NULL)
+		hashtable_migrate(hashtable, hashtable->old.capacity);
+
+	hashtable->old.capacity = hashtable->table.capacity;
+	hashtable->old.count = hashtable->table.count;
+	hashtable->old.deleted = hashtable->table.deleted;
+	osfy_atomic_store_ptr(&hashtable->old.slots, hashtable->table.slots);
+	hashtable->migrated = 0;
+
+	capacity = 2 * hashtable->old.capacity;
+	if(capacity < HASHTABLE_FAST_GROW_SIZE)
+		capacity *= 2;
+
+	hashtable_slots_init(hashtable, &hashtable->table, capacity);
+}
+
+
+/*
+ * Move some entries of the old table into the current one. They're
+ * left behind as deleted entries, so lookups of keys further along
+ * still find their way. Called with the mutex held.
+ *
+ */
+static void hashtable_migrate(struct hashtable *hashtable, unsigned int num_slots) {
+	struct hashslots *old = &hashtable->old;
+	struct hashentry *entry;
+
+	if(old->slots == NULL)
+		return;
+
+	for(; num_slots && hashtable->migrated < old->capacity; num_slots--) {
+		entry = SLOT(hashtable, old, hashtable->migrated++);
+		if(entry->dist == 0 || entry->key == NULL)
+			continue;
+
+		hashtable_slots_put(hashtable, &hashtable->table, SLOT_KEY(entry), entry->value, entry->hash);
+		hashtable_slots_delete(hashtable, old, entry, 0);
+	}
+
+	if(hashtable->migrated == old->capacity) {
+		hashtable_slots_retire(hashtable, old->slots);
+		osfy_atomic_store_ptr(&old->slots, NULL);
+		old->capacity = 0;
+		old->count = 0;
+		old->deleted = 0;
+	}
+}
+
+
+/* Rebuild the current table without the entries deleted while iterating */
+static void hashtable_purge(struct hashtable *hashtable) {
+	struct hashslots table = hashtable->table;
+	struct hashentry *entry;
+	unsigned int i;
+
+	hashtable_write_begin(hashtable);
+
+	hashtable_slots_init(hashtable, &hashtable->table, table.capacity);
+
+	for(i = 0; i < table.capacity; i++) {
+		entry = SLOT(hashtable, &table, i);
+		if(entry->dist && entry->key != NULL)
+			hashtable_slots_put(hashtable, &hashtable->table, SLOT_KEY(entry), entry->value, entry->hash);
+	}
+
+	hashtable_slots_retire(hashtable, table.slots);
+
+	hashtable_write_end(hashtable);
+}
+
+
+/* Keep out other writers, and make finds that overlap the changes try again */
+static void hashtable_lock(struct hashtable *hashtable) {
+	hashtable_writer_lock(hashtable);
+	hashtable_write_begin(hashtable);
+}
+
+
+static void hashtable_unlock(struct hashtable *hashtable) {
+	hashtable_write_end(hashtable);
+	hashtable_writer_unlock(hashtable);
+}
+
+
+/* Called with the mutex held, the exchange keeps the changes after it */
+static void hashtable_write_begin(struct hashtable *hashtable) {
+	osfy_atomic_xchg_int(&hashtable->seq, hashtable->seq + 1);
+}
+
+
+/* Also frees the arrays of slots retired, once no find is in progress */
+static void hashtable_write_end(struct hashtable *hashtable) {
+	unsigned char *slots;
+	int i;
+
+	osfy_atomic_store_int(&hashtable->seq, hashtable->seq + 1);
+
+	if(hashtable->retired == NULL)
+		return;
+
+	/* Finds that started since only saw the current arrays */
+	for(i = 0; i < HASHTABLE_READER_SLOTS; i++)
+		if(osfy_atomic_read_int(&hashtable->readers[i].count) != 0)
+			return;
+
+	while((slots = hashtable->retired) != NULL) {
+		hashtable->retired = SLOTS_HEADER(slots)->next_retired;
+		free(SLOTS_HEADER(slots));
+	}
+}
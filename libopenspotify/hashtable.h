@@ -7,31 +7,100 @@
 #include <pthread.h>
 #endif
 
+/* Slots in a new table, always a power of two */
+#define HASHTABLE_INIT_SIZE	256
+
+/* Tables with fewer slots grow to four times the size, larger ones to twice */
+#define HASHTABLE_FAST_GROW_SIZE	65536
+
+/* Slots of the old table moved over by each insert or remove while growing */
+#define HASHTABLE_MIGRATE_SLOTS	64
+
+/* Counters of the finds in progress, a power of two, see hashtable_find() */
+#define HASHTABLE_READER_SLOTS	8
+
+/* Times a find is tried again when an insert or remove got in the way, before taking the mutex */
+#define HASHTABLE_FIND_TRIES	4
+
+
+/*
+ * A slot in the table, directly followed by the key.
+ * Only key and value are of any interest outside of hashtable.c
+ *
+ */
 struct hashentry {
+	/* NULL if removed while the table was iterated or migrated */
 	void *key;
 	void *value;
 	unsigned int hash;
-	int dont_free;
-	struct hashentry *next;
+
+	/* Distance from the slot the hash points at plus one, zero if the slot is free */
+	unsigned int dist;
 };
 
+struct hashslots {
+	/* Preceded by a struct hashslots_header */
+	unsigned char *slots;
+	unsigned int capacity;
+	unsigned int count;
+	unsigned int deleted;
+};
+
+/* What a find needs to know about an array of slots without holding a lock */
+struct hashslots_header {
+	unsigned int capacity;
+
+	/* Arrays migrated from that finds may still be reading */
+	unsigned char *next_retired;
+};
+
+/* Finds in progress on the threads using it, a cache line each to keep them apart */
+struct hashreaders {
+	int count;
+	char pad[64 - sizeof(int)];
+};
+
+/*
+ * Finds go without a lock, checking that no insert or remove ran
+ * meanwhile, see hashtable_find(). Everything else takes the mutex.
+ * Iterators hold it, so the entries they return may be removed by the
+ * same thread.
+ *
+ */
 struct hashtable {
-	int size;
 	int keysize;
-	int count;
+	size_t stride;
+
+	struct hashslots table;
+
+	/* The table being moved into the current one while growing */
+	struct hashslots old;
+	unsigned int migrated;
+
+	int num_iterators;
+
+	/* Room for two keys used when swapping entries */
+	unsigned char *swap;
+
+	/* Odd while an insert or remove is changing the slots */
+	int seq;
+
+	struct hashreaders readers[HASHTABLE_READER_SLOTS];
+
+	/* Arrays of slots migrated from, freed once no find is in progress */
+	unsigned char *retired;
+
 #ifdef _WIN32
-	HANDLE *mutex;
+	HANDLE mutex;
 #else
 	pthread_mutex_t mutex;
 	pthread_mutexattr_t mutex_attr;
 #endif
-	struct hashentry **entries;
-	int num_to_free;
-	struct hashentry **freelist;
 };
 
 struct hashiterator {
 	int offset;
+	int in_old;
 	struct hashentry *entry;
 	struct hashtable *hashtable;
 };
@@ -39,11 +108,15 @@ struct hashiterator {
 struct hashtable *hashtable_create(int keysize);
 void hashtable_insert(struct hashtable *hashtable, void *key, void *value);
 void *hashtable_find(struct hashtable *hashtable, const void *key);
-void hashtable_insert(struct hashtable *hashtable, void *key, void *value);
+void *hashtable_find_with(struct hashtable *hashtable, const void *key, void (*callback)(void *value, void *arg), void *arg);
 void hashtable_remove(struct hashtable *hashtable, void *key);
+void hashtable_writer_lock(struct hashtable *hashtable);
+void hashtable_writer_unlock(struct hashtable *hashtable);
 struct hashiterator *hashtable_iterator_init(struct hashtable *hashtable);
 struct hashentry *hashtable_iterator_next(struct hashiterator *iter);
 void hashtable_iterator_free(struct hashiterator *iter);
+int hashtable_sweep(struct hashtable *hashtable, unsigned int *cursor, unsigned int num_slots,
+			int (*callback)(void *value, void *arg), void *arg);
 void hashtable_free(struct hashtable *hashtable);
 
 #endif
@@ -1,21 +1,80 @@
 #ifndef LIBOPENSPOTIFY_IMAGE_H
 #define LIBOPENSPOTIFY_IMAGE_H
 
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #include <libspotify/api.h>
 
+#include "buf.h"
+#include "decoder.h"
 #include "request.h"
 
 #define IMAGE_RETRY_TIMEOUT 120
 
+/* Bytes of loaded images kept in memory unless changed with opensp_session_set_image_memory_size() */
+#define IMAGE_MEMORY_DEFAULT_SIZE	(8 * 1024 * 1024)
+
 
 struct image_ctx {
 	sp_session *session;
 	struct request *req;
 	sp_image *image;
+
+	/* Reads the image from the disk cache on a decoder thread */
+	struct decode_job job;
+	struct buf *data;
+};
+
+
+/*
+ * Images that are no longer referenced are kept around in case
+ * they're asked for again, until the data of all loaded images grows
+ * past the budget. Images are referenced and released on the main thread
+ * and by the iothread when it frees albums, the mutex protects the list
+ * and the counters.
+ *
+ */
+struct image_lru {
+	/* Unreferenced images, most recently released first */
+	sp_image *head;
+	sp_image *tail;
+	int num_images;
+
+	/* Bytes used by all loaded images and the most that may be */
+	size_t size;
+	size_t max_size;
+
+	/* Counters for opensp_session_image_stats() */
+	unsigned int num_hits;
+	unsigned int num_disk_hits;
+	unsigned int num_misses;
+	unsigned int num_evictions;
+
+	/* Where image_lru_collect() goes on, and images it freed */
+	sp_image *sweep;
+	int sweeping;
+	unsigned int num_collected;
+
+#ifdef _WIN32
+	HANDLE mutex;
+#else
+	pthread_mutex_t mutex;
+#endif
 };
 
 
+void image_lru_init(sp_session *session);
+void image_lru_free(sp_session *session);
+void image_lru_set_size(sp_session *session, size_t max_size);
+int image_lru_collect(sp_session *session, int max_images);
+void image_lru_stats(sp_session *session, opensp_image_stats *stats);
 sp_image *osfy_image_create(sp_session *session, const byte image_id[20]);
+void osfy_image_loaded(sp_session *session, sp_image *image);
 int osfy_image_process_request(sp_session *session, struct request *req);
 
 #endif
@@ -0,0 +1,473 @@
+/*
+ * On-disk image cache
+ *
+ * Images are stored in a directory of the cache directory, one file per
+ * image named after its hex ID. Files are written to a temporary name
+ * and renamed into place, so a file with an image's name is always
+ * complete.
+ *
+ * The index is built by scanning the directory when the session is
+ * created, ordered by the files' modification times. Those are updated
+ * whenever an image is used, so the least recently used images are the
+ * first to go once the cache grows past its budget, in this session or
+ * the next.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "buf.h"
+#include "debug.h"
+#include "hashtable.h"
+#include "imgcache.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+/* The Visual C++ compiler doesn't know 'snprintf'... */
+#ifdef _MSC_VER
+#define snprintf _snprintf
+#endif
+
+
+/* An image found when scanning the directory */
+struct imgcache_scanned {
+	struct imgcache_entry *entry;
+	time_t mtime;
+};
+
+
+static void imgcache_scan(struct imgcache *ic);
+static void imgcache_scan_file(struct imgcache *ic, const char *name, size_t size, time_t mtime,
+				struct imgcache_scanned **scanned, int *num, int *max);
+static int imgcache_scanned_cmp(const void *a, const void *b);
+static void imgcache_path(struct imgcache *ic, const unsigned char id[20], const char *suffix, char *path);
+static void imgcache_link(struct imgcache *ic, struct imgcache_entry *entry);
+static void imgcache_unlink(struct imgcache *ic, struct imgcache_entry *entry);
+static void imgcache_evict(struct imgcache *ic);
+static void imgcache_lock(struct imgcache *ic);
+static void imgcache_unlock(struct imgcache *ic);
+
+
+/*
+ * Index the images stored by earlier sessions
+ * Called by cache_init() before the networking thread is started.
+ *
+ */
+int imgcache_init(sp_session *session, const char *dir) {
+	struct imgcache *ic;
+
+#ifdef _WIN32
+	CreateDirectory(dir, NULL);
+#else
+	mkdir(dir, 0700);
+#endif
+
+	ic = malloc(sizeof(struct imgcache));
+	if(ic == NULL)
+		return -1;
+
+	ic->dir = malloc(strlen(dir) + 1);
+	strcpy(ic->dir, dir);
+
+	ic->entries = hashtable_create(20);
+	ic->head = NULL;
+	ic->tail = NULL;
+
+	ic->size = 0;
+	ic->max_size = IMGCACHE_DEFAULT_SIZE;
+
+#ifdef _WIN32
+	ic->mutex = CreateMutex(NULL, FALSE, NULL);
+#else
+	pthread_mutex_init(&ic->mutex, NULL);
+#endif
+
+	imgcache_scan(ic);
+	imgcache_evict(ic);
+
+	session->imgcache = ic;
+
+	return 0;
+}
+
+
+void imgcache_free(sp_session *session) {
+	struct imgcache *ic = session->imgcache;
+	struct imgcache_entry *entry;
+
+	if(ic == NULL)
+		return;
+
+	while((entry = ic->head) != NULL) {
+		ic->head = entry->next;
+		free(entry);
+	}
+
+	hashtable_free(ic->entries);
+
+#ifdef _WIN32
+	CloseHandle(ic->mutex);
+#else
+	pthread_mutex_destroy(&ic->mutex);
+#endif
+
+	free(ic->dir);
+	free(ic);
+
+	session->imgcache = NULL;
+}
+
+
+/* Change the budget, called by opensp_session_set_image_cache_size() */
+void imgcache_set_size(sp_session *session, size_t max_size) {
+	struct imgcache *ic = session->imgcache;
+
+	if(ic == NULL)
+		return;
+
+	imgcache_lock(ic);
+	ic->max_size = max_size;
+	imgcache_evict(ic);
+	imgcache_unlock(ic);
+}
+
+
+/* Check if an image is in the cache, without reading it */
+int imgcache_contains(sp_session *session, const unsigned char id[20]) {
+	struct imgcache *ic = session->imgcache;
+	int found;
+
+	if(ic == NULL)
+		return 0;
+
+	imgcache_lock(ic);
+	found = hashtable_find(ic->entries, id) != NULL;
+	imgcache_unlock(ic);
+
+	return found;
+}
+
+
+/*
+ * Read a cached image, NULL if it's not in the cache
+ * Called by a decoder thread, see sp_image_create().
+ *
+ */
+struct buf *imgcache_load(sp_session *session, const unsigned char id[20]) {
+	struct imgcache *ic = session->imgcache;
+	struct imgcache_entry *entry;
+	char path[1024];
+	struct buf *data;
+	size_t size;
+	FILE *fd;
+
+	if(ic == NULL)
+		return NULL;
+
+	imgcache_lock(ic);
+	if((entry = hashtable_find(ic->entries, id)) == NULL) {
+		imgcache_unlock(ic);
+		return NULL;
+	}
+
+	/* Most recently used now */
+	imgcache_unlink(ic, entry);
+	imgcache_link(ic, entry);
+
+	size = entry->size;
+	imgcache_unlock(ic);
+
+
+	imgcache_path(ic, id, "", path);
+	if((fd = fopen(path, "rb")) == NULL)
+		return NULL;
+
+	data = buf_new();
+	buf_extend(data, size);
+	data->len = fread(data->ptr, 1, size, fd);
+	fclose(fd);
+
+	/* Evicted meanwhile, or changed behind our back */
+	if(data->len != size) {
+		buf_free(data);
+		return NULL;
+	}
+
+	/* Keep the order for the next session */
+#ifdef _WIN32
+	_utime(path, NULL);
+#else
+	utime(path, NULL);
+#endif
+
+	return data;
+}
+
+
+/*
+ * Store a downloaded image and evict the least recently used ones
+ * if the cache is over budget. Called by the iothread.
+ *
+ */
+int imgcache_store(sp_session *session, const unsigned char id[20], struct buf *data) {
+	struct imgcache *ic = session->imgcache;
+	struct imgcache_entry *entry;
+	char tmppath[1024], path[1024];
+	FILE *fd;
+	int ret;
+
+	if(ic == NULL || data->len == 0 || data->len > IMGCACHE_MAX_IMAGE_SIZE)
+		return -1;
+
+	imgcache_path(ic, id, ".tmp", tmppath);
+	imgcache_path(ic, id, "", path);
+
+	if((fd = fopen(tmppath, "wb")) == NULL)
+		return -1;
+
+	ret = fwrite(data->ptr, 1, data->len, fd) == (size_t)data->len? 0: -1;
+	if(fclose(fd))
+		ret = -1;
+
+#ifdef _WIN32
+	if(ret == 0 && !MoveFileEx(tmppath, path, MOVEFILE_REPLACE_EXISTING))
+		ret = -1;
+#else
+	if(ret == 0 && rename(tmppath, path))
+		ret = -1;
+#endif
+
+	if(ret != 0) {
+		DSFYDEBUG("Failed to store image in '%s'\n", path);
+		remove(tmppath);
+		return -1;
+	}
+
+
+	imgcache_lock(ic);
+	if((entry = hashtable_find(ic->entries, id)) != NULL) {
+		imgcache_unlink(ic, entry);
+	}
+	else {
+		entry = malloc(sizeof(struct imgcache_entry));
+		memcpy(entry->id, id, sizeof(entry->id));
+		entry->size = 0;
+
+		hashtable_insert(ic->entries, entry->id, entry);
+	}
+
+	entry->size = data->len;
+	imgcache_link(ic, entry);
+
+	imgcache_evict(ic);
+	imgcache_unlock(ic);
+
+	return 0;
+}
+
+
+/* Index the directory, most recently modified first */
+static void imgcache_scan(struct imgcache *ic) {
+	struct imgcache_scanned *scanned;
+	int i, num, max;
+#ifdef _WIN32
+	WIN32_FIND_DATA data;
+	ULARGE_INTEGER t;
+	HANDLE find;
+	char pattern[1024];
+
+	num = 0;
+	max = 0;
+	scanned = NULL;
+
+	snprintf(pattern, sizeof(pattern), "%s\\*", ic->dir);
+	if((find = FindFirstFile(pattern, &data)) != INVALID_HANDLE_VALUE) {
+		do {
+			if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+				continue;
+
+			/* Seconds since 1601 and since 1970 only differ by a constant */
+			t.LowPart = data.ftLastWriteTime.dwLowDateTime;
+			t.HighPart = data.ftLastWriteTime.dwHighDateTime;
+
+			imgcache_scan_file(ic, data.cFileName, data.nFileSizeLow,
+					(time_t)(t.QuadPart / 10000000), &scanned, &num, &max);
+		} while(FindNextFile(find, &data));
+
+		FindClose(find);
+	}
+#else
+	struct dirent *de;
+	struct stat st;
+	char path[1024];
+	DIR *dir;
+
+	num = 0;
+	max = 0;
+	scanned = NULL;
+
+	if((dir = opendir(ic->dir)) != NULL) {
+		while((de = readdir(dir)) != NULL) {
+			if(de->d_name[0] == '.')
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", ic->dir, de->d_name);
+			if(stat(path, &st) || !S_ISREG(st.st_mode))
+				continue;
+
+			imgcache_scan_file(ic, de->d_name, st.st_size, st.st_mtime, &scanned, &num, &max);
+		}
+
+		closedir(dir);
+	}
+#endif
+
+	if(num)
+		qsort(scanned, num, sizeof(struct imgcache_scanned), imgcache_scanned_cmp);
+
+	/* Linking puts entries first, so go from the oldest */
+	for(i = num - 1; i >= 0; i--)
+		imgcache_link(ic, scanned[i].entry);
+
+	free(scanned);
+
+	DSFYDEBUG("Found %d images of %lu bytes in '%s'\n", num, (unsigned long)ic->size, ic->dir);
+}
+
+
+/* Index a file named after an image ID, and remove leftovers of failed writes */
+static void imgcache_scan_file(struct imgcache *ic, const char *name, size_t size, time_t mtime,
+				struct imgcache_scanned **scanned, int *num, int *max) {
+	struct imgcache_entry *entry;
+	unsigned char id[20];
+	char path[1024];
+
+	if(strspn(name, "0123456789abcdef") != 40)
+		return;
+
+	if(name[40] != 0) {
+		if(strcmp(name + 40, ".tmp") == 0) {
+			snprintf(path, sizeof(path), "%s/%s", ic->dir, name);
+			remove(path);
+		}
+
+		return;
+	}
+
+	/* Not stored by this library, see imgcache_store() */
+	if(size > IMGCACHE_MAX_IMAGE_SIZE)
+		return;
+
+	hex_ascii_to_bytes(name, id, sizeof(id));
+
+	entry = malloc(sizeof(struct imgcache_entry));
+	memcpy(entry->id, id, sizeof(entry->id));
+	entry->size = size;
+
+	hashtable_insert(ic->entries, entry->id, entry);
+
+	if(*num == *max) {
+		*max = *max? 2 * *max: 256;
+		*scanned = realloc(*scanned, *max * sizeof(struct imgcache_scanned));
+	}
+
+	(*scanned)[*num].entry = entry;
+	(*scanned)[*num].mtime = mtime;
+	(*num)++;
+}
+
+
+/* Most recently modified first */
+static int imgcache_scanned_cmp(const void *a, const void *b) {
+	time_t ta = ((const struct imgcache_scanned *)a)->mtime;
+	time_t tb = ((const struct imgcache_scanned *)b)->mtime;
+
+	return ta < tb? 1: ta > tb? -1: 0;
+}
+
+
+static void imgcache_path(struct imgcache *ic, const unsigned char id[20], const char *suffix, char *path) {
+	char hex[41];
+
+	hex_bytes_to_ascii(id, hex, 20);
+	snprintf(path, 1024, "%s/%s%s", ic->dir, hex, suffix);
+}
+
+
+/* Insert an entry as the most recently used one */
+static void imgcache_link(struct imgcache *ic, struct imgcache_entry *entry) {
+	entry->prev = NULL;
+	entry->next = ic->head;
+
+	if(ic->head != NULL)
+		ic->head->prev = entry;
+	else
+		ic->tail = entry;
+
+	ic->head = entry;
+	ic->size += entry->size;
+}
+
+
+static void imgcache_unlink(struct imgcache *ic, struct imgcache_entry *entry) {
+	if(entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		ic->head = entry->next;
+
+	if(entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		ic->tail = entry->prev;
+
+	ic->size -= entry->size;
+}
+
+
+/* Remove the least recently used images until the cache is within budget */
+static void imgcache_evict(struct imgcache *ic) {
+	struct imgcache_entry *entry;
+	char path[1024];
+
+	while(ic->size > ic->max_size && (entry = ic->tail) != NULL) {
+		imgcache_path(ic, entry->id, "", path);
+		remove(path);
+
+		imgcache_unlink(ic, entry);
+		hashtable_remove(ic->entries, entry->id);
+		free(entry);
+	}
+}
+
+
+static void imgcache_lock(struct imgcache *ic) {
+#ifdef _WIN32
+	WaitForSingleObject(ic->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&ic->mutex);
+#endif
+}
+
+
+static void imgcache_unlock(struct imgcache *ic) {
+#ifdef _WIN32
+	ReleaseMutex(ic->mutex);
+#else
+	pthread_mutex_unlock(&ic->mutex);
+#endif
+}
@@ -0,0 +1,69 @@
+#ifndef LIBOPENSPOTIFY_IMGCACHE_H
+#define LIBOPENSPOTIFY_IMGCACHE_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "buf.h"
+#include "hashtable.h"
+
+
+/* Directory in the cache directory, images are stored by their hex ID */
+#define IMGCACHE_DIR		"images"
+
+/* Bytes of images kept unless changed with opensp_session_set_image_cache_size() */
+#define IMGCACHE_DEFAULT_SIZE	(32 * 1024 * 1024)
+
+/* Larger images aren't cached, which also bounds what a read allocates */
+#define IMGCACHE_MAX_IMAGE_SIZE	(2 * 1024 * 1024)
+
+
+struct imgcache_entry {
+	unsigned char id[20];
+	size_t size;
+
+	/* Most recently used first */
+	struct imgcache_entry *prev;
+	struct imgcache_entry *next;
+};
+
+
+/*
+ * Used by the iothread, the decoder threads reading images and the main
+ * thread checking for them, the index is protected by the mutex.
+ *
+ */
+struct imgcache {
+	char *dir;
+
+	/* Index of the images on disk */
+	struct hashtable *entries;
+	struct imgcache_entry *head;
+	struct imgcache_entry *tail;
+
+	/* Bytes used by the images and the most that may be */
+	size_t size;
+	size_t max_size;
+
+#ifdef _WIN32
+	HANDLE mutex;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+
+int imgcache_init(sp_session *session, const char *dir);
+void imgcache_free(sp_session *session);
+void imgcache_set_size(sp_session *session, size_t max_size);
+int imgcache_contains(sp_session *session, const unsigned char id[20]);
+struct buf *imgcache_load(sp_session *session, const unsigned char id[20]);
+int imgcache_store(sp_session *session, const unsigned char id[20], struct buf *data);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Event loop for the iothread
+ *
+ * On Linux the session socket and an eventfd are multiplexed with
+ * epoll so that request_post() can wake the iothread immediately and
+ * the iothread can sleep until either data arrives, a request is
+ * posted or the earliest request deadline expires.
+ *
+ * Other platforms fall back to select() on the socket, capped at
+ * IOLOOP_POLL_MS, and to the session's idle_wakeup condition while
+ * there's no socket to wait on.
+ *
+ * Wakeups are flagged with an atomic exchange and only reach the
+ * kernel when the iothread has announced that it's going to sleep,
+ * so posting requests to a busy iothread doesn't cost a syscall.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#endif
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "atomic.h"
+#include "debug.h"
+#include "ioloop.h"
+#include "sp_opaque.h"
+
+
+static int ioloop_update_socket(sp_session *session, int want_write);
+
+
+/*
+ * Setup the event loop, called once by sp_session_init()
+ * before the iothread is started
+ *
+ */
+int ioloop_init(sp_session *session) {
+	struct ioloop *ioloop;
+#ifdef __linux__
+	struct epoll_event ev;
+#endif
+
+	ioloop = malloc(sizeof(struct ioloop));
+	if(ioloop == NULL)
+		return -1;
+
+	ioloop->sock = -1;
+	ioloop->generation = 0;
+	ioloop->want_write = 0;
+	ioloop->pending = 0;
+	ioloop->parked = 0;
+
+#ifdef __linux__
+	ioloop->epoll_fd = epoll_create(2);
+	if(ioloop->epoll_fd < 0) {
+		DSFYDEBUG("epoll_create() failed with errno %d\n", errno);
+		free(ioloop);
+		return -1;
+	}
+
+	ioloop->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+	if(ioloop->wakeup_fd < 0) {
+		DSFYDEBUG("eventfd() failed with errno %d\n", errno);
+		close(ioloop->epoll_fd);
+		free(ioloop);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = ioloop->wakeup_fd;
+	if(epoll_ctl(ioloop->epoll_fd, EPOLL_CTL_ADD, ioloop->wakeup_fd, &ev) < 0) {
+		DSFYDEBUG("epoll_ctl() failed with errno %d\n", errno);
+		close(ioloop->wakeup_fd);
+		close(ioloop->epoll_fd);
+		free(ioloop);
+		return -1;
+	}
+#endif
+
+	session->ioloop = ioloop;
+
+	return 0;
+}
+
+
+/*
+ * Release resources held by the event loop
+ * The iothread must have been terminated before calling this
+ *
+ */
+void ioloop_free(sp_session *session) {
+	if(session->ioloop == NULL)
+		return;
+
+#ifdef __linux__
+	close(session->ioloop->wakeup_fd);
+	close(session->ioloop->epoll_fd);
+#endif
+
+	free(session->ioloop);
+	session->ioloop = NULL;
+}
+
+
+/*
+ * Wake up the iothread if it's sleeping in ioloop_wait()
+ * May be called from any thread without holding any locks
+ *
+ */
+void ioloop_wakeup(sp_session *session) {
+	struct ioloop *ioloop = session->ioloop;
+#ifdef __linux__
+	uint64_t one = 1;
+#endif
+
+	/*
+	 * If a wakeup is already pending or the iothread isn't parked
+	 * it will notice the pending flag before going to sleep
+	 *
+	 */
+	if(osfy_atomic_xchg_int(&ioloop->pending, 1) != 0
+		|| !osfy_atomic_load_int(&ioloop->parked))
+		return;
+
+#ifdef __linux__
+	/* EAGAIN means the counter is already non-zero, which is fine */
+	if(write(ioloop->wakeup_fd, &one, sizeof(one)) != sizeof(one)
+		&& errno != EAGAIN)
+		DSFYDEBUG("write() to eventfd failed with errno %d\n", errno);
+#elif defined(_WIN32)
+	SetEvent(session->idle_wakeup);
+#else
+	pthread_mutex_lock(&session->request_mutex);
+	pthread_cond_signal(&session->idle_wakeup);
+	pthread_mutex_unlock(&session->request_mutex);
+#endif
+}
+
+
+/*
+ * Keep the registered socket in sync with session->sock, which
+ * is replaced on login and closed on logout or errors, and with
+ * whether there's queued data waiting for it to become writable.
+ * A new connection often gets the descriptor number of the one it
+ * replaces, so connections are told apart by their generation.
+ *
+ */
+static int ioloop_update_socket(sp_session *session, int want_write) {
+	struct ioloop *ioloop = session->ioloop;
+#ifdef __linux__
+	struct epoll_event ev;
+	int op;
+#endif
+	int changed;
+
+	changed = ioloop->sock != session->sock || ioloop->generation != session->sock_generation;
+	if(!changed && ioloop->want_write == want_write)
+		return 0;
+
+#ifdef __linux__
+	op = EPOLL_CTL_MOD;
+	if(changed) {
+		/*
+		 * A closed descriptor is removed from the epoll set automatically,
+		 * this fails harmlessly unless the old socket is still open
+		 *
+		 */
+		if(ioloop->sock != -1)
+			epoll_ctl(ioloop->epoll_fd, EPOLL_CTL_DEL, ioloop->sock, NULL);
+
+		op = EPOLL_CTL_ADD;
+	}
+
+	if(session->sock != -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (want_write? EPOLLOUT: 0);
+		ev.data.fd = session->sock;
+		if(epoll_ctl(ioloop->epoll_fd, op, session->sock, &ev) < 0
+			&& (errno != EEXIST || epoll_ctl(ioloop->epoll_fd, EPOLL_CTL_MOD, session->sock, &ev) < 0)) {
+			DSFYDEBUG("epoll_ctl() failed with errno %d\n", errno);
+			ioloop->sock = -1;
+			return -1;
+		}
+	}
+#endif
+
+	ioloop->sock = session->sock;
+	ioloop->generation = session->sock_generation;
+	ioloop->want_write = want_write;
+
+	return 0;
+}
+
+
+/*
+ * Sleep until the socket becomes readable, or writable if want_write
+ * is set, ioloop_wakeup() is called or timeout_ms milliseconds have
+ * elapsed. A negative timeout means wait forever.
+ *
+ * Returns a bitmask of IOLOOP_READABLE, IOLOOP_WRITABLE and
+ * IOLOOP_WAKEUP, zero on timeout and -1 on errors.
+ *
+ */
+int ioloop_wait(sp_session *session, int timeout_ms, int want_write) {
+	struct ioloop *ioloop = session->ioloop;
+	int events = 0;
+	int ret;
+#ifdef __linux__
+	struct epoll_event ev[2];
+	uint64_t value;
+	int i;
+#else
+	fd_set rfds, wfds;
+	struct timeval tv;
+#ifndef _WIN32
+	struct timespec ts;
+#endif
+#endif
+
+	if(session->sock == -1)
+		want_write = 0;
+
+	if(ioloop_update_socket(session, want_write) < 0)
+		return -1;
+
+#ifdef __linux__
+	/* Don't block if a wakeup was flagged before we parked */
+	osfy_atomic_store_int(&ioloop->parked, 1);
+	if(osfy_atomic_load_int(&ioloop->pending))
+		timeout_ms = 0;
+
+	do {
+		ret = epoll_wait(ioloop->epoll_fd, ev, 2, timeout_ms);
+	} while(ret < 0 && errno == EINTR);
+
+	osfy_atomic_store_int(&ioloop->parked, 0);
+
+	if(ret < 0) {
+		DSFYDEBUG("epoll_wait() failed with errno %d\n", errno);
+		return -1;
+	}
+
+	for(i = 0; i < ret; i++) {
+		if(ev[i].data.fd == ioloop->wakeup_fd) {
+			/* Reset the counter */
+			if(read(ioloop->wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+				DSFYDEBUG("read() from eventfd failed with errno %d\n", errno);
+		}
+		else if(ev[i].data.fd == ioloop->sock) {
+			/* Let recv() report errors and hangups */
+			if(ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				events |= IOLOOP_READABLE;
+
+			if(ev[i].events & EPOLLOUT)
+				events |= IOLOOP_WRITABLE;
+		}
+	}
+#else
+	if(ioloop->sock != -1 && !osfy_atomic_load_int(&ioloop->pending)) {
+		/*
+		 * We can't be woken up while blocking in select() so cap the
+		 * timeout to keep newly posted requests from waiting too long
+		 *
+		 */
+		if(timeout_ms < 0 || timeout_ms > IOLOOP_POLL_MS)
+			timeout_ms = IOLOOP_POLL_MS;
+
+		FD_ZERO(&rfds);
+		FD_SET(ioloop->sock, &rfds);
+
+		FD_ZERO(&wfds);
+		if(want_write)
+			FD_SET(ioloop->sock, &wfds);
+
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+		ret = select(ioloop->sock + 1, &rfds, &wfds, NULL, &tv);
+		if(ret < 0)
+			return -1;
+
+		if(FD_ISSET(ioloop->sock, &rfds))
+			events |= IOLOOP_READABLE;
+
+		if(FD_ISSET(ioloop->sock, &wfds))
+			events |= IOLOOP_WRITABLE;
+	}
+
+#ifdef _WIN32
+	osfy_atomic_store_int(&ioloop->parked, 1);
+	if(!osfy_atomic_load_int(&ioloop->pending) && ioloop->sock == -1)
+		WaitForSingleObject(session->idle_wakeup, timeout_ms < 0? INFINITE: (DWORD)timeout_ms);
+
+	osfy_atomic_store_int(&ioloop->parked, 0);
+#else
+	/*
+	 * ioloop_wakeup() takes the mutex before signalling so it can't
+	 * slip in between the check of the pending flag and the wait
+	 *
+	 */
+	pthread_mutex_lock(&session->request_mutex);
+	osfy_atomic_store_int(&ioloop->parked, 1);
+	if(!osfy_atomic_load_int(&ioloop->pending) && ioloop->sock == -1) {
+		if(timeout_ms < 0) {
+			pthread_cond_wait(&session->idle_wakeup, &session->request_mutex);
+		}
+		else {
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec + timeout_ms / 1000;
+			ts.tv_nsec = 1000 * tv.tv_usec + 1000000 * (timeout_ms % 1000);
+			if(ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+
+			pthread_cond_timedwait(&session->idle_wakeup, &session->request_mutex, &ts);
+		}
+	}
+
+	osfy_atomic_store_int(&ioloop->parked, 0);
+	pthread_mutex_unlock(&session->request_mutex);
+#endif
+#endif
+
+	if(osfy_atomic_xchg_int(&ioloop->pending, 0))
+		events |= IOLOOP_WAKEUP;
+
+	return events;
+}
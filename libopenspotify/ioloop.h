@@ -0,0 +1,50 @@
+#ifndef LIBOPENSPOTIFY_IOLOOP_H
+#define LIBOPENSPOTIFY_IOLOOP_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libspotify/api.h>
+
+
+/* Events returned by ioloop_wait() */
+#define IOLOOP_READABLE	1	/* Data is available on the session socket */
+#define IOLOOP_WAKEUP	2	/* Someone called ioloop_wakeup() */
+#define IOLOOP_WRITABLE	4	/* The session socket can take more data */
+
+
+/* Max time to block in select() on systems without epoll */
+#define IOLOOP_POLL_MS	64
+
+
+struct ioloop {
+#ifdef __linux__
+	/* epoll instance multiplexing the socket and the wakeup eventfd */
+	int epoll_fd;
+	int wakeup_fd;
+#endif
+
+	/* Set by ioloop_wakeup(), cleared by ioloop_wait() */
+	int pending;
+
+	/* Set while the iothread is about to sleep or sleeping */
+	int parked;
+
+	/* The socket currently registered, or -1, and its connection's generation */
+	int sock;
+	unsigned int generation;
+
+	/* Set if the socket is also registered for writability */
+	int want_write;
+};
+
+
+int ioloop_init(sp_session *session);
+void ioloop_free(sp_session *session);
+void ioloop_wakeup(sp_session *session);
+int ioloop_wait(sp_session *session, int timeout_ms, int want_write);
+
+#endif
@@ -21,7 +21,11 @@
 #include "cache.h"
 #include "channel.h"
 #include "debug.h"
+#include "decoder.h"
+#include "flowctl.h"
+#include "gc.h"
 #include "image.h"
+#include "ioloop.h"
 #include "iothread.h"
 #include "login.h"
 #include "packet.h"
@@ -36,8 +40,12 @@
 #include "util.h"
 
 
+static void iothread_disconnect(sp_session *s);
+static void iothread_setup_connection(sp_session *s);
+static sp_error iothread_login_error(sp_session *s);
 static int process_request(sp_session *s, struct request *req);
 static int process_login_request(sp_session *s, struct request *req);
+static int process_reconnect_request(sp_session *s, struct request *req);
 static int process_logout_request(sp_session *s, struct request *req);
 
 
@@ -55,7 +63,7 @@ void *iothread(void *data) {
 	sp_session *s = (sp_session *)data;
 	struct request *req;
 	int ret;
-	int now;
+	int now, next_timeout, timeout;
 
 #ifdef _WIN32
 	/* Initialize Winsock */
@@ -66,82 +74,163 @@ void *iothread(void *data) {
 	for(;;) {
 		request_cleanup(s);
 
-		/* No locking needed since we're in control of request_cleanup() */
-		now = get_millisecs();
-		for(req = s->requests; req; req = req->next) {
-			if(req->state != REQ_STATE_NEW && req->state != REQ_STATE_RUNNING)
-				continue;
-
-			if(req->next_timeout > now)
-				continue;
+		/* Load what the decoder threads have finished, in order */
+		decoder_process(s);
 
-			DSFYDEBUG("Processing request <type %s, state %s, input %p, timeout %d>\n",
+		/*
+		 * Process requests whose timeout has expired, by lane and in the
+		 * order they became due. Requests that remain due after being
+		 * processed are deferred to the next pass by request_begin_pass()
+		 *
+		 */
+		now = get_millisecs();
+		flowctl_unblock(s);
+		request_begin_pass(s, now);
+		while((req = request_fetch_expired(s, now)) != NULL) {
+			DSFYDEBUG("Processing request <type %s, state %s, lane %s, input %p, timeout %d>\n",
 					REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state),
-					req->input, req->next_timeout);
+					REQUEST_PRIORITY_STR(req->priority), req->input, req->next_timeout);
 			ret = process_request(s, req);
 			DSFYDEBUG("Request processing returned %d\n", ret);
 
-			/* FIXME: Drop connection on errors! */
-			if(ret != 0) {
-				DSFYDEBUG("Request failed, good bye\n");
-#ifdef _WIN32
-#else
-				exit(1);
-#endif
+			/* Start over with a new connection on errors */
+			if(ret != 0 && s->connectionstate == SP_CONNECTION_STATE_LOGGED_IN) {
+				DSFYDEBUG("Request failed, reconnecting\n");
+				iothread_disconnect(s);
 			}
+
+			request_reschedule(s, req);
 		}
 
+		/*
+		 * Send the packets queued while processing requests and
+		 * packets, coalesced into as few send() calls as possible
+		 *
+		 */
+		if(s->connectionstate == SP_CONNECTION_STATE_LOGGED_IN
+			&& packet_flush(s) < 0) {
+			DSFYDEBUG("packet_flush() failed, disconnecting!\n");
+			iothread_disconnect(s);
+		}
 
-		/* Packets can only be processed once we're logged in */
-		if(s->connectionstate != SP_CONNECTION_STATE_LOGGED_IN) {
-#ifdef _WIN32
-			WaitForSingleObject(s->request_mutex, INFINITE);
-#else
-			pthread_mutex_lock(&s->request_mutex);
-#endif
-			if(s->requests == NULL) {
-				DSFYDEBUG("Sleeping because there's nothing to do\n");
-#ifdef _WIN32
-				ReleaseMutex(s->request_mutex);
-				WaitForSingleObject(s->idle_wakeup, INFINITE);
-				WaitForSingleObject(s->request_mutex, INFINITE);
-#else
-				pthread_cond_wait(&s->idle_wakeup, &s->request_mutex);
-#endif
-				DSFYDEBUG("Woke up, a new request was posted\n");
-			}
-#ifdef _WIN32
-			ReleaseMutex(s->request_mutex);
-#else
-			pthread_mutex_unlock(&s->request_mutex);
-#endif
+		/* Free some unreferenced objects, a slice at a time */
+		gc_process(s);
 
-			continue;
-		}
+		/* Keep track of when we need to wake up next */
+		next_timeout = request_next_timeout(s);
+		if(gc_next_timeout(s) < next_timeout)
+			next_timeout = gc_next_timeout(s);
 
 
 		/*
-		 * Read and process zero or more packets
-		 * Will sleep somewhere around 64ms if no
-		 * data is available
+		 * Sleep until a packet arrives, queued packets can be sent,
+		 * a new request is posted or the earliest request deadline
+		 * expires
+		 *
 		 */
+		timeout = -1;
+		if(next_timeout != INT_MAX) {
+			timeout = next_timeout - get_millisecs();
+			if(timeout < 0)
+				timeout = 0;
+		}
+
+		ret = ioloop_wait(s, timeout, packet_tx_pending(s));
+		if(ret < 0) {
+			DSFYDEBUG("ioloop_wait() failed\n");
+			continue;
+		}
+
+
+		/* Packets can only be processed once we're logged in */
+		if(!(ret & IOLOOP_READABLE) || s->connectionstate != SP_CONNECTION_STATE_LOGGED_IN)
+			continue;
+
+
+		/* Read and process zero or more packets */
 		ret = packet_read_and_process(s);
 		if(ret < 0) {
 			DSFYDEBUG("process_packets() returned %d, disconnecting!\n", ret);
+			iothread_disconnect(s);
+		}
+	}
+
+
+}
+
+
+/*
+ * Drop the connection after a network error and start reconnecting
+ * Resumable channels are kept and replayed once logged in again, the
+ * others are failed so that their requests start over. Requests are
+ * held back by process_request() in the meantime.
+ *
+ */
+static void iothread_disconnect(sp_session *s) {
 #ifdef _WIN32
-			closesocket(s->sock);
+	closesocket(s->sock);
 #else
-			close(s->sock);
+	close(s->sock);
 #endif
-			s->sock = -1;
+	s->sock = -1;
 
-			s->connectionstate = SP_CONNECTION_STATE_DISCONNECTED;
+	s->connectionstate = SP_CONNECTION_STATE_DISCONNECTED;
+	s->reconnect_attempts = 0;
 
-			request_post_result(s, REQ_TYPE_LOGOUT, SP_ERROR_OTHER_TRANSIENT, NULL);
-		}
-	}
+	channel_disconnect_all(s);
+
+	request_post(s, REQ_TYPE_RECONNECT, NULL);
+}
+
+
+/* Take over the socket and keys of a successful login */
+static void iothread_setup_connection(sp_session *s) {
+	unsigned char key_recv[32], key_send[32];
+
+	login_export_session(s->login, &s->sock, key_recv, key_send);
+	s->sock_generation++;
+	login_release(s->login);
+	s->login = NULL;
+
+	shn_key(&s->shn_recv, key_recv, sizeof(key_recv));
+	s->key_recv_IV = 0;
+	packet_reset(s);
 
+	shn_key(&s->shn_send, key_send, sizeof(key_send));
+	s->key_send_IV = 0;
 
+	s->connectionstate = SP_CONNECTION_STATE_LOGGED_IN;
+}
+
+
+/* Map the error of a failed login to an sp_error */
+static sp_error iothread_login_error(sp_session *s) {
+	switch(s->login->error) {
+	case SP_LOGIN_ERROR_DNS_FAILURE:
+	case SP_LOGIN_ERROR_NO_MORE_SERVERS:
+		return SP_ERROR_UNABLE_TO_CONTACT_SERVER;
+
+	case SP_LOGIN_ERROR_UPGRADE_REQUIRED:
+		return SP_ERROR_CLIENT_TOO_OLD;
+
+	case SP_LOGIN_ERROR_USER_BANNED:
+		return SP_ERROR_USER_BANNED;
+
+	case SP_LOGIN_ERROR_USER_NOT_FOUND:
+	case SP_LOGIN_ERROR_BAD_PASSWORD:
+		return SP_ERROR_BAD_USERNAME_OR_PASSWORD;
+
+	case SP_LOGIN_ERROR_USER_NEED_TO_COMPLETE_DETAILS:
+	case SP_LOGIN_ERROR_USER_COUNTRY_MISMATCH:
+	case SP_LOGIN_ERROR_OTHER_PERMANENT:
+		return SP_ERROR_OTHER_PERMANENT;
+
+	case SP_LOGIN_ERROR_SOCKET_ERROR:
+	default:
+		break;
+	}
+
+	return SP_ERROR_OTHER_TRANSIENT;
 }
 
 
@@ -152,8 +241,20 @@ void *iothread(void *data) {
 static int process_request(sp_session *session, struct request *req) {
 	int now = get_millisecs();
 
-	if(session->connectionstate != SP_CONNECTION_STATE_LOGGED_IN
-		&& (req->type != REQ_TYPE_LOGIN && req->type != REQ_TYPE_LOGOUT)) {
+	if(session->connectionstate == SP_CONNECTION_STATE_DISCONNECTED
+		&& (req->type != REQ_TYPE_LOGIN && req->type != REQ_TYPE_LOGOUT
+			&& req->type != REQ_TYPE_RECONNECT)) {
+		DSFYDEBUG("Holding back request <type %s, state %s, input %p> while reconnecting\n",
+				REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
+
+		/* Released by process_reconnect_request() */
+		request_block(session, req);
+
+		return 0;
+	}
+	else if(session->connectionstate != SP_CONNECTION_STATE_LOGGED_IN
+		&& (req->type != REQ_TYPE_LOGIN && req->type != REQ_TYPE_LOGOUT
+			&& req->type != REQ_TYPE_RECONNECT)) {
 		if(req->state == REQ_STATE_NEW) {
 			DSFYDEBUG("Postponing request <type %s, state %s, input %p> 10 seconds due to not logged in\n",
 					REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
@@ -164,21 +265,26 @@ static int process_request(sp_session *session, struct request *req) {
 		else if(req->state == REQ_STATE_RUNNING) {
 			DSFYDEBUG("Failing request <type %s, state %s, input %p> due to not logged in\n",
 					REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
+
+			/* Browse requests are returned along with the lookups coalesced into them */
+			switch(req->type) {
+			case REQ_TYPE_ALBUMBROWSE:
+			case REQ_TYPE_ARTISTBROWSE:
+			case REQ_TYPE_BROWSE_ALBUM:
+			case REQ_TYPE_BROWSE_ARTIST:
+			case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
+			case REQ_TYPE_BROWSE_TRACK:
+				return browse_fail(session, req, SP_ERROR_OTHER_TRANSIENT);
+
+			default:
+				break;
+			}
+
 			return request_set_result(session, req, SP_ERROR_OTHER_TRANSIENT, NULL);
 		}
 	}
-	else if(req->state == REQ_STATE_NEW && session->num_channels >= 16) {
-		DSFYDEBUG("%d channels active, postponing request <type %s, state %s, input %p>\n",
-			  session->num_channels, REQUEST_TYPE_STR(req->type),
-			  REQUEST_STATE_STR(req->state), req->input);
-
-		if(req->next_timeout < now + 100)
-			req->next_timeout = now + 100;
-		
-		return 0;
-	}
 
-	
+	/* Handlers that open a channel are held back by flowctl_admit() if the window is full */
 	switch(req->type) {
 	case REQ_TYPE_LOGIN:
 		return process_login_request(session, req);
@@ -187,6 +293,10 @@ static int process_request(sp_session *session, struct request *req) {
 	case REQ_TYPE_LOGOUT:
 		return process_logout_request(session, req);
 		break;
+
+	case REQ_TYPE_RECONNECT:
+		return process_reconnect_request(session, req);
+		break;
 	
 	case REQ_TYPE_PC_LOAD:
 	case REQ_TYPE_PLAYLIST_LOAD:
@@ -247,7 +357,6 @@ static int process_request(sp_session *session, struct request *req) {
 static int process_login_request(sp_session *s, struct request *req) {
 	int ret;
 	sp_error error;
-	unsigned char key_recv[32], key_send[32];
 
 	if(req->state == REQ_STATE_NEW) {
 		req->state = REQ_STATE_RUNNING;
@@ -274,57 +383,103 @@ static int process_login_request(sp_session *s, struct request *req) {
 	if(ret == 0)
 		return 0;
 	else if(ret == 1) {
-		login_export_session(s->login, &s->sock, key_recv, key_send);
-		login_release(s->login);
-		s->login = NULL;
+		iothread_setup_connection(s);
 
-		shn_key(&s->shn_recv, key_recv, sizeof(key_recv));
-		s->key_recv_IV = 0;
+		DSFYDEBUG("Logged in\n");
+		return request_set_result(s, req, SP_ERROR_OK, NULL);
+	}
 
-		shn_key(&s->shn_send, key_send, sizeof(key_send));
-		s->key_send_IV = 0;
+	error = iothread_login_error(s);
 
-		s->connectionstate = SP_CONNECTION_STATE_LOGGED_IN;
+	login_release(s->login);
+	s->login = NULL;
 
-		DSFYDEBUG("Logged in\n");
+	DSFYDEBUG("Login failed with error: %s\n", sp_error_message(error));
+	return request_set_result(s, req, error, NULL);
+}
+
+
+/*
+ * Log in again after the connection was lost
+ * Attempts are spaced out with exponential backoff. Once logged in
+ * the resumable channels are replayed and the requests held back while
+ * reconnecting are released, and sent from scratch.
+ *
+ */
+static int process_reconnect_request(sp_session *s, struct request *req) {
+	int ret, delay;
+	sp_error error;
+
+	/* Logged out while waiting to reconnect */
+	if(s->connectionstate != SP_CONNECTION_STATE_DISCONNECTED)
 		return request_set_result(s, req, SP_ERROR_OK, NULL);
+
+	if(req->state == REQ_STATE_NEW) {
+		req->state = REQ_STATE_RUNNING;
+
+		DSFYDEBUG("Reconnecting, attempt %d\n", s->reconnect_attempts + 1);
+		s->login = login_create(s->username, s->password);
 	}
 
-	switch(s->login->error) {
-	case SP_LOGIN_ERROR_DNS_FAILURE:
-	case SP_LOGIN_ERROR_NO_MORE_SERVERS:
-		error = SP_ERROR_UNABLE_TO_CONTACT_SERVER;
-		break;
+	if(s->login != NULL) {
+		ret = login_process(s->login);
+		if(ret == 0)
+			return 0;
+		else if(ret == 1) {
+			iothread_setup_connection(s);
+			s->reconnect_attempts = 0;
 
-	case SP_LOGIN_ERROR_UPGRADE_REQUIRED:
-		error = SP_ERROR_CLIENT_TOO_OLD;
-		break;
+			/* Substreams are only resumed after the play token and key */
+			if(player_reconnect(s) == 0)
+				ret = channel_replay_all(s);
+			else
+				ret = -1;
 
-	case SP_LOGIN_ERROR_USER_BANNED:
-		error = SP_ERROR_USER_BANNED;
-		break;
+			DSFYDEBUG("Reconnected, replayed %d channels\n", ret);
 
-	case SP_LOGIN_ERROR_USER_NOT_FOUND:
-	case SP_LOGIN_ERROR_BAD_PASSWORD:
-		error = SP_ERROR_BAD_USERNAME_OR_PASSWORD;
-		break;
+			request_unblock(s, INT_MAX, REQ_PRIO_BACKGROUND);
 
-	case SP_LOGIN_ERROR_USER_NEED_TO_COMPLETE_DETAILS:
-	case SP_LOGIN_ERROR_USER_COUNTRY_MISMATCH:
-	case SP_LOGIN_ERROR_OTHER_PERMANENT:
-		error = SP_ERROR_OTHER_PERMANENT;
-		break;
+			return request_set_result(s, req, SP_ERROR_OK, NULL);
+		}
 
-	case SP_LOGIN_ERROR_SOCKET_ERROR:
-	default:
+		error = iothread_login_error(s);
+
+		login_release(s->login);
+		s->login = NULL;
+	}
+	else
 		error = SP_ERROR_OTHER_TRANSIENT;
-		break;
+
+	if((error == SP_ERROR_OTHER_TRANSIENT || error == SP_ERROR_UNABLE_TO_CONTACT_SERVER)
+		&& ++s->reconnect_attempts < IOTHREAD_RECONNECT_MAX_ATTEMPTS) {
+		delay = IOTHREAD_RECONNECT_MIN_DELAY;
+		for(ret = 1; ret < s->reconnect_attempts && delay < IOTHREAD_RECONNECT_MAX_DELAY; ret++)
+			delay *= 2;
+
+		if(delay > IOTHREAD_RECONNECT_MAX_DELAY)
+			delay = IOTHREAD_RECONNECT_MAX_DELAY;
+
+		DSFYDEBUG("Reconnect failed with error: %s, retrying in %d ms\n",
+			  sp_error_message(error), delay);
+
+		req->state = REQ_STATE_NEW;
+		req->next_timeout = get_millisecs() + delay;
+
+		return 0;
 	}
 
-	login_release(s->login);
-	s->login = NULL;
 
-	DSFYDEBUG("Login failed with error: %s\n", sp_error_message(error));
+	/* Give up and fail everything that was waiting for the connection */
+	DSFYDEBUG("Giving up reconnecting after %d attempts, last error: %s\n",
+		  s->reconnect_attempts, sp_error_message(error));
+
+	s->connectionstate = SP_CONNECTION_STATE_LOGGED_OUT;
+
+	channel_fail_and_unregister_all(s);
+	request_unblock(s, INT_MAX, REQ_PRIO_BACKGROUND);
+
+	request_post_result(s, REQ_TYPE_LOGOUT, error, NULL);
+
 	return request_set_result(s, req, error, NULL);
 }
 
@@ -378,5 +533,8 @@ static int process_logout_request(sp_session *session, struct request *req) {
 	/* Unregister all channels */
 	channel_fail_and_unregister_all(session);
 
+	/* Let requests held back by a reconnect see that we're logged out */
+	request_unblock(session, INT_MAX, REQ_PRIO_BACKGROUND);
+
 	return request_set_result(session, req, SP_ERROR_OK, NULL);
 }
@@ -1,3 +1,11 @@
+/* Delay before the second reconnect attempt, doubled for each attempt */
+#define IOTHREAD_RECONNECT_MIN_DELAY	1000
+#define IOTHREAD_RECONNECT_MAX_DELAY	60000
+
+/* Give up and log out after this many failed attempts */
+#define IOTHREAD_RECONNECT_MAX_ATTEMPTS	10
+
+
 #ifdef _WIN32
 DWORD WINAPI iothread(LPVOID data);
 #else
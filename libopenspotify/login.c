@@ -19,6 +19,7 @@
 #include <sys/select.h>
 #include <fcntl.h>
 #endif
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
@@ -38,6 +39,42 @@
 #define SPOTIFY_SRV_HOSTNAME	"_spotify-client._tcp.spotify.com"
 
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Accessors of OpenSSL 1.1, whose DH and RSA structs are opaque */
+static int DH_set0_pqg(DH *dh, BIGNUM *p, BIGNUM *q, BIGNUM *g) {
+	dh->p = p;
+	dh->q = q;
+	dh->g = g;
+
+	return 1;
+}
+
+
+static void DH_get0_key(const DH *dh, const BIGNUM **pub_key, const BIGNUM **priv_key) {
+	if(pub_key != NULL)
+		*pub_key = dh->pub_key;
+
+	if(priv_key != NULL)
+		*priv_key = dh->priv_key;
+}
+
+
+static void RSA_get0_key(const RSA *rsa, const BIGNUM **n, const BIGNUM **e, const BIGNUM **d) {
+	if(n != NULL)
+		*n = rsa->n;
+
+	if(e != NULL)
+		*e = rsa->e;
+
+	if(d != NULL)
+		*d = rsa->d;
+}
+#endif
+
+/* Environment variable with a "host:port" to use instead of the SRV records */
+#define LOGIN_SERVER_ENV	"OPENSPOTIFY_SERVER"
+
+
 static int send_client_parameters(struct login_ctx *l);
 static int receive_server_parameters(struct login_ctx *l);
 static void key_init(struct login_ctx *l);
@@ -88,8 +125,7 @@ struct login_ctx *login_create(char *username, char *password) {
 
 	/* Diffie-Hellman parameters */
 	l->dh = DH_new ();
-	l->dh->p = BN_bin2bn(DH_prime, 96, NULL);
-	l->dh->g = BN_bin2bn(DH_generator, 1, NULL);
+	DH_set0_pqg(l->dh, BN_bin2bn(DH_prime, 96, NULL), NULL, BN_bin2bn(DH_generator, 1, NULL));
 	DH_generate_key(l->dh);
 
         strncpy(l->username, username, sizeof(l->username) - 1);
@@ -149,16 +185,24 @@ int login_process(struct login_ctx *l) {
 	struct addrinfo h, *ai;
 	fd_set wfds;
 	struct timeval tv;
+	char *server;
 
 	l->error = SP_LOGIN_ERROR_OK;
 	switch(l->state) {
 
 	case 0:
-		/* Lookup service records in DNS */
+		/*
+		 * Lookup service records in DNS, unless a server was given
+		 * in the environment, e.g. the mock in tools/mockap
+		 *
+		 */
 		if(l->service_records)
 			dns_free_list(l->service_records);
 
-		l->service_records = dns_get_service_list(SPOTIFY_SRV_HOSTNAME);
+		if((server = getenv(LOGIN_SERVER_ENV)) != NULL)
+			l->service_records = dns_service_from_string(server);
+		else
+			l->service_records = dns_get_service_list(SPOTIFY_SRV_HOSTNAME);
 		if(l->service_records == NULL) {
 			l->error = SP_LOGIN_ERROR_DNS_FAILURE;
 			DSFYDEBUG("Failed to lookup Spotify service in DNS\n");
@@ -431,6 +475,7 @@ static int send_client_parameters(struct login_ctx *l) {
 	unsigned char rsa_pub_exp[128];
 	unsigned int len_idx;
 	unsigned char bytevalue;
+	const BIGNUM *pub_key, *n;
 
 	struct buf* b = buf_new();
 
@@ -451,10 +496,12 @@ static int send_client_parameters(struct login_ctx *l) {
 	buf_append_data (b, l->client_random_16, 16);
 
 
-	BN_bn2bin (l->dh->pub_key, client_pub_key);
+	DH_get0_key(l->dh, &pub_key, NULL);
+	BN_bn2bin (pub_key, client_pub_key);
 	buf_append_data (b, client_pub_key, sizeof(client_pub_key));
 
-	BN_bn2bin (l->rsa->n, rsa_pub_exp);
+	RSA_get0_key(l->rsa, &n, NULL, NULL);
+	BN_bn2bin (n, rsa_pub_exp);
 	buf_append_data (b, rsa_pub_exp, sizeof(rsa_pub_exp));
 
 	buf_append_u8 (b, 0); /* length of random data */
@@ -0,0 +1,128 @@
+/*
+ * Memory accounting
+ *
+ * Counters of the objects and bytes a session has allocated, for
+ * opensp_session_memory_stats(). They're only added to and read with
+ * atomic operations, so updating them takes no locks.
+ *
+ */
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdatomic.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "memstats.h"
+#include "sp_opaque.h"
+
+
+static void memstats_reset(struct memstats_counter *counter);
+static void memstats_add(struct memstats_counter *counter, long num_objects, long bytes);
+static void memstats_get(struct memstats_counter *counter, opensp_memory_usage *usage);
+
+
+void memstats_init(sp_session *session) {
+	int i;
+
+	for(i = 0; i < OPENSP_MEMORY_NUM_CATEGORIES; i++)
+		memstats_reset(&session->memstats.categories[i]);
+
+	memstats_reset(&session->memstats.total);
+}
+
+
+/* Count an object of the given size, called where it's allocated */
+void memstats_alloc(sp_session *session, opensp_memory_category category, size_t bytes) {
+	memstats_add(&session->memstats.categories[category], 1, (long)bytes);
+	memstats_add(&session->memstats.total, 1, (long)bytes);
+}
+
+
+/* Stop counting an object, bytes must be what it was counted as */
+void memstats_free(sp_session *session, opensp_memory_category category, size_t bytes) {
+	memstats_add(&session->memstats.categories[category], -1, -(long)bytes);
+	memstats_add(&session->memstats.total, -1, -(long)bytes);
+}
+
+
+/* Count a buffer that grew or shrank, without changing the number of objects */
+void memstats_resize(sp_session *session, opensp_memory_category category, size_t old_bytes, size_t new_bytes) {
+	long bytes = (long)new_bytes - (long)old_bytes;
+
+	if(bytes == 0)
+		return;
+
+	memstats_add(&session->memstats.categories[category], 0, bytes);
+	memstats_add(&session->memstats.total, 0, bytes);
+}
+
+
+/* Copy the counters, which may be updated by other threads meanwhile */
+void memstats_snapshot(sp_session *session, opensp_memory_stats *stats) {
+	int i;
+
+	for(i = 0; i < OPENSP_MEMORY_NUM_CATEGORIES; i++)
+		memstats_get(&session->memstats.categories[i], &stats->categories[i]);
+
+	memstats_get(&session->memstats.total, &stats->total);
+}
+
+
+static void memstats_reset(struct memstats_counter *counter) {
+#ifdef _WIN32
+	counter->num_objects = 0;
+	counter->bytes = 0;
+	counter->peak_bytes = 0;
+#else
+	atomic_init(&counter->num_objects, 0);
+	atomic_init(&counter->bytes, 0);
+	atomic_init(&counter->peak_bytes, 0);
+#endif
+}
+
+
+static void memstats_add(struct memstats_counter *counter, long num_objects, long bytes) {
+	long value, peak;
+
+#ifdef _WIN32
+	if(num_objects)
+		InterlockedExchangeAdd(&counter->num_objects, num_objects);
+
+	value = InterlockedExchangeAdd(&counter->bytes, bytes) + bytes;
+
+	/* Raise the peak, unless another thread raised it further */
+	while(value > (peak = counter->peak_bytes)) {
+		if(InterlockedCompareExchange(&counter->peak_bytes, value, peak) == peak)
+			break;
+	}
+#else
+	if(num_objects)
+		atomic_fetch_add(&counter->num_objects, num_objects);
+
+	value = atomic_fetch_add(&counter->bytes, bytes) + bytes;
+
+	/* Raise the peak, unless another thread raised it further */
+	peak = atomic_load(&counter->peak_bytes);
+	while(value > peak) {
+		if(atomic_compare_exchange_weak(&counter->peak_bytes, &peak, value))
+			break;
+	}
+#endif
+}
+
+
+static void memstats_get(struct memstats_counter *counter, opensp_memory_usage *usage) {
+#ifdef _WIN32
+	usage->num_objects = InterlockedCompareExchange(&counter->num_objects, 0, 0);
+	usage->bytes = InterlockedCompareExchange(&counter->bytes, 0, 0);
+	usage->peak_bytes = InterlockedCompareExchange(&counter->peak_bytes, 0, 0);
+#else
+	usage->num_objects = atomic_load(&counter->num_objects);
+	usage->bytes = atomic_load(&counter->bytes);
+	usage->peak_bytes = atomic_load(&counter->peak_bytes);
+#endif
+}
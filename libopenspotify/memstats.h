@@ -0,0 +1,46 @@
+#ifndef LIBOPENSPOTIFY_MEMSTATS_H
+#define LIBOPENSPOTIFY_MEMSTATS_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdatomic.h>
+#endif
+
+#include <libspotify/api.h>
+
+
+#ifdef _WIN32
+typedef volatile LONG memcount_t;
+#else
+typedef atomic_long memcount_t;
+#endif
+
+struct memstats_counter {
+	memcount_t num_objects;
+	memcount_t bytes;
+	memcount_t peak_bytes;
+};
+
+
+/*
+ * Objects and bytes allocated by a session, by category. Updated where
+ * the memory is allocated and freed, by whichever thread that is.
+ * Only the objects themselves and the larger buffers they own are
+ * counted, and the interned names and country lists they share.
+ *
+ */
+struct memstats {
+	struct memstats_counter categories[OPENSP_MEMORY_NUM_CATEGORIES];
+	struct memstats_counter total;
+};
+
+
+void memstats_init(sp_session *session);
+void memstats_alloc(sp_session *session, opensp_memory_category category, size_t bytes);
+void memstats_free(sp_session *session, opensp_memory_category category, size_t bytes);
+void memstats_resize(sp_session *session, opensp_memory_category category, size_t old_bytes, size_t new_bytes);
+void memstats_snapshot(sp_session *session, opensp_memory_stats *stats);
+
+#endif
@@ -0,0 +1,1095 @@
+/*
+ * Persistent metadata cache
+ *
+ * Tracks, albums and artists loaded from the network are written to a
+ * single file in the cache directory by metacache_save(), which is run
+ * periodically by cache_process(). The file is mapped when the session
+ * is created and objects are loaded from it as they're created by
+ * osfy_track_add(), sp_album_add() and osfy_artist_add(), so metadata
+ * seen by an earlier session doesn't have to be browsed again.
+ *
+ * Records are looked up in place with a binary search, nothing is read
+ * from the file until an object is asked for. When the file is written
+ * again, records of objects that have since been freed are kept and it
+ * is only rewritten if objects not yet in it have been loaded.
+ *
+ * The iothread only copies the records of those objects. They're merged
+ * with the mapped file and written out by a decoder thread, see decoder.c,
+ * and the new file replaces the mapped one once the iothread gets the
+ * job back. Objects the garbage collector frees in between are copied
+ * as they're freed, with metacache_retire_track() and friends.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "album.h"
+#include "artist.h"
+#include "buf.h"
+#include "debug.h"
+#include "decoder.h"
+#include "hashtable.h"
+#include "image.h"
+#include "metacache.h"
+#include "sp_opaque.h"
+#include "strpool.h"
+#include "track.h"
+
+
+/* Kinds of records, in the order they're stored */
+#define METACACHE_TRACKS	0
+#define METACACHE_ALBUMS	1
+#define METACACHE_ARTISTS	2
+#define METACACHE_NUM_KINDS	3
+
+
+/* Sections of a file being written, or of the records copied for it */
+struct metacache_writer {
+	struct buf *records[METACACHE_NUM_KINDS];
+	struct buf *relations;
+	unsigned int num_relations;
+	struct buf *strings;
+};
+
+
+/* A save handed to a decoder thread by metacache_save() */
+struct metacache_save {
+	struct decode_job job;
+	struct metacache *mc;
+
+	/* Records of loaded objects that aren't in the file, sorted by ID */
+	struct metacache_writer added;
+	int num_added;
+
+	/* The records above, laid out like a mapped file */
+	struct metacache view;
+
+	char *tmpname;
+	int num[METACACHE_NUM_KINDS];
+	int ret;
+};
+
+
+static const size_t metacache_record_size[METACACHE_NUM_KINDS] = {
+	sizeof(struct metacache_track),
+	sizeof(struct metacache_album),
+	sizeof(struct metacache_artist)
+};
+
+static const unsigned char metacache_no_id[16];
+
+
+static int metacache_map(struct metacache *mc);
+static void metacache_unmap(struct metacache *mc);
+static const void *metacache_find(const void *records, unsigned int num, size_t size, const unsigned char *id);
+static const unsigned char *metacache_records(struct metacache *mc, int kind, unsigned int *num);
+static const char *metacache_string(struct metacache *mc, unsigned int offset);
+static void metacache_copy_string(sp_session *session, const char **dst, struct metacache *mc, unsigned int offset);
+static struct metacache_save *metacache_save_new(sp_session *session);
+static void metacache_save_free(struct metacache_save *save);
+static void metacache_save_decode(struct decode_job *job);
+static void metacache_save_apply(sp_session *session, struct decode_job *job);
+static void metacache_save_release(struct decode_job *job);
+static void metacache_keep(struct metacache *mc, struct metacache_save *save);
+static int metacache_replace(struct metacache *mc, struct metacache_save *save);
+static int metacache_add_new(sp_session *session, struct metacache_writer *w, int kind);
+static void metacache_sort(struct metacache_writer *w, struct metacache *view);
+static int metacache_record_cmp(const void *a, const void *b);
+static void metacache_merge(struct metacache_writer *w, int kind, struct metacache *old, struct metacache *added);
+static int metacache_write(struct metacache_writer *w, const char *filename);
+static void metacache_writer_init(struct metacache_writer *w);
+static void metacache_writer_free(struct metacache_writer *w);
+static unsigned int metacache_put_string(struct metacache_writer *w, const char *s);
+static void metacache_put_track(struct metacache_writer *w, sp_track *track);
+static void metacache_put_album(struct metacache_writer *w, sp_album *album);
+static void metacache_put_artist(struct metacache_writer *w, sp_artist *artist);
+static void metacache_copy_record(struct metacache_writer *w, int kind, struct metacache *mc, const void *record);
+
+
+/*
+ * Map the cache file, if there's one
+ * Called by cache_init() before the networking thread is started.
+ *
+ */
+int metacache_init(sp_session *session, const char *filename) {
+	struct metacache *mc;
+
+	mc = malloc(sizeof(struct metacache));
+	if(mc == NULL)
+		return -1;
+
+	mc->filename = malloc(strlen(filename) + 1);
+	if(mc->filename == NULL) {
+		free(mc);
+		return -1;
+	}
+
+	strcpy(mc->filename, filename);
+
+	mc->data = NULL;
+	metacache_unmap(mc);
+	mc->saving = 0;
+	mc->rescan = 0;
+
+	mc->retired = malloc(sizeof(struct metacache_writer));
+	metacache_writer_init(mc->retired);
+
+	if(metacache_map(mc) == 0)
+		DSFYDEBUG("Mapped %u tracks, %u albums and %u artists from '%s'\n",
+			mc->num_tracks, mc->num_albums, mc->num_artists, mc->filename);
+
+	session->metacache = mc;
+
+	return 0;
+}
+
+
+void metacache_free(sp_session *session) {
+	struct metacache *mc = session->metacache;
+
+	if(mc == NULL)
+		return;
+
+	metacache_unmap(mc);
+	metacache_writer_free(mc->retired);
+	free(mc->retired);
+	free(mc->filename);
+	free(mc);
+
+	session->metacache = NULL;
+}
+
+
+/*
+ * Have a decoder thread write loaded objects not yet in the file, along
+ * with the ones already there. Called periodically by cache_process().
+ *
+ */
+int metacache_save(sp_session *session) {
+	struct metacache *mc = session->metacache;
+	struct metacache_save *save;
+
+	if(mc == NULL)
+		return -1;
+
+	/* The file is replaced once the last save is done */
+	if(mc->saving)
+		return 0;
+
+	/* Nothing's been loaded since the file was written */
+	if((save = metacache_save_new(session)) == NULL)
+		return 0;
+
+	mc->saving = 1;
+	decoder_submit(session, &save->job);
+
+	return 0;
+}
+
+
+/*
+ * Write the file right away, called by cache_free() on the way out
+ * once the decoder threads are gone.
+ *
+ */
+int metacache_flush(sp_session *session) {
+	struct metacache *mc = session->metacache;
+	struct metacache_save *save;
+	int ret;
+
+	if(mc == NULL)
+		return -1;
+
+	if((save = metacache_save_new(session)) == NULL)
+		return 0;
+
+	metacache_save_decode(&save->job);
+	ret = metacache_replace(mc, save);
+	metacache_save_free(save);
+
+	return ret;
+}
+
+
+/* Load a track created by osfy_track_add() from the cache, if it's there */
+int metacache_load_track(sp_session *session, sp_track *track) {
+	struct metacache *mc = session->metacache;
+	const struct metacache_track *rec;
+	const char *name;
+	unsigned char id[16];
+	unsigned int i, first, num, flags;
+	sp_artist *artist;
+
+	if(mc == NULL || mc->data == NULL || track->is_loaded)
+		return -1;
+
+	rec = metacache_find(mc->tracks, mc->num_tracks, sizeof(struct metacache_track), track->id);
+	if(rec == NULL)
+		return -1;
+
+	first = ntohl(rec->artists);
+	num = ntohl(rec->num_artists);
+	if((name = metacache_string(mc, rec->name)) == NULL
+		|| first > mc->num_relations || num > mc->num_relations - first) {
+		DSFYDEBUG("Ignoring broken track record\n");
+		return -1;
+	}
+
+	strpool_set(session, &track->name, name);
+
+	memcpy(track->file_id, rec->file_id, sizeof(track->file_id));
+
+	metacache_copy_string(session, &track->allowed_countries, mc, rec->allowed_countries);
+	metacache_copy_string(session, &track->restricted_countries, mc, rec->restricted_countries);
+
+	flags = ntohl(rec->flags);
+	track->has_explicit_lyrics = (flags & METACACHE_EXPLICIT) != 0;
+	track->is_available = (flags & METACACHE_AVAILABLE) != 0;
+
+	track->index = ntohl(rec->index);
+	track->disc = ntohl(rec->disc);
+	track->duration = ntohl(rec->duration);
+	track->popularity = ntohl(rec->popularity);
+
+
+	/* Artists and album, which are loaded from the cache too if they're there */
+	for(i = 0; i < num; i++) {
+		memcpy(id, mc->relations + 16 * (first + i), sizeof(id));
+		artist = osfy_artist_add(session, id);
+
+		track->artists = realloc(track->artists, sizeof(sp_artist *) * (1 + track->num_artists));
+		track->artists[track->num_artists++] = artist;
+	}
+
+	if(memcmp(rec->album, metacache_no_id, sizeof(rec->album))) {
+		memcpy(id, rec->album, sizeof(id));
+		track->album = sp_album_add(session, id);
+	}
+
+
+	track->is_loaded = 1;
+	track->error = SP_ERROR_OK;
+	track->is_cached = 1;
+
+	return 0;
+}
+
+
+/* Load an album created by sp_album_add() from the cache, if it's there */
+int metacache_load_album(sp_session *session, sp_album *album) {
+	struct metacache *mc = session->metacache;
+	const struct metacache_album *rec;
+	const char *name;
+	unsigned char id[16];
+	unsigned int flags;
+
+	if(mc == NULL || mc->data == NULL || album->is_loaded)
+		return -1;
+
+	rec = metacache_find(mc->albums, mc->num_albums, sizeof(struct metacache_album), album->id);
+	if(rec == NULL)
+		return -1;
+
+	if((name = metacache_string(mc, rec->name)) == NULL) {
+		DSFYDEBUG("Ignoring broken album record\n");
+		return -1;
+	}
+
+	strpool_set(session, &album->name, name);
+
+	album->year = ntohl(rec->year);
+	album->type = ntohl(rec->type);
+
+	metacache_copy_string(session, &album->allowed_countries, mc, rec->allowed_countries);
+	metacache_copy_string(session, &album->restricted_countries, mc, rec->restricted_countries);
+
+	flags = ntohl(rec->flags);
+	album->is_available = (flags & METACACHE_AVAILABLE) != 0;
+
+	if(memcmp(rec->artist, metacache_no_id, sizeof(rec->artist))) {
+		memcpy(id, rec->artist, sizeof(id));
+		album->artist = osfy_artist_add(session, id);
+	}
+
+	if(memcmp(rec->image, metacache_no_id, sizeof(metacache_no_id))) {
+		album->image = osfy_image_create(session, rec->image);
+	}
+
+	album->is_loaded = 1;
+	album->is_cached = 1;
+
+	return 0;
+}
+
+
+/* Load an artist created by osfy_artist_add() from the cache, if it's there */
+int metacache_load_artist(sp_session *session, sp_artist *artist) {
+	struct metacache *mc = session->metacache;
+	const struct metacache_artist *rec;
+	const char *name;
+
+	if(mc == NULL || mc->data == NULL || artist->is_loaded)
+		return -1;
+
+	rec = metacache_find(mc->artists, mc->num_artists, sizeof(struct metacache_artist), artist->id);
+	if(rec == NULL)
+		return -1;
+
+	if((name = metacache_string(mc, rec->name)) == NULL) {
+		DSFYDEBUG("Ignoring broken artist record\n");
+		return -1;
+	}
+
+	strpool_set(session, &artist->name, name);
+
+	artist->is_loaded = 1;
+	artist->is_cached = 1;
+
+	return 0;
+}
+
+
+/*
+ * Copy the record of a track that's about to be freed, unless it's in
+ * the file already. Called by osfy_track_free() before anything's released.
+ *
+ */
+void metacache_retire_track(sp_session *session, sp_track *track) {
+	struct metacache *mc = session->metacache;
+
+	if(mc == NULL || !track->is_loaded || (track->is_cached && !mc->rescan))
+		return;
+
+	metacache_put_track(mc->retired, track);
+}
+
+
+void metacache_retire_album(sp_session *session, sp_album *album) {
+	struct metacache *mc = session->metacache;
+
+	if(mc == NULL || !album->is_loaded || (album->is_cached && !mc->rescan))
+		return;
+
+	metacache_put_album(mc->retired, album);
+}
+
+
+void metacache_retire_artist(sp_session *session, sp_artist *artist) {
+	struct metacache *mc = session->metacache;
+
+	if(mc == NULL || !artist->is_loaded || (artist->is_cached && !mc->rescan))
+		return;
+
+	metacache_put_artist(mc->retired, artist);
+}
+
+
+/* Map the file and check that its sections add up to its size */
+static int metacache_map(struct metacache *mc) {
+	const struct metacache_header *header;
+	size_t len, expected;
+#ifdef _WIN32
+	HANDLE file;
+
+	file = CreateFile(mc->filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	len = GetFileSize(file, NULL);
+	if(len == INVALID_FILE_SIZE || len < sizeof(struct metacache_header)) {
+		CloseHandle(file);
+		return -1;
+	}
+
+	mc->mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if(mc->mapping == NULL)
+		return -1;
+
+	mc->data = MapViewOfFile(mc->mapping, FILE_MAP_READ, 0, 0, 0);
+	if(mc->data == NULL) {
+		CloseHandle(mc->mapping);
+		mc->mapping = NULL;
+		return -1;
+	}
+#else
+	struct stat st;
+	void *p;
+	int fd;
+
+	if((fd = open(mc->filename, O_RDONLY)) < 0)
+		return -1;
+
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct metacache_header)) {
+		close(fd);
+		return -1;
+	}
+
+	len = st.st_size;
+	p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED)
+		return -1;
+
+	mc->data = p;
+#endif
+	mc->len = len;
+
+	header = (const struct metacache_header *)mc->data;
+	if(memcmp(header->magic, METACACHE_MAGIC, sizeof(header->magic))
+		|| ntohl(header->version) != METACACHE_VERSION) {
+		DSFYDEBUG("Ignoring '%s' with an unknown format\n", mc->filename);
+		metacache_unmap(mc);
+		return -1;
+	}
+
+	mc->num_tracks = ntohl(header->num_tracks);
+	mc->num_albums = ntohl(header->num_albums);
+	mc->num_artists = ntohl(header->num_artists);
+	mc->num_relations = ntohl(header->num_relations);
+	mc->strings_len = ntohl(header->strings_len);
+
+	expected = sizeof(struct metacache_header);
+	if(mc->num_tracks > len / sizeof(struct metacache_track)
+		|| mc->num_albums > len / sizeof(struct metacache_album)
+		|| mc->num_artists > len / sizeof(struct metacache_artist)
+		|| mc->num_relations > len / 16 || mc->strings_len > len) {
+		expected = 0;
+	}
+	else {
+		expected += mc->num_tracks * sizeof(struct metacache_track);
+		expected += mc->num_albums * sizeof(struct metacache_album);
+		expected += mc->num_artists * sizeof(struct metacache_artist);
+		expected += mc->num_relations * 16;
+		expected += mc->strings_len;
+	}
+
+	if(expected != len) {
+		DSFYDEBUG("Ignoring truncated '%s'\n", mc->filename);
+		metacache_unmap(mc);
+		return -1;
+	}
+
+	mc->tracks = (const struct metacache_track *)(header + 1);
+	mc->albums = (const struct metacache_album *)(mc->tracks + mc->num_tracks);
+	mc->artists = (const struct metacache_artist *)(mc->albums + mc->num_albums);
+	mc->relations = (const unsigned char *)(mc->artists + mc->num_artists);
+	mc->strings = (const char *)(mc->relations + 16 * mc->num_relations);
+
+	/* Strings can be used in place as long as the last one is terminated */
+	if(mc->strings_len && mc->strings[mc->strings_len - 1] != 0) {
+		DSFYDEBUG("Ignoring '%s' with unterminated strings\n", mc->filename);
+		metacache_unmap(mc);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void metacache_unmap(struct metacache *mc) {
+	if(mc->data != NULL) {
+#ifdef _WIN32
+		UnmapViewOfFile(mc->data);
+		CloseHandle(mc->mapping);
+#else
+		munmap(mc->data, mc->len);
+#endif
+	}
+
+	mc->data = NULL;
+	mc->len = 0;
+#ifdef _WIN32
+	mc->mapping = NULL;
+#endif
+
+	mc->tracks = NULL;
+	mc->albums = NULL;
+	mc->artists = NULL;
+	mc->relations = NULL;
+	mc->strings = NULL;
+
+	mc->num_tracks = 0;
+	mc->num_albums = 0;
+	mc->num_artists = 0;
+	mc->num_relations = 0;
+	mc->strings_len = 0;
+}
+
+
+/* Binary search for a record by its ID, which all records start with */
+static const void *metacache_find(const void *records, unsigned int num, size_t size, const unsigned char *id) {
+	const unsigned char *rec;
+	unsigned int lo, hi, mid;
+	int cmp;
+
+	lo = 0;
+	hi = num;
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rec = (const unsigned char *)records + mid * size;
+
+		cmp = memcmp(id, rec, 16);
+		if(cmp == 0)
+			return rec;
+		else if(cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+
+/* The records of a kind, in a mapped file or copied ones */
+static const unsigned char *metacache_records(struct metacache *mc, int kind, unsigned int *num) {
+	switch(kind) {
+		case METACACHE_TRACKS:
+			*num = mc->num_tracks;
+			return (const unsigned char *)mc->tracks;
+
+		case METACACHE_ALBUMS:
+			*num = mc->num_albums;
+			return (const unsigned char *)mc->albums;
+
+		default:
+			*num = mc->num_artists;
+			return (const unsigned char *)mc->artists;
+	}
+}
+
+
+static const char *metacache_string(struct metacache *mc, unsigned int offset) {
+	offset = ntohl(offset);
+	if(offset == METACACHE_NONE || offset >= mc->strings_len)
+		return NULL;
+
+	return mc->strings + offset;
+}
+
+
+static void metacache_copy_string(sp_session *session, const char **dst, struct metacache *mc, unsigned int offset) {
+	const char *s;
+
+	if((s = metacache_string(mc, offset)) == NULL)
+		return;
+
+	strpool_set(session, dst, s);
+}
+
+
+/*
+ * Copy the records of loaded objects that aren't in the file, so that
+ * a decoder thread can write them. Returns NULL if there are none.
+ *
+ */
+static struct metacache_save *metacache_save_new(sp_session *session) {
+	struct metacache *mc = session->metacache;
+	struct metacache_save *save;
+	int kind;
+
+	save = malloc(sizeof(struct metacache_save));
+	if(save == NULL)
+		return NULL;
+
+	/* Freed objects first, then the ones still around */
+	save->added = *mc->retired;
+	metacache_writer_init(mc->retired);
+	save->tmpname = NULL;
+
+	save->num_added = 0;
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++)
+		save->num_added += save->added.records[kind]->len / metacache_record_size[kind];
+
+	/* Objects copied now are marked as cached, in case this save fails too */
+	mc->rescan = 0;
+
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++)
+		save->num_added += metacache_add_new(session, &save->added, kind);
+
+	if(save->num_added == 0) {
+		metacache_save_free(save);
+		return NULL;
+	}
+
+	metacache_sort(&save->added, &save->view);
+
+	save->job.decode = metacache_save_decode;
+	save->job.apply = metacache_save_apply;
+	save->job.release = metacache_save_release;
+	save->mc = mc;
+
+	save->tmpname = malloc(strlen(mc->filename) + 5);
+	sprintf(save->tmpname, "%s.tmp", mc->filename);
+	save->ret = -1;
+
+	return save;
+}
+
+
+static void metacache_save_free(struct metacache_save *save) {
+	metacache_writer_free(&save->added);
+	free(save->tmpname);
+	free(save);
+}
+
+
+/* Merge the copied records with the mapped file into a new file, run by a decoder thread */
+static void metacache_save_decode(struct decode_job *job) {
+	struct metacache_save *save = (struct metacache_save *)job;
+	struct metacache_writer w;
+	int kind;
+
+	metacache_writer_init(&w);
+
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++) {
+		metacache_merge(&w, kind, save->mc, &save->view);
+		save->num[kind] = w.records[kind]->len / metacache_record_size[kind];
+	}
+
+	save->ret = metacache_write(&w, save->tmpname);
+
+	metacache_writer_free(&w);
+}
+
+
+/* Back on the iothread, which is the only one to map and unmap the file */
+static void metacache_save_apply(sp_session *session, struct decode_job *job) {
+	struct metacache_save *save = (struct metacache_save *)job;
+
+	save->mc->saving = 0;
+	if(metacache_replace(save->mc, save) < 0)
+		metacache_keep(save->mc, save);
+
+	metacache_save_free(save);
+}
+
+
+/* Dropped by decoder_free(), metacache_flush() writes the records again */
+static void metacache_save_release(struct decode_job *job) {
+	struct metacache_save *save = (struct metacache_save *)job;
+
+	save->mc->saving = 0;
+	save->mc->rescan = 1;
+	remove(save->tmpname);
+
+	metacache_keep(save->mc, save);
+	metacache_save_free(save);
+}
+
+
+/*
+ * Keep the records of a save that failed for the next one, as the freed
+ * objects among them are gone. Objects that are still around are copied
+ * again, the duplicates are dropped by metacache_merge().
+ *
+ */
+static void metacache_keep(struct metacache *mc, struct metacache_save *save) {
+	const unsigned char *records;
+	unsigned int num, i;
+	int kind;
+
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++) {
+		records = metacache_records(&save->view, kind, &num);
+		for(i = 0; i < num; i++)
+			metacache_copy_record(mc->retired, kind, &save->view, records + i * metacache_record_size[kind]);
+	}
+}
+
+
+/* Replace the mapped file with the one written by metacache_save_decode() */
+static int metacache_replace(struct metacache *mc, struct metacache_save *save) {
+	int ret = save->ret;
+
+	if(ret == 0) {
+		/* The records written referred to the old file until now */
+		metacache_unmap(mc);
+
+#ifdef _WIN32
+		if(!MoveFileEx(save->tmpname, mc->filename, MOVEFILE_REPLACE_EXISTING))
+			ret = -1;
+#else
+		if(rename(save->tmpname, mc->filename))
+			ret = -1;
+#endif
+
+		metacache_map(mc);
+	}
+
+	if(ret == 0) {
+		DSFYDEBUG("Wrote %d tracks, %d albums and %d artists (%d new) to '%s'\n",
+			save->num[METACACHE_TRACKS], save->num[METACACHE_ALBUMS],
+			save->num[METACACHE_ARTISTS], save->num_added, mc->filename);
+	}
+	else {
+		DSFYDEBUG("Failed to write metadata to '%s'\n", save->tmpname);
+		remove(save->tmpname);
+
+		/* The objects copied have to be found again */
+		mc->rescan = 1;
+	}
+
+	return ret;
+}
+
+
+/*
+ * Copy the records of loaded objects of a kind that aren't in the file,
+ * returns how many. Objects are marked once they were loaded from the
+ * file or copied, so only new ones have to be looked up in it.
+ *
+ */
+static int metacache_add_new(sp_session *session, struct metacache_writer *w, int kind) {
+	struct metacache *mc = session->metacache;
+	struct hashtable *hashtable;
+	struct hashiterator *iter;
+	struct hashentry *entry;
+	const unsigned char *records, *id;
+	unsigned int num_records;
+	int num, is_loaded, *is_cached;
+	void *object;
+
+	switch(kind) {
+		case METACACHE_TRACKS:
+			hashtable = session->hashtable_tracks;
+			break;
+
+		case METACACHE_ALBUMS:
+			hashtable = session->hashtable_albums;
+			break;
+
+		default:
+			hashtable = session->hashtable_artists;
+			break;
+	}
+
+	records = metacache_records(mc, kind, &num_records);
+
+	num = 0;
+	iter = hashtable_iterator_init(hashtable);
+	while((entry = hashtable_iterator_next(iter))) {
+		object = entry->value;
+
+		switch(kind) {
+			case METACACHE_TRACKS:
+				id = ((sp_track *)object)->id;
+				is_loaded = ((sp_track *)object)->is_loaded;
+				is_cached = &((sp_track *)object)->is_cached;
+				break;
+
+			case METACACHE_ALBUMS:
+				id = ((sp_album *)object)->id;
+				is_loaded = ((sp_album *)object)->is_loaded;
+				is_cached = &((sp_album *)object)->is_cached;
+				break;
+
+			default:
+				id = ((sp_artist *)object)->id;
+				is_loaded = ((sp_artist *)object)->is_loaded;
+				is_cached = &((sp_artist *)object)->is_cached;
+				break;
+		}
+
+		if(!is_loaded || (*is_cached && !mc->rescan))
+			continue;
+
+		*is_cached = 1;
+		if(metacache_find(records, num_records, metacache_record_size[kind], id) != NULL)
+			continue;
+
+		switch(kind) {
+			case METACACHE_TRACKS:
+				metacache_put_track(w, (sp_track *)object);
+				break;
+
+			case METACACHE_ALBUMS:
+				metacache_put_album(w, (sp_album *)object);
+				break;
+
+			default:
+				metacache_put_artist(w, (sp_artist *)object);
+				break;
+		}
+
+		num++;
+	}
+
+	hashtable_iterator_free(iter);
+
+	return num;
+}
+
+
+/* Sort copied records by ID and lay them out like a mapped file */
+static void metacache_sort(struct metacache_writer *w, struct metacache *view) {
+	int kind;
+
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++) {
+		qsort(w->records[kind]->ptr, w->records[kind]->len / metacache_record_size[kind],
+				metacache_record_size[kind], metacache_record_cmp);
+	}
+
+	memset(view, 0, sizeof(struct metacache));
+
+	view->tracks = (const struct metacache_track *)w->records[METACACHE_TRACKS]->ptr;
+	view->num_tracks = w->records[METACACHE_TRACKS]->len / sizeof(struct metacache_track);
+	view->albums = (const struct metacache_album *)w->records[METACACHE_ALBUMS]->ptr;
+	view->num_albums = w->records[METACACHE_ALBUMS]->len / sizeof(struct metacache_album);
+	view->artists = (const struct metacache_artist *)w->records[METACACHE_ARTISTS]->ptr;
+	view->num_artists = w->records[METACACHE_ARTISTS]->len / sizeof(struct metacache_artist);
+
+	view->relations = w->relations->ptr;
+	view->num_relations = w->num_relations;
+	view->strings = (const char *)w->strings->ptr;
+	view->strings_len = w->strings->len;
+}
+
+
+/* Records start with their ID */
+static int metacache_record_cmp(const void *a, const void *b) {
+	return memcmp(a, b, 16);
+}
+
+
+/* Write the records of a kind from both in ID order, copied ones replacing those in the file */
+static void metacache_merge(struct metacache_writer *w, int kind, struct metacache *old, struct metacache *added) {
+	const unsigned char *a, *b;
+	unsigned int num_a, num_b, i, j;
+	size_t size;
+	int cmp;
+
+	size = metacache_record_size[kind];
+	a = metacache_records(old, kind, &num_a);
+	b = metacache_records(added, kind, &num_b);
+
+	i = j = 0;
+	while(i < num_a || j < num_b) {
+		/* Freed and then loaded again since the last save */
+		if(j > 0 && j < num_b && memcmp(b + j * size, b + (j - 1) * size, 16) == 0) {
+			j++;
+			continue;
+		}
+
+		if(i == num_a)
+			cmp = 1;
+		else if(j == num_b)
+			cmp = -1;
+		else
+			cmp = memcmp(a + i * size, b + j * size, 16);
+
+		if(cmp < 0) {
+			metacache_copy_record(w, kind, old, a + i * size);
+			i++;
+			continue;
+		}
+
+		if(cmp == 0)
+			i++;
+
+		metacache_copy_record(w, kind, added, b + j * size);
+		j++;
+	}
+}
+
+
+static int metacache_write(struct metacache_writer *w, const char *filename) {
+	struct metacache_header header;
+	FILE *fd;
+	int kind, ret;
+
+	memcpy(header.magic, METACACHE_MAGIC, sizeof(header.magic));
+	header.version = htonl(METACACHE_VERSION);
+	header.num_tracks = htonl(w->records[METACACHE_TRACKS]->len / sizeof(struct metacache_track));
+	header.num_albums = htonl(w->records[METACACHE_ALBUMS]->len / sizeof(struct metacache_album));
+	header.num_artists = htonl(w->records[METACACHE_ARTISTS]->len / sizeof(struct metacache_artist));
+	header.num_relations = htonl(w->num_relations);
+	header.strings_len = htonl(w->strings->len);
+	header.reserved = 0;
+
+	if((fd = fopen(filename, "wb")) == NULL)
+		return -1;
+
+	fwrite(&header, sizeof(header), 1, fd);
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++)
+		fwrite(w->records[kind]->ptr, 1, w->records[kind]->len, fd);
+
+	fwrite(w->relations->ptr, 1, w->relations->len, fd);
+	fwrite(w->strings->ptr, 1, w->strings->len, fd);
+
+	ret = ferror(fd)? -1: 0;
+	if(fclose(fd))
+		ret = -1;
+
+	return ret;
+}
+
+
+static void metacache_writer_init(struct metacache_writer *w) {
+	int kind;
+
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++)
+		w->records[kind] = buf_new();
+
+	w->relations = buf_new();
+	w->num_relations = 0;
+	w->strings = buf_new();
+}
+
+
+static void metacache_writer_free(struct metacache_writer *w) {
+	int kind;
+
+	for(kind = 0; kind < METACACHE_NUM_KINDS; kind++)
+		buf_free(w->records[kind]);
+
+	buf_free(w->relations);
+	buf_free(w->strings);
+}
+
+
+static unsigned int metacache_put_string(struct metacache_writer *w, const char *s) {
+	unsigned int offset;
+
+	if(s == NULL)
+		return htonl(METACACHE_NONE);
+
+	offset = w->strings->len;
+	buf_append_data(w->strings, (void *)s, strlen(s) + 1);
+
+	return htonl(offset);
+}
+
+
+static void metacache_put_track(struct metacache_writer *w, sp_track *track) {
+	struct metacache_track rec;
+	int i;
+
+	memset(&rec, 0, sizeof(rec));
+	memcpy(rec.id, track->id, sizeof(rec.id));
+	memcpy(rec.file_id, track->file_id, sizeof(rec.file_id));
+	if(track->album != NULL)
+		memcpy(rec.album, track->album->id, sizeof(rec.album));
+
+	rec.name = metacache_put_string(w, track->name);
+	rec.allowed_countries = metacache_put_string(w, track->allowed_countries);
+	rec.restricted_countries = metacache_put_string(w, track->restricted_countries);
+
+	rec.artists = htonl(w->num_relations);
+	rec.num_artists = htonl(track->num_artists);
+	for(i = 0; i < track->num_artists; i++)
+		buf_append_data(w->relations, track->artists[i]->id, 16);
+
+	w->num_relations += track->num_artists;
+
+	rec.index = htonl(track->index);
+	rec.disc = htonl(track->disc);
+	rec.duration = htonl(track->duration);
+	rec.popularity = htonl(track->popularity);
+	rec.flags = htonl((track->has_explicit_lyrics? METACACHE_EXPLICIT: 0)
+			| (track->is_available? METACACHE_AVAILABLE: 0));
+
+	buf_append_data(w->records[METACACHE_TRACKS], &rec, sizeof(rec));
+}
+
+
+static void metacache_put_album(struct metacache_writer *w, sp_album *album) {
+	struct metacache_album rec;
+
+	memset(&rec, 0, sizeof(rec));
+	memcpy(rec.id, album->id, sizeof(rec.id));
+	if(album->image != NULL)
+		memcpy(rec.image, album->image->id, sizeof(rec.image));
+
+	if(album->artist != NULL)
+		memcpy(rec.artist, album->artist->id, sizeof(rec.artist));
+
+	rec.name = metacache_put_string(w, album->name);
+	rec.allowed_countries = metacache_put_string(w, album->allowed_countries);
+	rec.restricted_countries = metacache_put_string(w, album->restricted_countries);
+
+	rec.year = htonl(album->year);
+	rec.type = htonl(album->type);
+	rec.flags = htonl(album->is_available? METACACHE_AVAILABLE: 0);
+
+	buf_append_data(w->records[METACACHE_ALBUMS], &rec, sizeof(rec));
+}
+
+
+static void metacache_put_artist(struct metacache_writer *w, sp_artist *artist) {
+	struct metacache_artist rec;
+
+	memcpy(rec.id, artist->id, sizeof(rec.id));
+	rec.name = metacache_put_string(w, artist->name);
+
+	buf_append_data(w->records[METACACHE_ARTISTS], &rec, sizeof(rec));
+}
+
+
+/* Copy a record of a mapped file, or of copied records, along with its strings and artists */
+static void metacache_copy_record(struct metacache_writer *w, int kind, struct metacache *mc, const void *record) {
+	struct metacache_track track;
+	struct metacache_album album;
+	struct metacache_artist artist;
+	const struct metacache_track *old_track;
+	const struct metacache_album *old_album;
+	const struct metacache_artist *old_artist;
+	unsigned int first, num;
+
+	switch(kind) {
+		case METACACHE_TRACKS:
+			old_track = (const struct metacache_track *)record;
+			memcpy(&track, old_track, sizeof(track));
+
+			track.name = metacache_put_string(w, metacache_string(mc, old_track->name));
+			track.allowed_countries = metacache_put_string(w, metacache_string(mc, old_track->allowed_countries));
+			track.restricted_countries = metacache_put_string(w, metacache_string(mc, old_track->restricted_countries));
+
+			first = ntohl(old_track->artists);
+			num = ntohl(old_track->num_artists);
+			if(first > mc->num_relations || num > mc->num_relations - first)
+				num = 0;
+
+			track.artists = htonl(w->num_relations);
+			track.num_artists = htonl(num);
+			buf_append_data(w->relations, (void *)(mc->relations + 16 * first), 16 * num);
+			w->num_relations += num;
+
+			buf_append_data(w->records[METACACHE_TRACKS], &track, sizeof(track));
+			break;
+
+		case METACACHE_ALBUMS:
+			old_album = (const struct metacache_album *)record;
+			memcpy(&album, old_album, sizeof(album));
+
+			album.name = metacache_put_string(w, metacache_string(mc, old_album->name));
+			album.allowed_countries = metacache_put_string(w, metacache_string(mc, old_album->allowed_countries));
+			album.restricted_countries = metacache_put_string(w, metacache_string(mc, old_album->restricted_countries));
+
+			buf_append_data(w->records[METACACHE_ALBUMS], &album, sizeof(album));
+			break;
+
+		default:
+			old_artist = (const struct metacache_artist *)record;
+			memcpy(artist.id, old_artist->id, sizeof(artist.id));
+			artist.name = metacache_put_string(w, metacache_string(mc, old_artist->name));
+
+			buf_append_data(w->records[METACACHE_ARTISTS], &artist, sizeof(artist));
+			break;
+	}
+}
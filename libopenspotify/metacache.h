@@ -0,0 +1,142 @@
+#ifndef LIBOPENSPOTIFY_METACACHE_H
+#define LIBOPENSPOTIFY_METACACHE_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <libspotify/api.h>
+
+
+/* Name of the file in the cache directory */
+#define METACACHE_FILE		"metadata.cache"
+
+#define METACACHE_MAGIC		"OSMC"
+#define METACACHE_VERSION	1
+
+/* String offsets that aren't set */
+#define METACACHE_NONE		0xffffffffU
+
+/* Record flags */
+#define METACACHE_EXPLICIT	0x01
+#define METACACHE_AVAILABLE	0x02
+
+
+/*
+ * The file is mapped as is and records are looked up in place, all
+ * integers are stored in network byte order. It's laid out as:
+ *
+ *   header
+ *   tracks, albums and artists, each sorted by ID
+ *   artist IDs referred to by tracks, 16 bytes each
+ *   NUL terminated strings
+ *
+ * Objects refer to each other by ID, an all zero ID meaning none.
+ *
+ */
+struct metacache_header {
+	unsigned char magic[4];
+	unsigned int version;
+
+	unsigned int num_tracks;
+	unsigned int num_albums;
+	unsigned int num_artists;
+	unsigned int num_relations;
+	unsigned int strings_len;
+	unsigned int reserved;
+};
+
+
+struct metacache_track {
+	unsigned char id[16];
+	unsigned char file_id[20];
+	unsigned char album[16];
+
+	/* Offsets into the strings */
+	unsigned int name;
+	unsigned int allowed_countries;
+	unsigned int restricted_countries;
+
+	/* Index of the first artist ID */
+	unsigned int artists;
+	unsigned int num_artists;
+
+	unsigned int index;
+	unsigned int disc;
+	unsigned int duration;
+	unsigned int popularity;
+	unsigned int flags;
+};
+
+
+struct metacache_album {
+	unsigned char id[16];
+	unsigned char image[20];
+	unsigned char artist[16];
+
+	unsigned int name;
+	unsigned int allowed_countries;
+	unsigned int restricted_countries;
+
+	unsigned int year;
+	unsigned int type;
+	unsigned int flags;
+};
+
+
+struct metacache_artist {
+	unsigned char id[16];
+
+	unsigned int name;
+};
+
+
+struct metacache_writer;
+
+struct metacache {
+	char *filename;
+
+	/* The mapped file, NULL until one has been written */
+	unsigned char *data;
+	size_t len;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+
+	/* Sections of the mapped file */
+	const struct metacache_track *tracks;
+	const struct metacache_album *albums;
+	const struct metacache_artist *artists;
+	const unsigned char *relations;
+	const char *strings;
+
+	unsigned int num_tracks;
+	unsigned int num_albums;
+	unsigned int num_artists;
+	unsigned int num_relations;
+	unsigned int strings_len;
+
+	/* Set while a decoder thread writes a new file, see metacache_save() */
+	int saving;
+
+	/* The last save failed, objects marked as cached might not be */
+	int rescan;
+
+	/* Records of objects freed since the last save, see metacache_retire_track() */
+	struct metacache_writer *retired;
+};
+
+
+int metacache_init(sp_session *session, const char *filename);
+void metacache_free(sp_session *session);
+int metacache_save(sp_session *session);
+int metacache_flush(sp_session *session);
+int metacache_load_track(sp_session *session, sp_track *track);
+int metacache_load_album(sp_session *session, sp_album *album);
+int metacache_load_artist(sp_session *session, sp_artist *artist);
+void metacache_retire_track(sp_session *session, sp_track *track);
+void metacache_retire_album(sp_session *session, sp_album *album);
+void metacache_retire_artist(sp_session *session, sp_artist *artist);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Intrusive lock-free multi-producer, single-consumer queue
+ *
+ * Producers swap themselves in as the new head with a single atomic
+ * exchange and then link the previous head to the new node. The
+ * consumer follows the next pointers from the tail. A stub node keeps
+ * the queue non-empty so producers never have to touch the tail.
+ *
+ * Between a producer's exchange and its store to the previous node's
+ * next pointer the queue looks empty to the consumer. Callers deal with
+ * that by signalling the consumer after mpsc_push() has returned.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "atomic.h"
+#include "mpsc.h"
+
+
+void mpsc_init(struct mpsc_queue *queue) {
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+}
+
+
+/* Append a node, may be called from any thread */
+void mpsc_push(struct mpsc_queue *queue, struct mpsc_node *node) {
+	struct mpsc_node *prev;
+
+	node->next = NULL;
+	prev = osfy_atomic_xchg_ptr(&queue->head, node);
+	osfy_atomic_store_ptr(&prev->next, node);
+}
+
+
+/*
+ * Remove the oldest node, only to be called by the consumer
+ * Returns NULL if the queue is empty or a push is in progress
+ *
+ */
+struct mpsc_node *mpsc_pop(struct mpsc_queue *queue) {
+	struct mpsc_node *tail, *next;
+
+	tail = queue->tail;
+	next = osfy_atomic_load_ptr(&tail->next);
+
+	/* Skip over the stub */
+	if(tail == &queue->stub) {
+		if(next == NULL)
+			return NULL;
+
+		queue->tail = next;
+		tail = next;
+		next = osfy_atomic_load_ptr(&tail->next);
+	}
+
+	if(next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+
+	/* A producer has swapped in a new head but not yet linked it */
+	if(tail != osfy_atomic_load_ptr(&queue->head))
+		return NULL;
+
+	/* The tail is the last node, put the stub behind it so it can be removed */
+	mpsc_push(queue, &queue->stub);
+
+	next = osfy_atomic_load_ptr(&tail->next);
+	if(next != NULL) {
+		queue->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+
+/* For the consumer: Check if there's anything to pop */
+int mpsc_is_empty(struct mpsc_queue *queue) {
+	struct mpsc_node *tail = queue->tail;
+
+	if(tail != &queue->stub)
+		return 0;
+
+	return osfy_atomic_load_ptr(&tail->next) == NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef LIBOPENSPOTIFY_MPSC_H
+#define LIBOPENSPOTIFY_MPSC_H
+
+#include <stddef.h>
+
+
+/* Embed this in structures that are to be queued */
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+
+/*
+ * Lock-free multi-producer, single-consumer FIFO
+ * Any thread may push, only one thread may pop.
+ * The queue must not be moved in memory after mpsc_init()
+ *
+ */
+struct mpsc_queue {
+	/* Most recently pushed node, swapped in by producers */
+	struct mpsc_node *head;
+
+	/* Oldest node, only touched by the consumer */
+	struct mpsc_node *tail;
+
+	struct mpsc_node stub;
+};
+
+
+/* Get the structure containing an mpsc_node */
+#define mpsc_entry(node, type, member) \
+	((type *)((char *)(node) - offsetof(type, member)))
+
+
+void mpsc_init(struct mpsc_queue *queue);
+void mpsc_push(struct mpsc_queue *queue, struct mpsc_node *node);
+struct mpsc_node *mpsc_pop(struct mpsc_queue *queue);
+int mpsc_is_empty(struct mpsc_queue *queue);
+
+#endif
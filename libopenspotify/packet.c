@@ -9,90 +9,122 @@
 #include <ws2tcpip.h>
 #else
 #include <unistd.h>
-#include <sys/select.h>
 #include <time.h>
 #endif
 #include <assert.h>
+#include <errno.h>
 
+#include "buf.h"
 #include "debug.h"
 #include "handlers.h"
 #include "packet.h"
+#include "ring.h"
 #include "sp_opaque.h"
 #include "util.h"
 
 
+/*
+ * Discard buffered data from a previous connection
+ * Called when a new connection has been setup
+ *
+ */
+void packet_reset(sp_session *session) {
+	ring_reset(&session->rx);
+	session->rx_packet_len = -1;
+
+	ring_reset(&session->tx);
+}
+
+
+/*
+ * Read and process zero or more packets
+ * Called by the iothread when ioloop_wait() reports the socket as readable
+ *
+ * Packets are decrypted in the receive ring and handle_packet() is
+ * passed a pointer into it, so the payload is only valid until
+ * handle_packet() returns.
+ *
+ */
 int packet_read_and_process(sp_session *session) {
-	fd_set rfds;
-	struct timeval tv;
-	int ret;
-	struct buf *packet;
-	PHEADER header;
+	struct ring *rx = &session->rx;
+	unsigned char *ptr;
 	unsigned char nonce[4];
+	int ret, need, avail;
+	int cmd;
 
 
-	if(session->packet == NULL)
-		session->packet = buf_new();
-	else if(session->packet->len == session->packet->size)
-		buf_extend(session->packet, session->packet->size);
+	/* Make sure there's room for the rest of a partially received packet */
+	need = PACKET_MIN_READ;
+	if(session->rx_packet_len >= 0
+		&& 3 + session->rx_packet_len + 4 - ring_length(rx) > need)
+		need = 3 + session->rx_packet_len + 4 - ring_length(rx);
 
+	ptr = ring_reserve(rx, need, &avail);
+	if(ptr == NULL)
+		return -1;
 
-	FD_ZERO(&rfds);
-	FD_SET(session->sock, &rfds);
-	
-	tv.tv_sec = 0;
-	tv.tv_usec = 64 * 1000;
 
-	ret = select(session->sock + 1, &rfds, NULL, NULL, &tv);
-	if(ret <= 0)
-		return ret;
+	ret = recv(session->sock, ptr, avail, 0);
+#ifdef _WIN32
+	if(ret < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+	if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+#endif
+		return 0;
+	else if(ret <= 0)
+		return -1;
 
+	ring_commit(rx, ret);
 
-	ret = recv(session->sock,
-			session->packet->ptr + session->packet->len, 
-			session->packet->size - session->packet->len, 0);
-	if(ret <= 0)
-		return -1;
 
+	for(;;) {
+		ptr = ring_ptr(rx);
 
-	/* We need a complete packet header of three bytes */
-	session->packet->len += ret;
-	while(session->packet->len >= 3) {
+		/* We need a complete packet header of three bytes */
+		if(session->rx_packet_len < 0) {
+			if(ring_length(rx) < 3)
+				break;
 
-		/* Set nonce for Shannon */
-		nonce[0] = (session->key_recv_IV >> 24) & 0xff; 
-		nonce[1] = (session->key_recv_IV >> 16) & 0xff; 
-		nonce[2] = (session->key_recv_IV >> 8) & 0xff; 
-		nonce[3] = session->key_recv_IV & 0xff; 
-		shn_nonce(&session->shn_recv, nonce, 4);
+			/* Set nonce for Shannon */
+			nonce[0] = (session->key_recv_IV >> 24) & 0xff; 
+			nonce[1] = (session->key_recv_IV >> 16) & 0xff; 
+			nonce[2] = (session->key_recv_IV >> 8) & 0xff; 
+			nonce[3] = session->key_recv_IV & 0xff; 
+			shn_nonce(&session->shn_recv, nonce, 4);
 
 
-		/* Decrypt the packet header */
-		memcpy(&header, session->packet->ptr, 3);
-		shn_decrypt(&session->shn_recv, (unsigned char *)&header, 3);
+			/*
+			 * Decrypt the packet header in place. The cipher state is
+			 * left positioned at the payload until the rest arrives.
+			 *
+			 */
+			shn_decrypt(&session->shn_recv, ptr, 3);
+			session->rx_packet_len = (ptr[1] << 8) | ptr[2];
+		}
 
 
 		/* Make sure we have the entire payload aswell as the MAC */
-		header.len = ntohs(header.len);
 		DSFYDEBUG("%d bytes buffered, header.cmd=0x%02x, header.len=%d\n",
-			session->packet->len, header.cmd, header.len);
-		if(session->packet->len < 3 + header.len + 4)
+			ring_length(rx), ptr[0], session->rx_packet_len);
+		if(ring_length(rx) < 3 + session->rx_packet_len + 4)
 			break;
 
 
-		/* Extract the full packet, leaving eventual additional data as is */
-		packet = buf_consume(session->packet, 3 + header.len + 4);
-
-
-		/* Copy back the decrypted header and decrypt the payload */
-		memcpy(packet->ptr, &header, 3);
-		shn_decrypt(&session->shn_recv, packet->ptr + 3, header.len);
+		/* Decrypt the payload in place */
+		cmd = ptr[0];
+		shn_decrypt(&session->shn_recv, ptr + 3, session->rx_packet_len);
 
 
 		/* Increment receiving IV */
 		session->key_recv_IV++;
 
 
-		if(handle_packet(session, header.cmd, packet->ptr + 3, header.len)) {
+		ret = handle_packet(session, cmd, ptr + 3, session->rx_packet_len);
+
+		ring_consume(rx, 3 + session->rx_packet_len + 4);
+		session->rx_packet_len = -1;
+
+		if(ret) {
 			DSFYDEBUG("handle_packet() failed with an error\n");
 			return -1;
 		}
@@ -103,52 +135,97 @@ int packet_read_and_process(sp_session *session) {
 }
 
 
-int packet_write (sp_session * session, unsigned char cmd,
-		  unsigned char *payload, unsigned short len)
-{
+/*
+ * Get the session's buffer for building the payload of an outgoing
+ * packet. It's emptied and reused by every call, so the payload
+ * must be passed to packet_write() before building the next one.
+ *
+ */
+struct buf *packet_payload(sp_session *session) {
+	session->tx_payload->len = 0;
+
+	return session->tx_payload;
+}
+
+
+/*
+ * Encrypt a packet into the transmit ring
+ * Nothing is sent until the iothread calls packet_flush()
+ *
+ */
+int packet_write(sp_session *session, unsigned char cmd,
+		unsigned char *payload, unsigned short len) {
 	unsigned char nonce[4];
-	unsigned char *buf, *ptr;
-	PHEADER *h;
-	int ret;
+	unsigned char *ptr;
+	int avail;
+
+	ptr = ring_reserve(&session->tx, 3 + len + 4, &avail);
+	if(ptr == NULL)
+		return -1;
 
 	nonce[0] = (session->key_send_IV >> 24) & 0xff; 
 	nonce[1] = (session->key_send_IV >> 16) & 0xff; 
 	nonce[2] = (session->key_send_IV >> 8) & 0xff; 
 	nonce[3] = session->key_send_IV & 0xff; 
-	shn_nonce (&session->shn_send, nonce, 4);
+	shn_nonce(&session->shn_send, nonce, 4);
 
-	buf = (unsigned char *) malloc (3 + len + 4);
+	ptr[0] = cmd;
+	ptr[1] = (len >> 8) & 0xff;
+	ptr[2] = len & 0xff;
+	if(payload != NULL)
+		memcpy(ptr + 3, payload, len);
+	else
+		memset(ptr + 3, 0, len);
 
-	h = (PHEADER *) buf;
-	h->cmd = cmd;
-	h->len = htons (len);
+	DSFYDEBUG("Queueing packet with command 0x%02x, length %d, IV=%d\n",
+		 cmd, len, session->key_send_IV);
 
-	ptr = buf + 3;
-	if (payload != NULL)
-	{
- 		memcpy (ptr, payload, len);
-	}
-	
-	DSFYDEBUG("Sending packet with command 0x%02x, length %d, IV=%d\n",
-		 h->cmd, ntohs (h->len), session->key_send_IV);
+	shn_encrypt(&session->shn_send, ptr, 3 + len);
+	shn_finish(&session->shn_send, ptr + 3 + len, 4);
+
+	ring_commit(&session->tx, 3 + len + 4);
+
+	session->key_send_IV++;
 
-	shn_encrypt (&session->shn_send, buf, 3 + len);
-	ptr += len;
+	return 0;
+}
 
-	shn_finish (&session->shn_send, ptr, 4);
 
-	ret = block_write (session->sock, buf, 3 + len + 4);
+/* Check if there are queued packets waiting to be sent */
+int packet_tx_pending(sp_session *session) {
+	return ring_length(&session->tx) > 0;
+}
 
-	free(buf);
 
-	session->key_send_IV++;
+/*
+ * Send as much queued data as the socket will take with a single send()
+ * Whatever is left is sent once ioloop_wait() reports the socket as
+ * writable.
+ *
+ * Returns 0 on success, including partial writes, and -1 on errors
+ *
+ */
+int packet_flush(sp_session *session) {
+	struct ring *tx = &session->tx;
+	int ret;
 
+	if(ring_length(tx) == 0)
+		return 0;
 
-	if(ret != 3 + len + 4) {
-		DSFYDEBUG ("block_write() only wrote %d of %d bytes\n", ret,
-			   3 + len + 4);
+	ret = send(session->sock, (char *)ring_ptr(tx), ring_length(tx), 0);
+#ifdef _WIN32
+	if(ret < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+	if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+#endif
+		return 0;
+	else if(ret < 0) {
+		DSFYDEBUG("send() failed with %d bytes queued\n", ring_length(tx));
 		return -1;
 	}
 
+	DSFYDEBUG("Sent %d of %d queued bytes\n", ret, ring_length(tx));
+	ring_consume(tx, ret);
+
 	return 0;
 }
@@ -6,6 +6,7 @@
 #ifndef DESPOTIFY_PACKET_H
 #define DESPOTIFY_PACKET_H
 
+#include "buf.h"
 #include "sp_opaque.h"
 
 #ifdef _MSC_VER
@@ -31,6 +32,24 @@ struct packet_header
 typedef struct packet_header PHEADER;
 
 
+void packet_reset(sp_session *session);
+/*
+ * Size of the receive ring, large enough for two maximum sized packets
+ * of 3 bytes header, 65535 bytes payload and a 4 byte MAC
+ *
+ */
+#define PACKET_RX_RING_SIZE	(2 * 65542)
+
+/* Don't bother calling recv() with less room than this */
+#define PACKET_MIN_READ	4096
+
+/* Initial size of the transmit ring, grown as needed */
+#define PACKET_TX_RING_SIZE	(16 * 1024)
+
+
 int packet_read_and_process(sp_session *session);
+struct buf *packet_payload(sp_session *session);
 int packet_write (sp_session *, unsigned char, unsigned char *, unsigned short);
+int packet_tx_pending(sp_session *session);
+int packet_flush(sp_session *session);
 #endif
@@ -14,10 +14,14 @@
 #include <vorbis/vorbisfile.h>
 
 #include "aes.h"
+#include "atomic.h"
 #include "buf.h"
 #include "channel.h"
 #include "commands.h"
 #include "debug.h"
+#include "flowctl.h"
+#include "memstats.h"
+#include "mpsc.h"
 #include "player.h"
 #include "rbuf.h"
 #include "request.h"
@@ -25,13 +29,6 @@
 #include "util.h"
 
 
-struct player_substream_ctx {
-	sp_track *track;
-	int offset;
-	int length;
-};
-
-
 #ifdef _WIN32
 static DWORD WINAPI player_main(LPVOID arg);
 #else
@@ -39,6 +36,7 @@ static void *player_main(void *arg);
 #endif
 static int player_schedule(sp_session *session);
 static int player_deliver_pcm(sp_session *session, int ms);
+static void player_account(sp_session *session);
 
 /* Ogg/Vorbis callbacks */
 static size_t player_ov_read(void *ptr, size_t size, size_t nmemb, void *private);
@@ -47,6 +45,7 @@ static long player_ov_tell(void *private);
 
 static void player_seek_counter(struct player *player);
 static int player_aes_callback(CHANNEL *ch, unsigned char *buf, unsigned short len);
+static int player_rekey_callback(CHANNEL *ch, unsigned char *buf, unsigned short len);
 static int player_substream_callback(CHANNEL *ch, unsigned char *buf, unsigned short len);
 
 
@@ -69,16 +68,23 @@ int player_init(sp_session *session) {
 	pthread_cond_init(&session->player->cond, NULL);
 #endif
 	session->player->item_posted = 0;
+	session->player->parked = 0;
 
-	session->player->items = NULL;
+	mpsc_init(&session->player->items);
 
 	session->player->key = NULL;
 	session->player->track = NULL;
 
+	session->player->key_track = NULL;
+	session->player->key_delivered = 0;
+	session->player->has_token = 0;
+
 	session->player->ogg = rbuf_new();
 	session->player->stream_length = 0;
 	session->player->pcm = buf_new();
 	session->player->pcm_next_timeout_ms = 0;
+	session->player->buffer_size = 0;
+	player_account(session);
 
 	session->player->is_loaded = 0;
 	session->player->is_playing = 0;
@@ -109,6 +115,9 @@ int player_init(sp_session *session) {
  *
  */
 void player_free(sp_session *session) {
+	struct mpsc_node *node;
+	struct player_item *item;
+
 #ifdef _WIN32
 	TerminateThread(session->player->thread, 0);
 
@@ -134,8 +143,23 @@ void player_free(sp_session *session) {
 	if(session->player->key)
 		free(session->player->key);
 
+	if(session->player->key_track)
+		sp_track_release(session->player->key_track);
+
 	buf_free(session->player->pcm);
 	rbuf_free(session->player->ogg);
+	memstats_resize(session, OPENSP_MEMORY_PLAYER, session->player->buffer_size, 0);
+
+	/* Items that were still queued, and their data */
+	while((node = mpsc_pop(&session->player->items)) != NULL) {
+		item = mpsc_entry(node, struct player_item, node);
+		memstats_free(session, OPENSP_MEMORY_PLAYER,
+				sizeof(struct player_item) + (item->data != NULL? item->len: 0));
+
+		if(item->data != NULL && item->len)
+			free(item->data);
+		free(item);
+	}
 
 
 	free(session->player);
@@ -164,6 +188,7 @@ static void *player_main(void *arg) {
 
 		/* Process items and decode PCM-data */
 		ret = player_schedule(session);
+		player_account(session);
 
 
 		if(!player->is_loaded) {
@@ -210,6 +235,8 @@ static void *player_main(void *arg) {
 
 			buf_append_data(player->pcm, pcm, num_bytes);
 		}
+
+		player_account(session);
 	}
 
 #ifdef _WIN32
@@ -225,29 +252,19 @@ static void *player_main(void *arg) {
  * This appends a work item to the player's FIFO and notifies
  * the player to wake up in player_schedule()
  *
+ * The FIFO is lock-free. The mutex is only taken to signal the
+ * condition when the player thread is actually parked on it.
+ *
  */
 int player_push(sp_session *session, enum player_item_type type, void *data, size_t len) {
 	struct player *player = session->player;
 	struct player_item *item;
 
-#ifdef _WIN32
-	WaitForSingleObject(player->mutex, INFINITE);
-#else
-	pthread_mutex_lock(&player->mutex);
-#endif
-
-
-	if((item = player->items) == NULL) {
-		player->items = malloc(sizeof(struct player_item));
-		item = player->items;
-	}
-	else {
-		while(item->next)
-			item = item->next;
+	item = malloc(sizeof(struct player_item));
+	if(item == NULL)
+		return -1;
 
-		item->next = malloc(sizeof(struct player_item));
-		item = item->next;
-	}
+	memstats_alloc(session, OPENSP_MEMORY_PLAYER, sizeof(struct player_item) + (data != NULL? len: 0));
 
 	item->type = type;
 	if(data != NULL) {
@@ -259,16 +276,19 @@ int player_push(sp_session *session, enum player_item_type type, void *data, siz
 	}
 
 	item->len = len;
-	item->next = NULL;
 
+	mpsc_push(&player->items, &item->node);
 
-	/* Signal the condition */
-	player->item_posted = 1;
+
+	/* Signal the condition, unless the player will notice item_posted anyway */
+	if(osfy_atomic_xchg_int(&player->item_posted, 1) != 0
+		|| !osfy_atomic_load_int(&player->parked))
+		return 0;
 
 #ifdef _WIN32
-	PulseEvent(player->cond);
-	ReleaseMutex(player->mutex);
+	SetEvent(player->cond);
 #else
+	pthread_mutex_lock(&player->mutex);
 	pthread_cond_signal(&player->cond);
 	pthread_mutex_unlock(&player->mutex);
 #endif
@@ -287,6 +307,7 @@ int player_push(sp_session *session, enum player_item_type type, void *data, siz
 static int player_schedule(sp_session *session) {
 	struct player *player = session->player;
 	struct player_item *item;
+	struct mpsc_node *node;
 	int num_processed_items;
 	int ret;
 #ifdef WIN32
@@ -304,7 +325,11 @@ static int player_schedule(sp_session *session) {
 #else
 	pthread_mutex_lock(&player->mutex);
 #endif
-	while(!player->item_posted) {
+	for(;;) {
+		/* Let player_push() know it needs to signal the condition */
+		osfy_atomic_store_int(&player->parked, 1);
+		if(osfy_atomic_load_int(&player->item_posted))
+			break;
 
 		if(!player->is_loaded || !player->is_playing || player->is_paused || player->pcm->len == 0) {
 			/*
@@ -357,6 +382,9 @@ static int player_schedule(sp_session *session) {
 		DSFYDEBUG("WAIT timed: Waiting until %dms (max), time now is %dms\n", player->pcm_next_timeout_ms, cur_ms);;
 		if(pthread_cond_timedwait(&player->cond, &player->mutex, &ts) != 0) {
 #endif
+			/* No need to signal while we're busy delivering */
+			osfy_atomic_store_int(&player->parked, 0);
+
 			if(player_deliver_pcm(session, 100)) {
 				/* FIXME: Is this really needed? */
 				DSFYDEBUG("WAIT timeout: Out of PCM-data, giving up\n");
@@ -379,20 +407,22 @@ static int player_schedule(sp_session *session) {
 	}
 
 
+	osfy_atomic_store_int(&player->parked, 0);
+#ifdef _WIN32
+	ReleaseMutex(player->mutex);
+#else
+	pthread_mutex_unlock(&player->mutex);
+#endif
+
+
 	/*
 	 * Handle any notifications sent to the player thread using player_push()
 	 *
 	 */
 	num_processed_items = 0;
-	player->item_posted = 0;
-	while((item = player->items) != NULL) {
-
-		player->items = item->next;
-#ifdef _WIN32
-		ReleaseMutex(player->mutex);
-#else
-		pthread_mutex_unlock(&player->mutex);
-#endif
+	osfy_atomic_store_int(&player->item_posted, 0);
+	while((node = mpsc_pop(&player->items)) != NULL) {
+		item = mpsc_entry(node, struct player_item, node);
 
 		/* Process request */
 		switch(item->type) {
@@ -410,7 +440,7 @@ static int player_schedule(sp_session *session) {
 
 			container = malloc(sizeof(sp_track *));
 			*container = player->track;
-			sp_track_add_ref(player->track); /* player_process_request() calls sp_track_release() */
+			sp_track_add_ref(player->track); /* Kept by player_process_request() until the next key */
 			request_post(session, REQ_TYPE_PLAYER_KEY, container);
 			break;
 
@@ -554,24 +584,15 @@ static int player_schedule(sp_session *session) {
 		}
 
 
+		memstats_free(session, OPENSP_MEMORY_PLAYER,
+				sizeof(struct player_item) + (item->data != NULL? item->len: 0));
+
 		if(item->data != NULL && item->len) /* Only free if len > 0 */
 			free(item->data);
 		free(item);
-
-#ifdef _WIN32
-		WaitForSingleObject(player->mutex, INFINITE);
-#else
-		pthread_mutex_lock(&player->mutex);
-#endif
 		num_processed_items++;
 	}
 
-#ifdef _WIN32
-	ReleaseMutex(player->mutex);
-#else
-	pthread_mutex_unlock(&player->mutex);
-#endif
-
 	return num_processed_items;
 }
 
@@ -892,6 +913,17 @@ static int player_deliver_pcm(sp_session *session, int ms) {
 }
 
 
+/* Count the Ogg and PCM buffers, which grow and shrink as a track plays */
+static void player_account(sp_session *session) {
+	struct player *player = session->player;
+	size_t size;
+
+	size = player->ogg->size + sizeof(struct buf) + player->pcm->size;
+	memstats_resize(session, OPENSP_MEMORY_PLAYER, player->buffer_size, size);
+	player->buffer_size = size;
+}
+
+
 /*
  * Update the counter according to the rbuf's current position
  *
@@ -923,11 +955,24 @@ int player_process_request(sp_session *session, struct request *req) {
 	struct player_substream_ctx *psc;
 
 	DSFYDEBUG("REQUEST: Got request %s\n", REQUEST_TYPE_STR(req->type));
+
+	/* Keys and substreams are sent on channels, parked until there's room for another */
+	if((req->type == REQ_TYPE_PLAYER_KEY || req->type == REQ_TYPE_PLAYER_SUBSTREAM)
+		&& !flowctl_admit(session, req))
+		return 0;
+
 	switch(req->type) {
 	case REQ_TYPE_PLAYER_KEY:
 		track = *(sp_track **)req->input;
                 ret = cmd_aeskey(session, track->file_id, track->id, player_aes_callback, session);
-		sp_track_release(track);
+
+		/* The reference is kept for player_reconnect() */
+		if(session->player->key_track)
+			sp_track_release(session->player->key_track);
+
+		session->player->key_track = track;
+		session->player->key_delivered = 0;
+
 		ret = request_set_result(session, req, ret? SP_ERROR_OTHER_PERMANENT: SP_ERROR_OK, NULL);
 		break;
 
@@ -942,10 +987,12 @@ int player_process_request(sp_session *session, struct request *req) {
 
 	case REQ_TYPE_PLAY_TOKEN_ACQUIRE:
 		ret = cmd_token_acquire(session);
+		session->player->has_token = (ret == 0);
 		ret += request_set_result(session, req, ret? SP_ERROR_OTHER_PERMANENT: SP_ERROR_OK, NULL);
 		break;
 
 	case REQ_TYPE_PLAY_TOKEN_LOST:
+		session->player->has_token = 0;
 		player_push(session, PLAYER_PAUSE, NULL, 0);
 		ret = request_set_result(session, req, SP_ERROR_OK, NULL);
 		break;
@@ -959,8 +1006,32 @@ int player_process_request(sp_session *session, struct request *req) {
 }
 
 
+/*
+ * After a reconnect, called by the iothread before the substreams are
+ * resumed: the play token and the key of the current file are tied to
+ * the connection they were requested on, so ask for them again
+ *
+ */
+int player_reconnect(sp_session *session) {
+	struct player *player = session->player;
+	sp_track *track = player->key_track;
+
+	if(player->has_token && cmd_token_acquire(session) != 0)
+		return -1;
+
+	if(track == NULL)
+		return 0;
+
+	DSFYDEBUG("Requesting the key again, it was %sdelivered\n", player->key_delivered? "": "not ");
+
+	return cmd_aeskey(session, track->file_id, track->id, player_rekey_callback, session);
+}
+
+
 /*
  * AES key channel callback, called in the context of iothread.c 
+ * Key channels aren't resumable, one that's lost along with the
+ * connection is requested again by player_reconnect().
  *
  */
 static int player_aes_callback(CHANNEL* ch, unsigned char* buf, unsigned short len) {
@@ -970,6 +1041,8 @@ static int player_aes_callback(CHANNEL* ch, unsigned char* buf, unsigned short l
 	if(ch->state != CHANNEL_DATA)
 		return 0;
 
+	session->player->key_delivered = 1;
+
 	container = malloc(len); /* Free'd by player_schedule() */
 	memcpy(container, buf, len);
 
@@ -977,6 +1050,17 @@ static int player_aes_callback(CHANNEL* ch, unsigned char* buf, unsigned short l
 }
 
 
+/* The key requested again by player_reconnect(), only passed on if the first one never was */
+static int player_rekey_callback(CHANNEL* ch, unsigned char* buf, unsigned short len) {
+	sp_session *session = (sp_session *)ch->private;
+
+	if(ch->state != CHANNEL_DATA || session->player->key_delivered)
+		return 0;
+
+	return player_aes_callback(ch, buf, len);
+}
+
+
 /*
  * GetSubStream channel callback, called in the context of iothread.c 
  *
@@ -13,6 +13,7 @@
 #include "aes.h"
 #include "buf.h"
 #include "channel.h"
+#include "mpsc.h"
 #include "rbuf.h"
 #include "request.h"
 
@@ -41,7 +42,15 @@ struct player_item {
 	void *data;
 	size_t len;
 
-	struct player_item *next;
+	struct mpsc_node node;
+};
+
+
+/* Input of REQ_TYPE_PLAYER_SUBSTREAM requests */
+struct player_substream_ctx {
+	sp_track *track;
+	int offset;
+	int length;
 };
 
 
@@ -49,7 +58,7 @@ struct player {
 #ifdef _WIN32
 	HANDLE thread;
 
-	/* Mutex protecting the action list */
+	/* Mutex used for parking the player thread */
 	HANDLE mutex;
 
 	/* Condition variables to signal the player there's work to do */
@@ -57,18 +66,19 @@ struct player {
 #else
 	pthread_t thread;
 
-	/* Mutex protecting the action list */
+	/* Mutex used for parking the player thread */
 	pthread_mutex_t mutex;
 
 	/* Condition variables to signal the player there's work to do */
 	pthread_cond_t cond;
 #endif
 
-	int item_posted;
+	int item_posted;	/* Set by player_push(), cleared by player_schedule() */
+	int parked;		/* Set while the player thread waits on the condition */
 	int is_recursive;	/* Only set when scheduling from player_ov_read() */
 
-	/* List of things to do */
-	struct player_item *items;
+	/* Lock-free FIFO of things to do */
+	struct mpsc_queue items;
 
 	int is_loaded;		/* The player is initialized and ready for playback */
 	int is_eof;		/* No more .ogg data can be fetched */
@@ -93,6 +103,15 @@ struct player {
 	unsigned char *key;
 	sp_track *track;
 
+	/*
+	 * Kept by the iothread to ask for the play token and the key
+	 * again after a reconnect, before substreams are resumed
+	 *
+	 */
+	sp_track *key_track;	/* Track whose key was last requested */
+	int key_delivered;	/* Set once that key was passed to the player */
+	int has_token;		/* The play token was acquired and not lost */
+
 
 	/* Ogg/Vorbis data to decode */
 	struct rbuf *ogg;
@@ -102,6 +121,9 @@ struct player {
 	struct buf *pcm;
 	int pcm_next_timeout_ms;
 	sp_audioformat audioformat;
+
+	/* Bytes of the buffers last counted by player_account() */
+	size_t buffer_size;
 };
 
 
@@ -109,4 +131,5 @@ int player_init(sp_session *session);
 void player_free(sp_session *session);
 int player_push(sp_session *session, enum player_item_type type, void *data, size_t len);
 int player_process_request(sp_session *session, struct request *req);
+int player_reconnect(sp_session *session);
 #endif
@@ -59,6 +59,8 @@
 #include "commands.h"
 #include "debug.h"
 #include "ezxml.h"
+#include "flowctl.h"
+#include "memstats.h"
 #include "playlist.h"
 #include "request.h"
 #include "sp_opaque.h"
@@ -78,6 +80,7 @@ static int playlist_callback(CHANNEL *ch, unsigned char *payload, unsigned short
 static int playlist_parse_xml(sp_session *session, sp_playlist *playlist);
 
 static int osfy_playlist_browse(sp_session *session, sp_playlist *playlist);
+static int osfy_playlist_browse_element(struct browse_callback_ctx *brctx, void *element);
 static int osfy_playlist_browse_callback(struct browse_callback_ctx *brctx);
 
 
@@ -104,6 +107,10 @@ int playlist_process(sp_session *session, struct request *req) {
 	 * If there's an error the channel callback will reset the timeout
 	 *
 	 */
+	/* Parked until there's room for another channel */
+	if(!flowctl_admit(session, req))
+		return 0;
+
 	req->next_timeout = INT_MAX;
 	if(req->type == REQ_TYPE_PC_LOAD) {
 		/* Send request (CMD_GETPLAYLIST) to load playlist container */
@@ -217,10 +224,10 @@ static int playlistcontainer_callback(CHANNEL *ch, unsigned char *payload, unsig
 
 	case CHANNEL_ERROR:
 		DSFYDEBUG("Error on channel '%s' (playlist container), will retry request in %dms\n",
-			ch->name, PLAYLIST_RETRY_TIMEOUT*1000);
+			CHANNEL_NAME(ch), PLAYLIST_RETRY_TIMEOUT*1000);
 
 		/* Reset timeout so the request can be retried */
-		callback_ctx->req->next_timeout = get_millisecs() + PLAYLIST_RETRY_TIMEOUT*1000;
+		request_set_timeout(callback_ctx->session, callback_ctx->req, channel_retry_timeout(ch, PLAYLIST_RETRY_TIMEOUT*1000));
 
 		buf_free(callback_ctx->session->playlistcontainer->buf);
 		callback_ctx->session->playlistcontainer->buf = NULL;
@@ -312,6 +319,8 @@ sp_playlist *playlist_create(sp_session *session, unsigned char id[17]) {
 	playlist = (sp_playlist *)malloc(sizeof(sp_playlist));
 	if(playlist == NULL)
 		return playlist;
+
+	memstats_alloc(session, OPENSP_MEMORY_PLAYLISTS, sizeof(sp_playlist));
 	
 	memcpy(playlist->id, id, sizeof(playlist->id));
 
@@ -363,6 +372,9 @@ void playlist_release(sp_session *session, sp_playlist *playlist) {
 	if(playlist->callbacks)
 		free(playlist->callbacks);
 	
+	memstats_free(session, OPENSP_MEMORY_PLAYLISTS,
+			sizeof(sp_playlist) + playlist->num_tracks * sizeof(sp_track *));
+
 	free(playlist);
 }
 
@@ -463,10 +475,10 @@ static int playlist_callback(CHANNEL *ch, unsigned char *payload, unsigned short
 
 	case CHANNEL_ERROR:
 		DSFYDEBUG("Error on channel '%s' (playlist), will retry request in %dms\n",
-			ch->name, PLAYLIST_RETRY_TIMEOUT*1000);
+			CHANNEL_NAME(ch), PLAYLIST_RETRY_TIMEOUT*1000);
 
 		/* Reset timeout so the request is retried */
-		callback_ctx->req->next_timeout = get_millisecs() + PLAYLIST_RETRY_TIMEOUT*1000;
+		request_set_timeout(callback_ctx->session, callback_ctx->req, channel_retry_timeout(ch, PLAYLIST_RETRY_TIMEOUT*1000));
 
 		buf_free(playlist->buf);
 		playlist->buf = NULL;
@@ -513,6 +525,7 @@ static int playlist_parse_xml(sp_session *session, sp_playlist *playlist) {
 	unsigned char track_id[16];
 	ezxml_t root, node;
 	sp_track *track;
+	int num_tracks;
 
 	buf_append_data(playlist->buf, end_element, strlen(end_element));
 #ifdef DEBUG
@@ -548,6 +561,7 @@ static int playlist_parse_xml(sp_session *session, sp_playlist *playlist) {
 	node = ezxml_get(root, "next-change", 0, "change", 0, "ops", 0, "add", 0, "items", -1);
 	if(node) {
 		id_list = node->txt;
+		num_tracks = playlist->num_tracks;
 		for(idstr = strtok(id_list, ",\n"); idstr; idstr = strtok(NULL, ",\n")) {
 			hex_ascii_to_bytes(idstr, track_id, sizeof(track_id));
 			track = osfy_track_add(session, track_id);
@@ -555,13 +569,17 @@ static int playlist_parse_xml(sp_session *session, sp_playlist *playlist) {
 			playlist->tracks = (sp_track **)realloc(playlist->tracks, (playlist->num_tracks + 1) * sizeof(sp_track *));
 			playlist->tracks[playlist->num_tracks] = track;
 			playlist->num_tracks++;
-
-			sp_track_add_ref(track);
 		}
+
+		memstats_resize(session, OPENSP_MEMORY_PLAYLISTS,
+				num_tracks * sizeof(sp_track *), playlist->num_tracks * sizeof(sp_track *));
 	}
 	
 	node = ezxml_get(root, "next-change", 0, "change", 0, "user", -1);
 	if(node) {
+		if(playlist->owner)
+			user_release(playlist->owner);
+
 		playlist->owner = user_add(session, node->txt);
 		if(!sp_user_is_loaded(playlist->owner)) {
 			DSFYDEBUG("Playlist owner '%s' is a not-yet loaded user, requesting details\n", node->txt);
@@ -627,11 +645,21 @@ int osfy_playlist_browse(sp_session *session, sp_playlist *playlist) {
 	brctx->data.playlist = playlist;
 	brctx->num_total = playlist->num_tracks;
 	brctx->num_browsed = 0;
+	brctx->offset = 0;
 	brctx->num_in_request = 0;
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->retry = NULL;
+	brctx->waiters = NULL;
+	brctx->num_waiters = 0;
+	brctx->error = SP_ERROR_OK;
 	
 	
 	/* Our gzip'd XML parser */
 	brctx->browse_parser = osfy_playlist_browse_callback;
+	brctx->browse_element = "track";
+	brctx->browse_element_decoder = osfy_track_xml_decode;
+	brctx->browse_element_parser = osfy_playlist_browse_element;
 	
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -641,110 +669,85 @@ int osfy_playlist_browse(sp_session *session, sp_playlist *playlist) {
 }
 
 
-static int osfy_playlist_browse_callback(struct browse_callback_ctx *brctx) {
-	int i;
-	struct buf *xml;
+/* Load the track(s) of a <track> element as soon as it's been received */
+static int osfy_playlist_browse_element(struct browse_callback_ctx *brctx, void *element) {
+	struct track_xml *tx = (struct track_xml *)element;
 	unsigned char id[16];
-	ezxml_t root, track_node, node;
 	sp_track *track;
+	int i;
 	
+
+	/* Get ID of track */
+	hex_ascii_to_bytes(tx->id, id, 16);
 	
-	/* Decompress the XML returned by track browsing */
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-#ifdef DEBUG
-	{
-		FILE *fd;
-		char buf[35];
-		char filename[100];
-
-		hex_bytes_to_ascii(brctx->data.playlist->id, buf, 17);
-		sprintf(filename, "browse-playlist-%s-%d-%d.xml", buf, brctx->num_browsed, brctx->num_in_request);
-		DSFYDEBUG("Decompresed %d bytes data for playlist '%s', xml=%p, saving raw XML to %s\n",
-			  brctx->buf->len, buf, xml, filename);
-		fd = fopen(filename, "w");
-		if(fd) {
-			(void)fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
-	}
-#endif
+	/* We'll simply use ofsy_track_add() to find a track by its ID */
+	track = osfy_track_add(brctx->session, id);
 	
-
-	/* Load XML */
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+	/* Skip loading of already loaded tracks */
+	if(!sp_track_is_loaded(track)) {
+		/* Load the track from XML */
+		osfy_track_load_from_track_xml(brctx->session, track, tx);
 	}
-	
 
-	/* Loop over each track in the list */
-	for(i = 1, track_node = ezxml_get(root, "tracks", 0, "track", -1);
-	    track_node;
-	    track_node = track_node->next, i++) {
-		
-		/* Get ID of track */
-		node = ezxml_get(track_node, "id", -1);
-		hex_ascii_to_bytes(node->txt, id, 16);
-		
+	sp_track_release(track);
+
+
+	/*
+	 * FIXME:
+	 * A request for track with id X might return a different track
+	 * (i.e, the 'id' element differs from the id of the track requested)
+	 * with one of the 'redirect' elements set to the requested track's id.
+	 *
+	 * Below is an example where track with id '3c1919e237ca4f2c9b5fc686b7a6f6c3'
+	 * was browsed but a different track returned (a5a43c74af924171a50f0668aee36b43)
+	 * '3c1919e237ca4f2c9b5fc686b7a6f6c3' appears in the redirect element.
+	 *
+	 * <id>a5a43c74af924171a50f0668aee36b43</id>
+	 * <redirect>3c1919e237ca4f2c9b5fc686b7a6f6c3</redirect>
+	 * <redirect>93934b1df8984c6586a63d18cd6ecfa6</redirect>
+	 * <redirect>2e0d3f5a98014c40932a014b2a9eca69</redirect>
+	 * <title>Insane in the Brain</title>
+	 * <artist-id>9e74e7856a07496190ef2180d26003db</artist-id>
+	 * <artist>Cypress Hill</artist>
+	 * <album>Black Sunday</album>
+	 * <album-id>c3711d81999b48529903bf708b8192da</album-id>
+	 * <album-artist>Cypress Hill</album-artist>
+	 * <album-artist-id>9e74e7856a07496190ef2180d26003db</album-artist-id>
+	 * <year>1993</year>
+	 * <track-number>3</track-number>
+	 *
+	 */
+	for(i = 0; i < tx->num_redirects; i++) {
+		hex_ascii_to_bytes(tx->redirects[i], id, 16);
+	
 		/* We'll simply use ofsy_track_add() to find a track by its ID */
 		track = osfy_track_add(brctx->session, id);
-		
+	
 		/* Skip loading of already loaded tracks */
 		if(!sp_track_is_loaded(track)) {
 			/* Load the track from XML */
-			osfy_track_load_from_xml(brctx->session, track, track_node);
+			osfy_track_load_from_track_xml(brctx->session, track, tx);
 		}
 
-
-		/*
-		 * FIXME:
-		 * A request for track with id X might return a different track
-		 * (i.e, the 'id' element differs from the id of the track requested)
-		 * with one of the 'redirect' elements set to the requested track's id.
-		 *
-		 * Below is an example where track with id '3c1919e237ca4f2c9b5fc686b7a6f6c3'
-		 * was browsed but a different track returned (a5a43c74af924171a50f0668aee36b43)
-		 * '3c1919e237ca4f2c9b5fc686b7a6f6c3' appears in the redirect element.
-		 *
-		 * <id>a5a43c74af924171a50f0668aee36b43</id>
-		 * <redirect>3c1919e237ca4f2c9b5fc686b7a6f6c3</redirect>
-		 * <redirect>93934b1df8984c6586a63d18cd6ecfa6</redirect>
-		 * <redirect>2e0d3f5a98014c40932a014b2a9eca69</redirect>
-		 * <title>Insane in the Brain</title>
-		 * <artist-id>9e74e7856a07496190ef2180d26003db</artist-id>
-		 * <artist>Cypress Hill</artist>
-		 * <album>Black Sunday</album>
-		 * <album-id>c3711d81999b48529903bf708b8192da</album-id>
-		 * <album-artist>Cypress Hill</album-artist>
-		 * <album-artist-id>9e74e7856a07496190ef2180d26003db</album-artist-id>
-		 * <year>1993</year>
-		 * <track-number>3</track-number>
-		 *
-		 */
-		for(node = ezxml_get(track_node, "redirect", -1); node; node = node->next) {
-			hex_ascii_to_bytes(node->txt, id, 16);
-		
-			/* We'll simply use ofsy_track_add() to find a track by its ID */
-			track = osfy_track_add(brctx->session, id);
-		
-			/* Skip loading of already loaded tracks */
-			if(!sp_track_is_loaded(track)) {
-				/* Load the track from XML */
-				osfy_track_load_from_xml(brctx->session, track, track_node);
-			}
-		}
+		sp_track_release(track);
 	}
 
-	/* Free XML structures and buffer */
-	ezxml_free(root);
-	buf_free(xml);
+	return 0;
+}
+
+
+/* Called once all tracks in a chunk have been received */
+static int osfy_playlist_browse_callback(struct browse_callback_ctx *brctx) {
+	int i;
+	
+	
+	if(brctx->buf == NULL)
+		DSFYDEBUG("No playlist track XML, the tracks were loaded already or it failed to decompress\n");
 
 	
 	/* Release references made in osfy_playlist_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_track_release(brctx->data.playlist->tracks[brctx->num_browsed + i]);
+		sp_track_release(brctx->data.playlist->tracks[brctx->offset + i]);
 	
 	
 	return 0;
@@ -0,0 +1,137 @@
+/*
+ * Slab allocator for objects of a fixed size
+ *
+ * A free object's first bytes link it into the free list, so the pool
+ * needs no memory besides the slabs. The slabs are never given back
+ * before the pool is freed, a session that once held many tracks keeps
+ * the memory for the tracks it loads next.
+ *
+ */
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "pool.h"
+
+
+#define POOL_ROUND(n)	(((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+
+static void pool_grow(struct pool *pool);
+static void pool_lock(struct pool *pool);
+static void pool_unlock(struct pool *pool);
+
+
+void pool_init(struct pool *pool, size_t size) {
+	pool->size = POOL_ROUND(size);
+	pool->num_per_slab = (int)((POOL_SLAB_SIZE - POOL_ROUND(sizeof(struct pool_slab))) / pool->size);
+	if(pool->num_per_slab < 1)
+		pool->num_per_slab = 1;
+
+	pool->slabs = NULL;
+	pool->free_list = NULL;
+
+	pool->num_slabs = 0;
+	pool->num_used = 0;
+
+#ifdef _WIN32
+	pool->mutex = CreateMutex(NULL, FALSE, NULL);
+#else
+	pthread_mutex_init(&pool->mutex, NULL);
+#endif
+}
+
+
+/* Free the slabs, along with any objects still allocated from them */
+void pool_free(struct pool *pool) {
+	struct pool_slab *slab;
+
+	while((slab = pool->slabs) != NULL) {
+		pool->slabs = slab->next;
+		free(slab);
+	}
+
+	pool->free_list = NULL;
+	pool->num_slabs = 0;
+	pool->num_used = 0;
+
+#ifdef _WIN32
+	CloseHandle(pool->mutex);
+#else
+	pthread_mutex_destroy(&pool->mutex);
+#endif
+}
+
+
+/* Get an object, NULL if memory is out */
+void *pool_get(struct pool *pool) {
+	void *object;
+
+	pool_lock(pool);
+	if(pool->free_list == NULL)
+		pool_grow(pool);
+
+	if((object = pool->free_list) != NULL) {
+		pool->free_list = *(void **)object;
+		pool->num_used++;
+	}
+
+	pool_unlock(pool);
+
+	return object;
+}
+
+
+void pool_put(struct pool *pool, void *object) {
+	pool_lock(pool);
+	*(void **)object = pool->free_list;
+	pool->free_list = object;
+	pool->num_used--;
+	pool_unlock(pool);
+}
+
+
+/* Add a slab's worth of objects to the free list, called with the mutex held */
+static void pool_grow(struct pool *pool) {
+	struct pool_slab *slab;
+	char *object;
+	int i;
+
+	slab = malloc(POOL_ROUND(sizeof(struct pool_slab)) + pool->num_per_slab * pool->size);
+	if(slab == NULL)
+		return;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	pool->num_slabs++;
+
+	/* Link them back to front, so they're handed out in address order */
+	object = (char *)slab + POOL_ROUND(sizeof(struct pool_slab)) + pool->num_per_slab * pool->size;
+	for(i = 0; i < pool->num_per_slab; i++) {
+		object -= pool->size;
+		*(void **)object = pool->free_list;
+		pool->free_list = object;
+	}
+}
+
+
+static void pool_lock(struct pool *pool) {
+#ifdef _WIN32
+	WaitForSingleObject(pool->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+
+static void pool_unlock(struct pool *pool) {
+#ifdef _WIN32
+	ReleaseMutex(pool->mutex);
+#else
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+}
@@ -0,0 +1,55 @@
+#ifndef LIBOPENSPOTIFY_POOL_H
+#define LIBOPENSPOTIFY_POOL_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+
+/* Bytes allocated at once by a pool, room for a few dozen objects or more */
+#define POOL_SLAB_SIZE		(16 * 1024)
+
+/* Objects are rounded up to a multiple of this */
+#define POOL_ALIGN		16
+
+
+/* A block of objects, followed by the objects themselves */
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+
+/*
+ * Objects of one size carved out of larger slabs, so creating thousands
+ * of tracks doesn't take a malloc() each. Freed objects are kept for
+ * the next allocation, slabs are only freed along with the pool.
+ * Objects may be allocated and freed by any thread.
+ *
+ */
+struct pool {
+	size_t size;
+	int num_per_slab;
+
+	struct pool_slab *slabs;
+	void *free_list;
+
+	int num_slabs;
+	int num_used;
+
+#ifdef _WIN32
+	HANDLE mutex;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+
+void pool_init(struct pool *pool, size_t size);
+void pool_free(struct pool *pool);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *object);
+
+#endif
@@ -27,6 +27,7 @@ void *rbuf_new(void) {
 
 	b->n_regions = START_SIZE / CHUNK_SIZE;
 	b->regions = (struct region **)calloc(b->n_regions, sizeof(struct region *));
+	b->size = sizeof(struct rbuf) + b->n_regions * sizeof(struct region *);
 
 	return b;
 }
@@ -115,6 +116,7 @@ void rbuf_write(struct rbuf *b, void *data, size_t len) {
 		n = b->write_offset / CHUNK_SIZE;
 		if(n >= b->n_regions) {
 			b->regions = realloc(b->regions, sizeof(struct region *) * (n + 1));
+			b->size += (n + 1 - b->n_regions) * sizeof(struct region *);
 			while(b->n_regions <= n) {
 				b->regions[b->n_regions++] = NULL;
 				assert(b->regions[b->n_regions - 1] == NULL);
@@ -125,6 +127,8 @@ void rbuf_write(struct rbuf *b, void *data, size_t len) {
 		if((reg = b->regions[n]) == NULL) {
 			b->regions[n] = reg = malloc(sizeof(struct region) + CHUNK_SIZE);
 			reg->len = 0;
+
+			b->size += sizeof(struct region) + CHUNK_SIZE;
 		}
 
 		/* Figure out where to write */
@@ -10,6 +10,9 @@ struct rbuf {
 	size_t write_offset;
 	unsigned int n_regions;
 	struct region **regions;
+
+	/* Bytes allocated for the buffer */
+	size_t size;
 };
 
 
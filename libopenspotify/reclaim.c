@@ -0,0 +1,168 @@
+/*
+ * Deferred freeing of albums, artists, tracks and users
+ *
+ * Lookups take their reference while holding the hashtable's mutex,
+ * see reclaim_find(). The garbage collector retires an object by
+ * swapping its reference count from zero to RECLAIM_DEAD and removing it
+ * from its hashtable while holding the same mutex, so a lookup either
+ * references the object first or doesn't find it at all.
+ *
+ * Nothing else may reach an object without holding a reference. Lookups
+ * must go through reclaim_find(), never hashtable_find(). Objects,
+ * requests and threads keeping a pointer hold a reference of their own,
+ * and an object is only referenced again by code that already holds a
+ * reference to it, or to an object that does. A retired object can
+ * therefore never be referenced again, and is freed by the garbage
+ * collector's next step.
+ *
+ */
+
+#include <stdlib.h>
+
+#include <libspotify/api.h>
+
+#include "debug.h"
+#include "hashtable.h"
+#include "reclaim.h"
+#include "sp_opaque.h"
+
+
+/* What reclaim_retire() needs to know about the table being swept */
+struct reclaim_sweep {
+	struct reclaim *reclaim;
+	size_t ref_offset;
+	reclaim_cb callback;
+};
+
+
+static void reclaim_ref(void *object, void *arg);
+static int reclaim_retire(void *object, void *arg);
+static int reclaim_kill(refcount_t *ref_count);
+
+
+void reclaim_init(sp_session *session) {
+	session->reclaim.head = NULL;
+	session->reclaim.tail = NULL;
+	session->reclaim.num_entries = 0;
+
+	session->reclaim.num_retired = 0;
+	session->reclaim.num_freed = 0;
+}
+
+
+/* Free all retired objects, called by sp_session_release() once the threads are gone */
+void reclaim_free(sp_session *session) {
+	struct reclaim_entry *entry;
+
+	while((entry = session->reclaim.head) != NULL) {
+		session->reclaim.head = entry->next;
+
+		entry->callback(session, entry->object);
+		free(entry);
+	}
+
+	session->reclaim.tail = NULL;
+	session->reclaim.num_entries = 0;
+}
+
+
+/*
+ * Free up to max_objects of the retired objects, returns 1 once none
+ * are left. Called by the iothread.
+ *
+ */
+int reclaim_process(sp_session *session, int max_objects) {
+	struct reclaim *reclaim = &session->reclaim;
+	struct reclaim_entry *entry;
+
+	for(; max_objects && (entry = reclaim->head) != NULL; max_objects--) {
+		reclaim->head = entry->next;
+		if(reclaim->head == NULL)
+			reclaim->tail = NULL;
+
+		reclaim->num_entries--;
+
+		entry->callback(session, entry->object);
+		reclaim->num_freed++;
+
+		free(entry);
+	}
+
+	return reclaim->head == NULL;
+}
+
+
+/*
+ * Find an object and take a reference to it, the reference count
+ * being at ref_offset in the object. Returns NULL if there's none.
+ *
+ */
+void *reclaim_find(struct hashtable *hashtable, const void *key, size_t ref_offset) {
+
+	return hashtable_find_with(hashtable, key, reclaim_ref, &ref_offset);
+}
+
+
+/*
+ * Retire the unreferenced objects in up to num_slots slots of a hashtable,
+ * the reference count being at ref_offset in each. Returns 1 once the
+ * whole table was swept. Called by the iothread.
+ *
+ */
+int reclaim_sweep(sp_session *session, struct hashtable *hashtable, unsigned int *cursor, unsigned int num_slots,
+			size_t ref_offset, reclaim_cb callback) {
+	struct reclaim_sweep sweep;
+
+	sweep.reclaim = &session->reclaim;
+	sweep.ref_offset = ref_offset;
+	sweep.callback = callback;
+
+	return hashtable_sweep(hashtable, cursor, num_slots, reclaim_retire, &sweep);
+}
+
+
+static void reclaim_ref(void *object, void *arg) {
+	refcount_t *ref_count = (refcount_t *)((char *)object + *(size_t *)arg);
+
+	REFCOUNT_INC(ref_count);
+}
+
+
+/* Mark an unreferenced object as dead and queue it, fails if it's referenced */
+static int reclaim_retire(void *object, void *arg) {
+	struct reclaim_sweep *sweep = arg;
+	struct reclaim *reclaim = sweep->reclaim;
+	refcount_t *ref_count = (refcount_t *)((char *)object + sweep->ref_offset);
+	struct reclaim_entry *retired;
+
+	if(!reclaim_kill(ref_count))
+		return 0;
+
+	retired = malloc(sizeof(struct reclaim_entry));
+	retired->object = object;
+	retired->callback = sweep->callback;
+	retired->next = NULL;
+
+	if(reclaim->tail != NULL)
+		reclaim->tail->next = retired;
+	else
+		reclaim->head = retired;
+
+	reclaim->tail = retired;
+	reclaim->num_entries++;
+	reclaim->num_retired++;
+
+	return 1;
+}
+
+
+/* Swap the count of an unreferenced object to RECLAIM_DEAD, fails if it's referenced */
+static int reclaim_kill(refcount_t *ref_count) {
+#ifdef _WIN32
+	return InterlockedCompareExchange(ref_count, RECLAIM_DEAD, 0) == 0;
+#else
+	int expected = 0;
+
+	return atomic_compare_exchange_strong(ref_count, &expected, RECLAIM_DEAD);
+#endif
+}
@@ -0,0 +1,80 @@
+#ifndef LIBOPENSPOTIFY_RECLAIM_H
+#define LIBOPENSPOTIFY_RECLAIM_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdatomic.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "hashtable.h"
+
+
+/*
+ * Reference counts of objects found through the session's hashtables,
+ * shared by the main thread, the iothread, the decoder threads and the
+ * player thread
+ *
+ */
+#ifdef _WIN32
+typedef volatile LONG refcount_t;
+
+#define REFCOUNT_INIT(r, n)	(*(r) = (n))
+#define REFCOUNT_GET(r)		InterlockedCompareExchange((r), 0, 0)
+#define REFCOUNT_INC(r)		((void)InterlockedIncrement(r))
+#define REFCOUNT_DEC(r)		InterlockedDecrement(r)
+#else
+typedef atomic_int refcount_t;
+
+#define REFCOUNT_INIT(r, n)	atomic_init((r), (n))
+#define REFCOUNT_GET(r)		atomic_load(r)
+#define REFCOUNT_INC(r)		((void)atomic_fetch_add((r), 1))
+#define REFCOUNT_DEC(r)		(atomic_fetch_sub((r), 1) - 1)
+#endif
+
+/* The reference count of an object the garbage collector has retired, see reclaim.c */
+#define RECLAIM_DEAD		0x40000000
+
+
+/* Frees an object retired by the garbage collector */
+typedef void (*reclaim_cb)(sp_session *session, void *object);
+
+struct reclaim_entry {
+	void *object;
+	reclaim_cb callback;
+
+	struct reclaim_entry *next;
+};
+
+
+/*
+ * Objects are never freed when their last reference is released, as
+ * another thread may be about to find them in a hashtable. The garbage
+ * collector retires unreferenced objects and removes them from their
+ * hashtable, and frees them in its next step, outside the table's lock.
+ * Only used by the iothread.
+ *
+ */
+struct reclaim {
+	/* Oldest first */
+	struct reclaim_entry *head;
+	struct reclaim_entry *tail;
+	int num_entries;
+
+	/* Objects retired and freed */
+	unsigned int num_retired;
+	unsigned int num_freed;
+};
+
+
+void reclaim_init(sp_session *session);
+void reclaim_free(sp_session *session);
+int reclaim_process(sp_session *session, int max_objects);
+void *reclaim_find(struct hashtable *hashtable, const void *key, size_t ref_offset);
+int reclaim_sweep(sp_session *session, struct hashtable *hashtable, unsigned int *cursor, unsigned int num_slots,
+			size_t ref_offset, reclaim_cb callback);
+
+#endif
@@ -4,7 +4,9 @@
  *
  */
 
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include "sp_opaque.h"
 #ifdef _WIN32
 #include <windows.h>
@@ -15,54 +17,125 @@
 
 #include <libspotify/api.h>
 
+#include "atomic.h"
 #include "debug.h"
+#include "ioloop.h"
+#include "memstats.h"
+#include "mpsc.h"
 #include "request.h"
 #include "util.h"
 
 
-static void request_notify_main_thread(sp_session *session, struct request *request);
+/*
+ * A lane that has requests ready is served at least once every this
+ * many requests, even if higher lanes have more to do
+ *
+ */
+static const int request_lane_reserve[REQ_PRIO_NUM] = { 0, 4, 8 };
+
+
+static request_priority request_type_priority(request_type type);
+static int request_lane_is_ready(struct request_scheduler *sched, int lane);
+static void request_notify_main_thread(sp_session *session, request_type type, void *output);
+static void request_queue_append(struct request_queue *queue, struct request *req);
+static struct request *request_queue_shift(struct request_queue *queue);
+static void request_queue_remove(struct request_queue *queue, struct request *req);
+static int request_heap_push(struct request_scheduler *sched, struct request *req);
+static void request_heap_remove(struct request_scheduler *sched, struct request *req);
+static void request_heap_sift_up(struct request_scheduler *sched, int i);
+static void request_heap_sift_down(struct request_scheduler *sched, int i);
+static void request_schedule(sp_session *session, struct request *req);
+static void request_unlink(sp_session *session, struct request *req);
+static void request_return(sp_session *session, struct request *req);
+static void request_free(sp_session *session, struct request *req);
+
+
+/*
+ * Setup the request queues, called by sp_session_init()
+ * before the iothread is started
+ *
+ */
+void request_scheduler_init(sp_session *session) {
+	struct request_scheduler *sched = &session->requests;
+
+	memset(sched, 0, sizeof(struct request_scheduler));
+	mpsc_init(&sched->incoming);
+	mpsc_init(&sched->results);
+	mpsc_init(&sched->processed);
+	sched->next_deadline = INT_MAX;
+}
+
+
+/*
+ * Free all requests still known to the scheduler
+ * The iothread must have been terminated before calling this
+ *
+ */
+void request_scheduler_free(sp_session *session) {
+	struct request_scheduler *sched = &session->requests;
+	struct mpsc_queue *queues[3];
+	struct mpsc_node *node;
+	struct request *req;
+	int i;
+
+	queues[0] = &sched->incoming;
+	queues[1] = &sched->results;
+	queues[2] = &sched->processed;
+	for(i = 0; i < 3; i++) {
+		while((node = mpsc_pop(queues[i])) != NULL)
+			request_free(session, mpsc_entry(node, struct request, node));
+	}
+
+	for(i = 0; i < REQ_PRIO_NUM; i++) {
+		while((req = request_queue_shift(&sched->ready[i])) != NULL)
+			request_free(session, req);
+
+		while((req = request_queue_shift(&sched->blocked[i])) != NULL)
+			request_free(session, req);
+	}
+
+	for(i = 0; i < sched->heap_len; i++)
+		request_free(session, sched->heap[i]);
+
+	if(sched->heap)
+		free(sched->heap);
+
+	sched->heap = NULL;
+	sched->heap_len = sched->heap_size = 0;
+}
 
 
 /*
  * Post a new request to be processed by the networking thread
  * If input is non-NULL, it will be free'd at the end of the request
  *
+ * May be called from any thread
+ *
  */
 int request_post(sp_session *session, request_type type, void *input) {
 	struct request *req;
 
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
+	req = malloc(sizeof(struct request));
+	if(req == NULL)
+		return -1;
 
-	if(session->requests == NULL) {
-		req = session->requests = malloc(sizeof(struct request));
-	}
-	else {
-		for(req = session->requests; req->next; req = req->next);
-		req->next = malloc(sizeof(struct request));
-		req = req->next;
-	}
+	memstats_alloc(session, OPENSP_MEMORY_REQUESTS, sizeof(struct request));
 
 	req->type = type;
 	req->state = REQ_STATE_NEW;
+	req->priority = request_type_priority(type);
 	req->error = 0;
 	req->input = input;
 	req->output = NULL;
-	req->next = NULL;
 	req->next_timeout = 0;
+	req->queue = REQ_QUEUE_INCOMING;
+	req->heap_index = -1;
+	req->next = NULL;
+
+	mpsc_push(&session->requests.incoming, &req->node);
 
-#ifdef _WIN32
-	/* Notify the network thread if it's waiting for something to do */
-	PulseEvent(session->idle_wakeup);
-	ReleaseMutex(session->request_mutex);
-#else
 	/* Notify the network thread if it's waiting for something to do */
-	pthread_cond_signal(&session->idle_wakeup);
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+	ioloop_wakeup(session);
 
 	return 0;
 }
@@ -79,40 +152,30 @@ int request_post(sp_session *session, request_type type, void *input) {
 int request_post_result(sp_session *session, request_type type, sp_error error, void *output) {
 	struct request *req;
 
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
+	req = malloc(sizeof(struct request));
+	if(req == NULL)
+		return -1;
 
-	if(session->requests == NULL) {
-		req = session->requests = malloc(sizeof(struct request));
-	}
-	else {
-		for(req = session->requests; req->next; req = req->next);
-		req->next = malloc(sizeof(struct request));
-		req = req->next;
-	}
+	memstats_alloc(session, OPENSP_MEMORY_REQUESTS, sizeof(struct request));
 
 	req->type = type;
 	req->state = REQ_STATE_RETURNED;
+	req->priority = request_type_priority(type);
 	req->error = error;
 	req->input = NULL;
 	req->output = output;
-	req->next = NULL;
 	req->next_timeout = 0;
+	req->queue = REQ_QUEUE_RESULTS;
+	req->heap_index = -1;
+	req->next = NULL;
 
 	DSFYDEBUG("Posted results for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
 		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
 		req->error, req->output);
 
-	request_notify_main_thread(session, req);
-
-#ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
-#else
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+	/* Pushed before notifying, and the main thread may free it as soon as it is */
+	mpsc_push(&session->requests.results, &req->node);
+	request_notify_main_thread(session, type, output);
 
 	return 0;
 }
@@ -125,37 +188,283 @@ int request_post_result(sp_session *session, request_type type, sp_error error,
  *
  */
 int request_set_result(sp_session *session, struct request *req, sp_error error, void *output) {
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
+	/* Already handed over to the main thread */
+	if(req->queue == REQ_QUEUE_RESULTS || req->queue == REQ_QUEUE_PROCESSED) {
+		DSFYDEBUG("BUG: Request <type %s, state %s, input %p> returned twice\n",
+			REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
+		return 0;
+	}
 
 	req->error = error;
 	req->output = output;
 	req->state = REQ_STATE_RETURNED;
-	
+
 	DSFYDEBUG("Returned results for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
 		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
 		req->error, req->output);
-	request_notify_main_thread(session, req);
 
-#ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
-#else
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+	/* Requests being processed are handed over by request_reschedule() */
+	if(req->queue == REQ_QUEUE_BUSY)
+		return 0;
+
+	request_unlink(session, req);
+	request_return(session, req);
 
 	return 0;
 }
 
 
-/* For selecting which requests we should notify the main thread about */
-static void request_notify_main_thread(sp_session *session, struct request *request) {
+/*
+ * Change when a request should be processed next
+ * Used by channel callbacks to retry or resume a request
+ * that's waiting for data with next_timeout set to INT_MAX
+ *
+ */
+void request_set_timeout(sp_session *session, struct request *req, int next_timeout) {
+	switch(req->queue) {
+	case REQ_QUEUE_NONE:
+	case REQ_QUEUE_TIMER:
+	case REQ_QUEUE_BLOCKED:
+		request_unlink(session, req);
+		req->next_timeout = next_timeout;
+		request_schedule(session, req);
+		break;
+
+	default:
+		/*
+		 * Ready requests are checked against next_timeout again
+		 * by request_fetch_expired() and busy ones are rescheduled
+		 * by request_reschedule()
+		 *
+		 */
+		req->next_timeout = next_timeout;
+		break;
+	}
+}
+
 
-	switch(request->type) {
+/*
+ * Start a new round of request processing in the iothread
+ * Newly posted requests and those whose timeout has expired are
+ * moved to the ready queue of their lane. Requests scheduled as ready
+ * after this call won't be returned by request_fetch_expired() until
+ * the next round, so a request that keeps its timeout in the past
+ * can't starve the network
+ *
+ */
+void request_begin_pass(sp_session *session, int now) {
+	struct request_scheduler *sched = &session->requests;
+	struct mpsc_node *node;
+	struct request *req;
+
+	while((node = mpsc_pop(&sched->incoming)) != NULL) {
+		req = mpsc_entry(node, struct request, node);
+		req->queue = REQ_QUEUE_NONE;
+		request_schedule(session, req);
+	}
+
+	while(sched->heap_len > 0 && sched->heap[0]->next_timeout <= now) {
+		req = sched->heap[0];
+		request_heap_remove(sched, req);
+
+		req->pass = sched->pass;
+		req->queue = REQ_QUEUE_READY;
+		request_queue_append(&sched->ready[req->priority], req);
+	}
+
+	sched->pass++;
+}
+
+
+/*
+ * For the iothread: Fetch the next ready request
+ * Higher lanes are served first, but a lower lane with requests ready
+ * is served once it's been passed over request_lane_reserve[] times.
+ *
+ * The request is owned by the caller until it's handed back with
+ * request_reschedule()
+ *
+ */
+struct request *request_fetch_expired(sp_session *session, int now) {
+	struct request_scheduler *sched = &session->requests;
+	struct request *req;
+	int lane, i;
+
+	for(;;) {
+		lane = -1;
+		for(i = REQ_PRIO_NUM - 1; i > 0; i--) {
+			if(request_lane_is_ready(sched, i)
+				&& sched->num_skipped[i] >= request_lane_reserve[i]) {
+				lane = i;
+				break;
+			}
+		}
+
+		for(i = 0; lane < 0 && i < REQ_PRIO_NUM; i++) {
+			if(request_lane_is_ready(sched, i))
+				lane = i;
+		}
+
+		if(lane < 0)
+			return NULL;
+
+		req = request_queue_shift(&sched->ready[lane]);
+		req->queue = REQ_QUEUE_NONE;
+
+		/* Postponed with request_set_timeout() while queued */
+		if(req->next_timeout > now) {
+			request_schedule(session, req);
+			continue;
+		}
+
+		break;
+	}
+
+	for(i = 0; i < REQ_PRIO_NUM; i++) {
+		if(i == lane)
+			sched->num_skipped[i] = 0;
+		else if(i > lane && request_lane_is_ready(sched, i))
+			sched->num_skipped[i]++;
+	}
+
+	req->queue = REQ_QUEUE_BUSY;
+
+	return req;
+}
+
+
+/* Check if a lane has a request that's eligible in the current pass */
+static int request_lane_is_ready(struct request_scheduler *sched, int lane) {
+	struct request *req = sched->ready[lane].head;
+
+	return req != NULL && req->pass != sched->pass;
+}
+
+
+/*
+ * For the iothread: Hand back a request fetched with request_fetch_expired()
+ * Unless the request returned a result while being processed it's queued
+ * according to its updated next_timeout
+ *
+ */
+void request_reschedule(sp_session *session, struct request *req) {
+	if(req->queue != REQ_QUEUE_BUSY)
+		return;
+
+	req->queue = REQ_QUEUE_NONE;
+	if(req->state == REQ_STATE_RETURNED)
+		request_return(session, req);
+	else if(req->state == REQ_STATE_NEW || req->state == REQ_STATE_RUNNING)
+		request_schedule(session, req);
+}
+
+
+/*
+ * For the iothread: Park a request that's being processed until
+ * request_unblock() is called, i.e. when there's room for another channel
+ *
+ */
+void request_block(sp_session *session, struct request *req) {
+	struct request_scheduler *sched = &session->requests;
+
+	req->next_timeout = INT_MAX;
+	req->queue = REQ_QUEUE_BLOCKED;
+	request_queue_append(&sched->blocked[req->priority], req);
+	sched->num_blocked++;
+}
+
+
+/*
+ * For the iothread: Make up to num blocked requests ready, taken from
+ * lanes up to and including lowest. Higher lanes are released first,
+ * oldest first within a lane. Returns the number released
+ *
+ */
+int request_unblock(sp_session *session, int num, request_priority lowest) {
+	struct request_scheduler *sched = &session->requests;
+	struct request *req;
+	int lane, num_released;
+
+	num_released = 0;
+	for(lane = 0; lane <= (int)lowest && num > 0; lane++) {
+		while(num > 0 && (req = request_queue_shift(&sched->blocked[lane])) != NULL) {
+			sched->num_blocked--;
+			req->queue = REQ_QUEUE_NONE;
+			req->next_timeout = 0;
+			request_schedule(session, req);
+			num--;
+			num_released++;
+		}
+	}
+
+	return num_released;
+}
+
+
+/*
+ * For the iothread: Get the earliest next_timeout of all queued requests
+ * Returns INT_MAX if there's nothing to do until a request is posted
+ * or a channel callback updates a request
+ *
+ */
+int request_next_timeout(sp_session *session) {
+	struct request_scheduler *sched = &session->requests;
+	int next_timeout, i;
+
+	next_timeout = INT_MAX;
+	if(sched->heap_len > 0)
+		next_timeout = sched->heap[0]->next_timeout;
+
+	osfy_atomic_store_int(&sched->next_deadline, next_timeout);
+
+	for(i = 0; i < REQ_PRIO_NUM; i++)
+		if(sched->ready[i].head != NULL)
+			next_timeout = 0;
+
+	if(!mpsc_is_empty(&sched->incoming))
+		next_timeout = 0;
+
+	return next_timeout;
+}
+
+
+/* Pick the lane requests of a given type are served in */
+static request_priority request_type_priority(request_type type) {
+	switch(type) {
+	case REQ_TYPE_LOGIN:
+	case REQ_TYPE_LOGOUT:
+	case REQ_TYPE_PLAYER_KEY:
+	case REQ_TYPE_PLAYER_SUBSTREAM:
+	case REQ_TYPE_PLAY_TOKEN_ACQUIRE:
+	case REQ_TYPE_PLAY_TOKEN_LOST:
+	case REQ_TYPE_RECONNECT:
+		return REQ_PRIO_REALTIME;
+
+	case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
+	case REQ_TYPE_IMAGE:
+	case REQ_TYPE_CACHE_PERIODIC:
+		return REQ_PRIO_BACKGROUND;
+
+	default:
+		break;
+	}
+
+	return REQ_PRIO_INTERACTIVE;
+}
+
+
+/*
+ * For selecting which requests we should notify the main thread about
+ * Called after the request is pushed, which the main thread may have
+ * free'd by now, so it only gets the type and output.
+ *
+ */
+static void request_notify_main_thread(sp_session *session, request_type type, void *output) {
+
+	switch(type) {
 	case REQ_TYPE_LOGIN:
 	case REQ_TYPE_LOGOUT:
+	case REQ_TYPE_RECONNECT:
 	case REQ_TYPE_PLAY_TOKEN_LOST:
 	case REQ_TYPE_NOTIFY:
 	case REQ_TYPE_IMAGE:
@@ -175,19 +484,16 @@ static void request_notify_main_thread(sp_session *session, struct request *requ
 		if (session->callbacks->notify_main_thread == NULL)
 			break;
 		session->callbacks->notify_main_thread(session);
-		DSFYDEBUG("Notified main thread for <type %s, state %s, input %p>\n",
-			REQUEST_TYPE_STR(request->type), REQUEST_STATE_STR(request->state),
-			request->input);
+		DSFYDEBUG("Notified main thread for <type %s>\n", REQUEST_TYPE_STR(type));
 		break;
 
 	case REQ_TYPE_PLAYLIST_LOAD:
 		{
 			char idstr[35];
-			if(request->output != NULL) {
-				hex_bytes_to_ascii(((sp_playlist *)request->output)->id, idstr, 17);
-				DSFYDEBUG("Request <type %s, state %s, input %p>, playlist '%s' is LISTED\n",
-					REQUEST_TYPE_STR(request->type), REQUEST_STATE_STR(request->state),
-					request->input, idstr);
+			if(output != NULL) {
+				hex_bytes_to_ascii(((sp_playlist *)output)->id, idstr, 17);
+				DSFYDEBUG("Request <type %s>, playlist '%s' is LISTED\n",
+					REQUEST_TYPE_STR(type), idstr);
 			}
 		}
 		break;
@@ -195,11 +501,10 @@ static void request_notify_main_thread(sp_session *session, struct request *requ
 	case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
 		{
 			char idstr[35];
-			if(request->output != NULL) {
-				hex_bytes_to_ascii(((sp_playlist *)request->output)->id, idstr, 17);
-				DSFYDEBUG("Request <type %s, state %s, input %p>, playlist '%s' is LOADED\n",
-					REQUEST_TYPE_STR(request->type), REQUEST_STATE_STR(request->state),
-					request->input, idstr);
+			if(output != NULL) {
+				hex_bytes_to_ascii(((sp_playlist *)output)->id, idstr, 17);
+				DSFYDEBUG("Request <type %s>, playlist '%s' is LOADED\n",
+					REQUEST_TYPE_STR(type), idstr);
 			}
 		}
 		break;
@@ -212,27 +517,16 @@ static void request_notify_main_thread(sp_session *session, struct request *requ
 
 /* For the main thread: Fetch next entry with state REQ_STATE_RETURNED */
 struct request *request_fetch_next_result(sp_session *session, int *next_timeout) {
-	struct request *walker, *request;
-	int timeout;
-
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
+	struct request_scheduler *sched = &session->requests;
+	struct mpsc_node *node;
+	int deadline, timeout;
 
 	/* Default timeout (milliseconds) */
 	*next_timeout = 5000;
 
-	request = NULL;
-	for(walker = session->requests; walker; walker = walker->next) {
-		if(!request && walker->state == REQ_STATE_RETURNED)
-			request = walker;
-
-		if(walker->next_timeout == 0)
-			continue;
-
-		timeout = (int) (walker->next_timeout - get_millisecs());
+	deadline = osfy_atomic_load_int(&sched->next_deadline);
+	if(deadline != INT_MAX) {
+		timeout = (int) (deadline - get_millisecs());
 
 		/* FIXME: Sensible to always sleep one second? */
 		if(timeout < 1000)
@@ -242,14 +536,10 @@ struct request *request_fetch_next_result(sp_session *session, int *next_timeout
 			*next_timeout = timeout;
 	}
 
+	if((node = mpsc_pop(&sched->results)) == NULL)
+		return NULL;
 
-#ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
-#else
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
-
-	return request;
+	return mpsc_entry(node, struct request, node);
 }
 
 
@@ -259,22 +549,14 @@ struct request *request_fetch_next_result(sp_session *session, int *next_timeout
  *
  */
 void request_mark_processed(sp_session *session, struct request *req) {
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
-
 	req->state = REQ_STATE_PROCESSED;
+	req->queue = REQ_QUEUE_PROCESSED;
+
 	DSFYDEBUG("Finished processing for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
 		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
 		req->error, req->output);
 
-#ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
-#else
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+	mpsc_push(&session->requests.processed, &req->node);
 }
 
 
@@ -283,41 +565,211 @@ void request_mark_processed(sp_session *session, struct request *req) {
  *
  */
 void request_cleanup(sp_session *session) {
+	struct mpsc_node *node;
+
+	while((node = mpsc_pop(&session->requests.processed)) != NULL)
+		request_free(session, mpsc_entry(node, struct request, node));
+}
+
+
+/*
+ * Hand a returned request over to the main thread
+ * The iothread must not touch the request afterwards
+ *
+ */
+static void request_return(sp_session *session, struct request *req) {
+	request_type type = req->type;
+	void *output = req->output;
+
+	/* Pushed before notifying, or the main thread might wake up to an empty queue */
+	req->queue = REQ_QUEUE_RESULTS;
+	mpsc_push(&session->requests.results, &req->node);
+	request_notify_main_thread(session, type, output);
+}
+
+
+static void request_free(sp_session *session, struct request *req) {
+	/* Free input variable, if set */
+	if(req->input)
+		free(req->input);
+
+	memstats_free(session, OPENSP_MEMORY_REQUESTS, sizeof(struct request));
+
+	free(req);
+}
+
+
+/*
+ * Queue a request according to its next_timeout
+ * Only called by the iothread
+ *
+ */
+static void request_schedule(sp_session *session, struct request *req) {
+	struct request_scheduler *sched = &session->requests;
+
+	/* Waiting for a channel callback to call request_set_timeout() */
+	if(req->next_timeout == INT_MAX) {
+		req->queue = REQ_QUEUE_NONE;
+		return;
+	}
+
+	if(req->next_timeout > get_millisecs() && request_heap_push(sched, req) == 0) {
+		req->queue = REQ_QUEUE_TIMER;
+		return;
+	}
+
+	req->pass = sched->pass;
+	req->queue = REQ_QUEUE_READY;
+	request_queue_append(&sched->ready[req->priority], req);
+}
+
+
+/*
+ * Remove a request from the ready queue or the timer heap
+ * Only called by the iothread
+ *
+ */
+static void request_unlink(sp_session *session, struct request *req) {
+	if(req->queue == REQ_QUEUE_READY)
+		request_queue_remove(&session->requests.ready[req->priority], req);
+	else if(req->queue == REQ_QUEUE_TIMER)
+		request_heap_remove(&session->requests, req);
+	else if(req->queue == REQ_QUEUE_BLOCKED) {
+		request_queue_remove(&session->requests.blocked[req->priority], req);
+		session->requests.num_blocked--;
+	}
+
+	req->queue = REQ_QUEUE_NONE;
+}
+
+
+static void request_queue_append(struct request_queue *queue, struct request *req) {
+	req->next = NULL;
+	if(queue->tail)
+		queue->tail->next = req;
+	else
+		queue->head = req;
+
+	queue->tail = req;
+}
+
+
+static struct request *request_queue_shift(struct request_queue *queue) {
+	struct request *req;
+
+	if((req = queue->head) == NULL)
+		return NULL;
+
+	queue->head = req->next;
+	if(queue->head == NULL)
+		queue->tail = NULL;
+
+	req->next = NULL;
+
+	return req;
+}
+
+
+/* O(n) but only needed when a queued request returns before it's processed */
+static void request_queue_remove(struct request_queue *queue, struct request *req) {
 	struct request *prev, *walker;
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
 
+	prev = NULL;
+	for(walker = queue->head; walker; walker = walker->next) {
+		if(walker == req)
+			break;
 
-	do {
-		prev = NULL;
-		for(walker = session->requests; walker; walker = walker->next) {
-			if(walker->state == REQ_STATE_PROCESSED)
-				break;
+		prev = walker;
+	}
 
-			prev = walker;
-		}
+	if(walker == NULL)
+		return;
 
-		if(!walker)
+	if(prev)
+		prev->next = req->next;
+	else
+		queue->head = req->next;
+
+	if(queue->tail == req)
+		queue->tail = prev;
+
+	req->next = NULL;
+}
+
+
+static int request_heap_push(struct request_scheduler *sched, struct request *req) {
+	struct request **heap;
+	int size;
+
+	if(sched->heap_len == sched->heap_size) {
+		size = sched->heap_size? 2 * sched->heap_size: 64;
+		heap = realloc(sched->heap, size * sizeof(struct request *));
+		if(heap == NULL)
+			return -1;
+
+		sched->heap = heap;
+		sched->heap_size = size;
+	}
+
+	req->heap_index = sched->heap_len++;
+	sched->heap[req->heap_index] = req;
+	request_heap_sift_up(sched, req->heap_index);
+
+	return 0;
+}
+
+
+static void request_heap_remove(struct request_scheduler *sched, struct request *req) {
+	int i = req->heap_index;
+
+	sched->heap_len--;
+	if(i != sched->heap_len) {
+		sched->heap[i] = sched->heap[sched->heap_len];
+		sched->heap[i]->heap_index = i;
+		request_heap_sift_down(sched, i);
+		request_heap_sift_up(sched, i);
+	}
+
+	req->heap_index = -1;
+}
+
+
+static void request_heap_sift_up(struct request_scheduler *sched, int i) {
+	struct request *req = sched->heap[i];
+	int parent;
+
+	while(i > 0) {
+		parent = (i - 1) / 2;
+		if(sched->heap[parent]->next_timeout <= req->next_timeout)
 			break;
 
-		if(prev)
-			prev->next = walker->next;
-		else
-			session->requests = walker->next;
+		sched->heap[i] = sched->heap[parent];
+		sched->heap[i]->heap_index = i;
+		i = parent;
+	}
 
-		/* Free input variable, if set */
-		if(walker->input)
-			free(walker->input);
+	sched->heap[i] = req;
+	req->heap_index = i;
+}
 
-		free(walker);
-	} while(1);
 
-#ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
-#else
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+static void request_heap_sift_down(struct request_scheduler *sched, int i) {
+	struct request *req = sched->heap[i];
+	int child;
+
+	while((child = 2 * i + 1) < sched->heap_len) {
+		if(child + 1 < sched->heap_len
+			&& sched->heap[child + 1]->next_timeout < sched->heap[child]->next_timeout)
+			child++;
+
+		if(req->next_timeout <= sched->heap[child]->next_timeout)
+			break;
+
+		sched->heap[i] = sched->heap[child];
+		sched->heap[i]->heap_index = i;
+		i = child;
+	}
+
+	sched->heap[i] = req;
+	req->heap_index = i;
 }
@@ -8,6 +8,8 @@
 
 #include <libspotify/api.h>
 
+#include "mpsc.h"
+
 typedef enum {
 	/* All requests created with request_post() have this state */
 	REQ_STATE_NEW = 0,
@@ -176,18 +178,138 @@ typedef enum {
 	 * Never returns.
 	 *
 	 */
-	REQ_TYPE_CACHE_PERIODIC
+	REQ_TYPE_CACHE_PERIODIC,
+
+	/*
+	 * Posted by the iothread when the connection is lost.
+	 * Logs in again with backoff and replays open channels.
+	 * Returns an error to the main thread if it gives up.
+	 *
+	 */
+	REQ_TYPE_RECONNECT
 } request_type;
 
 
+/*
+ * Scheduling lanes, see request.c:request_type_priority()
+ * Lower values are served first
+ *
+ */
+typedef enum {
+	/* Audio playback and session control */
+	REQ_PRIO_REALTIME = 0,
+
+	/* Things the user is waiting for, i.e. searches and browsing */
+	REQ_PRIO_INTERACTIVE,
+
+	/* Prefetching of playlist tracks, images and housekeeping */
+	REQ_PRIO_BACKGROUND,
+
+	REQ_PRIO_NUM
+} request_priority;
+
+
+/* Which of the scheduler's queues a request is currently linked into */
+typedef enum {
+	/* Waiting on a channel with next_timeout set to INT_MAX */
+	REQ_QUEUE_NONE = 0,
+
+	/* Due for processing, see request_fetch_expired() */
+	REQ_QUEUE_READY,
+
+	/* In the timer heap until next_timeout expires */
+	REQ_QUEUE_TIMER,
+
+	/* Being processed by the iothread, see request_reschedule() */
+	REQ_QUEUE_BUSY,
+
+	/* Waiting for the flow control window to open, see flowctl.c */
+	REQ_QUEUE_BLOCKED,
+
+	/* Posted with request_post(), not yet seen by the iothread */
+	REQ_QUEUE_INCOMING,
+
+	/* Waiting for request_fetch_next_result() */
+	REQ_QUEUE_RESULTS,
+
+	/* Waiting to be free'd by request_cleanup() */
+	REQ_QUEUE_PROCESSED
+} request_queue_id;
+
+
 struct request {
 	request_type type;
 	request_state state;
+	request_priority priority;
 	void *input;
 	void *output;
 	sp_error error;
+
+	/*
+	 * When the iothread should process the request next
+	 * Request handlers may set this directly while the request is being
+	 * processed. Everyone else (i.e, channel callbacks) must go through
+	 * request_set_timeout() so the request is moved to the right queue.
+	 *
+	 */
 	int next_timeout;
+
+	/*
+	 * Scheduler bookkeeping, only touched by the iothread while the
+	 * request is in the ready queue or the timer heap. The node links
+	 * the request into the lock-free queues shared between threads.
+	 *
+	 */
+	request_queue_id queue;
+	int heap_index;
+	unsigned int pass;
 	struct request *next;
+	struct mpsc_node node;
+};
+
+
+/* Singly linked FIFO with O(1) append */
+struct request_queue {
+	struct request *head;
+	struct request *tail;
+};
+
+
+/*
+ * Requests are kept in a FIFO of ready requests, a binary min-heap
+ * ordered on next_timeout and FIFOs for returned and processed requests
+ * so that neither thread ever needs to walk all outstanding requests
+ *
+ * Requests cross threads through lock-free MPSC queues:
+ * incoming (any thread -> iothread), results (iothread -> main thread)
+ * and processed (main thread -> iothread). The ready queue and the
+ * heap are private to the iothread.
+ *
+ */
+struct request_scheduler {
+	struct mpsc_queue incoming;
+
+	/* One ready queue per lane */
+	struct request_queue ready[REQ_PRIO_NUM];
+
+	/* Times each lane was passed over in favor of a higher one */
+	int num_skipped[REQ_PRIO_NUM];
+
+	struct request **heap;
+	int heap_len;
+	int heap_size;
+
+	struct request_queue blocked[REQ_PRIO_NUM];
+	int num_blocked;
+
+	struct mpsc_queue results;
+	struct mpsc_queue processed;
+
+	/* Incremented by request_begin_pass() */
+	unsigned int pass;
+
+	/* Earliest timer deadline, published for the main thread */
+	int next_deadline;
 };
 
 #define REQUEST_TYPE_STR(type) (type == REQ_TYPE_LOGIN? "LOGIN": \
@@ -218,17 +340,32 @@ struct request {
 				type == REQ_TYPE_PLAY_TOKEN_ACQUIRE? "PLAY_TOKEN_ACQUIRE": \
 				type == REQ_TYPE_PLAY_TOKEN_LOST? "PLAY_TOKEN_LOST": \
 				type == REQ_TYPE_CACHE_PERIODIC? "CACHE_PERIODIC": \
+				type == REQ_TYPE_RECONNECT? "RECONNECT": \
 				"UNKNOWN")
 
+#define REQUEST_PRIORITY_STR(prio) (prio == REQ_PRIO_REALTIME? "REALTIME": \
+				prio == REQ_PRIO_INTERACTIVE? "INTERACTIVE": \
+				prio == REQ_PRIO_BACKGROUND? "BACKGROUND": \
+				"INVALID")
+
 #define REQUEST_STATE_STR(state) (state == REQ_STATE_NEW? "NEW": \
 				state == REQ_STATE_RUNNING? "RUNNING": \
 				state == REQ_STATE_RETURNED? "RETURNED": \
 				state == REQ_STATE_PROCESSED? "PROCESSED": \
 				"INVALID")
 
+void request_scheduler_init(sp_session *session);
+void request_scheduler_free(sp_session *session);
 int request_post(sp_session *session, request_type type, void *input);
 int request_post_result(sp_session *session, request_type type, sp_error error, void *output);
 int request_set_result(sp_session *session, struct request *req, sp_error error, void *output);
+void request_set_timeout(sp_session *session, struct request *req, int next_timeout);
+void request_begin_pass(sp_session *session, int now);
+struct request *request_fetch_expired(sp_session *session, int now);
+void request_reschedule(sp_session *session, struct request *req);
+void request_block(sp_session *session, struct request *req);
+int request_unblock(sp_session *session, int num, request_priority lowest);
+int request_next_timeout(sp_session *session);
 struct request *request_fetch_next_result(sp_session *session, int *next_timeout);
 void request_mark_processed(sp_session *session, struct request *req);
 void request_cleanup(sp_session *session);
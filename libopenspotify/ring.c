@@ -0,0 +1,107 @@
+/*
+ * Byte queue used for incoming and outgoing packets
+ *
+ * Data is appended at the tail and consumed at the head, so packets
+ * can be encrypted, decrypted and handed to the packet handlers in
+ * place. Once everything has been consumed both offsets wrap back to
+ * the start of the buffer. Only when the data left sits at the end of
+ * the buffer and there's no room to append what's needed is it moved
+ * to the start, which keeps packets contiguous without copying every
+ * packet.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "ring.h"
+
+
+/*
+ * Allocate the buffer
+ * Returns 0 on success and -1 if out of memory
+ *
+ */
+int ring_init(struct ring *r, int size) {
+	r->data = malloc(size);
+	if(r->data == NULL)
+		return -1;
+
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+
+	return 0;
+}
+
+
+void ring_free(struct ring *r) {
+	if(r->data)
+		free(r->data);
+
+	r->data = NULL;
+	r->size = 0;
+	r->head = r->tail = 0;
+}
+
+
+/* Discard all data, i.e. when a new connection has been setup */
+void ring_reset(struct ring *r) {
+	r->head = r->tail = 0;
+}
+
+
+/*
+ * Make room for at least need bytes after the data already received
+ * Returns a pointer to where new data should be written and sets
+ * avail to the number of bytes that may be written there, or NULL
+ * if out of memory
+ *
+ */
+unsigned char *ring_reserve(struct ring *r, int need, int *avail) {
+	unsigned char *data;
+	int len, size;
+
+	if(r->size - r->tail < need) {
+		len = r->tail - r->head;
+
+		if(r->size - len < need) {
+			size = r->size;
+			while(size - len < need)
+				size *= 2;
+
+			DSFYDEBUG("Growing receive buffer from %d to %d bytes\n", r->size, size);
+			data = realloc(r->data, size);
+			if(data == NULL)
+				return NULL;
+
+			r->data = data;
+			r->size = size;
+		}
+
+		if(r->size - r->tail < need) {
+			memmove(r->data, r->data + r->head, len);
+			r->head = 0;
+			r->tail = len;
+		}
+	}
+
+	*avail = r->size - r->tail;
+
+	return r->data + r->tail;
+}
+
+
+/* Account for len bytes written at the pointer returned by ring_reserve() */
+void ring_commit(struct ring *r, int len) {
+	r->tail += len;
+}
+
+
+/* Release len bytes at the head of the buffer */
+void ring_consume(struct ring *r, int len) {
+	r->head += len;
+	if(r->head == r->tail)
+		r->head = r->tail = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef LIBOPENSPOTIFY_RING_H
+#define LIBOPENSPOTIFY_RING_H
+
+struct ring {
+	unsigned char *data;
+	int size;
+
+	/* Start of data not yet consumed */
+	int head;
+
+	/* End of data received */
+	int tail;
+};
+
+
+#define ring_ptr(r)		((r)->data + (r)->head)
+#define ring_length(r)	((r)->tail - (r)->head)
+
+
+int ring_init(struct ring *r, int size);
+void ring_free(struct ring *r);
+void ring_reset(struct ring *r);
+unsigned char *ring_reserve(struct ring *r, int need, int *avail);
+void ring_commit(struct ring *r, int len);
+void ring_consume(struct ring *r, int len);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -7,16 +8,23 @@
 #include "album.h"
 #include "artist.h"
 #include "buf.h"
+#include "channel.h"
 #include "commands.h"
 #include "debug.h"
+#include "decoder.h"
 #include "ezxml.h"
+#include "flowctl.h"
 #include "search.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
+#include "xmlstream.h"
 
 
 static int search_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void search_decode(struct decode_job *job);
+static void search_apply(sp_session *session, struct decode_job *job);
+static void search_release(struct decode_job *job);
 static int search_parse_xml(struct search_ctx *search_ctx);
 
 
@@ -24,6 +32,10 @@ int search_process_request(sp_session *session, struct request *req) {
 	struct search_ctx *search_ctx = *(struct search_ctx **)req->input;
 	sp_search *search = search_ctx->search;
 
+	/* Parked until there's room for another channel */
+	if(!flowctl_admit(session, req))
+		return 0;
+
 	/*
 	 * Prevent request from happening again.
 	 * If there's an error the channel callback will reset the timeout
@@ -46,49 +58,30 @@ int search_process_request(sp_session *session, struct request *req) {
 
 
 static int search_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct search_ctx *search_ctx = (struct search_ctx *)ch->private;
 
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-
-				if (len == 0)
-					break;
-			}
-
-			buf_append_data(search_ctx->buf, payload, len);
+			/* Inflated on a decoder thread, in order */
+			xml_stream_submit(search_ctx->session, search_ctx->xs, payload, len);
 			break;
 
 		case CHANNEL_ERROR:
 			DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", SEARCH_RETRY_TIMEOUT);
-			buf_free(search_ctx->buf);
-			search_ctx->buf = buf_new();
+			xml_stream_submit_free(search_ctx->session, search_ctx->xs);
+			search_ctx->xs = xml_stream_new();
 
 			/* Reset timeout so the request can be retried */
-			search_ctx->req->next_timeout = get_millisecs() + SEARCH_RETRY_TIMEOUT*1000;
+			request_set_timeout(search_ctx->session, search_ctx->req, channel_retry_timeout(ch, SEARCH_RETRY_TIMEOUT*1000));
 
 			break;
 
 		case CHANNEL_END:
-			if(search_parse_xml(search_ctx) == 0) {
-				search_ctx->search->error = SP_ERROR_OK;
-				search_ctx->search->is_loaded = 1;
-			}
-			else
-				search_ctx->search->error = SP_ERROR_OTHER_PERMANENT;
-
-			request_set_result(search_ctx->session, search_ctx->req, search_ctx->search->error, search_ctx->search);
-
-			buf_free(search_ctx->buf);
-			free(search_ctx);
+			/* Results are loaded by search_apply() once decoded */
+			search_ctx->job.decode = search_decode;
+			search_ctx->job.apply = search_apply;
+			search_ctx->job.release = search_release;
+			decoder_submit_serial(search_ctx->session, &search_ctx->job, search_ctx->xs);
 			break;
 
 		default:
@@ -100,35 +93,84 @@ static int search_callback(CHANNEL *ch, unsigned char *payload, unsigned short l
 }
 
 
-static int search_parse_xml(struct search_ctx *search_ctx) {
-	int i, count;
-	struct buf *xml;
-	unsigned char id[16];
-	sp_search *search = search_ctx->search;
-	ezxml_t root, node, artist_node, album_node, track_node;
-	sp_artist *artist;
-	sp_album *album;
-	sp_track *track;
+/* Inflate and parse the XML, run by a decoder thread */
+static void search_decode(struct decode_job *job) {
+	struct search_ctx *search_ctx;
 
-	xml = despotify_inflate(search_ctx->buf->ptr, search_ctx->buf->len);
-	if(xml == NULL)
-		return -1;
+	search_ctx = (struct search_ctx *)((char *)job - offsetof(struct search_ctx, job));
+
+	/* Inflated by the jobs submitted before this one, see search_callback() */
+	search_ctx->xml = xml_stream_finish(search_ctx->xs);
+	search_ctx->xs = NULL;
+	if(search_ctx->xml == NULL)
+		return;
 
 #ifdef DEBUG
 	{
 		FILE *fd;
 		fd = fopen("search.xml", "w");
 		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
+			fwrite(search_ctx->xml->ptr, search_ctx->xml->len, 1, fd);
 			fclose(fd);
 		}
 	}
 #endif
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
+	search_ctx->root = ezxml_parse_str((char *)search_ctx->xml->ptr, search_ctx->xml->len);
+}
+
+
+/* Load the results and return the request, run by the iothread */
+static void search_apply(sp_session *session, struct decode_job *job) {
+	struct search_ctx *search_ctx;
+
+	search_ctx = (struct search_ctx *)((char *)job - offsetof(struct search_ctx, job));
+
+	if(search_parse_xml(search_ctx) == 0) {
+		search_ctx->search->error = SP_ERROR_OK;
+		search_ctx->search->is_loaded = 1;
+	}
+	else
+		search_ctx->search->error = SP_ERROR_OTHER_PERMANENT;
+
+	request_set_result(search_ctx->session, search_ctx->req, search_ctx->search->error, search_ctx->search);
+
+	search_release(job);
+}
+
+
+static void search_release(struct decode_job *job) {
+	struct search_ctx *search_ctx;
+
+	search_ctx = (struct search_ctx *)((char *)job - offsetof(struct search_ctx, job));
+
+	if(search_ctx->root != NULL)
+		ezxml_free(search_ctx->root);
+
+	if(search_ctx->xml != NULL)
+		buf_free(search_ctx->xml);
+
+	/* Dropped by decoder_free() before it was decoded */
+	if(search_ctx->xs != NULL)
+		xml_stream_free(search_ctx->xs);
+
+	free(search_ctx);
+}
+
+
+static int search_parse_xml(struct search_ctx *search_ctx) {
+	int i, count;
+	unsigned char id[16];
+	sp_search *search = search_ctx->search;
+	ezxml_t root, node, artist_node, album_node, track_node;
+	sp_artist *artist;
+	sp_album *album;
+	sp_track *track;
+
+	/* Parsed by search_decode(), freed by search_release() */
+	root = search_ctx->root;
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
@@ -137,7 +179,6 @@ static int search_parse_xml(struct search_ctx *search_ctx) {
 	if((node = ezxml_get(root, "version", -1)) == NULL
 		|| atoi(node->txt) != 1) {
 		DSFYDEBUG("Unsupported search XML version!\n");
-		buf_free(xml);
 		return -1;
 	}
 
@@ -181,7 +222,6 @@ static int search_parse_xml(struct search_ctx *search_ctx) {
 		if(!sp_artist_is_loaded(artist))
 			osfy_artist_load_artist_from_xml(search_ctx->session, artist, artist_node);
 
-		sp_artist_add_ref(artist);
 		search->artists[search->num_artists] = artist;
 		search->num_artists++;
 	}
@@ -211,7 +251,6 @@ static int search_parse_xml(struct search_ctx *search_ctx) {
 		if(!sp_album_is_loaded(album))
 			osfy_album_load_from_search_xml(search_ctx->session, album, album_node);
 
-		sp_album_add_ref(album);
 		search->albums[search->num_albums] = album;
 		search->num_albums++;
 	}
@@ -241,13 +280,10 @@ static int search_parse_xml(struct search_ctx *search_ctx) {
 			osfy_track_load_from_xml(search_ctx->session, track, track_node);
 
 		search->tracks = realloc(search->tracks, sizeof(sp_track *) * (1 + search->num_tracks));
-		sp_track_add_ref(track);
 		search->tracks[search->num_tracks] = track;
 		search->num_tracks++;
 	}
 
 
-	ezxml_free(root);
-
 	return 0;
 }
@@ -4,7 +4,10 @@
 #include <libspotify/api.h>
 
 #include "buf.h"
+#include "decoder.h"
+#include "ezxml.h"
 #include "request.h"
+#include "xmlstream.h"
 
 
 #define SEARCH_RETRY_TIMEOUT	30*1000
@@ -13,8 +16,13 @@
 struct search_ctx {
         sp_session *session;
         struct request *req;
-	struct buf *buf;
+	struct xml_stream *xs;
         sp_search *search;
+
+	/* Inflates and parses the reply on a decoder thread */
+	struct decode_job job;
+	struct buf *xml;
+	ezxml_t root;
 };
 
 
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -9,9 +10,16 @@
 #include "browse.h"
 #include "debug.h"
 #include "ezxml.h"
+#include "hashtable.h"
 #include "image.h"
+#include "memstats.h"
+#include "metacache.h"
+#include "pool.h"
+#include "reclaim.h"
 #include "request.h"
 #include "sp_opaque.h"
+#include "strpool.h"
+#include "track.h"
 #include "util.h"
 
 
@@ -59,19 +67,16 @@ SP_LIBEXPORT(sp_albumtype) sp_album_type(sp_album *album) {
 
 SP_LIBEXPORT(void) sp_album_add_ref(sp_album *album) {
 
-	album->ref_count++;
+	REFCOUNT_INC(&album->ref_count);
 }
 
 
+/* Unreferenced albums are freed by the garbage collector, see reclaim.c */
 SP_LIBEXPORT(void) sp_album_release(sp_album *album) {
+	int ref_count;
 
-	assert(album->ref_count > 0);
-
-	if(--album->ref_count)
-		return;
-
-	DSFYDEBUG("Freeing album %p because of zero ref count\n", album);
-	osfy_album_free(album);
+	ref_count = REFCOUNT_DEC(&album->ref_count);
+	assert(ref_count >= 0);
 }
 
 
@@ -79,16 +84,27 @@ SP_LIBEXPORT(void) sp_album_release(sp_album *album) {
  * Functions for internal use
  *
  */
+/* Find or create an album, the caller gets a reference */
 sp_album *sp_album_add(sp_session *session, unsigned char id[16]) {
 	sp_album *album;
 
+	/* Another thread adding the same album must find this one */
+	hashtable_writer_lock(session->hashtable_albums);
 
-	album = (sp_album *)hashtable_find(session->hashtable_albums, id);
-	if(album)
+	album = (sp_album *)reclaim_find(session->hashtable_albums, id, offsetof(sp_album, ref_count));
+	if(album) {
+		hashtable_writer_unlock(session->hashtable_albums);
 		return album;
+	}
+
+	album = pool_get(&session->pool_albums);
+	if(album == NULL) {
+		hashtable_writer_unlock(session->hashtable_albums);
+		return NULL;
+	}
 
-	album = malloc(sizeof(sp_album));
 	DSFYDEBUG("Allocated album at %p\n", album);
+	memstats_alloc(session, OPENSP_MEMORY_ALBUMS, sizeof(sp_album));
 
 	memcpy(album->id, id, sizeof(album->id));
 
@@ -104,25 +120,29 @@ sp_album *sp_album_add(sp_session *session, unsigned char id[16]) {
 	album->is_available = 0;
 
 	album->is_loaded = 0;
-	album->ref_count = 0;
+	REFCOUNT_INIT(&album->ref_count, 1);
+	album->is_cached = 0;
 
 	album->hashtable = session->hashtable_albums;
 	hashtable_insert(album->hashtable, album->id, album);
+	hashtable_writer_unlock(album->hashtable);
 
+	/* Saved by an earlier session? */
+	metacache_load_album(session, album);
 
 	return album;
 }
 
 
-/* Free an album. Used by sp_album_relase() and the garbage collector */
-void osfy_album_free(sp_album *album) {
+/* Free an album retired by the garbage collector */
+void osfy_album_free(sp_session *session, sp_album *album) {
 
-	assert(album->ref_count == 0);
+	assert(REFCOUNT_GET(&album->ref_count) == RECLAIM_DEAD);
 
-	hashtable_remove(album->hashtable, album->id);
+	/* Written by the next save, unless it's there already */
+	metacache_retire_album(session, album);
 
-	if(album->name)
-		free(album->name);
+	strpool_put(session, album->name);
 
 	if(album->artist)
 		sp_artist_release(album->artist);
@@ -130,14 +150,29 @@ void osfy_album_free(sp_album *album) {
 	if(album->image)
 		sp_image_release(album->image);
 
-	if(album->restricted_countries)
-		free(album->restricted_countries);
+	strpool_put(session, album->restricted_countries);
 
-	if(album->allowed_countries)
-		free(album->allowed_countries);
+	strpool_put(session, album->allowed_countries);
 
 	DSFYDEBUG("Deallocated album at %p\n", album);
-	free(album);
+
+	memstats_free(session, OPENSP_MEMORY_ALBUMS, sizeof(sp_album));
+
+	pool_put(&session->pool_albums, album);
+}
+
+
+static void osfy_album_reclaim(sp_session *session, void *object) {
+	sp_album *album = (sp_album *)object;
+
+	DSFYDEBUG("Freeing album %p because of zero ref_count\n", album);
+	osfy_album_free(session, album);
+}
+
+
+int osfy_album_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots) {
+	return reclaim_sweep(session, session->hashtable_albums, cursor, num_slots,
+			offsetof(sp_album, ref_count), osfy_album_reclaim);
 }
 
 
@@ -176,8 +211,7 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 		return -1;
 	}
 
-	album->name = realloc(album->name, strlen(node->txt) + 1);
-	strcpy(album->name, node->txt);
+	strpool_set(session, &album->name, node->txt);
 
 
 	/* Album year. Might be empty, i.e '<year/>' */
@@ -201,16 +235,14 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 			continue;
 
 		if((str = ezxml_attr(node, "allowed")) != NULL) {
-			album->allowed_countries = realloc(album->allowed_countries, strlen(str) + 1);
-			strcpy(album->allowed_countries, str);
+			strpool_set(session, &album->allowed_countries, str);
 
 			if(strstr(album->allowed_countries, session->country))
 				album->is_available = 1;
 		}
 
 		if((str = ezxml_attr(node, "forbidden")) != NULL) {
-			album->restricted_countries = realloc(album->restricted_countries, strlen(str) + 1);
-			strcpy(album->restricted_countries, str);
+			strpool_set(session, &album->restricted_countries, str);
 
 			if(strstr(album->restricted_countries, session->country))
 				album->is_available = 0;
@@ -230,7 +262,6 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 
 	hex_ascii_to_bytes(node->txt, id, 16);
 	album->artist = osfy_artist_add(session, id);
-	sp_artist_add_ref(album->artist);
 
 	if(sp_artist_is_loaded(album->artist) == 0) {
 		{
@@ -278,7 +309,6 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 	if((node = ezxml_get(album_node, "cover", -1)) != NULL) {
 		hex_ascii_to_bytes(node->txt, id, 20);
 		album->image = osfy_image_create(session, id);
-		sp_image_add_ref(album->image);
 	}
 	else {
 		DSFYDEBUG("Failed to find element 'cover'\n");
@@ -320,8 +350,7 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 		return -1;
 	}
 
-	album->name = realloc(album->name, strlen(node->txt) + 1);
-	strcpy(album->name, node->txt);
+	strpool_set(session, &album->name, node->txt);
 
 
 	/* Album year */
@@ -342,16 +371,14 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 			continue;
 
 		if((str = ezxml_attr(node, "allowed")) != NULL) {
-			album->allowed_countries = realloc(album->allowed_countries, strlen(str) + 1);
-			strcpy(album->allowed_countries, str);
+			strpool_set(session, &album->allowed_countries, str);
 
 			if(strstr(album->allowed_countries, session->country))
 				album->is_available = 1;
 		}
 
 		if((str = ezxml_attr(node, "forbidden")) != NULL) {
-			album->restricted_countries = realloc(album->restricted_countries, strlen(str) + 1);
-			strcpy(album->restricted_countries, str);
+			strpool_set(session, &album->restricted_countries, str);
 
 			if(strstr(album->restricted_countries, session->country))
 				album->is_available = 0;
@@ -372,7 +399,6 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 
 	hex_ascii_to_bytes(node->txt, id, 16);
 	album->artist = osfy_artist_add(session, id);
-	sp_artist_add_ref(album->artist);
 
 	if(sp_artist_is_loaded(album->artist) == 0) {
 		{
@@ -382,8 +408,7 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 		}
 
 		if((node = ezxml_get(album_node, "artist-name", -1)) != NULL) {
-			album->artist->name = realloc(album->artist->name, strlen(node->txt) + 1);
-			strcpy(album->artist->name, node->txt);
+			strpool_set(session, &album->artist->name, node->txt);
 
 			album->artist->is_loaded = 1;
 		}
@@ -403,7 +428,6 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 
 	hex_ascii_to_bytes(node->txt, id, 20);
 	album->image = osfy_image_create(session, id);
-	sp_image_add_ref(album->image);
 
 
 	/* Done loading */
@@ -414,9 +438,8 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 
 
 /* Load album from XML returned by track browsing */
-int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t album_node) {
+int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, const struct track_xml *tx) {
 	unsigned char id[20];
-	ezxml_t node;
 
 	{
 		char buf[33];
@@ -425,41 +448,40 @@ int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t
 	}
 
 	/* Verify we're loading XML for the expected album ID */
-	if((node = ezxml_get(album_node, "album-id", -1)) == NULL) {
+	if(tx->album_id == NULL) {
 		DSFYDEBUG("Failed to find element 'album-id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(album->id));
+	hex_ascii_to_bytes(tx->album_id, id, sizeof(album->id));
 	assert(memcmp(album->id, id, sizeof(album->id)) == 0);
 
 
 	/* Album name */
-	if((node = ezxml_get(album_node, "album", -1)) == NULL) {
+	if(tx->album == NULL) {
 		DSFYDEBUG("Failed to find element 'album'\n");
 		return -1;
 	}
 
-	album->name = realloc(album->name, strlen(node->txt) + 1);
-	strcpy(album->name, node->txt);
+	strpool_set(session, &album->name, tx->album);
 
 
 	/* Album year */
-	if((node = ezxml_get(album_node, "year", -1)) == NULL) {
+	if(tx->year == NULL) {
 		DSFYDEBUG("Failed to find element 'year'\n");
 		return -1;
 	}
 
-	album->year = atoi(node->txt);
+	album->year = atoi(tx->year);
 
 
 	/* Album artist */
-	if((node = ezxml_get(album_node, "album-artist-id", -1)) == NULL) {
+	if(tx->album_artist_id == NULL) {
 		DSFYDEBUG("Failed to find element 'album-artist-id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, 16);
+	hex_ascii_to_bytes(tx->album_artist_id, id, 16);
 
 
 	/* Add artist to album */
@@ -467,7 +489,6 @@ int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t
 		sp_artist_release(album->artist);
 
 	album->artist = osfy_artist_add(session, id);
-	sp_artist_add_ref(album->artist);
 
 	/* Load album from XML if necessary */
 	if(sp_artist_is_loaded(album->artist) == 0) {
@@ -477,26 +498,25 @@ int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t
 			DSFYDEBUG("Artist '%s' not yet loaded, trying to load from XML\n", buf);
 		}
 
-		osfy_artist_load_album_artist_from_xml(session, album->artist, album_node);
+		osfy_artist_load_album_artist_from_xml(session, album->artist, tx);
 	}
 
 	assert(sp_artist_is_loaded(album->artist) != 0);
 
 
 	/* Album cover */
-	if((node = ezxml_get(album_node, "cover", -1)) == NULL) {
+	if(tx->cover == NULL) {
 		DSFYDEBUG("Failed to find element 'cover'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, 20);
+	hex_ascii_to_bytes(tx->cover, id, 20);
 
 	/* Add cover to album */
 	if(album->image != NULL)
 		sp_image_release(album->image);
 
 	album->image = osfy_image_create(session, id);
-	sp_image_add_ref(album->image);
 
 
 	/* Done loading */
@@ -541,11 +561,21 @@ int osfy_album_browse(sp_session *session, sp_album *album) {
 	brctx->data.albums = albums;
 	brctx->num_total = 1;
 	brctx->num_browsed = 0;
+	brctx->offset = 0;
 	brctx->num_in_request = 0;
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->retry = NULL;
+	brctx->waiters = NULL;
+	brctx->num_waiters = 0;
+	brctx->error = SP_ERROR_OK;
 
 
 	/* Our gzip'd XML parser */
 	brctx->browse_parser = osfy_album_browse_callback;
+	brctx->browse_element = NULL;
+	brctx->browse_element_decoder = NULL;
+	brctx->browse_element_parser = NULL;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -561,12 +591,16 @@ static int osfy_album_browse_callback(struct browse_callback_ctx *brctx) {
 	struct buf *xml;
 	ezxml_t root;
 
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
+	xml = brctx->buf;
+	if(xml == NULL) {
+		DSFYDEBUG("Failed to decompress album XML\n");
+		return -1;
+	}
+
 #ifdef DEBUG
 	{
 		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
+		DSFYDEBUG("Decompresed %d bytes data\n", xml->len);
 		fd = fopen("browse-albums.xml", "w");
 		if(fd) {
 			fwrite(xml->ptr, xml->len, 1, fd);
@@ -578,24 +612,22 @@ static int osfy_album_browse_callback(struct browse_callback_ctx *brctx) {
 	root = ezxml_parse_str((char *) xml->ptr, xml->len);
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
 	albums = brctx->data.albums;
 	for(i = 0; i < brctx->num_in_request; i++) {
-		osfy_album_load_from_album_xml(brctx->session, albums[brctx->num_browsed + i], root);
-		assert(sp_album_is_loaded(albums[brctx->num_browsed + i]));
+		osfy_album_load_from_album_xml(brctx->session, albums[brctx->offset + i], root);
+		assert(sp_album_is_loaded(albums[brctx->offset + i]));
 	}
 
 
 	ezxml_free(root);
-	buf_free(xml);
 
 
 	/* Release references made in osfy_album_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_album_release(albums[brctx->num_browsed + i]);
+		sp_album_release(albums[brctx->offset + i]);
 
 
 	return 0;
@@ -73,11 +73,21 @@ SP_LIBEXPORT(sp_albumbrowse *) sp_albumbrowse_create(sp_session *session, sp_alb
 	brctx->data.albumbrowses[0] = alb;
 	brctx->num_total = 1;
 	brctx->num_browsed = 0;
+	brctx->offset = 0;
 	brctx->num_in_request = 0;
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->retry = NULL;
+	brctx->waiters = NULL;
+	brctx->num_waiters = 0;
+	brctx->error = SP_ERROR_OK;
 
 
 	/* Our gzip'd XML parser */
 	brctx->browse_parser = osfy_albumbrowse_browse_callback;
+	brctx->browse_element = NULL;
+	brctx->browse_element_decoder = NULL;
+	brctx->browse_element_parser = NULL;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -97,24 +107,23 @@ static int osfy_albumbrowse_browse_callback(struct browse_callback_ctx *brctx) {
 	ezxml_t root;
 
 	for(i = 0; i < brctx->num_in_request; i++) {
-		alb = brctx->data.albumbrowses[brctx->num_browsed + i];
+		alb = brctx->data.albumbrowses[brctx->offset + i];
 
 		/* Set defaults */
 		alb->is_loaded = 0;
 		alb->error = SP_ERROR_OTHER_TRANSIENT;
 	}
 
-	/* Might happen because of a channel error */
+	/* Might happen because of a channel or decompression error */
 	if(brctx->buf == NULL)
 		return 0;
 
 
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
+	xml = brctx->buf;
 #ifdef DEBUG
 	{
 		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
+		DSFYDEBUG("Decompresed %d bytes data\n", xml->len);
 		fd = fopen("browse-albumbrowse.xml", "w");
 		if(fd) {
 			fwrite(xml->ptr, xml->len, 1, fd);
@@ -126,23 +135,21 @@ static int osfy_albumbrowse_browse_callback(struct browse_callback_ctx *brctx) {
 	root = ezxml_parse_str((char *) xml->ptr, xml->len);
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
 	for(i = 0; i < brctx->num_in_request; i++) {
-		alb = brctx->data.albumbrowses[brctx->num_browsed + i];
+		alb = brctx->data.albumbrowses[brctx->offset + i];
 		osfy_albumbrowse_load_from_xml(brctx->session, alb, root);
 	}
 
 
 	ezxml_free(root);
-	buf_free(xml);
 
 
 	/* Release references made in sp_albumbrowse_create() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_albumbrowse_release(brctx->data.albumbrowses[brctx->num_browsed + i]);
+		sp_albumbrowse_release(brctx->data.albumbrowses[brctx->offset + i]);
 
 
 	return 0;
@@ -185,7 +192,6 @@ static int osfy_albumbrowse_load_from_xml(sp_session *session, sp_albumbrowse *a
 
 	hex_ascii_to_bytes(node->txt, id, 16);
 	alb->artist = osfy_artist_add(session, id);
-	sp_artist_add_ref(alb->artist);
 	if(sp_artist_is_loaded(alb->artist) == 0) {
 		DSFYDEBUG("Loading artist '%s' from XML returned by album browsing\n", node->txt);
 		osfy_artist_load_track_artist_from_xml(session, alb->artist, root);
@@ -253,10 +259,9 @@ static int osfy_albumbrowse_load_from_xml(sp_session *session, sp_albumbrowse *a
 				track->index = i;
 
 
-			/* Add track to albumbrowse and increase the track's ref count */
+			/* Add track to albumbrowse, it keeps the reference */
 			alb->tracks = realloc(alb->tracks, sizeof(sp_track *) * (1 + alb->num_tracks));
 			alb->tracks[alb->num_tracks] = track;
-			sp_track_add_ref(alb->tracks[alb->num_tracks]);
 			alb->num_tracks++;
 		}
 
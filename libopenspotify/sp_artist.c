@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -8,8 +9,14 @@
 #include "browse.h"
 #include "debug.h"
 #include "hashtable.h"
+#include "memstats.h"
+#include "metacache.h"
+#include "pool.h"
+#include "reclaim.h"
 #include "request.h"
 #include "sp_opaque.h"
+#include "strpool.h"
+#include "track.h"
 #include "util.h"
 
 
@@ -28,19 +35,16 @@ SP_LIBEXPORT(bool) sp_artist_is_loaded(sp_artist *artist) {
 
 SP_LIBEXPORT(void) sp_artist_add_ref(sp_artist *artist) {
 
-	artist->ref_count++;
+	REFCOUNT_INC(&artist->ref_count);
 }
 
 
+/* Unreferenced artists are freed by the garbage collector, see reclaim.c */
 SP_LIBEXPORT(void) sp_artist_release(sp_artist *artist) {
+	int ref_count;
 
-	assert(artist->ref_count > 0);
-
-	if(--artist->ref_count)
-		return;
-
-	DSFYDEBUG("Deallocated artist at %p\n", artist);
-	osfy_artist_free(artist);
+	ref_count = REFCOUNT_DEC(&artist->ref_count);
+	assert(ref_count >= 0);
 }
 
 
@@ -48,48 +52,76 @@ SP_LIBEXPORT(void) sp_artist_release(sp_artist *artist) {
  * Functions for internal use
  *
  */
+/* Find or create an artist, the caller gets a reference */
 sp_artist *osfy_artist_add(sp_session *session, unsigned char id[16]) {
 	sp_artist *artist;
 
+	/* Another thread adding the same artist must find this one */
+	hashtable_writer_lock(session->hashtable_artists);
 
-	artist = (sp_artist *)hashtable_find(session->hashtable_artists, id);
+	artist = (sp_artist *)reclaim_find(session->hashtable_artists, id, offsetof(sp_artist, ref_count));
 	if(artist) {
+		hashtable_writer_unlock(session->hashtable_artists);
 		DSFYDEBUG("Returning existing artist at %p (ref_count %d)\n",
-		artist, artist->ref_count);
+		artist, (int)REFCOUNT_GET(&artist->ref_count));
 		return artist;
 	}
 
-	artist = malloc(sizeof(sp_artist));
-	if(artist == NULL)
+	artist = pool_get(&session->pool_artists);
+	if(artist == NULL) {
+		hashtable_writer_unlock(session->hashtable_artists);
 		return NULL;
+	}
 
 	DSFYDEBUG("Allocated artist at %p\n", artist);
+	memstats_alloc(session, OPENSP_MEMORY_ARTISTS, sizeof(sp_artist));
 
 	memcpy(artist->id, id, sizeof(artist->id));
 
 	artist->name = NULL;
 
 	artist->is_loaded = 0;
-	artist->ref_count = 0;
+	REFCOUNT_INIT(&artist->ref_count, 1);
+	artist->is_cached = 0;
 
 	artist->hashtable = session->hashtable_artists;
 	hashtable_insert(artist->hashtable, artist->id, artist);
+	hashtable_writer_unlock(artist->hashtable);
+
+	/* Saved by an earlier session? */
+	metacache_load_artist(session, artist);
 
 	return artist;
 }
 
 
-/* Free an artist. Used by sp_artist_relase() and the garbage collector */
-void osfy_artist_free(sp_artist *artist) {
+/* Free an artist retired by the garbage collector */
+void osfy_artist_free(sp_session *session, sp_artist *artist) {
+
+	assert(REFCOUNT_GET(&artist->ref_count) == RECLAIM_DEAD);
 
-	assert(artist->ref_count == 0);
+	/* Written by the next save, unless it's there already */
+	metacache_retire_artist(session, artist);
 
-	hashtable_remove(artist->hashtable, artist->id);
+	strpool_put(session, artist->name);
 
-	if(artist->name)
-		free(artist->name);
+	memstats_free(session, OPENSP_MEMORY_ARTISTS, sizeof(sp_artist));
 
-	free(artist);
+	pool_put(&session->pool_artists, artist);
+}
+
+
+static void osfy_artist_reclaim(sp_session *session, void *object) {
+	sp_artist *artist = (sp_artist *)object;
+
+	DSFYDEBUG("Freeing artist %p because of zero ref_count\n", artist);
+	osfy_artist_free(session, artist);
+}
+
+
+int osfy_artist_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots) {
+	return reclaim_sweep(session, session->hashtable_artists, cursor, num_slots,
+			offsetof(sp_artist, ref_count), osfy_artist_reclaim);
 }
 
 
@@ -120,8 +152,7 @@ int osfy_artist_load_artist_from_xml(sp_session *session, sp_artist *artist, ezx
 		return -1;
 	}
 
-	artist->name = realloc(artist->name, strlen(node->txt) + 1);
-	strcpy(artist->name, node->txt);
+	strpool_set(session, &artist->name, node->txt);
 
 
 	artist->is_loaded = 1;
@@ -158,8 +189,7 @@ int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artis
 		}
 
 		/* Artist name */
-		artist->name = realloc(artist->name, strlen(name_node->txt) + 1);
-		strcpy(artist->name, name_node->txt);
+		strpool_set(session, &artist->name, name_node->txt);
 		break;
 	}
 
@@ -172,10 +202,42 @@ int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artis
 }
 
 
+/* Load a track's artist from XML returned by track browsing */
+int osfy_artist_load_from_track_xml(sp_session *session, sp_artist *artist, const struct track_xml *tx) {
+	unsigned char id[16];
+	int i;
+
+	{
+		char buf[33];
+		hex_bytes_to_ascii(artist->id, buf, 16);
+		DSFYDEBUG("Loading track artist '%s' from XML returned by track browsing\n", buf);
+	}
+
+	for(i = 0; i < tx->num_artist_ids && i < tx->num_artists; i++) {
+		/* Verify we're loading XML for the expected artist ID */
+		hex_ascii_to_bytes(tx->artist_ids[i], id, sizeof(artist->id));
+		if(memcmp(artist->id, id, sizeof(artist->id))) {
+			DSFYDEBUG("Artist '%s' at offset %d is not the one sought\n", tx->artist_ids[i], i);
+			continue;
+		}
+
+		/* Artist name */
+		strpool_set(session, &artist->name, tx->artists[i]);
+		break;
+	}
+
+
+	assert(i < tx->num_artist_ids && i < tx->num_artists);
+
+	artist->is_loaded = 1;
+
+	return 0;
+}
+
+
 /* Load albums's artist from XML returned by track browsing */
-int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t artist_node) {
+int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artist, const struct track_xml *tx) {
 	unsigned char id[16];
-	ezxml_t node;
 
 	{
 		char buf[33];
@@ -184,23 +246,22 @@ int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artis
 	}
 
 	/* Verify we're loading XML for the expected artist ID */
-	if((node = ezxml_get(artist_node, "album-artist-id", -1)) == NULL) {
+	if(tx->album_artist_id == NULL) {
 		DSFYDEBUG("Failed to find element 'album-artist-id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(artist->id));
+	hex_ascii_to_bytes(tx->album_artist_id, id, sizeof(artist->id));
 	assert(memcmp(artist->id, id, sizeof(artist->id)) == 0);
 
 
 	/* Artist name */
-	if((node = ezxml_get(artist_node, "album-artist", -1)) == NULL) {
+	if(tx->album_artist == NULL) {
 		DSFYDEBUG("Failed to find element 'album-artist'\n");
 		return -1;
 	}
 
-	artist->name = realloc(artist->name, strlen(node->txt) + 1);
-	strcpy(artist->name, node->txt);
+	strpool_set(session, &artist->name, tx->album_artist);
 
 
 	artist->is_loaded = 1;
@@ -245,11 +306,21 @@ int osfy_artist_browse(sp_session *session, sp_artist *artist) {
 	brctx->data.artists = artists;
 	brctx->num_total = 1;
 	brctx->num_browsed = 0;
+	brctx->offset = 0;
 	brctx->num_in_request = 0;
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->retry = NULL;
+	brctx->waiters = NULL;
+	brctx->num_waiters = 0;
+	brctx->error = SP_ERROR_OK;
 
 
 	/* Our gzip'd XML parser */
 	brctx->browse_parser = osfy_artist_browse_callback;
+	brctx->browse_element = NULL;
+	brctx->browse_element_decoder = NULL;
+	brctx->browse_element_parser = NULL;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -265,12 +336,16 @@ static int osfy_artist_browse_callback(struct browse_callback_ctx *brctx) {
 	struct buf *xml;
 	ezxml_t root;
 
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
+	xml = brctx->buf;
+	if(xml == NULL) {
+		DSFYDEBUG("Failed to decompress artist XML\n");
+		return -1;
+	}
+
 #ifdef DEBUG
 	{
 		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
+		DSFYDEBUG("Decompresed %d bytes data\n", xml->len);
 		fd = fopen("browse-artists.xml", "w");
 		if(fd) {
 			fwrite(xml->ptr, xml->len, 1, fd);
@@ -282,24 +357,22 @@ static int osfy_artist_browse_callback(struct browse_callback_ctx *brctx) {
 	root = ezxml_parse_str((char *) xml->ptr, xml->len);
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
 
 	artists = brctx->data.artists;
 	for(i = 0; i < brctx->num_in_request; i++) {
-		osfy_artist_load_artist_from_xml(brctx->session, artists[brctx->num_browsed + i], root);
+		osfy_artist_load_artist_from_xml(brctx->session, artists[brctx->offset + i], root);
 	}
 
 
 	ezxml_free(root);
-	buf_free(xml);
 
 
 	/* Release references made in osfy_artist_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_artist_release(artists[brctx->num_browsed + i]);
+		sp_artist_release(artists[brctx->offset + i]);
 
 
 	return 0;
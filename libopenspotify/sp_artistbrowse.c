@@ -78,10 +78,20 @@ SP_LIBEXPORT(sp_artistbrowse *) sp_artistbrowse_create(sp_session *session, sp_a
 	brctx->data.artistbrowses[0] = arb;
 	brctx->num_total = 1;
 	brctx->num_browsed = 0;
+	brctx->offset = 0;
 	brctx->num_in_request = 0;
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->retry = NULL;
+	brctx->waiters = NULL;
+	brctx->num_waiters = 0;
+	brctx->error = SP_ERROR_OK;
 
 	/* Our gzip'd XML parser */
 	brctx->browse_parser = osfy_artistbrowse_browse_callback;
+	brctx->browse_element = NULL;
+	brctx->browse_element_decoder = NULL;
+	brctx->browse_element_parser = NULL;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -101,23 +111,22 @@ static int osfy_artistbrowse_browse_callback(struct browse_callback_ctx *brctx)
 	ezxml_t root;
 
 	for(i = 0; i < brctx->num_in_request; i++) {
-		arb = brctx->data.artistbrowses[brctx->num_browsed + i];
+		arb = brctx->data.artistbrowses[brctx->offset + i];
 
 		/* Set defaults */
 		arb->is_loaded = 0;
 		arb->error = SP_ERROR_OTHER_TRANSIENT;
 	}
 
-	/* Might happen because of a channel error */
+	/* Might happen because of a channel or decompression error */
 	if(brctx->buf == NULL)
 		return 0;
 
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
+	xml = brctx->buf;
 #ifdef DEBUG
 	{
 		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
+		DSFYDEBUG("Decompresed %d bytes data\n", xml->len);
 		fd = fopen("browse-artistbrowse.xml", "w");
 		if(fd) {
 			fwrite(xml->ptr, xml->len, 1, fd);
@@ -129,12 +138,11 @@ static int osfy_artistbrowse_browse_callback(struct browse_callback_ctx *brctx)
 	root = ezxml_parse_str((char *) xml->ptr, xml->len);
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
 	for(i = 0; i < brctx->num_in_request; i++) {
-		arb = brctx->data.artistbrowses[brctx->num_browsed + i];
+		arb = brctx->data.artistbrowses[brctx->offset + i];
 		osfy_artistbrowse_load_from_xml(brctx->session, arb, root);
 		arb->is_loaded = 1;
 		arb->error = SP_ERROR_OK;
@@ -142,12 +150,11 @@ static int osfy_artistbrowse_browse_callback(struct browse_callback_ctx *brctx)
 
 
 	ezxml_free(root);
-	buf_free(xml);
 
 
 	/* Release references made in sp_artistbrowse_create() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_artistbrowse_release(brctx->data.artistbrowses[brctx->num_browsed + i]);
+		sp_artistbrowse_release(brctx->data.artistbrowses[brctx->offset + i]);
 
 
 	return 0;
@@ -206,7 +213,6 @@ static int osfy_artistbrowse_load_from_xml(sp_session *session, sp_artistbrowse
 
 		arb->similar_artists[arb->num_similar_artists]
 					= osfy_artist_add(session, id);
-		sp_artist_add_ref(arb->similar_artists[arb->num_similar_artists]);
 
 		if(sp_artist_is_loaded(arb->similar_artists[arb->num_similar_artists]) == 0) {
 			DSFYDEBUG("Loading similar artist from artistbrowse XML\n");
@@ -243,7 +249,6 @@ static int osfy_artistbrowse_load_from_xml(sp_session *session, sp_artistbrowse
 		/* Add album to artistbrowse's list of albums */
 		arb->albums = realloc(arb->albums, sizeof(sp_album *) * (1 + arb->num_albums));
 		arb->albums[arb->num_albums] = album;
-		sp_album_add_ref(arb->albums[arb->num_albums]);
 		arb->num_albums++;
 
 
@@ -305,10 +310,9 @@ static int osfy_artistbrowse_load_from_xml(sp_session *session, sp_artistbrowse
 					track->is_available = album->is_available;
 				}
 
-				/* Add track to artistbrowse and increase the track's ref count */
+				/* Add track to artistbrowse, it keeps the reference */
 				arb->tracks = realloc(arb->tracks, sizeof(sp_track *) * (1 + arb->num_tracks));
 				arb->tracks[arb->num_tracks] = track;
-				sp_track_add_ref(arb->tracks[arb->num_tracks]);
 
 				arb->num_tracks++;
 			}
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -5,21 +6,154 @@
 #include <libspotify/api.h>
 
 #include "buf.h"
+#include "channel.h"
 #include "commands.h"
 #include "debug.h"
+#include "decoder.h"
+#include "flowctl.h"
 #include "image.h"
+#include "imgcache.h"
 #include "hashtable.h"
+#include "memstats.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "util.h"
 
 
 static int osfy_image_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void osfy_image_read(struct decode_job *job);
+static void osfy_image_read_release(struct decode_job *job);
+static void osfy_image_set_loaded(sp_session *session, sp_image *image);
+static void osfy_image_done(sp_session *session, struct image_ctx *image_ctx);
+static void osfy_image_free(sp_image *image);
+static void image_lru_account(struct image_lru *lru, sp_image *image);
+static void image_lru_link(struct image_lru *lru, sp_image *image);
+static void image_lru_unlink(struct image_lru *lru, sp_image *image);
+static void image_lru_evict(struct image_lru *lru);
+static void image_lru_lock(struct image_lru *lru);
+static void image_lru_unlock(struct image_lru *lru);
+
+
+void image_lru_init(sp_session *session) {
+	struct image_lru *lru = &session->images;
+
+	lru->head = NULL;
+	lru->tail = NULL;
+	lru->num_images = 0;
+
+	lru->size = 0;
+	lru->max_size = IMAGE_MEMORY_DEFAULT_SIZE;
+
+	lru->num_hits = 0;
+	lru->num_disk_hits = 0;
+	lru->num_misses = 0;
+	lru->num_evictions = 0;
+
+	lru->sweep = NULL;
+	lru->sweeping = 0;
+	lru->num_collected = 0;
+
+#ifdef _WIN32
+	lru->mutex = CreateMutex(NULL, FALSE, NULL);
+#else
+	pthread_mutex_init(&lru->mutex, NULL);
+#endif
+}
+
+
+/* Free the images nobody holds a reference to anymore */
+void image_lru_free(sp_session *session) {
+	struct image_lru *lru = &session->images;
+	sp_image *image;
+
+	while((image = lru->head) != NULL) {
+		image_lru_unlink(lru, image);
+		osfy_image_free(image);
+	}
+
+#ifdef _WIN32
+	CloseHandle(lru->mutex);
+#else
+	pthread_mutex_destroy(&lru->mutex);
+#endif
+}
+
+
+/* Change the budget, called by opensp_session_set_image_memory_size() */
+void image_lru_set_size(sp_session *session, size_t max_size) {
+	struct image_lru *lru = &session->images;
+
+	image_lru_lock(lru);
+	lru->max_size = max_size;
+	image_lru_evict(lru);
+	image_lru_unlock(lru);
+}
+
+
+/*
+ * Free up to max_images of the unreferenced images that aren't loaded.
+ * They cost no budget, so they're never evicted otherwise. Goes on where
+ * the last call stopped and returns 1 once the whole list was seen.
+ * Called by the garbage collector on the iothread.
+ *
+ */
+int image_lru_collect(sp_session *session, int max_images) {
+	struct image_lru *lru = &session->images;
+	sp_image *image;
+	int done;
+
+	image_lru_lock(lru);
+	if(!lru->sweeping) {
+		lru->sweep = lru->tail;
+		lru->sweeping = 1;
+	}
 
+	for(; max_images && (image = lru->sweep) != NULL; max_images--) {
+		lru->sweep = image->lru_prev;
+		if(image->is_loaded)
+			continue;
 
+		image_lru_unlink(lru, image);
+		osfy_image_free(image);
+
+		lru->num_collected++;
+	}
+
+	done = lru->sweep == NULL;
+	if(done)
+		lru->sweeping = 0;
+
+	image_lru_unlock(lru);
+
+	return done;
+}
+
+
+/* Copy the counters, called by opensp_session_image_stats() */
+void image_lru_stats(sp_session *session, opensp_image_stats *stats) {
+	struct image_lru *lru = &session->images;
+
+	image_lru_lock(lru);
+	stats->bytes = lru->size;
+	stats->max_bytes = lru->max_size;
+	stats->num_unreferenced = lru->num_images;
+	stats->num_hits = lru->num_hits;
+	stats->num_disk_hits = lru->num_disk_hits;
+	stats->num_misses = lru->num_misses;
+	stats->num_evictions = lru->num_evictions;
+	image_lru_unlock(lru);
+}
+
+
+/*
+ * Find or create an image, the caller gets a reference
+ * Called by the main thread and the iothread.
+ *
+ */
 sp_image *osfy_image_create(sp_session *session, const byte image_id[20]) {
 	sp_image *image;
 
+	image_lru_lock(&session->images);
 	image = (sp_image *)hashtable_find(session->hashtable_images, image_id);
 	if(image) {
 		{
@@ -28,10 +162,17 @@ sp_image *osfy_image_create(sp_session *session, const byte image_id[20]) {
 			DSFYDEBUG("Returning existing image '%s'\n", buf);
 		}
 
+		if(image->in_lru)
+			image_lru_unlink(&session->images, image);
+
+		image->ref_count++;
+		image_lru_unlock(&session->images);
+
 		return image;
 	}
 
 	image = malloc(sizeof(sp_image));
+	memstats_alloc(session, OPENSP_MEMORY_IMAGES, sizeof(sp_image));
 
 	memcpy(image->id, image_id, sizeof(image->id));
 	image->format = SP_IMAGE_FORMAT_UNKNOWN;
@@ -39,15 +180,23 @@ sp_image *osfy_image_create(sp_session *session, const byte image_id[20]) {
 
 	image->error = SP_ERROR_RESOURCE_NOT_LOADED;
 
-	image->callback = NULL;
+	image->num_callbacks = 0;
+	image->callbacks = NULL;
 	image->userdata = NULL;
 
 	image->is_loaded = 0;
-	image->ref_count = 0;
+	image->ref_count = 1;
 
+	image->in_lru = 0;
+	image->lru_prev = NULL;
+	image->lru_next = NULL;
+
+	image->session = session;
 	image->hashtable = session->hashtable_images;
 	hashtable_insert(image->hashtable, image->id, image);
 
+	image_lru_unlock(&session->images);
+
 	return image;
 }
 
@@ -59,23 +208,45 @@ SP_LIBEXPORT(sp_image *) sp_image_create(sp_session *session, const byte image_i
 
 
 	image = osfy_image_create(session, image_id);
-	sp_image_add_ref(image);
 
-	if(sp_image_is_loaded(image))
+	if(sp_image_is_loaded(image)) {
+		image_lru_lock(&session->images);
+		session->images.num_hits++;
+		image_lru_unlock(&session->images);
+
 		return image;
+	}
 
 
 	/* Prevent the image from being loaded twice */
 	if(image->error == SP_ERROR_IS_LOADING)
 		return image;
 
+	/* Read from the disk cache or downloaded by osfy_image_process_request() */
 	image->error = SP_ERROR_IS_LOADING;
 
+	/* Held by the request, released by osfy_image_loaded() */
+	sp_image_add_ref(image);
+
 
 	image_ctx = malloc(sizeof(struct image_ctx));
 	image_ctx->session = session;
 	image_ctx->req = NULL;
 	image_ctx->image = image;
+	image_ctx->data = NULL;
+
+	/* Downloaded by this or an earlier session? Read and returned by a decoder thread */
+	if(imgcache_contains(session, image->id)) {
+		image_ctx->job.decode = osfy_image_read;
+		image_ctx->job.release = osfy_image_read_release;
+		decoder_submit_detached(session, &image_ctx->job);
+
+		return image;
+	}
+
+	image_lru_lock(&session->images);
+	session->images.num_misses++;
+	image_lru_unlock(&session->images);
 
 	container = (void **)malloc(sizeof(void *));
 	*container = image_ctx;
@@ -83,7 +254,7 @@ SP_LIBEXPORT(sp_image *) sp_image_create(sp_session *session, const byte image_i
 	{
 		char buf[41];
 		hex_bytes_to_ascii(image->id, buf, 20);
-		DSFYDEBUG("Requesting download of image '%s'\n", buf);
+		DSFYDEBUG("Requesting image '%s'\n", buf);
 	}
 
 	request_post(session, REQ_TYPE_IMAGE, container);
@@ -92,10 +263,42 @@ SP_LIBEXPORT(sp_image *) sp_image_create(sp_session *session, const byte image_i
 }
 
 
+/*
+ * Notify the load callbacks of a downloaded image and drop the reference
+ * held by its request. Called by sp_session_process_events().
+ *
+ */
+void osfy_image_loaded(sp_session *session, sp_image *image) {
+	image_loaded_cb **callbacks;
+	void **userdata;
+	int i, num_callbacks;
+
+	/* Callbacks may add or remove callbacks, the request's reference keeps the image */
+	num_callbacks = image->num_callbacks;
+	callbacks = malloc(sizeof(image_loaded_cb *) * (1 + num_callbacks));
+	userdata = malloc(sizeof(void *) * (1 + num_callbacks));
+	memcpy(callbacks, image->callbacks, sizeof(image_loaded_cb *) * num_callbacks);
+	memcpy(userdata, image->userdata, sizeof(void *) * num_callbacks);
+
+	for(i = 0; i < num_callbacks; i++)
+		callbacks[i](image, userdata[i]);
+
+	free(callbacks);
+	free(userdata);
+
+	sp_image_release(image);
+}
+
+
 SP_LIBEXPORT(void) sp_image_add_load_callback(sp_image *image, image_loaded_cb *callback, void *userdata) {
-	/* FIXME: Support multiple callbacks */
-	image->callback = callback;
-	image->userdata = userdata;
+
+	image->callbacks = realloc(image->callbacks, sizeof(image_loaded_cb *) * (1 + image->num_callbacks));
+	image->userdata = realloc(image->userdata, sizeof(void *) * (1 + image->num_callbacks));
+
+	image->callbacks[image->num_callbacks] = callback;
+	image->userdata[image->num_callbacks] = userdata;
+
+	image->num_callbacks++;
 
 
 	/* FIXME: Check with libspotify */
@@ -105,9 +308,21 @@ SP_LIBEXPORT(void) sp_image_add_load_callback(sp_image *image, image_loaded_cb *
 
 
 SP_LIBEXPORT(void) sp_image_remove_load_callback(sp_image *image, image_loaded_cb *callback, void *userdata) {
-	/* FIXME: Support multiple callbacks */
-	image->callback = NULL;
-	image->userdata = NULL;
+	int i;
+
+	do {
+		for(i = 0; i < image->num_callbacks; i++) {
+			if(image->callbacks[i] != callback || image->userdata[i] != userdata)
+				continue;
+
+			image->callbacks[i] = image->callbacks[image->num_callbacks - 1];
+			image->userdata[i] = image->userdata[image->num_callbacks - 1];
+			image->num_callbacks--;
+
+			/* We don't bother with reallocating memory at this point */
+			break;
+		}
+	} while(i != image->num_callbacks);
 }
 
 
@@ -144,16 +359,42 @@ SP_LIBEXPORT(const byte *) sp_image_image_id(sp_image *image) {
 
 
 SP_LIBEXPORT(void) sp_image_add_ref(sp_image *image) {
+	struct image_lru *lru = &image->session->images;
+
+	image_lru_lock(lru);
+	if(image->in_lru)
+		image_lru_unlink(lru, image);
 
 	image->ref_count++;
+	image_lru_unlock(lru);
 }
 
 
+/*
+ * Unreferenced images are kept until they're evicted to stay within
+ * the budget, as another thread may just have found them with
+ * osfy_image_create(). Images that aren't loaded cost no budget, they're
+ * freed by the garbage collector, see image_lru_collect().
+ *
+ */
 SP_LIBEXPORT(void) sp_image_release(sp_image *image) {
+	struct image_lru *lru = &image->session->images;
 
+	image_lru_lock(lru);
 	assert(image->ref_count);
-	if(--image->ref_count)
+	if(--image->ref_count) {
+		image_lru_unlock(lru);
 		return;
+	}
+
+	image_lru_link(lru, image);
+	image_lru_evict(lru);
+	image_lru_unlock(lru);
+}
+
+
+/* Called with the LRU locked, or by image_lru_free() */
+static void osfy_image_free(sp_image *image) {
 
 	hashtable_remove(image->hashtable, image->id);
 
@@ -163,9 +404,19 @@ SP_LIBEXPORT(void) sp_image_release(sp_image *image) {
 		DSFYDEBUG("Freeing image '%s'\n", buf);
 	}
 
+	if(image->is_loaded) {
+		image->session->images.size -= image->data->len;
+		memstats_resize(image->session, OPENSP_MEMORY_IMAGES, image->data->len, 0);
+	}
+
+	memstats_free(image->session, OPENSP_MEMORY_IMAGES, sizeof(sp_image));
+
 	if(image->data)
 		buf_free(image->data);
 
+	free(image->callbacks);
+	free(image->userdata);
+
 	free(image);
 }
 
@@ -173,6 +424,10 @@ SP_LIBEXPORT(void) sp_image_release(sp_image *image) {
 int osfy_image_process_request(sp_session *session, struct request *req) {
 	struct image_ctx *image_ctx = *(struct image_ctx **)req->input;
 
+	/* Parked until there's room for another channel */
+	if(!flowctl_admit(session, req))
+		return 0;
+
 	/*
 	 * Prevent request from happening again.
 	 * If there's an error the channel callback will reset the timeout
@@ -210,19 +465,15 @@ static int osfy_image_callback(CHANNEL *ch, unsigned char *payload, unsigned sho
 			image_ctx->image->data = NULL;
 
 			/* Reset timeout so the request can be retried */
-			image_ctx->req->next_timeout = get_millisecs() + IMAGE_RETRY_TIMEOUT*1000;
+			request_set_timeout(image_ctx->session, image_ctx->req, channel_retry_timeout(ch, IMAGE_RETRY_TIMEOUT*1000));
 
 			break;
 
 		case CHANNEL_END:
-			/* We simply assume we're always getting a JPEG image back */
-			image_ctx->image->format = SP_IMAGE_FORMAT_JPEG;
-			image_ctx->image->is_loaded = 1;
-			image_ctx->image->error = SP_ERROR_OK;
-
-			request_set_result(image_ctx->session, image_ctx->req, SP_ERROR_OK, image_ctx->image);
+			/* Keep it for the next session */
+			imgcache_store(image_ctx->session, image_ctx->image->id, image_ctx->image->data);
 
-			free(image_ctx);
+			osfy_image_done(image_ctx->session, image_ctx);
 			break;
 
 		default:
@@ -231,3 +482,159 @@ static int osfy_image_callback(CHANNEL *ch, unsigned char *payload, unsigned sho
 
 	return 0;
 }
+
+
+/*
+ * Read the image from the disk cache and return it to the main thread,
+ * run by a decoder thread. If it was evicted meanwhile it's downloaded.
+ *
+ */
+static void osfy_image_read(struct decode_job *job) {
+	struct image_ctx *image_ctx;
+	sp_session *session;
+	void **container;
+
+	image_ctx = (struct image_ctx *)((char *)job - offsetof(struct image_ctx, job));
+	session = image_ctx->session;
+
+	image_ctx->data = imgcache_load(session, image_ctx->image->id);
+	if(image_ctx->data == NULL) {
+		image_lru_lock(&session->images);
+		session->images.num_misses++;
+		image_lru_unlock(&session->images);
+
+		container = (void **)malloc(sizeof(void *));
+		*container = image_ctx;
+		request_post(session, REQ_TYPE_IMAGE, container);
+		return;
+	}
+
+	image_lru_lock(&session->images);
+	session->images.num_disk_hits++;
+	image_lru_unlock(&session->images);
+
+	image_ctx->image->data = image_ctx->data;
+	osfy_image_set_loaded(session, image_ctx->image);
+
+	request_post_result(session, REQ_TYPE_IMAGE, SP_ERROR_OK, image_ctx->image);
+
+	free(image_ctx);
+}
+
+
+static void osfy_image_read_release(struct decode_job *job) {
+	struct image_ctx *image_ctx;
+
+	image_ctx = (struct image_ctx *)((char *)job - offsetof(struct image_ctx, job));
+
+	if(image_ctx->data != NULL)
+		buf_free(image_ctx->data);
+
+	free(image_ctx);
+}
+
+
+/* Mark the image as loaded with its data, which it must have */
+static void osfy_image_set_loaded(sp_session *session, sp_image *image) {
+
+	/* We simply assume we're always getting a JPEG image back */
+	image->format = SP_IMAGE_FORMAT_JPEG;
+	image->is_loaded = 1;
+	image->error = SP_ERROR_OK;
+
+	image_lru_lock(&session->images);
+	image_lru_account(&session->images, image);
+	image_lru_unlock(&session->images);
+}
+
+
+/* Mark a downloaded image as loaded and return the request */
+static void osfy_image_done(sp_session *session, struct image_ctx *image_ctx) {
+
+	osfy_image_set_loaded(session, image_ctx->image);
+
+	request_set_result(session, image_ctx->req, SP_ERROR_OK, image_ctx->image);
+
+	free(image_ctx);
+}
+
+
+/*
+ * Count the data of an image that was just loaded and make room
+ * for it. The image is referenced, so it's not evicted itself.
+ *
+ */
+static void image_lru_account(struct image_lru *lru, sp_image *image) {
+	lru->size += image->data->len;
+	memstats_resize(image->session, OPENSP_MEMORY_IMAGES, 0, image->data->len);
+	image_lru_evict(lru);
+}
+
+
+/* Insert an unreferenced image as the most recently released one */
+static void image_lru_link(struct image_lru *lru, sp_image *image) {
+	image->lru_prev = NULL;
+	image->lru_next = lru->head;
+
+	if(lru->head != NULL)
+		lru->head->lru_prev = image;
+	else
+		lru->tail = image;
+
+	lru->head = image;
+	lru->num_images++;
+	image->in_lru = 1;
+}
+
+
+static void image_lru_unlink(struct image_lru *lru, sp_image *image) {
+	if(lru->sweep == image)
+		lru->sweep = image->lru_prev;
+
+	if(image->lru_prev != NULL)
+		image->lru_prev->lru_next = image->lru_next;
+	else
+		lru->head = image->lru_next;
+
+	if(image->lru_next != NULL)
+		image->lru_next->lru_prev = image->lru_prev;
+	else
+		lru->tail = image->lru_prev;
+
+	image->lru_prev = NULL;
+	image->lru_next = NULL;
+
+	lru->num_images--;
+	image->in_lru = 0;
+}
+
+
+/* Free the least recently released images until loaded images are within budget */
+static void image_lru_evict(struct image_lru *lru) {
+	sp_image *image;
+
+	while(lru->size > lru->max_size && (image = lru->tail) != NULL) {
+		image_lru_unlink(lru, image);
+		osfy_image_free(image);
+
+		lru->num_evictions++;
+	}
+}
+
+
+static void image_lru_lock(struct image_lru *lru) {
+#ifdef _WIN32
+	WaitForSingleObject(lru->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&lru->mutex);
+#endif
+}
+
+
+static void image_lru_unlock(struct image_lru *lru) {
+#ifdef _WIN32
+	ReleaseMutex(lru->mutex);
+#else
+	pthread_mutex_unlock(&lru->mutex);
+#endif
+}
@@ -78,7 +78,6 @@ SP_LIBEXPORT(sp_link *) sp_link_create_from_string (const char *link) {
 
 		lnk->type       = SP_LINKTYPE_TRACK;
 		lnk->data.track = osfy_track_add(session, id);
-		sp_track_add_ref(lnk->data.track);
 
 		/* Browse track if needed */
 		if(sp_track_is_loaded(lnk->data.track) == 0) {
@@ -94,7 +93,6 @@ SP_LIBEXPORT(sp_link *) sp_link_create_from_string (const char *link) {
 
 		lnk->type       = SP_LINKTYPE_ALBUM;
 		lnk->data.album = sp_album_add(session, id);
-		sp_album_add_ref(lnk->data.album);
 
 		/* Browse album if needed */
 		if(sp_album_is_loaded(lnk->data.album) == 0) {
@@ -110,7 +108,6 @@ SP_LIBEXPORT(sp_link *) sp_link_create_from_string (const char *link) {
 
 		lnk->type        = SP_LINKTYPE_ARTIST;
 		lnk->data.artist = osfy_artist_add(session, id);
-		sp_artist_add_ref(lnk->data.artist);
 
 		/* Browse artist if needed */
 		if(sp_artist_is_loaded(lnk->data.artist) == 0) {
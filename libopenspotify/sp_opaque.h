@@ -24,11 +24,22 @@
 #define SP_LIBEXPORT(x) __attribute__((visibility("default"))) x
 #endif
 
+#include "browse.h"
 #include "channel.h"
+#include "decoder.h"
+#include "flowctl.h"
+#include "gc.h"
 #include "hashtable.h"
+#include "image.h"
 #include "login.h"
+#include "memstats.h"
 #include "player.h"
+#include "pool.h"
+#include "reclaim.h"
+#include "request.h"
+#include "ring.h"
 #include "shn.h"
+#include "strpool.h"
 
 
 /* sp_album.c */
@@ -36,18 +47,21 @@ struct sp_album {
 	unsigned char id[16];
 	sp_image *image;
 
-	char *name;
+	const char *name;
 	int year;
 	sp_albumtype type;
 
 	sp_artist *artist;
 
-	char *restricted_countries;
-	char *allowed_countries;
+	const char *restricted_countries;
+	const char *allowed_countries;
 	int is_available;
 
 	int is_loaded;
-	int ref_count;
+	refcount_t ref_count;
+
+	/* Has a record in the metadata cache file, see metacache.c */
+	int is_cached;
 
 	struct hashtable *hashtable;
 };
@@ -109,10 +123,13 @@ struct sp_artistbrowse {
 struct sp_artist {
 	unsigned char id[16];
 
-	char *name;
+	const char *name;
 
 	int is_loaded;
-	int ref_count;
+	refcount_t ref_count;
+
+	/* Has a record in the metadata cache file, see metacache.c */
+	int is_cached;
 
 	struct hashtable *hashtable;
 };
@@ -127,14 +144,21 @@ struct sp_image {
 
 	sp_imageformat format;
 
-	image_loaded_cb *callback;
-	void *userdata;
+	int num_callbacks;
+	image_loaded_cb **callbacks;
+	void **userdata;
 
 	sp_error error;
 
 	int ref_count;
 	int is_loaded;
 
+	/* Neighbours in the session's unreferenced images, see sp_image.c */
+	int in_lru;
+	sp_image *lru_prev;
+	sp_image *lru_next;
+
+	sp_session *session;
 	struct hashtable *hashtable;
 };
 
@@ -283,7 +307,7 @@ struct sp_track {
 	unsigned char id[16];
 	unsigned char file_id[20];
 
-	char *name;
+	const char *name;
 
 	sp_album *album;
 
@@ -293,8 +317,8 @@ struct sp_track {
 	int has_explicit_lyrics;
 
 	int is_available;
-	char *restricted_countries;
-	char *allowed_countries;
+	const char *restricted_countries;
+	const char *allowed_countries;
 
 	int index;
 	int disc;
@@ -304,7 +328,10 @@ struct sp_track {
 	int is_loaded;
 	sp_error error;
 
-	int ref_count;
+	refcount_t ref_count;
+
+	/* Has a record in the metadata cache file, see metacache.c */
+	int is_cached;
 
 	struct hashtable *hashtable;
 };
@@ -319,7 +346,7 @@ struct sp_user {
 
 	sp_error error;
 	int is_loaded;
-	int ref_count;
+	refcount_t ref_count;
 };
 
 
@@ -334,6 +361,12 @@ struct sp_session {
 	/* Low-level network stuff */
 	int sock;
 
+	/* Bumped for every new connection, since the kernel may reuse the descriptor */
+	unsigned int sock_generation;
+
+	/* Event loop for the iothread, see ioloop.c */
+	struct ioloop *ioloop;
+
 
 	/* Used when logging in */
 	char username[256];
@@ -347,20 +380,49 @@ struct sp_session {
 	shn_ctx shn_recv;
 	shn_ctx shn_send;
 
-	struct buf *packet;
+	/*
+	 * Incoming packets, and the payload length of the packet at
+	 * the head of the ring once its header has been decrypted
+	 * in place, or -1
+	 *
+	 */
+	struct ring rx;
+	int rx_packet_len;
+
+	/*
+	 * Encrypted packets waiting to be sent, flushed by the iothread,
+	 * and a reusable buffer for building packet payloads
+	 *
+	 */
+	struct ring tx;
+	struct buf *tx_payload;
 
 	/* Channels */
-	CHANNEL *channels;
+	struct channel_table channels;
 	int num_channels;
-	int next_channel_id;
 
-	/* Requests scoreboard */
-	struct request *requests;
+	/* Limits the number of channels in flight, see flowctl.c */
+	struct flowctl flowctl;
+
+	/* Requests scoreboard, see request.c */
+	struct request_scheduler requests;
+
+	/* Track lookups waiting to be browsed together, see browse.c */
+	struct browse_coalescer browse;
+
+	/* Max number of chunks of a single browse request in flight */
+	int browse_max_chunks;
+
+	/* Threads decoding replies off the iothread, see decoder.c */
+	struct decoder *decoder;
 
 
 	/* High level connection state */
 	sp_connectionstate connectionstate;
 
+	/* Failed reconnect attempts since the connection was lost */
+	int reconnect_attempts;
+
 
 	/* For keeping track of playlists and related states */
 	sp_playlistcontainer *playlistcontainer;
@@ -372,6 +434,35 @@ struct sp_session {
 	struct hashtable *hashtable_tracks;
 	struct hashtable *hashtable_users;
 
+	/* Unreferenced images kept in memory, see sp_image.c */
+	struct image_lru images;
+
+	/* Objects retired by the garbage collector, see reclaim.c */
+	struct reclaim reclaim;
+
+	/* Progress of the garbage collector, see gc.c */
+	struct gc gc;
+
+	/* What the memory is used for, see memstats.c */
+	struct memstats memstats;
+
+	/* Where tracks, albums and artists are allocated, see pool.c */
+	struct pool pool_tracks;
+	struct pool pool_albums;
+	struct pool pool_artists;
+
+	/* Names and country lists, see strpool.c */
+	struct strpool strings;
+
+	/* Directory given in sp_session_config, NULL if there's none */
+	char *cache_location;
+
+	/* Metadata saved by earlier sessions, see metacache.c */
+	struct metacache *metacache;
+
+	/* Images downloaded by earlier sessions, see imgcache.c */
+	struct imgcache *imgcache;
+
 	/* Player */
 	struct player *player;
 
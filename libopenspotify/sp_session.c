@@ -10,15 +10,27 @@
 
 #include <libspotify/api.h>
 
+#include "browse.h"
+#include "buf.h"
 #include "cache.h"
 #include "debug.h"
+#include "decoder.h"
+#include "flowctl.h"
+#include "image.h"
+#include "imgcache.h"
+#include "ioloop.h"
 #include "iothread.h"
 #include "link.h"
 #include "login.h"
+#include "memstats.h"
+#include "packet.h"
 #include "player.h"
 #include "playlist.h"
+#include "pool.h"
+#include "reclaim.h"
 #include "request.h"
 #include "sp_opaque.h"
+#include "strpool.h"
 #include "user.h"
 
 
@@ -52,6 +64,16 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	session->callbacks = (sp_session_callbacks *)malloc(sizeof(sp_session_callbacks));
 	memcpy(session->callbacks, config->callbacks, sizeof(sp_session_callbacks));
 
+	/* Counters of what the session allocates, see memstats.c */
+	memstats_init(session);
+
+	pool_init(&session->pool_tracks, sizeof(sp_track));
+	pool_init(&session->pool_albums, sizeof(sp_album));
+	pool_init(&session->pool_artists, sizeof(sp_artist));
+
+	/* Names and country lists shared by the objects, see strpool.c */
+	strpool_init(session);
+
 	
 	/* Connection state is undefined (We were never logged in).*/
 	session->connectionstate = SP_CONNECTION_STATE_UNDEFINED;
@@ -74,6 +96,19 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	session->hashtable_images = hashtable_create(20);
 	session->hashtable_tracks = hashtable_create(16);
 	session->hashtable_users = hashtable_create(256);
+	image_lru_init(session);
+	reclaim_init(session);
+	gc_init(session);
+
+	/* Persistent cache, disabled unless a directory is given */
+	session->cache_location = NULL;
+	if(config->cache_location != NULL && *config->cache_location) {
+		session->cache_location = malloc(strlen(config->cache_location) + 1);
+		strcpy(session->cache_location, config->cache_location);
+	}
+
+	/* Load album, artist and track cache */
+	cache_init(session);
 
 	/* Allocate memory for user info. */
 	if((session->user = (sp_user *)malloc(sizeof(sp_user))) == NULL)
@@ -81,18 +116,40 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 
 	/* Low-level networking stuff. */
 	session->sock = -1;
+	session->reconnect_attempts = 0;
 
 	/* Incoming packet buffer */
-	session->packet = NULL;
+	if(ring_init(&session->rx, PACKET_RX_RING_SIZE) < 0)
+		return SP_ERROR_API_INITIALIZATION_FAILED;
+
+	session->rx_packet_len = -1;
+
+	/* Outgoing packet queue and scratch buffer for building payloads */
+	if(ring_init(&session->tx, PACKET_TX_RING_SIZE) < 0)
+		return SP_ERROR_API_INITIALIZATION_FAILED;
+
+	session->tx_payload = buf_new();
 
 	/* To allow main thread to communicate with network thread */
-	session->requests = NULL;
+	request_scheduler_init(session);
+
+	/* Track lookups are browsed together, large browses are pipelined */
+	browse_coalescer_init(session);
+	session->browse_max_chunks = BROWSE_MAX_CHUNKS;
 
 	/* Channels */
-	session->channels = NULL;
-	session->next_channel_id = 0;
+	channel_table_init(session);
 	session->num_channels = 0;
+	flowctl_init(session);
+
+
+	/* Allows request_post() to wake up the networking thread */
+	if(ioloop_init(session))
+		return SP_ERROR_API_INITIALIZATION_FAILED;
 
+	/* Decompresses and parses large replies for the networking thread */
+	if(decoder_init(session, DECODER_NUM_WORKERS))
+		return SP_ERROR_API_INITIALIZATION_FAILED;
 
 	/* Spawn networking thread. */
 #ifdef _WIN32
@@ -116,10 +173,7 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	/* Helper function for sp_link_create_from_string() */
 	libopenspotify_link_init(session);
 
-	/* Load album, artist and track cache */
-	cache_init(session);
-
-	/* Run garbage collector and save metadata to disk periodically */
+	/* Save metadata to disk periodically */
 	request_post(session, REQ_TYPE_CACHE_PERIODIC, NULL);
 
 	DSFYDEBUG("Session initialized at %p\n", session);
@@ -138,7 +192,6 @@ SP_LIBEXPORT(sp_error) sp_session_login (sp_session *session, const char *userna
 	session->password[sizeof(session->password) - 1] = 0;
 
 	session->user = user_add(session, username);
-	user_add_ref(session->user);
 	
 	DSFYDEBUG("Posting REQ_TYPE_LOGIN\n");
 	request_post(session, REQ_TYPE_LOGIN, NULL);
@@ -209,6 +262,13 @@ SP_LIBEXPORT(void) sp_session_process_events(sp_session *session, int *next_time
 			session->callbacks->logged_out(session);
 			break;
 
+		case REQ_TYPE_RECONNECT:
+			if(request->error == SP_ERROR_OK || session->callbacks->connection_error == NULL)
+				break;
+
+			session->callbacks->connection_error(session, request->error);
+			break;
+
 		case REQ_TYPE_PLAY_TOKEN_LOST:
 			if(session->callbacks->play_token_lost == NULL)
 				break;
@@ -318,8 +378,7 @@ SP_LIBEXPORT(void) sp_session_process_events(sp_session *session, int *next_time
 
 		case REQ_TYPE_IMAGE:
 			image = (sp_image *)request->output;
-			if(image->callback)
-				image->callback(image, image->userdata);
+			osfy_image_loaded(session, image);
 			break;
 
 		default:
@@ -334,6 +393,124 @@ SP_LIBEXPORT(void) sp_session_process_events(sp_session *session, int *next_time
 }
 
 
+/*
+ * Not available in libspotify
+ * The values are maintained by the iothread and sampled without locking
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_flowctl_stats(sp_session *session, opensp_flowctl_stats *stats) {
+	struct flowctl *fc = &session->flowctl;
+
+	stats->window = fc->window;
+	stats->channels_in_flight = session->num_channels;
+	stats->queue_depth = session->requests.num_blocked;
+	stats->rtt_ms = fc->srtt_ms;
+	stats->throughput = fc->throughput;
+	stats->num_completed = fc->num_completed;
+	stats->num_failed = fc->num_failed;
+	stats->num_decreases = fc->num_decreases;
+}
+
+
+/*
+ * Not available in libspotify
+ * Set how long single track lookups, e.g. from sp_link_create_from_string(),
+ * are held back to be browsed together. Zero browses them one by one.
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_browse_window(sp_session *session, int window_ms) {
+	session->browse.window_ms = window_ms;
+}
+
+
+/*
+ * Not available in libspotify
+ * Set how many chunks of up to 244 tracks of a single browse request,
+ * i.e. the tracks of a playlist, may be in flight at once
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_browse_pipeline(sp_session *session, int max_chunks) {
+	if(max_chunks < 1)
+		max_chunks = 1;
+
+	session->browse_max_chunks = max_chunks;
+}
+
+
+/*
+ * Not available in libspotify
+ * Set how many bytes of images may be kept in the cache directory,
+ * the least recently used ones are removed to make room
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_image_cache_size(sp_session *session, size_t max_bytes) {
+	imgcache_set_size(session, max_bytes);
+}
+
+
+/*
+ * Not available in libspotify
+ * Set how many bytes of loaded images may be kept in memory, unreferenced
+ * images are freed in the order they were released to make room
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_image_memory_size(sp_session *session, size_t max_bytes) {
+	image_lru_set_size(session, max_bytes);
+}
+
+
+/*
+ * Not available in libspotify
+ * Get the garbage collector statistics
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_gc_stats(sp_session *session, opensp_gc_stats *stats) {
+	struct gc *gc = &session->gc;
+
+	stats->num_rounds = gc->num_rounds;
+	stats->num_slices = gc->num_slices;
+	stats->last_pause_us = gc->last_pause_us;
+	stats->max_pause_us = gc->max_pause_us;
+	stats->total_pause_ms = gc->total_pause_ms;
+	stats->num_retired = session->reclaim.num_retired;
+	stats->num_freed = session->reclaim.num_freed + session->images.num_collected;
+	stats->num_pending = session->reclaim.num_entries;
+}
+
+
+/*
+ * Not available in libspotify
+ * Get how many objects and bytes the session has allocated, by what
+ * they're used for. The counters are updated by all threads, so
+ * categories may be slightly out of step with each other and the total.
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_memory_stats(sp_session *session, opensp_memory_stats *stats) {
+	memstats_snapshot(session, stats);
+}
+
+
+/*
+ * Not available in libspotify
+ * Get how many distinct names and country lists the session keeps, and
+ * how much memory sharing them between objects saves
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_string_stats(sp_session *session, opensp_string_stats *stats) {
+	strpool_stats(session, stats);
+}
+
+
+/*
+ * Not available in libspotify
+ * Get the image memory statistics
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_image_stats(sp_session *session, opensp_image_stats *stats) {
+	image_lru_stats(session, stats);
+}
+
+
 SP_LIBEXPORT(sp_error) sp_session_player_load(sp_session *session, sp_track *track) {
 	void **container;
 
@@ -428,14 +605,33 @@ SP_LIBEXPORT(sp_error) sp_session_release (sp_session *session) {
 	pthread_cond_destroy(&session->idle_wakeup);
 #endif
 
-	if(session->packet)
-		buf_free(session->packet);
+	decoder_free(session);
+
+	/* Objects freed now are saved too */
+	reclaim_free(session);
+
+	/* Save metadata for the next session */
+	cache_free(session);
+
+	ioloop_free(session);
+
+	request_scheduler_free(session);
+
+	browse_coalescer_free(session);
+
+	channel_table_free(session);
+
+	ring_free(&session->rx);
+	ring_free(&session->tx);
+	buf_free(session->tx_payload);
 
 	if(session->login)
 		login_release(session->login);
 
 	playlistcontainer_release(session);
 
+	image_lru_free(session);
+
 	if(session->hashtable_albums)
 		hashtable_free(session->hashtable_albums);
 
@@ -453,7 +649,15 @@ SP_LIBEXPORT(sp_error) sp_session_release (sp_session *session) {
 	
 	if(session->hashtable_users)
 		hashtable_free(session->hashtable_users);
+
+	/* Along with whatever is still referenced */
+	pool_free(&session->pool_tracks);
+	pool_free(&session->pool_albums);
+	pool_free(&session->pool_artists);
+	strpool_free(session);
 	
+	free(session->cache_location);
+
 	free(session->callbacks);
 
 	/* Helper function for sp_link_create_from_string() */
@@ -62,7 +62,9 @@ SP_LIBEXPORT(sp_toplistbrowse *) sp_toplistbrowse_create (sp_session *session, s
 
 	toplistbrowse_ctx->session = session;
 	toplistbrowse_ctx->req = NULL; /* Filled in by the request processor */
-	toplistbrowse_ctx->buf = buf_new();
+	toplistbrowse_ctx->xs = xml_stream_new();
+	toplistbrowse_ctx->xml = NULL;
+	toplistbrowse_ctx->root = NULL;
 	toplistbrowse_ctx->toplistbrowse = toplistbrowse;
 
 	/* Request input container. Will be free'd when the request is finished. */
@@ -1,23 +1,48 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#ifdef _WIN32
-#include <ws2tcpip.h>
-#else
-#include <arpa/inet.h>
-#endif
 
 #include <libspotify/api.h>
 
 #include "album.h"
+#include "arena.h"
 #include "artist.h"
 #include "browse.h"
 #include "debug.h"
 #include "ezxml.h"
 #include "hashtable.h"
+#include "memstats.h"
+#include "metacache.h"
+#include "pool.h"
+#include "reclaim.h"
 #include "sp_opaque.h"
+#include "strpool.h"
 #include "track.h"
 #include "util.h"
+#include "xmlpull.h"
+
+
+/* xml_pull_hash() of the elements of a <track> */
+#define TRACK_XML_HASH_TRACK		0x7b3d6c3cU
+#define TRACK_XML_HASH_ID		0x37386ae0U
+#define TRACK_XML_HASH_REDIRECT		0x173b3eb1U
+#define TRACK_XML_HASH_TITLE		0x9865b509U
+#define TRACK_XML_HASH_EXPLICIT		0x68e79149U
+#define TRACK_XML_HASH_POPULARITY	0xf33fa03eU
+#define TRACK_XML_HASH_LENGTH		0x83d03615U
+#define TRACK_XML_HASH_ARTIST_ID	0x6d9a468cU
+#define TRACK_XML_HASH_ARTIST		0x22244cdeU
+#define TRACK_XML_HASH_ALBUM		0x64fb286cU
+#define TRACK_XML_HASH_ALBUM_ID		0x40e2111eU
+#define TRACK_XML_HASH_ALBUM_ARTIST	0x52f564bcU
+#define TRACK_XML_HASH_ALBUM_ARTIST_ID	0x013e760eU
+#define TRACK_XML_HASH_YEAR		0xae7f4d1cU
+#define TRACK_XML_HASH_COVER		0xbacd0480U
+#define TRACK_XML_HASH_FILES		0x3ee74090U
+#define TRACK_XML_HASH_FILE		0xaaea5743U
+#define TRACK_XML_HASH_RESTRICTIONS	0xdb04f3faU
+#define TRACK_XML_HASH_RESTRICTION	0x5b26202dU
 
 
 SP_LIBEXPORT(bool) sp_track_is_loaded(sp_track *track) {
@@ -99,18 +124,16 @@ SP_LIBEXPORT(int) sp_track_index(sp_track *track) {
 
 SP_LIBEXPORT(void) sp_track_add_ref(sp_track *track) {
 
-	track->ref_count++;
+	REFCOUNT_INC(&track->ref_count);
 }
 
 
+/* Unreferenced tracks are freed by the garbage collector, see reclaim.c */
 SP_LIBEXPORT(void) sp_track_release(sp_track *track) {
-	assert(track->ref_count > 0);
+	int ref_count;
 
-	if(--track->ref_count)
-		return;
-
-	DSFYDEBUG("Freeing track %p because of zero ref_count\n", track);
-	osfy_track_free(track);
+	ref_count = REFCOUNT_DEC(&track->ref_count);
+	assert(ref_count >= 0);
 }
 
 
@@ -120,23 +143,29 @@ SP_LIBEXPORT(void) sp_track_release(sp_track *track) {
  */
 
 
+/* Find or create a track, the caller gets a reference */
 sp_track *osfy_track_add(sp_session *session, unsigned char id[16]) {
 	sp_track *track;
 
 	assert(session != NULL);
 
-	if((track = (sp_track *)hashtable_find(session->hashtable_tracks, id)) != NULL)
+	/* Another thread adding the same track must find this one */
+	hashtable_writer_lock(session->hashtable_tracks);
+
+	if((track = (sp_track *)reclaim_find(session->hashtable_tracks, id, offsetof(sp_track, ref_count))) != NULL) {
+		hashtable_writer_unlock(session->hashtable_tracks);
 		return track;
+	}
 
 
-	track = (sp_track *)malloc(sizeof(sp_track));
-	if(track == NULL)
+	track = (sp_track *)pool_get(&session->pool_tracks);
+	if(track == NULL) {
+		hashtable_writer_unlock(session->hashtable_tracks);
 		return NULL;
+	}
 
 	DSFYDEBUG("Allocated track at %p\n", track);
-
-	track->hashtable = session->hashtable_tracks;
-	hashtable_insert(track->hashtable, id, track);
+	memstats_alloc(session, OPENSP_MEMORY_TRACKS, sizeof(sp_track));
 
 	memcpy(track->id, id, sizeof(track->id));
 	memset(track->file_id, 0, sizeof(track->file_id));
@@ -160,21 +189,30 @@ sp_track *osfy_track_add(sp_session *session, unsigned char id[16]) {
 	track->is_loaded = 0;
 	track->error = SP_ERROR_RESOURCE_NOT_LOADED;
 
-	track->ref_count = 0;
+	REFCOUNT_INIT(&track->ref_count, 1);
+	track->is_cached = 0;
+
+	track->hashtable = session->hashtable_tracks;
+	hashtable_insert(track->hashtable, track->id, track);
+	hashtable_writer_unlock(track->hashtable);
+
+	/* Saved by an earlier session? */
+	metacache_load_track(session, track);
 
 	return track;
 }
 
 
-void osfy_track_free(sp_track *track) {
+/* Free a track retired by the garbage collector */
+void osfy_track_free(sp_session *session, sp_track *track) {
 	int i;
 
-	assert(track->ref_count == 0);
+	assert(REFCOUNT_GET(&track->ref_count) == RECLAIM_DEAD);
 
-	hashtable_remove(track->hashtable, track->id);
+	/* Written by the next save, unless it's there already */
+	metacache_retire_track(session, track);
 
-	if(track->name)
-		free(track->name);
+	strpool_put(session, track->name);
 
 
 	for(i = 0; i < track->num_artists; i++)
@@ -186,28 +224,262 @@ void osfy_track_free(sp_track *track) {
 	if(track->album)
 		sp_album_release(track->album);
 
-	if(track->restricted_countries)
-		free(track->restricted_countries);
+	strpool_put(session, track->restricted_countries);
 	
-	if(track->allowed_countries)
-		free(track->allowed_countries);
+	strpool_put(session, track->allowed_countries);
 
 	DSFYDEBUG("Deallocated track at %p\n", track);
 
-	free(track);
+	memstats_free(session, OPENSP_MEMORY_TRACKS, sizeof(sp_track));
+
+	pool_put(&session->pool_tracks, track);
+}
+
+
+/*
+ * Get where to keep the text of a child element of <track>, if anywhere
+ * Repeated elements get the next free slot.
+ *
+ */
+static const char **osfy_track_xml_field(struct track_xml *tx, const char *name, unsigned int hash) {
+	switch(hash) {
+		case TRACK_XML_HASH_ID:
+			if(strcmp(name, "id") == 0)
+				return &tx->id;
+			break;
+
+		case TRACK_XML_HASH_REDIRECT:
+			if(strcmp(name, "redirect") == 0 && tx->num_redirects < TRACK_XML_MAX_REDIRECTS)
+				return &tx->redirects[tx->num_redirects++];
+			break;
+
+		case TRACK_XML_HASH_TITLE:
+			if(strcmp(name, "title") == 0)
+				return &tx->title;
+			break;
+
+		case TRACK_XML_HASH_EXPLICIT:
+			if(strcmp(name, "explicit") == 0)
+				return &tx->explicit_lyrics;
+			break;
+
+		case TRACK_XML_HASH_POPULARITY:
+			if(strcmp(name, "popularity") == 0)
+				return &tx->popularity;
+			break;
+
+		case TRACK_XML_HASH_LENGTH:
+			if(strcmp(name, "length") == 0)
+				return &tx->length;
+			break;
+
+		case TRACK_XML_HASH_ARTIST_ID:
+			if(strcmp(name, "artist-id") == 0 && tx->num_artist_ids < TRACK_XML_MAX_ARTISTS)
+				return &tx->artist_ids[tx->num_artist_ids++];
+			break;
+
+		case TRACK_XML_HASH_ARTIST:
+			if(strcmp(name, "artist") == 0 && tx->num_artists < TRACK_XML_MAX_ARTISTS)
+				return &tx->artists[tx->num_artists++];
+			break;
+
+		case TRACK_XML_HASH_ALBUM_ID:
+			if(strcmp(name, "album-id") == 0)
+				return &tx->album_id;
+			break;
+
+		case TRACK_XML_HASH_ALBUM:
+			if(strcmp(name, "album") == 0)
+				return &tx->album;
+			break;
+
+		case TRACK_XML_HASH_ALBUM_ARTIST_ID:
+			if(strcmp(name, "album-artist-id") == 0)
+				return &tx->album_artist_id;
+			break;
+
+		case TRACK_XML_HASH_ALBUM_ARTIST:
+			if(strcmp(name, "album-artist") == 0)
+				return &tx->album_artist;
+			break;
+
+		case TRACK_XML_HASH_YEAR:
+			if(strcmp(name, "year") == 0)
+				return &tx->year;
+			break;
+
+		case TRACK_XML_HASH_COVER:
+			if(strcmp(name, "cover") == 0)
+				return &tx->cover;
+			break;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Grab ID of file
+ * Multiple files might be listed here, all with different bit rates
+ * Zero 'file' elements indicates the file is not available.
+ *
+ * Example:
+ * <files>
+ *   <file id="cfe68177e9eb9526b7b441f6147d1c5a9a07ca62" format="Ogg Vorbis,160000,1,32,4"/>
+ *   <file id="bf1314d9814795f64a995c6dc8a9b6cc12b952d6" format="Ogg Vorbis,96000,1,32,4"/>
+ * </files>
+ *
+ */
+static void osfy_track_xml_file(struct track_xml *tx, const char *format, const char *id) {
+	/* XXX - Only care about 160kbit/s files for now */
+	if(format == NULL || !strstr(format, "160000"))
+		return;
+
+	assert(id != NULL);
+	tx->file_id = id;
+}
+
+
+/* There might be restrictions that do not apply for premium users */
+static void osfy_track_xml_restriction(struct track_xml *tx, const char *catalogues, const char *allowed, const char *forbidden) {
+	if(!catalogues || !strstr(catalogues, "premium"))
+		return;
+
+	if(allowed != NULL)
+		tx->allowed = allowed;
+
+	if(forbidden != NULL)
+		tx->forbidden = forbidden;
+}
+
+
+/*
+ * Decode a <track> element in a single pass, without building a DOM
+ * The XML is modified in place and the fields point into it.
+ *
+ */
+int osfy_track_xml_parse(struct track_xml *tx, char *xml, int len) {
+	static char empty[] = "";
+	struct xml_pull xp;
+	const char **field = NULL;
+	unsigned int parent = 0;
+	int event;
+
+	memset(tx, 0, sizeof(struct track_xml));
+
+	xml_pull_init(&xp, xml, len);
+	while((event = xml_pull_next(&xp)) != XML_PULL_EOF) {
+		switch(event) {
+			case XML_PULL_ERROR:
+				DSFYDEBUG("Failed to parse track XML\n");
+				return -1;
+
+			case XML_PULL_START:
+				if(xp.depth == 1) {
+					if(xp.hash != TRACK_XML_HASH_TRACK || strcmp(xp.name, "track")) {
+						DSFYDEBUG("Expected element 'track', got '%s'\n", xp.name);
+						return -1;
+					}
+				}
+				else if(xp.depth == 2) {
+					parent = xp.hash;
+
+					/* Empty elements have no text */
+					if((field = osfy_track_xml_field(tx, xp.name, xp.hash)) != NULL)
+						*field = empty;
+				}
+				else if(xp.depth == 3) {
+					if(parent == TRACK_XML_HASH_FILES && xp.hash == TRACK_XML_HASH_FILE
+						&& strcmp(xp.name, "file") == 0)
+						osfy_track_xml_file(tx, xml_pull_attr(&xp, "format"),
+								    xml_pull_attr(&xp, "id"));
+					else if(parent == TRACK_XML_HASH_RESTRICTIONS && xp.hash == TRACK_XML_HASH_RESTRICTION
+						&& strcmp(xp.name, "restriction") == 0)
+						osfy_track_xml_restriction(tx, xml_pull_attr(&xp, "catalogues"),
+									   xml_pull_attr(&xp, "allowed"),
+									   xml_pull_attr(&xp, "forbidden"));
+				}
+				break;
+
+			case XML_PULL_TEXT:
+				if(xp.depth == 2 && field != NULL)
+					*field = xp.text;
+				break;
+
+			case XML_PULL_END:
+				if(xp.depth == 1)
+					field = NULL;
+				break;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Decode a <track> element into a track_xml allocated from the arena
+ * Used by browse.c on the decoder threads, returns NULL on errors.
+ *
+ */
+void *osfy_track_xml_decode(char *xml, int len, struct arena *arena) {
+	struct track_xml *tx;
+
+	tx = arena_alloc(arena, sizeof(struct track_xml));
+	if(tx == NULL)
+		return NULL;
+
+	if(osfy_track_xml_parse(tx, xml, len) || tx->id == NULL)
+		return NULL;
+
+	return tx;
+}
+
+
+/* Get the fields of a <track> element already parsed by ezxml */
+void osfy_track_xml_from_ezxml(struct track_xml *tx, ezxml_t track_node) {
+	const char **field;
+	unsigned int hash;
+	ezxml_t node, child;
+
+	memset(tx, 0, sizeof(struct track_xml));
+
+	for(node = track_node->child; node; node = node->ordered) {
+		hash = xml_pull_hash(node->name);
+		if((field = osfy_track_xml_field(tx, node->name, hash)) != NULL) {
+			*field = node->txt;
+		}
+		else if(hash == TRACK_XML_HASH_FILES && strcmp(node->name, "files") == 0) {
+			for(child = ezxml_child(node, "file"); child; child = child->next)
+				osfy_track_xml_file(tx, ezxml_attr(child, "format"), ezxml_attr(child, "id"));
+		}
+		else if(hash == TRACK_XML_HASH_RESTRICTIONS && strcmp(node->name, "restrictions") == 0) {
+			for(child = ezxml_child(node, "restriction"); child; child = child->next)
+				osfy_track_xml_restriction(tx, ezxml_attr(child, "catalogues"),
+							   ezxml_attr(child, "allowed"),
+							   ezxml_attr(child, "forbidden"));
+		}
+	}
 }
 
 
 int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track_node) {
+	struct track_xml tx;
+
+	osfy_track_xml_from_ezxml(&tx, track_node);
+
+	return osfy_track_load_from_track_xml(session, track, &tx);
+}
+
+
+int osfy_track_load_from_track_xml(sp_session *session, sp_track *track, const struct track_xml *tx) {
 	unsigned char id[20];
-	const char *str;
 	double popularity;
-	int i;
-	ezxml_t node;
+	int i, j;
 	
 
 	/* Track UUID */
-	if((node = ezxml_get(track_node, "id", -1)) == NULL) {
+	if(tx->id == NULL) {
 		DSFYDEBUG("Failed to find element 'id'\n");
 		/* This might happen when a track that doesn't exist is browsed */
 
@@ -215,72 +487,50 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 		return -1;
 	}
 	
-	DSFYDEBUG("Found track with ID '%s' in XML\n", node->txt);
+	DSFYDEBUG("Found track with ID '%s' in XML\n", tx->id);
 	
 	
 	/* Track name */
-	if((node = ezxml_get(track_node, "title", -1)) == NULL) {
+	if(tx->title == NULL) {
 		DSFYDEBUG("Failed to find element 'title'\n");
 		return -1;
 	}
 
-	track->name = realloc(track->name, strlen(node->txt) + 1);
-	strcpy(track->name, node->txt);
+	strpool_set(session, &track->name, tx->title);
 
 
 	/* Explicit lyrics? */
-	if((node = ezxml_get(track_node, "explicit", -1)) != NULL) {
+	if(tx->explicit_lyrics != NULL) {
 #ifdef _WIN32
-		if(!stricmp(node->txt, "true"))
+		if(!stricmp(tx->explicit_lyrics, "true"))
 #else
-		if(!strcasecmp(node->txt, "true"))
+		if(!strcasecmp(tx->explicit_lyrics, "true"))
 #endif
 			track->has_explicit_lyrics = 1;
 	}
 
 
 	/* Track popularity */
-	if((node = ezxml_get(track_node, "popularity", -1)) == NULL) {
+	if(tx->popularity == NULL) {
 		DSFYDEBUG("Failed to find element 'popularity'\n");
 		return -1;
 	}
 	
-	sscanf(node->txt, "%lf", &popularity);
+	sscanf(tx->popularity, "%lf", &popularity);
 	track->popularity = (int)(100 * popularity);
 
 	
-	/*
-	 * Grab ID of file
-	 * Multiple files might be listed here, all with different bit rates
-	 * Zero 'file' elements indicates the file is not available.
-	 *
-	 * Example:
-	 * <files>
-	 *   <file id="cfe68177e9eb9526b7b441f6147d1c5a9a07ca62" format="Ogg Vorbis,160000,1,32,4"/>
-	 *   <file id="bf1314d9814795f64a995c6dc8a9b6cc12b952d6" format="Ogg Vorbis,96000,1,32,4"/>
-	 * </files>
-	 *
-	 */
+	/* File ID, see osfy_track_xml_file() */
 	memset(track->file_id, 0, sizeof(track->file_id));
-	for(node = ezxml_get(track_node, "files", 0, "file", -1);
-	    node;
-	    node = node->next) {
-		/* XXX - Only care about 160kbit/s files for now */
-		str = ezxml_attr(node, "format");
-		if(!strstr(str, "160000")) {
-			continue;
-		}
-
-		str = ezxml_attr(node, "id");
-		assert(str != NULL);
-		hex_ascii_to_bytes(str, id, sizeof(track->file_id));
+	if(tx->file_id != NULL) {
+		hex_ascii_to_bytes(tx->file_id, id, sizeof(track->file_id));
 		memcpy(track->file_id, id, sizeof(track->file_id));
 	}
 
 	
 	/* Track duration */
-	if((node = ezxml_get(track_node, "length", -1)) != NULL) {
-		track->duration = atoi(node->txt);
+	if(tx->length != NULL) {
+		track->duration = atoi(tx->length);
 	}
 	else {
 		/* Track duration defaults to zero so no update is needed */
@@ -291,33 +541,20 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 	/* Country restrictions */
 	assert(track->allowed_countries == NULL);
 	assert(track->restricted_countries == NULL);
-	for(node = ezxml_get(track_node, "restrictions", 0, "restriction", -1);
-	    node;
-	    node = node->next) {
-	    	str = ezxml_attr(node, "catalogues");
-
-
-		/* There might be restrictions that do not apply for premium users */
-		if(!str || !strstr(str, "premium"))
-			continue;
-
-		if((str = ezxml_attr(node, "allowed")) != NULL) {
-			track->allowed_countries = realloc(track->allowed_countries, strlen(str) + 1);
-			strcpy(track->allowed_countries, str);
+	if(tx->allowed != NULL) {
+		strpool_set(session, &track->allowed_countries, tx->allowed);
 
-			if(strstr(track->allowed_countries, session->country))
-				track->is_available = 1;
-		}
+		if(strstr(track->allowed_countries, session->country))
+			track->is_available = 1;
+	}
 
-		if((str = ezxml_attr(node, "forbidden")) != NULL) {
-			track->restricted_countries = realloc(track->restricted_countries, strlen(str) + 1);
-			strcpy(track->restricted_countries, str);
+	if(tx->forbidden != NULL) {
+		strpool_set(session, &track->restricted_countries, tx->forbidden);
 
-			if(strstr(track->restricted_countries, session->country))
-				track->is_available = 0;
-			else
-				track->is_available = 1;
-		}
+		if(strstr(track->restricted_countries, session->country))
+			track->is_available = 0;
+		else
+			track->is_available = 1;
 	}
 
 
@@ -327,10 +564,8 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 
 
 	/* Add artists */
-	for(node = ezxml_get(track_node, "artist-id", -1);
-	    node;
-	    node = node->next) {
-		hex_ascii_to_bytes(node->txt, id, 16);
+	for(j = 0; j < tx->num_artist_ids; j++) {
+		hex_ascii_to_bytes(tx->artist_ids[j], id, 16);
 		for(i = 0; i < track->num_artists; i++)
 			if(memcmp(track->artists[i]->id, id, sizeof(track->artists[i]->id)) == 0)
 				break;
@@ -339,16 +574,15 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 		if(i != track->num_artists)
 			continue;
 		
-		DSFYDEBUG("Adding artist '%s' to track's list\n", node->txt);
+		DSFYDEBUG("Adding artist '%s' to track's list\n", tx->artist_ids[j]);
 
 		track->artists = realloc(track->artists, sizeof(sp_artist *) * (1 + track->num_artists));
 		track->artists[track->num_artists] = osfy_artist_add(session, id);
-		sp_artist_add_ref(track->artists[track->num_artists]);
 		
 		if(sp_artist_is_loaded(track->artists[track->num_artists]) == 0)
-			osfy_artist_load_track_artist_from_xml(session, 
-							       track->artists[track->num_artists],
-							       track_node);
+			osfy_artist_load_from_track_xml(session, 
+							track->artists[track->num_artists],
+							tx);
 			
 		
 		track->num_artists++;
@@ -361,14 +595,13 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 		hex_bytes_to_ascii(track->id, buf, 16);
 		DSFYDEBUG("Loading album for track '%s'\n", buf);
 	}
-	if((node = ezxml_get(track_node, "album-id", -1)) != NULL) {
+	if(tx->album_id != NULL) {
 		/* Add album to track */
 		if(track->album != NULL)
 			sp_album_release(track->album);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
+		hex_ascii_to_bytes(tx->album_id, id, 16);
 		track->album = sp_album_add(session, id);
-		sp_album_add_ref(track->album);
 
 		/* Load album from XML if necessary */
 		if(sp_album_is_loaded(track->album) == 0) {
@@ -376,7 +609,7 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 			hex_bytes_to_ascii(track->album->id, buf, 16);
 			DSFYDEBUG("Album '%s' not yet loaded, trying to load from XML\n", buf);
 
-			osfy_album_load_from_track_xml(session, track->album, track_node);
+			osfy_album_load_from_track_xml(session, track->album, tx);
 			
 			/* FIXME: Assume that the album is available if the track is available */
 			if(track->is_available && !track->album->is_available) {
@@ -396,6 +629,7 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 }
 
 
+static int osfy_track_browse_element(struct browse_callback_ctx *brctx, void *element);
 static int osfy_track_browse_callback(struct browse_callback_ctx *brctx);
 
 /*
@@ -432,203 +666,115 @@ int osfy_track_browse(sp_session *session, sp_track *track) {
 	brctx->data.tracks = tracks;
 	brctx->num_total = 1;
 	brctx->num_browsed = 0;
+	brctx->offset = 0;
 	brctx->num_in_request = 0;
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->retry = NULL;
+	brctx->waiters = NULL;
+	brctx->num_waiters = 0;
+	brctx->error = SP_ERROR_OK;
 	
 	
-	/* Our gzip'd XML parser */
+	/* Our gzip'd XML parsers, tracks are loaded as soon as they're received */
 	brctx->browse_parser = osfy_track_browse_callback;
+	brctx->browse_element = "track";
+	brctx->browse_element_decoder = osfy_track_xml_decode;
+	brctx->browse_element_parser = osfy_track_browse_element;
 	
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
 	*container = brctx;
 	
-	return request_post(session, REQ_TYPE_BROWSE_ALBUM, container);
+	return request_post(session, REQ_TYPE_BROWSE_TRACK, container);
 }
 
 
-static int osfy_track_browse_callback(struct browse_callback_ctx *brctx) {
-	sp_track **tracks;
+/* Check if a track element is the given track or replaces it */
+static int osfy_track_xml_matches(const struct track_xml *tx, sp_track *track) {
+	unsigned char id[16];
 	int i;
-	struct buf *xml;
-	ezxml_t root, node;
-	
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-	if(xml == NULL) {
-		DSFYDEBUG("Failed to decompress track XML\n");
-		return -1;
-	}
 
-#ifdef DEBUG
-	{
-		char buf[64];
-		FILE *fd;
-		sprintf(buf, "browse-tracks-%d-%d.xml", brctx->num_browsed, brctx->num_in_request);
-		fd = fopen(buf, "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
-	}
-#endif
+	hex_ascii_to_bytes(tx->id, id, 16);
+	if(memcmp(track->id, id, 16) == 0)
+		return 1;
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+	for(i = 0; i < tx->num_redirects; i++) {
+		hex_ascii_to_bytes(tx->redirects[i], id, 16);
+		if(memcmp(track->id, id, 16) == 0)
+			return 1;
 	}
-	
-	tracks = brctx->data.tracks;
-	for(i = 0; i < brctx->num_in_request; i++) {
-		node = ezxml_get(root, "tracks", 0, "track", -1);
-		if(osfy_track_load_from_xml(brctx->session, tracks[brctx->num_browsed + i], node)) {
-			DSFYDEBUG("Failed to load track %d of %d from XML, error is %d\n", 
-				brctx->num_browsed + i + 1, brctx->num_in_request,
-				tracks[brctx->num_browsed + i]->error);
-		}
-	}
-	
-	
-	ezxml_free(root);
-	buf_free(xml);
-	
-	
-	/* Release references made in osfy_track_browse() */
-	for(i = 0; i < brctx->num_in_request; i++)
-		sp_track_release(tracks[brctx->num_browsed + i]);
-	
-	
+
 	return 0;
 }
 
 
-void osfy_track_garbage_collect(sp_session *session) {
-	struct hashiterator *iter;
-	struct hashentry *entry;
-	sp_track *track;
+/*
+ * Load a track from a <track> element as soon as it's been received
+ *
+ * Lookups are coalesced by browse.c so several tracks may be browsed
+ * at once. Match the returned tracks with the requested ones by their
+ * ID or, for tracks replaced by another, a redirect.
+ *
+ */
+static int osfy_track_browse_element(struct browse_callback_ctx *brctx, void *element) {
+	struct track_xml *tx = (struct track_xml *)element;
+	sp_track **tracks;
+	int i;
 
-	iter = hashtable_iterator_init(session->hashtable_tracks);
-	while((entry = hashtable_iterator_next(iter))) {
-		track = (sp_track *)entry->value;
+	tracks = brctx->data.tracks + brctx->offset;
+	for(i = 0; i < brctx->num_in_request; i++)
+		if(osfy_track_xml_matches(tx, tracks[i]))
+			break;
 
-		if(track->ref_count)
-			continue;
+	/* A single track is loaded from whatever was returned, as before */
+	if(i == brctx->num_in_request && brctx->num_in_request == 1)
+		i = 0;
 
-		DSFYDEBUG("Freeing track %p because of zero ref_count\n", track);
-		osfy_track_free(track);
+	if(i == brctx->num_in_request) {
+		DSFYDEBUG("Got a track that wasn't asked for, ignoring it\n");
+		return 0;
 	}
 
-	hashtable_iterator_free(iter);
-}
-
-
-int osfy_track_metadata_save_to_disk(sp_session *session, char *filename) {
-	FILE *fd;
-	struct hashiterator *iter;
-	struct hashentry *entry;
-	sp_track *track;
-	unsigned char len;
-	unsigned int num;
-
-	if((fd = fopen(filename, "w")) == NULL)
+	if(osfy_track_load_from_track_xml(brctx->session, tracks[i], tx)) {
+		DSFYDEBUG("Failed to load track %d of %d from XML, error is %d\n", 
+			brctx->offset + i + 1, brctx->num_total,
+			tracks[i]->error);
 		return -1;
-	
-	iter = hashtable_iterator_init(session->hashtable_tracks);
-	while((entry = hashtable_iterator_next(iter))) {
-		track = (sp_track *)entry->value;
-
-		if(track->is_loaded == 0)
-			continue;
-
-		fwrite(track->id, sizeof(track->id), 1, fd);
-		fwrite(track->file_id, sizeof(track->file_id), 1, fd);
-		#if 0
-		fwrite(track->album->id, sizeof(track->album->id), 1, fd);
-		#endif
-		
-		len = (track->name? strlen(track->name): 0);
-		fwrite(&len, 1, 1, fd);
-		fwrite(track->name, len, 1, fd);
-
-		num = htons(track->index);
-		fwrite(&num, sizeof(int), 1, fd);
-		num = htons(track->disc);
-		fwrite(&num, sizeof(int), 1, fd);
 	}
 
-	hashtable_iterator_free(iter);
-	fclose(fd);
-
 	return 0;
 }
 
 
-int osfy_track_metadata_load_from_disk(sp_session *session, char *filename) {
-	FILE *fd;
-	unsigned char len, id16[16], id20[20];
-	unsigned int num;
-	char buf[256 + 1];
-	sp_track *track;
-
-	if((fd = fopen(filename, "r")) == NULL)
-		return -1;
-	
-	/* FIXME: Don't assume lengths on track/artist/album names */
-	buf[256] = 0;
-	while(!feof(fd)) {
-		if(fread(id16, sizeof(id16), 1, fd) == 1)
-			track = osfy_track_add(session, id16);
-		else
-			break;
-
-		if(fread(id20, sizeof(id20), 1, fd) == 1)
-			memcpy(track->file_id, id20, sizeof(track->file_id));
-		else
-			break;
-
-		#if 0
-		if(fread(id16, sizeof(id16), 1, fd) == 1) {
-			album = sp_album_add(session, id16);
-			track->album = album;
-			sp_album_add_ref(album);
-		}
-		else
-			break;
-		#endif
-
-		
-		if(fread(&len, 1, 1, fd) == 1) {
-			if(len && fread(buf, len, 1, fd) == 1) {
-				buf[len] = 0;
-
-				track->name = realloc(track->name, strlen(buf) + 1);
-				strcpy(track->name, buf);
-			}
-		}
-		else
-			break;
-
+/* Called once all tracks in a chunk have been received */
+static int osfy_track_browse_callback(struct browse_callback_ctx *brctx) {
+	sp_track **tracks;
+	int i;
 
-		if(fread(&num, 1, 1, fd) == 1)
-			track->index = ntohs(num);
-		else
-			break;
+	if(brctx->buf == NULL)
+		DSFYDEBUG("Failed to decompress track XML\n");
 
-		if(fread(&num, sizeof(int), 1, fd) == 1)
-			track->disc = ntohs(num);
-		else
-			break;
+	
+	/* Release references made in osfy_track_browse() */
+	tracks = brctx->data.tracks + brctx->offset;
+	for(i = 0; i < brctx->num_in_request; i++)
+		sp_track_release(tracks[i]);
+	
+	
+	return 0;
+}
 
-		if(fread(&num, sizeof(int), 1, fd) == 1)
-			track->duration = ntohs(num);
-		else
-			break;
 
+static void osfy_track_reclaim(sp_session *session, void *object) {
+	sp_track *track = (sp_track *)object;
 
-		track->is_loaded = 1;
-	}
+	DSFYDEBUG("Freeing track %p because of zero ref_count\n", track);
+	osfy_track_free(session, track);
+}
 
-	fclose(fd);
 
-	return 0;
+int osfy_track_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots) {
+	return reclaim_sweep(session, session->hashtable_tracks, cursor, num_slots,
+			offsetof(sp_track, ref_count), osfy_track_reclaim);
 }
@@ -0,0 +1,250 @@
+/*
+ * Interned strings
+ *
+ * Albums and artists are named once per track that has them, and most
+ * tracks and albums carry one of only a few country lists, each several
+ * hundred bytes long. The loaders take those strings from this pool
+ * instead of copying them, so there's one reference counted copy of
+ * each however many objects use it.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libspotify/api.h>
+
+#include "memstats.h"
+#include "sp_opaque.h"
+#include "strpool.h"
+
+
+#define STRPOOL_ENTRY(str)	((struct strpool_entry *)((char *)(str) - offsetof(struct strpool_entry, str)))
+
+
+static unsigned int strpool_hash(const char *str, size_t len);
+static void strpool_grow(sp_session *session, struct strpool *sp);
+static void strpool_lock(struct strpool *sp);
+static void strpool_unlock(struct strpool *sp);
+
+
+void strpool_init(sp_session *session) {
+	struct strpool *sp = &session->strings;
+
+	sp->num_buckets = STRPOOL_INIT_BUCKETS;
+	sp->buckets = calloc(sp->num_buckets, sizeof(struct strpool_entry *));
+	memstats_resize(session, OPENSP_MEMORY_STRINGS, 0, sp->num_buckets * sizeof(struct strpool_entry *));
+
+	sp->num_strings = 0;
+	sp->num_references = 0;
+	sp->bytes = 0;
+	sp->bytes_referenced = 0;
+
+#ifdef _WIN32
+	sp->mutex = CreateMutex(NULL, FALSE, NULL);
+#else
+	pthread_mutex_init(&sp->mutex, NULL);
+#endif
+}
+
+
+/* Free the table, along with the strings of objects that were never freed */
+void strpool_free(sp_session *session) {
+	struct strpool *sp = &session->strings;
+	struct strpool_entry *entry;
+	unsigned int i;
+
+	for(i = 0; i < sp->num_buckets; i++) {
+		while((entry = sp->buckets[i]) != NULL) {
+			sp->buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+
+	free(sp->buckets);
+	sp->buckets = NULL;
+	sp->num_buckets = 0;
+
+#ifdef _WIN32
+	CloseHandle(sp->mutex);
+#else
+	pthread_mutex_destroy(&sp->mutex);
+#endif
+}
+
+
+/*
+ * Get a reference to the pool's copy of a string, which must be
+ * released with strpool_put(). NULL if the string is NULL or memory
+ * is out.
+ *
+ */
+const char *strpool_get(sp_session *session, const char *str) {
+	struct strpool *sp = &session->strings;
+	struct strpool_entry *entry;
+	unsigned int hash;
+	size_t len, size;
+
+	if(str == NULL)
+		return NULL;
+
+	len = strlen(str);
+	hash = strpool_hash(str, len);
+
+	strpool_lock(sp);
+	for(entry = sp->buckets[hash & (sp->num_buckets - 1)]; entry; entry = entry->next) {
+		if(entry->hash == hash && entry->len == len && memcmp(entry->str, str, len) == 0)
+			break;
+	}
+
+	if(entry == NULL) {
+		size = offsetof(struct strpool_entry, str) + len + 1;
+		if((entry = malloc(size)) == NULL) {
+			strpool_unlock(sp);
+			return NULL;
+		}
+
+		entry->hash = hash;
+		entry->ref_count = 0;
+		entry->len = len;
+		memcpy(entry->str, str, len + 1);
+
+		entry->next = sp->buckets[hash & (sp->num_buckets - 1)];
+		sp->buckets[hash & (sp->num_buckets - 1)] = entry;
+
+		sp->num_strings++;
+		sp->bytes += size;
+		memstats_alloc(session, OPENSP_MEMORY_STRINGS, size);
+
+		if(sp->num_strings > (int)sp->num_buckets)
+			strpool_grow(session, sp);
+	}
+
+	entry->ref_count++;
+	sp->num_references++;
+	sp->bytes_referenced += len + 1;
+	strpool_unlock(sp);
+
+	return entry->str;
+}
+
+
+/* Release a string from strpool_get(), NULL is ignored */
+void strpool_put(sp_session *session, const char *str) {
+	struct strpool *sp = &session->strings;
+	struct strpool_entry *entry, **prev;
+	size_t size;
+
+	if(str == NULL)
+		return;
+
+	entry = STRPOOL_ENTRY(str);
+
+	strpool_lock(sp);
+	sp->num_references--;
+	sp->bytes_referenced -= entry->len + 1;
+
+	if(--entry->ref_count > 0) {
+		strpool_unlock(sp);
+		return;
+	}
+
+	for(prev = &sp->buckets[entry->hash & (sp->num_buckets - 1)]; *prev != entry; prev = &(*prev)->next)
+		;
+
+	*prev = entry->next;
+
+	size = offsetof(struct strpool_entry, str) + entry->len + 1;
+	sp->num_strings--;
+	sp->bytes -= size;
+	strpool_unlock(sp);
+
+	memstats_free(session, OPENSP_MEMORY_STRINGS, size);
+	free(entry);
+}
+
+
+/* Replace a string from the pool with the pool's copy of another one */
+void strpool_set(sp_session *session, const char **dst, const char *str) {
+	const char *old = *dst;
+
+	*dst = strpool_get(session, str);
+	strpool_put(session, old);
+}
+
+
+/* Called by opensp_session_string_stats() */
+void strpool_stats(sp_session *session, opensp_string_stats *stats) {
+	struct strpool *sp = &session->strings;
+
+	strpool_lock(sp);
+	stats->num_strings = sp->num_strings;
+	stats->num_references = sp->num_references;
+	stats->bytes = sp->bytes;
+	stats->bytes_saved = (long)sp->bytes_referenced - (long)sp->bytes;
+	strpool_unlock(sp);
+}
+
+
+/* FNV-1a */
+static unsigned int strpool_hash(const char *str, size_t len) {
+	unsigned int hash = 2166136261U;
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+
+/* Double the number of buckets, called with the mutex held */
+static void strpool_grow(sp_session *session, struct strpool *sp) {
+	struct strpool_entry **buckets, *entry;
+	unsigned int i, num_buckets;
+
+	num_buckets = 2 * sp->num_buckets;
+	if((buckets = calloc(num_buckets, sizeof(struct strpool_entry *))) == NULL)
+		return;
+
+	for(i = 0; i < sp->num_buckets; i++) {
+		while((entry = sp->buckets[i]) != NULL) {
+			sp->buckets[i] = entry->next;
+			entry->next = buckets[entry->hash & (num_buckets - 1)];
+			buckets[entry->hash & (num_buckets - 1)] = entry;
+		}
+	}
+
+	memstats_resize(session, OPENSP_MEMORY_STRINGS,
+			sp->num_buckets * sizeof(struct strpool_entry *),
+			num_buckets * sizeof(struct strpool_entry *));
+
+	free(sp->buckets);
+	sp->buckets = buckets;
+	sp->num_buckets = num_buckets;
+}
+
+
+static void strpool_lock(struct strpool *sp) {
+#ifdef _WIN32
+	WaitForSingleObject(sp->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&sp->mutex);
+#endif
+}
+
+
+static void strpool_unlock(struct strpool *sp) {
+#ifdef _WIN32
+	ReleaseMutex(sp->mutex);
+#else
+	pthread_mutex_unlock(&sp->mutex);
+#endif
+}
@@ -0,0 +1,62 @@
+#ifndef LIBOPENSPOTIFY_STRPOOL_H
+#define LIBOPENSPOTIFY_STRPOOL_H
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <libspotify/api.h>
+
+
+/* Buckets in a new table, doubled whenever there are more strings than buckets */
+#define STRPOOL_INIT_BUCKETS	1024
+
+
+/* A string and its references, followed by the characters */
+struct strpool_entry {
+	struct strpool_entry *next;
+	unsigned int hash;
+	int ref_count;
+	size_t len;
+	char str[1];
+};
+
+
+/*
+ * Names and country lists shared by the objects that have them. There's
+ * one copy of each distinct string, so two strings from the pool are
+ * equal exactly if their pointers are. Strings are taken and released
+ * by the loaders on the main thread and by the garbage collector on the
+ * iothread, the table is protected by the mutex.
+ *
+ */
+struct strpool {
+	struct strpool_entry **buckets;
+	unsigned int num_buckets;
+
+	int num_strings;
+	int num_references;
+
+	/* Bytes of the entries, and what a copy per reference would take */
+	size_t bytes;
+	size_t bytes_referenced;
+
+#ifdef _WIN32
+	HANDLE mutex;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+
+void strpool_init(sp_session *session);
+void strpool_free(sp_session *session);
+const char *strpool_get(sp_session *session, const char *str);
+void strpool_put(sp_session *session, const char *str);
+void strpool_set(sp_session *session, const char **dst, const char *str);
+void strpool_stats(sp_session *session, opensp_string_stats *stats);
+
+#endif
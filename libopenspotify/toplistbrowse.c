@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -7,16 +8,23 @@
 #include "album.h"
 #include "artist.h"
 #include "buf.h"
+#include "channel.h"
 #include "commands.h"
 #include "debug.h"
+#include "decoder.h"
 #include "ezxml.h"
+#include "flowctl.h"
 #include "toplistbrowse.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
+#include "xmlstream.h"
 
 
 static int toplistbrowse_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void toplistbrowse_decode(struct decode_job *job);
+static void toplistbrowse_apply(sp_session *session, struct decode_job *job);
+static void toplistbrowse_release(struct decode_job *job);
 static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx);
 
 
@@ -24,6 +32,10 @@ int toplistbrowse_process_request(sp_session *session, struct request *req) {
 	struct toplistbrowse_ctx *toplistbrowse_ctx = *(struct toplistbrowse_ctx **)req->input;
 	sp_toplistbrowse *toplistbrowse = toplistbrowse_ctx->toplistbrowse;
 
+	/* Parked until there's room for another channel */
+	if(!flowctl_admit(session, req))
+		return 0;
+
 	/*
 	 * Prevent request from happening again.
 	 * If there's an error the channel callback will reset the timeout
@@ -41,51 +53,29 @@ int toplistbrowse_process_request(sp_session *session, struct request *req) {
 
 
 static int toplistbrowse_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct toplistbrowse_ctx *toplistbrowse_ctx = (struct toplistbrowse_ctx *)ch->private;
 
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-
-				if (len == 0)
-					break;
-			}
-
-			buf_append_data(toplistbrowse_ctx->buf, payload, len);
+			/* Inflated on a decoder thread, in order */
+			xml_stream_submit(toplistbrowse_ctx->session, toplistbrowse_ctx->xs, payload, len);
 			break;
 
 		case CHANNEL_ERROR:
 			DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", TOPLISTBROWSE_RETRY_TIMEOUT);
-			buf_free(toplistbrowse_ctx->buf);
-			toplistbrowse_ctx->buf = buf_new();
+			xml_stream_submit_free(toplistbrowse_ctx->session, toplistbrowse_ctx->xs);
+			toplistbrowse_ctx->xs = xml_stream_new();
 
 			/* Reset timeout so the request can be retried */
-			toplistbrowse_ctx->req->next_timeout = get_millisecs() + TOPLISTBROWSE_RETRY_TIMEOUT*1000;
+			request_set_timeout(toplistbrowse_ctx->session, toplistbrowse_ctx->req, channel_retry_timeout(ch, TOPLISTBROWSE_RETRY_TIMEOUT*1000));
 			break;
 
 		case CHANNEL_END:
-			if(toplistbrowse_parse_xml(toplistbrowse_ctx) == 0) {
-				toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OK;
-				toplistbrowse_ctx->toplistbrowse->is_loaded = 1;
-			}
-			else
-				toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OTHER_PERMANENT;
-
-			request_set_result(toplistbrowse_ctx->session, toplistbrowse_ctx->req, toplistbrowse_ctx->toplistbrowse->error, toplistbrowse_ctx->toplistbrowse);
-
-			/* Release reference made in sp_toplistbrowse_create() */
-			sp_toplistbrowse_release(toplistbrowse_ctx->toplistbrowse);
-
-			buf_free(toplistbrowse_ctx->buf);
-			free(toplistbrowse_ctx);
+			/* Results are loaded by toplistbrowse_apply() once decoded */
+			toplistbrowse_ctx->job.decode = toplistbrowse_decode;
+			toplistbrowse_ctx->job.apply = toplistbrowse_apply;
+			toplistbrowse_ctx->job.release = toplistbrowse_release;
+			decoder_submit_serial(toplistbrowse_ctx->session, &toplistbrowse_ctx->job, toplistbrowse_ctx->xs);
 			break;
 
 		default:
@@ -97,36 +87,88 @@ static int toplistbrowse_callback(CHANNEL *ch, unsigned char *payload, unsigned
 }
 
 
-static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx) {
-	unsigned char id[16];
-	struct buf *xml;
-	sp_toplistbrowse *toplistbrowse = toplistbrowse_ctx->toplistbrowse;
-	ezxml_t root, listnode, node;
-	sp_artist *artist;
-	sp_album *album;
-	sp_track *track;
+/* Inflate and parse the XML, run by a decoder thread */
+static void toplistbrowse_decode(struct decode_job *job) {
+	struct toplistbrowse_ctx *toplistbrowse_ctx;
 
-	xml = despotify_inflate(toplistbrowse_ctx->buf->ptr, toplistbrowse_ctx->buf->len);
-	if(xml == NULL)
-		return -1;
+	toplistbrowse_ctx = (struct toplistbrowse_ctx *)((char *)job - offsetof(struct toplistbrowse_ctx, job));
+
+	/* Inflated by the jobs submitted before this one, see toplistbrowse_callback() */
+	toplistbrowse_ctx->xml = xml_stream_finish(toplistbrowse_ctx->xs);
+	toplistbrowse_ctx->xs = NULL;
+	if(toplistbrowse_ctx->xml == NULL)
+		return;
 
 #ifdef DEBUG
 	{
 		FILE *fd;
 		char buf[64];
-		sprintf(buf, "toplistbrowse-%04x-%04x.xml", toplistbrowse->type, toplistbrowse->region);
+		sprintf(buf, "toplistbrowse-%04x-%04x.xml", toplistbrowse_ctx->toplistbrowse->type, toplistbrowse_ctx->toplistbrowse->region);
 		fd = fopen(buf, "w");
 		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
+			fwrite(toplistbrowse_ctx->xml->ptr, toplistbrowse_ctx->xml->len, 1, fd);
 			fclose(fd);
 		}
 	}
 #endif
 
-	root = ezxml_parse_str((char *)xml->ptr, xml->len);
+	toplistbrowse_ctx->root = ezxml_parse_str((char *)toplistbrowse_ctx->xml->ptr, toplistbrowse_ctx->xml->len);
+}
+
+
+/* Load the results and return the request, run by the iothread */
+static void toplistbrowse_apply(sp_session *session, struct decode_job *job) {
+	struct toplistbrowse_ctx *toplistbrowse_ctx;
+
+	toplistbrowse_ctx = (struct toplistbrowse_ctx *)((char *)job - offsetof(struct toplistbrowse_ctx, job));
+
+	if(toplistbrowse_parse_xml(toplistbrowse_ctx) == 0) {
+		toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OK;
+		toplistbrowse_ctx->toplistbrowse->is_loaded = 1;
+	}
+	else
+		toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OTHER_PERMANENT;
+
+	request_set_result(toplistbrowse_ctx->session, toplistbrowse_ctx->req, toplistbrowse_ctx->toplistbrowse->error, toplistbrowse_ctx->toplistbrowse);
+
+	/* Release reference made in sp_toplistbrowse_create() */
+	sp_toplistbrowse_release(toplistbrowse_ctx->toplistbrowse);
+
+	toplistbrowse_release(job);
+}
+
+
+static void toplistbrowse_release(struct decode_job *job) {
+	struct toplistbrowse_ctx *toplistbrowse_ctx;
+
+	toplistbrowse_ctx = (struct toplistbrowse_ctx *)((char *)job - offsetof(struct toplistbrowse_ctx, job));
+
+	if(toplistbrowse_ctx->root != NULL)
+		ezxml_free(toplistbrowse_ctx->root);
+
+	if(toplistbrowse_ctx->xml != NULL)
+		buf_free(toplistbrowse_ctx->xml);
+
+	/* Dropped by decoder_free() before it was decoded */
+	if(toplistbrowse_ctx->xs != NULL)
+		xml_stream_free(toplistbrowse_ctx->xs);
+
+	free(toplistbrowse_ctx);
+}
+
+
+static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx) {
+	unsigned char id[16];
+	sp_toplistbrowse *toplistbrowse = toplistbrowse_ctx->toplistbrowse;
+	ezxml_t root, listnode, node;
+	sp_artist *artist;
+	sp_album *album;
+	sp_track *track;
+
+	/* Parsed by toplistbrowse_decode(), freed by toplistbrowse_release() */
+	root = toplistbrowse_ctx->root;
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
@@ -144,7 +186,6 @@ static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx)
 		if(!sp_artist_is_loaded(artist))
 			osfy_artist_load_artist_from_xml(toplistbrowse_ctx->session, artist, listnode);
 
-		sp_artist_add_ref(artist);
 		toplistbrowse->artists = (sp_artist **)realloc(toplistbrowse->artists, (toplistbrowse->num_artists + 1) * sizeof(sp_artist *));
 		toplistbrowse->artists[toplistbrowse->num_artists++] = artist;
 	}
@@ -163,7 +204,6 @@ static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx)
 		if(!sp_album_is_loaded(album))
 			osfy_album_load_from_search_xml(toplistbrowse_ctx->session, album, listnode);
 
-		sp_album_add_ref(album);
 		toplistbrowse->albums = (sp_album **)realloc(toplistbrowse->albums, (toplistbrowse->num_albums + 1) * sizeof(sp_album *));
 		toplistbrowse->albums[toplistbrowse->num_albums++] = album;
 	}
@@ -182,14 +222,10 @@ static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx)
 		if(!sp_track_is_loaded(track))
 			osfy_track_load_from_xml(toplistbrowse_ctx->session, track, listnode);
 
-		sp_track_add_ref(track);
 		toplistbrowse->tracks = (sp_track **)realloc(toplistbrowse->tracks, (toplistbrowse->num_tracks + 1) * sizeof(sp_track *));
 		toplistbrowse->tracks[toplistbrowse->num_tracks++] = track;
 	}
 
 
-	ezxml_free(root);
-	buf_free(xml);
-
 	return 0;
 }
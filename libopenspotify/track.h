@@ -3,15 +3,60 @@
 
 #include <libspotify/api.h>
 
+#include "arena.h"
 #include "ezxml.h"
 
 
+/* Repeated elements kept per track, any others are ignored */
+#define TRACK_XML_MAX_ARTISTS	16
+#define TRACK_XML_MAX_REDIRECTS	16
+
+
+/*
+ * Fields of a <track> element, pointing into the XML they were decoded
+ * from. Fields not found are NULL.
+ *
+ */
+struct track_xml {
+	const char *id;
+	const char *redirects[TRACK_XML_MAX_REDIRECTS];
+	int num_redirects;
+
+	const char *title;
+	const char *explicit_lyrics;
+	const char *popularity;
+	const char *length;
+
+	/* ID of the 160 kbit/s file */
+	const char *file_id;
+
+	/* Country restrictions applying to premium users */
+	const char *allowed;
+	const char *forbidden;
+
+	/* Track artists, the IDs and names are in the same order */
+	const char *artist_ids[TRACK_XML_MAX_ARTISTS];
+	int num_artist_ids;
+	const char *artists[TRACK_XML_MAX_ARTISTS];
+	int num_artists;
+
+	const char *album_id;
+	const char *album;
+	const char *album_artist_id;
+	const char *album_artist;
+	const char *year;
+	const char *cover;
+};
+
+
 sp_track *osfy_track_add(sp_session *session, unsigned char id[16]);
-void osfy_track_free(sp_track *track);
+void osfy_track_free(sp_session *session, sp_track *track);
 int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track_node);
+int osfy_track_xml_parse(struct track_xml *tx, char *xml, int len);
+void *osfy_track_xml_decode(char *xml, int len, struct arena *arena);
+void osfy_track_xml_from_ezxml(struct track_xml *tx, ezxml_t track_node);
+int osfy_track_load_from_track_xml(sp_session *session, sp_track *track, const struct track_xml *tx);
 int osfy_track_browse(sp_session *session, sp_track *track);
-void osfy_track_garbage_collect(sp_session *session);
-int osfy_track_metadata_save_to_disk(sp_session *session, char *filename);
-int osfy_track_metadata_load_from_disk(sp_session *session, char *filename);
+int osfy_track_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots);
 
 #endif
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -8,39 +9,63 @@
 #include "channel.h"
 #include "commands.h"
 #include "debug.h"
+#include "decoder.h"
 #include "ezxml.h"
+#include "flowctl.h"
+#include "hashtable.h"
+#include "memstats.h"
+#include "reclaim.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "user.h"
 #include "util.h"
+#include "xmlstream.h"
 
 
 struct user_ctx {
         sp_session *session;
         struct request *req;
-	struct buf *buf;
+	struct xml_stream *xs;
         sp_user *user;
+
+	/* Inflates and parses the reply on a decoder thread */
+	struct decode_job job;
+	struct buf *xml;
+	ezxml_t root;
 };
 
 
 static int user_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void user_ctx_decode(struct decode_job *job);
+static void user_ctx_apply(sp_session *session, struct decode_job *job);
+static void user_ctx_release(struct decode_job *job);
 static int user_parse_xml(struct user_ctx *user_ctx);
 
 
+/* Find or create a user, the caller gets a reference */
 sp_user *user_add(sp_session *session, const char *name) {
 	char name_key[256];
 	sp_user *user;
 	
 	strncpy(name_key, name, sizeof(name_key) - 1);
 	name_key[sizeof(name_key) - 1] = 0;
+
+	/* Another thread adding the same user must find this one */
+	hashtable_writer_lock(session->hashtable_users);
 	
-	user = (sp_user *)hashtable_find(session->hashtable_users, name_key);
-	if(user)
+	user = (sp_user *)reclaim_find(session->hashtable_users, name_key, offsetof(sp_user, ref_count));
+	if(user) {
+		hashtable_writer_unlock(session->hashtable_users);
 		return user;
+	}
 	
 	user = malloc(sizeof(sp_user));
-	if(user == NULL)
+	if(user == NULL) {
+		hashtable_writer_unlock(session->hashtable_users);
 		return NULL;
+	}
+
+	memstats_alloc(session, OPENSP_MEMORY_USERS, sizeof(sp_user));
 	
 	strncpy(user->canonical_name, name, sizeof(user->canonical_name) - 1);
 	user->canonical_name[sizeof(user->canonical_name) - 1] = 0;
@@ -49,13 +74,14 @@ sp_user *user_add(sp_session *session, const char *name) {
 	
 	user->display_name = NULL;
 
-	user->hashtable = session->hashtable_users;
-	hashtable_insert(user->hashtable, user->canonical_name, user);
-
 	user->error = SP_ERROR_RESOURCE_NOT_LOADED;
 	user->is_loaded = 0;
 
-	user->ref_count = 0;
+	REFCOUNT_INIT(&user->ref_count, 1);
+
+	user->hashtable = session->hashtable_users;
+	hashtable_insert(user->hashtable, user->canonical_name, user);
+	hashtable_writer_unlock(user->hashtable);
 	
 	return user;
 }
@@ -85,7 +111,9 @@ int user_lookup(sp_session *session, sp_user *user) {
 
 	user_ctx->session = session;
 	user_ctx->req = NULL;
-	user_ctx->buf = buf_new();
+	user_ctx->xs = xml_stream_new();
+	user_ctx->xml = NULL;
+	user_ctx->root = NULL;
 	user_ctx->user = user;
 	
         container = (void **)malloc(sizeof(void *));
@@ -95,34 +123,54 @@ int user_lookup(sp_session *session, sp_user *user) {
 }
 
 
+/* Unreferenced users are freed by the garbage collector, see reclaim.c */
 void user_release(sp_user *user) {
-	assert(user->ref_count > 0);
-	
-	if(--user->ref_count)
-		return;
+	int ref_count;
 
-	user_free(user);
+	ref_count = REFCOUNT_DEC(&user->ref_count);
+	assert(ref_count >= 0);
 }
 
 
-void user_free(sp_user *user) {
+/* Free a user retired by the garbage collector */
+void user_free(sp_session *session, sp_user *user) {
+	assert(REFCOUNT_GET(&user->ref_count) == RECLAIM_DEAD);
+
 	if(user->display_name)
 		free(user->display_name);
 
-	hashtable_remove(user->hashtable, user->canonical_name);
+	memstats_free(session, OPENSP_MEMORY_USERS, sizeof(sp_user));
 
 	free(user);
 }
 
 
 void user_add_ref(sp_user *user) {
-	user->ref_count++;
+	REFCOUNT_INC(&user->ref_count);
+}
+
+
+static void user_reclaim(sp_session *session, void *object) {
+	sp_user *user = (sp_user *)object;
+
+	DSFYDEBUG("Freeing user '%s' because of zero ref_count\n", user->canonical_name);
+	user_free(session, user);
+}
+
+
+int user_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots) {
+	return reclaim_sweep(session, session->hashtable_users, cursor, num_slots,
+			offsetof(sp_user, ref_count), user_reclaim);
 }
 
 
 int user_process_request(sp_session *session, struct request *req) {
 	struct user_ctx *user_ctx = *(struct user_ctx **)req->input;
 	
+	/* Parked until there's room for another channel */
+	if(!flowctl_admit(session, req))
+		return 0;
+
 	/*
 	 * Prevent request from happening again.
 	 * If there's an error the channel callback will reset the timeout
@@ -139,48 +187,30 @@ int user_process_request(sp_session *session, struct request *req) {
 
 
 static int user_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct user_ctx *user_ctx = (struct user_ctx *)ch->private;
 	
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-				
-				if (len == 0)
-					break;
-			}
-
-			buf_append_data(user_ctx->buf, payload, len);
+			/* Inflated on a decoder thread, in order */
+			xml_stream_submit(user_ctx->session, user_ctx->xs, payload, len);
 			break;
 			
 		case CHANNEL_ERROR:
 			DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", USER_RETRY_TIMEOUT);
-			buf_free(user_ctx->buf);
-			user_ctx->buf = buf_new();
+			xml_stream_submit_free(user_ctx->session, user_ctx->xs);
+			user_ctx->xs = xml_stream_new();
 
 			/* Reset timeout so the request can be retried */
-			user_ctx->req->next_timeout = get_millisecs() + USER_RETRY_TIMEOUT*1000;
+			request_set_timeout(user_ctx->session, user_ctx->req, channel_retry_timeout(ch, USER_RETRY_TIMEOUT*1000));
 
 			break;
 			
 		case CHANNEL_END:
-			if(user_parse_xml(user_ctx) == 0) {
-				request_set_result(user_ctx->session, user_ctx->req, SP_ERROR_OK, user_ctx->user);
-			
-				buf_free(user_ctx->buf);
-				free(user_ctx);
-			}
-			else {
-				buf_free(user_ctx->buf);
-				user_ctx->buf = buf_new();
-			}
+			/* The user is loaded by user_ctx_apply() once decoded */
+			user_ctx->job.decode = user_ctx_decode;
+			user_ctx->job.apply = user_ctx_apply;
+			user_ctx->job.release = user_ctx_release;
+			decoder_submit_serial(user_ctx->session, &user_ctx->job, user_ctx->xs);
 			break;
 			
 		default:
@@ -192,13 +222,17 @@ static int user_callback(CHANNEL *ch, unsigned char *payload, unsigned short len
 }
 
 
-static int user_parse_xml(struct user_ctx *user_ctx) {
-	struct buf *xml;
-	ezxml_t root, node;
-	
-	xml = despotify_inflate(user_ctx->buf->ptr, user_ctx->buf->len);
-	if(xml == NULL)
-		return -1;
+/* Inflate and parse the XML, run by a decoder thread */
+static void user_ctx_decode(struct decode_job *job) {
+	struct user_ctx *user_ctx;
+
+	user_ctx = (struct user_ctx *)((char *)job - offsetof(struct user_ctx, job));
+
+	/* Inflated by the jobs submitted before this one, see user_callback() */
+	user_ctx->xml = xml_stream_finish(user_ctx->xs);
+	user_ctx->xs = NULL;
+	if(user_ctx->xml == NULL)
+		return;
 	
 	{
 		FILE *fd;
@@ -206,16 +240,66 @@ static int user_parse_xml(struct user_ctx *user_ctx) {
 		sprintf(buf, "user-%s.xml", user_ctx->user->canonical_name);
 		fd = fopen(buf, "w");
 		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
+			fwrite(user_ctx->xml->ptr, user_ctx->xml->len, 1, fd);
 			fclose(fd);
 		}
 	}
 
+	user_ctx->root = ezxml_parse_str((char *)user_ctx->xml->ptr, user_ctx->xml->len);
+}
+
+
+/* Load the user and return the request, run by the iothread */
+static void user_ctx_apply(sp_session *session, struct decode_job *job) {
+	struct user_ctx *user_ctx;
+
+	user_ctx = (struct user_ctx *)((char *)job - offsetof(struct user_ctx, job));
+
+	if(user_parse_xml(user_ctx) == 0) {
+		request_set_result(user_ctx->session, user_ctx->req, SP_ERROR_OK, user_ctx->user);
+
+		user_ctx_release(job);
+		return;
+	}
+
+	if(user_ctx->root != NULL)
+		ezxml_free(user_ctx->root);
+
+	if(user_ctx->xml != NULL)
+		buf_free(user_ctx->xml);
+
+	user_ctx->root = NULL;
+	user_ctx->xml = NULL;
+	user_ctx->xs = xml_stream_new();
+}
+
+
+static void user_ctx_release(struct decode_job *job) {
+	struct user_ctx *user_ctx;
+
+	user_ctx = (struct user_ctx *)((char *)job - offsetof(struct user_ctx, job));
+
+	if(user_ctx->root != NULL)
+		ezxml_free(user_ctx->root);
+
+	if(user_ctx->xml != NULL)
+		buf_free(user_ctx->xml);
+
+	/* Dropped by decoder_free() before it was decoded */
+	if(user_ctx->xs != NULL)
+		xml_stream_free(user_ctx->xs);
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
+	free(user_ctx);
+}
+
+
+static int user_parse_xml(struct user_ctx *user_ctx) {
+	ezxml_t root, node;
+
+	/* Parsed by user_ctx_decode(), freed by user_ctx_release() */
+	root = user_ctx->root;
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
@@ -232,7 +316,5 @@ static int user_parse_xml(struct user_ctx *user_ctx) {
 		user_ctx->user->is_loaded = 1;
 	}
 
-	ezxml_free(root);
-	
 	return 0;
 }
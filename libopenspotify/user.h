@@ -12,8 +12,9 @@
 sp_user *user_add(sp_session *session, const char *name);
 int user_lookup(sp_session *session, sp_user *user);
 void user_release(sp_user *user);
-void user_free(sp_user *user);
+void user_free(sp_session *session, sp_user *user);
 void user_add_ref(sp_user *user);
+int user_garbage_collect(sp_session *session, unsigned int *cursor, unsigned int num_slots);
 int user_process_request(sp_session *session, struct request *req);
 
 #endif
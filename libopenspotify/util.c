@@ -219,6 +219,37 @@ int get_millisecs(void) {
 }
 
 
+
+/* For measuring short intervals, wraps around every 71 minutes or so */
+unsigned int get_microsecs(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if(!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+
+	QueryPerformanceCounter(&count);
+	return (unsigned int)(count.QuadPart * 1000000 / freq.QuadPart);
+#elif __linux__
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned int)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif __APPLE__
+	static mach_timebase_info_data_t mtid;
+
+	if(!mtid.denom)
+		mach_timebase_info(&mtid);
+
+	return (unsigned int)(mach_absolute_time() * mtid.numer / mtid.denom / 1000);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned int)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 struct buf* despotify_inflate(unsigned char* data, int len) {
 	int done, offset, rc;
 	struct buf *b;
@@ -26,6 +26,7 @@ void logdata (char *, int, void *, int);
 ssize_t block_read (int, void *, size_t);
 ssize_t block_write (int, const void *, size_t);
 int get_millisecs(void);
+unsigned int get_microsecs(void);
 struct buf* despotify_inflate(unsigned char* data, int len);
 
 #endif
@@ -0,0 +1,368 @@
+/*
+ * Zero-copy XML pull parser
+ *
+ * Used for the metadata that's parsed most often, where building a
+ * DOM with ezxml and looking up every field with ezxml_get() costs far
+ * more than the data is worth. The caller asks for one event at a time
+ * (start tag, text, end tag) and decodes the fields it's interested in
+ * into its own structures as it goes.
+ *
+ * Only what the Spotify metadata needs is supported: no DTDs, no
+ * namespaces, and end tags aren't checked against the start tags.
+ * Comments, processing instructions and declarations are skipped and
+ * CDATA sections are returned as text.
+ *
+ */
+
+#include <string.h>
+
+#include "xmlpull.h"
+
+
+static char *xml_pull_skip_space(char *p, char *end);
+static char *xml_pull_find(char *p, char *end, const char *s);
+static int xml_pull_decode(char *s, char *e);
+static int xml_pull_start_tag(struct xml_pull *xp, char *p);
+
+
+/* FNV-1a hash of an element name, used to dispatch on names */
+unsigned int xml_pull_hash(const char *name) {
+	unsigned int hash = 2166136261U;
+
+	while(*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+
+void xml_pull_init(struct xml_pull *xp, char *xml, int len) {
+	xp->p = xml;
+	xp->end = xml + len;
+
+	xp->depth = 0;
+
+	xp->name = NULL;
+	xp->hash = 0;
+
+	xp->num_attrs = 0;
+
+	xp->text = NULL;
+	xp->text_len = 0;
+
+	xp->empty = 0;
+	xp->in_tag = 0;
+}
+
+
+int xml_pull_next(struct xml_pull *xp) {
+	char *p, *q;
+
+	/* An empty element tag ends the element too */
+	if(xp->empty) {
+		xp->empty = 0;
+		xp->depth--;
+
+		return XML_PULL_END;
+	}
+
+	for(;;) {
+		p = xp->p;
+
+		if(!xp->in_tag) {
+			if(p >= xp->end)
+				return xp->depth? XML_PULL_ERROR: XML_PULL_EOF;
+
+			if(*p == '<') {
+				xp->p = p + 1;
+				xp->in_tag = 1;
+				continue;
+			}
+
+			/* Text up to the next tag */
+			for(q = p; q < xp->end && *q != '<'; q++);
+			if(q == xp->end)
+				return xp->depth? XML_PULL_ERROR: XML_PULL_EOF;
+
+			xp->p = q + 1;
+			xp->in_tag = 1;
+
+			/* Skip whitespace between elements */
+			if(xp->depth == 0 || xml_pull_skip_space(p, q) == q)
+				continue;
+
+			/* The '<' is replaced by the terminator, we know a tag follows */
+			*q = 0;
+			xp->text = p;
+			xp->text_len = xml_pull_decode(p, q);
+
+			return XML_PULL_TEXT;
+		}
+
+		xp->in_tag = 0;
+
+		/* Comments */
+		if(xp->end - p >= 3 && memcmp(p, "!--", 3) == 0) {
+			if((q = xml_pull_find(p + 3, xp->end, "-->")) == NULL)
+				return XML_PULL_ERROR;
+
+			xp->p = q + 3;
+			continue;
+		}
+
+		/* CDATA sections, returned as is */
+		if(xp->end - p >= 8 && memcmp(p, "![CDATA[", 8) == 0) {
+			if((q = xml_pull_find(p + 8, xp->end, "]]>")) == NULL)
+				return XML_PULL_ERROR;
+
+			xp->p = q + 3;
+			if(xp->depth == 0)
+				continue;
+
+			*q = 0;
+			xp->text = p + 8;
+			xp->text_len = q - xp->text;
+
+			return XML_PULL_TEXT;
+		}
+
+		/* Processing instructions and declarations */
+		if(p < xp->end && (*p == '?' || *p == '!')) {
+			if((q = xml_pull_find(p, xp->end, *p == '?'? "?>": ">")) == NULL)
+				return XML_PULL_ERROR;
+
+			xp->p = q + (*p == '?'? 2: 1);
+			continue;
+		}
+
+		/* End tags */
+		if(p < xp->end && *p == '/') {
+			if((q = memchr(p, '>', xp->end - p)) == NULL || xp->depth == 0)
+				return XML_PULL_ERROR;
+
+			xp->p = q + 1;
+			xp->name = ++p;
+			while(p < q && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+				p++;
+
+			*p = 0;
+			xp->hash = xml_pull_hash(xp->name);
+			xp->depth--;
+
+			return XML_PULL_END;
+		}
+
+		return xml_pull_start_tag(xp, p);
+	}
+}
+
+
+/* Get the value of an attribute of the element just started */
+const char *xml_pull_attr(struct xml_pull *xp, const char *name) {
+	int i;
+
+	for(i = 0; i < xp->num_attrs; i++)
+		if(strcmp(xp->attr_names[i], name) == 0)
+			return xp->attr_values[i];
+
+	return NULL;
+}
+
+
+/* Parse a start tag, or an empty element tag, following a '<' */
+static int xml_pull_start_tag(struct xml_pull *xp, char *p) {
+	char *name_end, *attr_name, *value, quote;
+
+	xp->name = p;
+	while(p < xp->end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'
+		&& *p != '/' && *p != '>')
+		p++;
+
+	name_end = p;
+	if(name_end == xp->name)
+		return XML_PULL_ERROR;
+
+	xp->num_attrs = 0;
+	xp->text = NULL;
+	xp->text_len = 0;
+
+	for(;;) {
+		p = xml_pull_skip_space(p, xp->end);
+		if(p >= xp->end)
+			return XML_PULL_ERROR;
+
+		if(*p == '>') {
+			p++;
+			break;
+		}
+
+		if(*p == '/') {
+			if(p + 1 >= xp->end || p[1] != '>')
+				return XML_PULL_ERROR;
+
+			xp->empty = 1;
+			p += 2;
+			break;
+		}
+
+		/* Attribute name */
+		attr_name = p;
+		while(p < xp->end && *p != '=' && *p != ' ' && *p != '\t'
+			&& *p != '\r' && *p != '\n' && *p != '>')
+			p++;
+
+		if(p >= xp->end)
+			return XML_PULL_ERROR;
+
+		if(*p != '=') {
+			*p++ = 0;
+			p = xml_pull_skip_space(p, xp->end);
+			if(p >= xp->end || *p != '=')
+				return XML_PULL_ERROR;
+		}
+		else
+			*p = 0;
+
+		/* Quoted attribute value */
+		p = xml_pull_skip_space(p + 1, xp->end);
+		if(p >= xp->end || (*p != '"' && *p != '\''))
+			return XML_PULL_ERROR;
+
+		quote = *p++;
+		if(xp->num_attrs < XML_PULL_MAX_ATTRS) {
+			xp->attr_names[xp->num_attrs] = attr_name;
+			xp->attr_values[xp->num_attrs] = p;
+		}
+
+		value = p;
+		while(p < xp->end && *p != quote)
+			p++;
+
+		if(p >= xp->end)
+			return XML_PULL_ERROR;
+
+		*p++ = 0;
+		if(xp->num_attrs < XML_PULL_MAX_ATTRS) {
+			xml_pull_decode(value, p - 1);
+			xp->num_attrs++;
+		}
+	}
+
+	xp->p = p;
+
+	*name_end = 0;
+	xp->hash = xml_pull_hash(xp->name);
+	xp->depth++;
+
+	return XML_PULL_START;
+}
+
+
+static char *xml_pull_skip_space(char *p, char *end) {
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+		p++;
+
+	return p;
+}
+
+
+static char *xml_pull_find(char *p, char *end, const char *s) {
+	int len = strlen(s);
+
+	for(; p + len <= end; p++) {
+		if(*p == *s && memcmp(p, s, len) == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Decode entities in place and NUL terminate the result
+ * Returns the length of the decoded string.
+ *
+ */
+static int xml_pull_decode(char *s, char *e) {
+	static const struct {
+		const char *name;
+		char c;
+	} entities[] = {
+		{ "amp;", '&' },
+		{ "lt;", '<' },
+		{ "gt;", '>' },
+		{ "quot;", '"' },
+		{ "apos;", '\'' }
+	};
+	char *d, *r, *q;
+	unsigned long c;
+	int i, n;
+
+	if((r = memchr(s, '&', e - s)) == NULL) {
+		*e = 0;
+		return e - s;
+	}
+
+	for(d = r; r < e; ) {
+		if(*r != '&') {
+			*d++ = *r++;
+			continue;
+		}
+
+		/* Named entities */
+		for(i = 0; i < sizeof(entities) / sizeof(entities[0]); i++) {
+			n = strlen(entities[i].name);
+			if(e - r > n && memcmp(r + 1, entities[i].name, n) == 0)
+				break;
+		}
+
+		if(i < sizeof(entities) / sizeof(entities[0])) {
+			*d++ = entities[i].c;
+			r += 1 + n;
+			continue;
+		}
+
+		/* Character references, encoded as UTF-8 */
+		if(e - r > 3 && r[1] == '#' && (q = memchr(r, ';', e - r)) != NULL) {
+			c = 0;
+			if(r[2] == 'x') {
+				for(n = 3; r + n < q; n++)
+					c = c * 16 + (r[n] <= '9'? r[n] - '0': (r[n] | 0x20) - 'a' + 10);
+			}
+			else {
+				for(n = 2; r + n < q; n++)
+					c = c * 10 + r[n] - '0';
+			}
+
+			if(c < 0x80)
+				*d++ = (char)c;
+			else if(c < 0x800) {
+				*d++ = (char)(0xc0 | (c >> 6));
+				*d++ = (char)(0x80 | (c & 0x3f));
+			}
+			else if(c < 0x10000) {
+				*d++ = (char)(0xe0 | (c >> 12));
+				*d++ = (char)(0x80 | ((c >> 6) & 0x3f));
+				*d++ = (char)(0x80 | (c & 0x3f));
+			}
+			else {
+				*d++ = (char)(0xf0 | ((c >> 18) & 0x07));
+				*d++ = (char)(0x80 | ((c >> 12) & 0x3f));
+				*d++ = (char)(0x80 | ((c >> 6) & 0x3f));
+				*d++ = (char)(0x80 | (c & 0x3f));
+			}
+
+			r = q + 1;
+			continue;
+		}
+
+		/* Not an entity we know of, keep it */
+		*d++ = *r++;
+	}
+
+	*d = 0;
+
+	return d - s;
+}
@@ -0,0 +1,57 @@
+#ifndef LIBOPENSPOTIFY_XMLPULL_H
+#define LIBOPENSPOTIFY_XMLPULL_H
+
+
+/* Events returned by xml_pull_next() */
+#define XML_PULL_ERROR	-1
+#define XML_PULL_EOF	0
+#define XML_PULL_START	1
+#define XML_PULL_END	2
+#define XML_PULL_TEXT	3
+
+/* Attributes kept per element, any others are ignored */
+#define XML_PULL_MAX_ATTRS	8
+
+
+/*
+ * Pull parser working in place on a mutable XML buffer
+ *
+ * Names, attribute values and text are NUL terminated and have their
+ * entities decoded within the buffer, so they can be used as strings
+ * for as long as the buffer is kept around.
+ *
+ */
+struct xml_pull {
+	char *p;
+	char *end;
+
+	/* Depth of the current element, the root element is at depth 1 */
+	int depth;
+
+	/* Name of the element started or ended, and its hash */
+	char *name;
+	unsigned int hash;
+
+	/* Attributes of the element started */
+	char *attr_names[XML_PULL_MAX_ATTRS];
+	char *attr_values[XML_PULL_MAX_ATTRS];
+	int num_attrs;
+
+	/* Text within the current element */
+	char *text;
+	int text_len;
+
+	/* Set after an empty element tag, which is followed by an END event */
+	int empty;
+
+	/* Set when p is past the '<' of a tag, which might be overwritten */
+	int in_tag;
+};
+
+
+unsigned int xml_pull_hash(const char *name);
+void xml_pull_init(struct xml_pull *xp, char *xml, int len);
+int xml_pull_next(struct xml_pull *xp);
+const char *xml_pull_attr(struct xml_pull *xp, const char *name);
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Streaming decompression and parsing of gzip'd XML replies
+ *
+ * Replies to browse, search, toplist and user requests are gzip'd XML
+ * documents delivered in CHANNEL_DATA payloads. Instead of keeping the
+ * compressed reply around until CHANNEL_END, each payload is inflated
+ * as soon as it arrives using a z_stream that lives as long as the
+ * channel.
+ *
+ * When an element name is set with xml_stream_set_element(), every
+ * complete element with that name (i.e, a <track> in a track browse
+ * reply) is handed to a callback right away and its text dropped, so
+ * only the element being received is kept in memory.
+ * Whatever else the document contains is returned by
+ * xml_stream_finish().
+ *
+ * Channel callbacks don't inflate on the iothread though, they hand
+ * each payload to a decoder thread with xml_stream_submit(). Jobs for
+ * the same stream are run one at a time in order, so the stream itself
+ * is only ever touched by one thread.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "buf.h"
+#include "debug.h"
+#include "decoder.h"
+#include "xmlstream.h"
+
+
+#define XML_TAG_OTHER	0
+#define XML_TAG_OPEN	1
+#define XML_TAG_CLOSE	2
+#define XML_TAG_EMPTY	3
+
+
+static int xml_stream_tag_end(unsigned char *p, int tag, int len, int *kind);
+static int xml_stream_tag_matches(struct xml_stream *xs, unsigned char *p, int len, int kind);
+static int xml_stream_scan(struct xml_stream *xs);
+static void xml_stream_emit(struct xml_stream *xs, int start, int end);
+static void xml_stream_compact(struct xml_stream *xs);
+static void xml_stream_job_decode(struct decode_job *job);
+static void xml_stream_job_apply(sp_session *session, struct decode_job *job);
+static void xml_stream_job_release(struct decode_job *job);
+
+
+struct xml_stream *xml_stream_new(void) {
+	struct xml_stream *xs;
+	int rc;
+
+	xs = malloc(sizeof(struct xml_stream));
+	if(xs == NULL)
+		return NULL;
+
+	memset(&xs->z, 0, sizeof(xs->z));
+	rc = inflateInit2(&xs->z, -MAX_WBITS);
+	if(rc != Z_OK) {
+		DSFYDEBUG("error: inflateInit() returned %d\n", rc);
+		free(xs);
+		return NULL;
+	}
+
+	xs->skip = XML_STREAM_GZIP_HEADER;
+	xs->error = 0;
+	xs->xml = buf_new();
+
+	xs->element = NULL;
+	xs->element_len = 0;
+	xs->callback = NULL;
+	xs->private = NULL;
+
+	xs->scan = 0;
+	xs->start = 0;
+	xs->depth = 0;
+
+	xs->num_elements = 0;
+
+	return xs;
+}
+
+
+void xml_stream_set_element(struct xml_stream *xs, const char *element, xml_stream_element_cb callback, void *private) {
+	free(xs->element);
+
+	xs->element = strdup(element);
+	xs->element_len = strlen(element);
+	xs->callback = callback;
+	xs->private = private;
+}
+
+
+/*
+ * Inflate a CHANNEL_DATA payload and hand any elements completed by it
+ * to the callback. Returns -1 if the data couldn't be inflated.
+ *
+ */
+int xml_stream_feed(struct xml_stream *xs, unsigned char *data, int len) {
+	int rc, skip;
+
+	if(xs->error)
+		return -1;
+
+	/* Skip a minimal gzip header */
+	skip = xs->skip < len? xs->skip: len;
+	xs->skip -= skip;
+	data += skip;
+	len -= skip;
+
+	xs->z.next_in = data;
+	xs->z.avail_in = len;
+
+	while(xs->z.avail_in) {
+		if(xs->xml->size - xs->xml->len < XML_STREAM_INFLATE_CHUNK)
+			buf_extend(xs->xml, XML_STREAM_INFLATE_CHUNK);
+
+		xs->z.next_out = xs->xml->ptr + xs->xml->len;
+		xs->z.avail_out = xs->xml->size - xs->xml->len;
+
+		rc = inflate(&xs->z, Z_NO_FLUSH);
+		xs->xml->len = xs->xml->size - xs->z.avail_out;
+
+		if(rc == Z_STREAM_END)
+			break;
+		else if(rc != Z_OK && rc != Z_BUF_ERROR) {
+			DSFYDEBUG("error: inflate() returned %d\n", rc);
+			xs->error = 1;
+			return -1;
+		}
+	}
+
+	if(xs->element != NULL)
+		return xml_stream_scan(xs);
+
+	return 0;
+}
+
+
+/*
+ * Free the stream and return the XML that wasn't handed to the
+ * element callback, NUL terminated. Returns NULL on errors or if
+ * there was no data at all.
+ *
+ */
+struct buf *xml_stream_finish(struct xml_stream *xs) {
+	struct buf *xml = NULL;
+
+	if(!xs->error && xs->z.total_out) {
+		xml = xs->xml;
+		xs->xml = NULL;
+
+		/* Null terminate string */
+		buf_append_u8(xml, 0);
+		xml->len--;
+	}
+
+	xml_stream_free(xs);
+
+	return xml;
+}
+
+
+void xml_stream_free(struct xml_stream *xs) {
+	inflateEnd(&xs->z);
+
+	if(xs->xml != NULL)
+		buf_free(xs->xml);
+
+	free(xs->element);
+	free(xs);
+}
+
+
+/*
+ * Have a decoder thread feed a copy of the data to the stream, after
+ * anything submitted for it before. Called by the iothread, which must
+ * not touch the stream itself until a job submitted with
+ * decoder_submit_serial() and the stream as its serial is applied.
+ *
+ */
+int xml_stream_submit(sp_session *session, struct xml_stream *xs, unsigned char *data, int len) {
+	struct xml_stream_job *xsj;
+
+	xsj = malloc(sizeof(struct xml_stream_job) + (len > 0? len: 0));
+	if(xsj == NULL) {
+		DSFYDEBUG("Failed to allocate a job for %d bytes of XML\n", len);
+		return -1;
+	}
+
+	xsj->job.decode = xml_stream_job_decode;
+	xsj->job.apply = xml_stream_job_apply;
+	xsj->job.release = xml_stream_job_release;
+	xsj->xs = xs;
+	xsj->len = len;
+	if(len > 0)
+		memcpy(xsj->data, data, len);
+
+	decoder_submit_serial(session, &xsj->job, xs);
+
+	return 0;
+}
+
+
+/* Have a decoder thread free the stream, once the data submitted for it is fed */
+int xml_stream_submit_free(sp_session *session, struct xml_stream *xs) {
+	return xml_stream_submit(session, xs, NULL, -1);
+}
+
+
+/* Run by a decoder thread */
+static void xml_stream_job_decode(struct decode_job *job) {
+	struct xml_stream_job *xsj = (struct xml_stream_job *)job;
+
+	if(xsj->len < 0)
+		xml_stream_free(xsj->xs);
+	else
+		xml_stream_feed(xsj->xs, xsj->data, xsj->len);
+}
+
+
+/* Nothing to load, the stream holds the inflated XML */
+static void xml_stream_job_apply(sp_session *session, struct decode_job *job) {
+	free(job);
+}
+
+
+/* Dropped by decoder_free(), with the decoder threads gone */
+static void xml_stream_job_release(struct decode_job *job) {
+	struct xml_stream_job *xsj = (struct xml_stream_job *)job;
+
+	if(xsj->len < 0)
+		xml_stream_free(xsj->xs);
+
+	free(xsj);
+}
+
+
+/*
+ * Find the end of the markup starting at the '<' at offset 'tag'
+ * Returns the offset following it or -1 if it isn't complete yet.
+ *
+ */
+static int xml_stream_tag_end(unsigned char *p, int tag, int len, int *kind) {
+	static const struct {
+		const char *start;
+		const char *end;
+	} skip[] = {
+		{ "<!--", "-->" },
+		{ "<![CDATA[", "]]>" },
+		{ "<?", "?>" },
+		{ "<!", ">" }
+	};
+	unsigned char quote = 0;
+	int i, n, end;
+
+	*kind = XML_TAG_OTHER;
+
+	/* Comments, CDATA sections, processing instructions and declarations */
+	for(i = 0; i < sizeof(skip) / sizeof(skip[0]); i++) {
+		n = strlen(skip[i].start);
+		if(len - tag < n) {
+			if(memcmp(p + tag, skip[i].start, len - tag) == 0)
+				return -1;
+
+			continue;
+		}
+
+		if(memcmp(p + tag, skip[i].start, n) != 0)
+			continue;
+
+		n = strlen(skip[i].end);
+		for(end = tag + 2; end + n <= len; end++)
+			if(memcmp(p + end, skip[i].end, n) == 0)
+				return end + n;
+
+		return -1;
+	}
+
+	/* Elements, taking care of '>' within attribute values */
+	for(end = tag + 1; end < len; end++) {
+		if(quote) {
+			if(p[end] == quote)
+				quote = 0;
+		}
+		else if(p[end] == '"' || p[end] == '\'')
+			quote = p[end];
+		else if(p[end] == '>')
+			break;
+	}
+
+	if(end == len)
+		return -1;
+
+	if(p[tag + 1] == '/')
+		*kind = XML_TAG_CLOSE;
+	else if(p[end - 1] == '/')
+		*kind = XML_TAG_EMPTY;
+	else
+		*kind = XML_TAG_OPEN;
+
+	return end + 1;
+}
+
+
+/* Check if a tag has the name of the elements looked for */
+static int xml_stream_tag_matches(struct xml_stream *xs, unsigned char *p, int len, int kind) {
+	unsigned char c;
+	int skip;
+
+	/* The name is followed by at least the closing '>' */
+	skip = kind == XML_TAG_CLOSE? 2: 1;
+	if(len - skip <= xs->element_len)
+		return 0;
+
+	p += skip;
+	if(memcmp(p, xs->element, xs->element_len) != 0)
+		return 0;
+
+	c = p[xs->element_len];
+
+	return c == '>' || c == '/' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+
+/* Look for complete elements in the XML inflated so far */
+static int xml_stream_scan(struct xml_stream *xs) {
+	unsigned char *p = xs->xml->ptr, *lt;
+	int len = xs->xml->len;
+	int tag, end, kind;
+
+	while(xs->scan < len) {
+		lt = memchr(p + xs->scan, '<', len - xs->scan);
+		if(lt == NULL) {
+			xs->scan = len;
+			break;
+		}
+
+		tag = lt - p;
+		if((end = xml_stream_tag_end(p, tag, len, &kind)) < 0) {
+			/* Wait for the rest of the tag */
+			xs->scan = tag;
+			break;
+		}
+
+		xs->scan = end;
+		if(kind == XML_TAG_OTHER || !xml_stream_tag_matches(xs, p + tag, end - tag, kind))
+			continue;
+
+		switch(kind) {
+			case XML_TAG_OPEN:
+				if(xs->depth++ == 0)
+					xs->start = tag;
+				break;
+
+			case XML_TAG_CLOSE:
+				if(xs->depth && --xs->depth == 0)
+					xml_stream_emit(xs, xs->start, end);
+				break;
+
+			case XML_TAG_EMPTY:
+				if(xs->depth == 0)
+					xml_stream_emit(xs, tag, end);
+				break;
+		}
+	}
+
+	xml_stream_compact(xs);
+
+	return 0;
+}
+
+
+static void xml_stream_emit(struct xml_stream *xs, int start, int end) {
+	xs->callback((char *)xs->xml->ptr + start, end - start, xs->private);
+	xs->num_elements++;
+}
+
+
+/*
+ * Drop the text before the element being received, or everything
+ * scanned if there's none, so memory use doesn't grow with the number
+ * of elements. Markup outside the elements looked for is dropped too.
+ *
+ */
+static void xml_stream_compact(struct xml_stream *xs) {
+	int discard;
+
+	discard = xs->depth? xs->start: xs->scan;
+	if(discard == 0)
+		return;
+
+	memmove(xs->xml->ptr, xs->xml->ptr + discard, xs->xml->len - discard);
+	xs->xml->len -= discard;
+
+	xs->scan -= discard;
+	if(xs->depth)
+		xs->start -= discard;
+}
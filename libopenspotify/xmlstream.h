@@ -0,0 +1,74 @@
+#ifndef LIBOPENSPOTIFY_XMLSTREAM_H
+#define LIBOPENSPOTIFY_XMLSTREAM_H
+
+#include <zlib.h>
+
+#include <libspotify/api.h>
+
+#include "buf.h"
+#include "decoder.h"
+
+
+/* Size of the minimal gzip header preceding the deflated XML */
+#define XML_STREAM_GZIP_HEADER	10
+
+/* Inflate into at least this many free bytes at a time */
+#define XML_STREAM_INFLATE_CHUNK	4096
+
+
+/*
+ * Called with the text of every complete element with the name given
+ * to xml_stream_set_element(). The text may be modified in place but
+ * is dropped when the callback returns.
+ *
+ */
+typedef int (*xml_stream_element_cb)(char *xml, int len, void *private);
+
+
+struct xml_stream {
+	z_stream z;
+
+	/* Bytes of the gzip header left to skip */
+	int skip;
+
+	/* Set when inflating failed, further data is ignored */
+	int error;
+
+	/* Inflated XML not yet handed to the element callback */
+	struct buf *xml;
+
+	/* Elements to hand to the callback as soon as they're complete */
+	char *element;
+	int element_len;
+	xml_stream_element_cb callback;
+	void *private;
+
+	/* Offset of the next tag to scan for and of the open element, if any */
+	int scan;
+	int start;
+	int depth;
+
+	int num_elements;
+};
+
+
+/* Data fed to a stream by a decoder thread, see xml_stream_submit() */
+struct xml_stream_job {
+	struct decode_job job;
+	struct xml_stream *xs;
+
+	/* Free the stream instead when negative */
+	int len;
+	unsigned char data[1];
+};
+
+
+struct xml_stream *xml_stream_new(void);
+void xml_stream_set_element(struct xml_stream *xs, const char *element, xml_stream_element_cb callback, void *private);
+int xml_stream_feed(struct xml_stream *xs, unsigned char *data, int len);
+struct buf *xml_stream_finish(struct xml_stream *xs);
+void xml_stream_free(struct xml_stream *xs);
+int xml_stream_submit(sp_session *session, struct xml_stream *xs, unsigned char *data, int len);
+int xml_stream_submit_free(sp_session *session, struct xml_stream *xs);
+
+#endif
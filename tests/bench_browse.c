@@ -0,0 +1,174 @@
+/*
+ * Loading a large playlist, see playlist.c and browse.c
+ *
+ * Loads a playlist of 10,000 tracks from tools/mockap, which delays
+ * every reply by a round trip, and browses its tracks with one chunk
+ * of 244 tracks in flight at a time as before, and with more of them
+ * pipelined. Each run has a session and mock of its own, so that no
+ * tracks are loaded yet.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libspotify/api.h>
+
+#include "playlist.h"
+#include "request.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+#define NUM_TRACKS	10000
+#define LATENCY_MS	"50"
+
+#define TIMEOUT_MS	120000
+
+
+static char dir[] = "/tmp/bench_browse.XXXXXX";
+
+static sp_session_callbacks callbacks;
+static int metadata_updated;
+
+static int max_chunks;
+
+
+static void make_id(unsigned char *id, int len, int kind, int n) {
+	int i;
+
+	for(i = 0; i < len; i++)
+		id[i] = (unsigned char)((n + 1) * 2654435761U >> (i % 4 * 8)) ^ (kind * 16 + i);
+}
+
+
+/* A playlist with all the tracks, as the service sends it but for the owner */
+static void write_playlist(void) {
+	unsigned char id[17];
+	char hex[35], path[128];
+	FILE *fp;
+	int i;
+
+	/* The container is all zeros */
+	make_id(id, 17, 0, 0);
+	hex_bytes_to_ascii(id, hex, 17);
+	sprintf(path, "%s/playlist-%s.xml", dir, hex);
+	CHECK((fp = fopen(path, "w")) != NULL);
+
+	fprintf(fp, "<next-change><change><ops><name>Large</name><add><items>");
+	for(i = 0; i < NUM_TRACKS; i++) {
+		make_id(id, 16, 1, i);
+		hex_bytes_to_ascii(id, hex, 16);
+		fprintf(fp, "%s%s", i? ",": "", hex);
+	}
+
+	fprintf(fp, "</items></add></ops></change>");
+	fprintf(fp, "<version>0000000001,%010d,0000000000,0</version></next-change>\n", NUM_TRACKS);
+	fclose(fp);
+}
+
+
+/* A track like the ones the service returns, see playlist.c */
+static void write_track(int n) {
+	unsigned char id[20];
+	char hex[41], path[128];
+	FILE *fp;
+
+	make_id(id, 16, 1, n);
+	hex_bytes_to_ascii(id, hex, 16);
+	sprintf(path, "%s/track-%s.xml", dir, hex);
+	CHECK((fp = fopen(path, "w")) != NULL);
+
+	fprintf(fp, "<track><id>%s</id><title>Track %d</title>", hex, n);
+
+	make_id(id, 16, 2, n / 10);
+	hex_bytes_to_ascii(id, hex, 16);
+	fprintf(fp, "<artist-id>%s</artist-id><artist>Artist %d</artist>", hex, n / 10);
+	fprintf(fp, "<album-artist-id>%s</album-artist-id><album-artist>Artist %d</album-artist>", hex, n / 10);
+
+	make_id(id, 16, 3, n / 10);
+	hex_bytes_to_ascii(id, hex, 16);
+	fprintf(fp, "<album>Album %d</album><album-id>%s</album-id><year>2009</year>", n / 10, hex);
+
+	make_id(id, 20, 5, n / 10);
+	hex_bytes_to_ascii(id, hex, 20);
+	fprintf(fp, "<cover>%s</cover>", hex);
+	fprintf(fp, "<track-number>%d</track-number><length>%d</length>", n % 10 + 1, 180000 + n);
+
+	make_id(id, 20, 4, n);
+	hex_bytes_to_ascii(id, hex, 20);
+	fprintf(fp, "<files><file id=\"%s\" format=\"Ogg Vorbis,160000,1,32,4\"/></files>", hex);
+	fprintf(fp, "<restrictions><restriction catalogues=\"premium\" allowed=\"SE\"/></restrictions>");
+	fprintf(fp, "<popularity>0.5</popularity></track>\n");
+
+	fclose(fp);
+}
+
+
+static void SP_CALLCONV metadata_updated_cb(sp_session *session) {
+	metadata_updated = 1;
+}
+
+
+static void browse(void) {
+	unsigned char id[17];
+	const char *options[] = { "-d", LATENCY_MS, NULL };
+	char log_file[64];
+	sp_session *session;
+	sp_playlist *playlist, **container;
+	long long start;
+	int next_timeout, i;
+
+	sprintf(log_file, "%s/mockap-%d.log", dir, (int)getpid());
+	harness_mockap_start(dir, log_file, options);
+
+	callbacks.metadata_updated = metadata_updated_cb;
+	session = harness_login(&callbacks);
+	opensp_session_set_browse_pipeline(session, max_chunks);
+
+	make_id(id, 17, 0, 0);
+	CHECK((playlist = playlist_create(session, id)) != NULL);
+	container = malloc(sizeof(sp_playlist *));
+	*container = playlist;
+
+	start = harness_usecs();
+	CHECK(request_post(session, REQ_TYPE_PLAYLIST_LOAD, container) == 0);
+	while(!metadata_updated) {
+		CHECK(harness_usecs() - start < TIMEOUT_MS * 1000LL);
+		sp_session_process_events(session, &next_timeout);
+		usleep(1000);
+	}
+
+	harness_report("until the playlist was loaded", (harness_usecs() - start) / 1000.0, "ms");
+
+	CHECK(playlist->state == PLAYLIST_STATE_LOADED);
+	CHECK(playlist->num_tracks == NUM_TRACKS);
+	for(i = 0; i < NUM_TRACKS; i++)
+		CHECK(sp_track_is_loaded(playlist->tracks[i]));
+}
+
+
+int main(void) {
+	char name[64], path[128];
+	int i;
+
+	CHECK(mkdtemp(dir) != NULL);
+	write_playlist();
+	for(i = 0; i < NUM_TRACKS; i++)
+		write_track(i);
+
+	printf("Playlist of %d tracks, %sms round trips\n", NUM_TRACKS, LATENCY_MS);
+	for(max_chunks = 1; max_chunks <= 8; max_chunks *= 2) {
+		sprintf(name, "%d chunk%s in flight", max_chunks, max_chunks > 1? "s": "");
+		harness_fork(name, browse);
+	}
+
+	sprintf(path, "rm -rf %s", dir);
+	CHECK(system(path) == 0);
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * Cost of dispatching packets to channels, see channel.c
+ *
+ * Opens a growing number of channels and feeds data packets for them,
+ * round robin, through channel_process() like the iothread does for
+ * CMD_CHANNELDATA. Before the channel table every packet walked the
+ * list of open channels, so the cost grew with their number. Also
+ * measures opening and closing a channel with the others still open,
+ * which rescanned the list for a free id.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libspotify/api.h>
+
+#include "channel.h"
+#include "sp_opaque.h"
+
+#include "harness.h"
+
+
+#define MAX_CHANNELS	4096
+#define NUM_PACKETS	4000000
+#define NUM_REOPENED	1000000
+#define PAYLOAD_SIZE	4096
+
+
+static long long num_bytes;
+
+
+static int data_callback(CHANNEL *ch, unsigned char *buf, unsigned short len) {
+	num_bytes += len;
+
+	return 0;
+}
+
+
+static void run(sp_session *session, int num) {
+	static CHANNEL *channels[MAX_CHANNELS];
+	static unsigned char packet[2 + PAYLOAD_SIZE];
+	long long start;
+	CHANNEL *ch;
+	int i, id;
+
+	for(i = 0; i < num; i++) {
+		CHECK((channels[i] = channel_register(session, "bench", data_callback, NULL)) != NULL);
+
+		/* No headers */
+		packet[0] = channels[i]->channel_id >> 8;
+		packet[1] = channels[i]->channel_id & 0xff;
+		packet[2] = packet[3] = 0;
+		channel_process(session, packet, 4, 0);
+		CHECK(channels[i]->state == CHANNEL_DATA);
+	}
+
+	num_bytes = 0;
+	start = harness_usecs();
+	for(i = 0; i < NUM_PACKETS; i++) {
+		id = channels[i % num]->channel_id;
+		packet[0] = id >> 8;
+		packet[1] = id & 0xff;
+		channel_process(session, packet, sizeof(packet), 0);
+	}
+
+	CHECK(num_bytes == (long long)NUM_PACKETS * PAYLOAD_SIZE);
+
+	printf("%d open channels\n", num);
+	harness_report("per data packet", (harness_usecs() - start) * 1000.0 / NUM_PACKETS, "ns");
+
+	start = harness_usecs();
+	for(i = 0; i < NUM_REOPENED; i++) {
+		ch = channels[i % num];
+		channel_unregister(session, ch);
+		CHECK((channels[i % num] = channel_register(session, "bench", data_callback, NULL)) != NULL);
+	}
+
+	harness_report("close and open one", (harness_usecs() - start) * 1000.0 / NUM_REOPENED, "ns");
+
+	for(i = 0; i < num; i++)
+		channel_unregister(session, channels[i]);
+
+	CHECK(session->num_channels == 0);
+}
+
+
+int main(void) {
+	sp_session *session;
+	int num;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	for(num = 1; num <= MAX_CHANNELS; num *= 16)
+		run(session, num);
+
+	return 0;
+}
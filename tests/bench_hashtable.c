@@ -0,0 +1,296 @@
+/*
+ * Inserting, finding and removing metadata IDs, see hashtable.c
+ *
+ * Fills a table with 16 byte keys like the track IDs of a session, then
+ * finds every key, finds as many keys that aren't there and removes
+ * them all, at 10k, 100k and 1M entries. Keys are found and removed in
+ * a random order, not the order the old table allocated its entries in.
+ * Compared is the table used before, with a fixed 2048 chains hashed on
+ * the first four bytes of the key and a key copy allocated per entry, up
+ * to where it takes minutes. Then how finds scale with threads reading
+ * at once, which take no lock, as far as the CPUs allow.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "hashtable.h"
+
+#include "harness.h"
+
+
+#define KEY_SIZE	16
+#define MAX_ENTRIES	1000000
+#define MAX_CHAINED_ENTRIES	100000
+#define MAX_READERS	4
+#define NUM_READER_FINDS	1000000
+
+#define NUM_CHAINS	2048
+
+
+/* An entry of the table used before */
+struct chained_entry {
+	void *key;
+	void *value;
+	struct chained_entry *next;
+};
+
+
+struct chained_table {
+	struct chained_entry *chains[NUM_CHAINS];
+	pthread_mutex_t mutex;
+};
+
+
+static unsigned char (*keys)[KEY_SIZE];
+static int *order;
+static struct hashtable *shared;
+
+
+/* Random looking like real IDs, the second half of the keys are never inserted */
+static void make_keys(void) {
+	unsigned int x;
+	int i;
+
+	keys = malloc(2 * MAX_ENTRIES * KEY_SIZE);
+	for(i = 0; i < 2 * MAX_ENTRIES; i++) {
+		x = (i + 1) * 2654435761U;
+		memset(keys[i], 0, KEY_SIZE);
+		memcpy(keys[i], &x, 4);
+		memcpy(keys[i] + 8, &i, 4);
+	}
+
+	order = malloc(MAX_ENTRIES * sizeof(int));
+}
+
+
+/* A random order of the first num keys */
+static void shuffle(int num) {
+	int i, j, tmp;
+
+	for(i = 0; i < num; i++)
+		order[i] = i;
+
+	for(i = num - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+
+static struct chained_table *chained_create(void) {
+	struct chained_table *table;
+	pthread_mutexattr_t attr;
+
+	table = calloc(1, sizeof(struct chained_table));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&table->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	return table;
+}
+
+
+/* Appended to the end of the chain, like before */
+static void chained_insert(struct chained_table *table, void *key, void *value) {
+	struct chained_entry *entry, **ptr;
+
+	pthread_mutex_lock(&table->mutex);
+	for(ptr = &table->chains[*(unsigned int *)key & (NUM_CHAINS - 1)]; *ptr; ptr = &(*ptr)->next)
+		;
+
+	entry = malloc(sizeof(struct chained_entry));
+	entry->key = malloc(KEY_SIZE);
+	memcpy(entry->key, key, KEY_SIZE);
+	entry->value = value;
+	entry->next = NULL;
+	*ptr = entry;
+
+	pthread_mutex_unlock(&table->mutex);
+}
+
+
+static void *chained_find(struct chained_table *table, const void *key) {
+	struct chained_entry *entry;
+
+	pthread_mutex_lock(&table->mutex);
+	for(entry = table->chains[*(unsigned int *)key & (NUM_CHAINS - 1)]; entry; entry = entry->next)
+		if(!memcmp(entry->key, key, KEY_SIZE))
+			break;
+
+	pthread_mutex_unlock(&table->mutex);
+
+	return entry? entry->value: NULL;
+}
+
+
+static void chained_remove(struct chained_table *table, void *key) {
+	struct chained_entry *entry, **ptr;
+
+	pthread_mutex_lock(&table->mutex);
+	for(ptr = &table->chains[*(unsigned int *)key & (NUM_CHAINS - 1)]; (entry = *ptr) != NULL; ptr = &entry->next) {
+		if(!memcmp(entry->key, key, KEY_SIZE)) {
+			*ptr = entry->next;
+			free(entry->key);
+			free(entry);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&table->mutex);
+}
+
+
+static void chained_free(struct chained_table *table) {
+	pthread_mutex_destroy(&table->mutex);
+	free(table);
+}
+
+
+static void report(long long start, int num, const char *name) {
+	harness_report(name, (harness_usecs() - start) * 1000.0 / num, "ns");
+}
+
+
+static void run_chained(int num) {
+	struct chained_table *table;
+	long long start;
+	int i;
+
+	table = chained_create();
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		chained_insert(table, keys[i], keys[i]);
+
+	printf("Fixed chains, %d entries\n", num);
+	report(start, num, "insert");
+
+	shuffle(num);
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		CHECK(chained_find(table, keys[order[i]]) == keys[order[i]]);
+
+	report(start, num, "find");
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		CHECK(chained_find(table, keys[MAX_ENTRIES + i]) == NULL);
+
+	report(start, num, "find, not there");
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		chained_remove(table, keys[order[i]]);
+
+	report(start, num, "remove");
+
+	for(i = 0; i < NUM_CHAINS; i++)
+		CHECK(table->chains[i] == NULL);
+
+	chained_free(table);
+}
+
+
+static void run(int num) {
+	struct hashtable *table;
+	long long start;
+	int i;
+
+	CHECK((table = hashtable_create(KEY_SIZE)) != NULL);
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		hashtable_insert(table, keys[i], keys[i]);
+
+	printf("Robin Hood table, %d entries\n", num);
+	report(start, num, "insert");
+
+	shuffle(num);
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		CHECK(hashtable_find(table, keys[order[i]]) == keys[order[i]]);
+
+	report(start, num, "find");
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		CHECK(hashtable_find(table, keys[MAX_ENTRIES + i]) == NULL);
+
+	report(start, num, "find, not there");
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		hashtable_remove(table, keys[order[i]]);
+
+	report(start, num, "remove");
+
+	CHECK(table->table.count == 0 && table->old.count == 0);
+	hashtable_free(table);
+}
+
+
+static void *reader(void *arg) {
+	unsigned int n = *(unsigned int *)arg;
+	int i;
+
+	for(i = 0; i < NUM_READER_FINDS; i++) {
+		n = n * 1103515245 + 12345;
+		CHECK(hashtable_find(shared, keys[n % MAX_ENTRIES]) == keys[n % MAX_ENTRIES]);
+	}
+
+	return NULL;
+}
+
+
+static void run_readers(int num_readers) {
+	pthread_t threads[MAX_READERS];
+	unsigned int seeds[MAX_READERS];
+	long long start;
+	int i;
+
+	start = harness_usecs();
+	for(i = 0; i < num_readers; i++) {
+		seeds[i] = i;
+		pthread_create(&threads[i], NULL, reader, &seeds[i]);
+	}
+
+	for(i = 0; i < num_readers; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("%d reader%s, %d entries, %ld CPUs\n", num_readers, num_readers > 1? "s": "", MAX_ENTRIES,
+		sysconf(_SC_NPROCESSORS_ONLN));
+	harness_report("finds per second",
+		(double)num_readers * NUM_READER_FINDS * 1000000.0 / (harness_usecs() - start), "");
+}
+
+
+int main(void) {
+	int num, i;
+
+	make_keys();
+
+	for(num = 10000; num <= MAX_ENTRIES; num *= 10) {
+		run(num);
+		if(num <= MAX_CHAINED_ENTRIES)
+			run_chained(num);
+	}
+
+	CHECK((shared = hashtable_create(KEY_SIZE)) != NULL);
+	for(i = 0; i < MAX_ENTRIES; i++)
+		hashtable_insert(shared, keys[i], keys[i]);
+
+	for(num = 1; num <= MAX_READERS; num *= 2)
+		run_readers(num);
+
+	hashtable_free(shared);
+
+	return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * How long a posted request waits for a sleeping iothread to wake up
+ *
+ * A thread standing in for the iothread sleeps in ioloop_wait() with
+ * no timeout, and is woken with ioloop_wakeup() as request_post() does.
+ * Before the eventfd it only noticed new requests when select() timed
+ * out, after 32ms on average. Also measures what ioloop_wakeup() costs
+ * a producer while the iothread is busy, when it shouldn't reach the
+ * kernel at all.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libspotify/api.h>
+
+#include "atomic.h"
+#include "ioloop.h"
+#include "sp_opaque.h"
+
+#include "harness.h"
+
+
+#define NUM_WAKEUPS	5000
+#define NUM_BUSY_WAKEUPS	10000000
+
+
+static long long woken_at;
+static int num_woken;
+static int stop;
+
+
+static void *sleeper(void *arg) {
+	sp_session *session = (sp_session *)arg;
+
+	while(!osfy_atomic_load_int(&stop)) {
+		if(ioloop_wait(session, -1, 0) <= 0)
+			continue;
+
+		woken_at = harness_usecs();
+		osfy_atomic_store_int(&num_woken, num_woken + 1);
+	}
+
+	return NULL;
+}
+
+
+int main(void) {
+	static long long latency[NUM_WAKEUPS];
+	sp_session *session;
+	pthread_t thread;
+	long long start;
+	int i;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	pthread_create(&thread, NULL, sleeper, session);
+	for(i = 0; i < NUM_WAKEUPS; i++) {
+		/* Let it park */
+		usleep(100);
+
+		start = harness_usecs();
+		ioloop_wakeup(session);
+		while(osfy_atomic_load_int(&num_woken) == i)
+			;
+
+		latency[i] = woken_at - start;
+	}
+
+	osfy_atomic_store_int(&stop, 1);
+	ioloop_wakeup(session);
+	pthread_join(thread, NULL);
+
+	qsort(latency, NUM_WAKEUPS, sizeof(long long), harness_compare_usecs);
+	printf("Wakeup latency of a parked iothread, %d wakeups\n", NUM_WAKEUPS);
+	harness_report("median", latency[NUM_WAKEUPS / 2], "us");
+	harness_report("99th percentile", latency[NUM_WAKEUPS * 99 / 100], "us");
+	harness_report("max", latency[NUM_WAKEUPS - 1], "us");
+
+
+	/* The iothread isn't parked, the wakeup is only flagged */
+	start = harness_usecs();
+	for(i = 0; i < NUM_BUSY_WAKEUPS; i++) {
+		ioloop_wakeup(session);
+		session->ioloop->pending = 0;
+	}
+
+	printf("Wakeups of a busy iothread, %d wakeups\n", NUM_BUSY_WAKEUPS);
+	harness_report("per wakeup", (harness_usecs() - start) * 1000.0 / NUM_BUSY_WAKEUPS, "ns");
+
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Saving and loading the metadata cache, see metacache.c
+ *
+ * Measures how long metacache_save() keeps the iothread busy compared
+ * to the whole save, which a decoder thread finishes, both for a first
+ * save and for one that only adds a few objects. Then how long it takes
+ * to create and load every track again at startup, with the file just
+ * evicted from the page cache (cold) and with it still there (warm),
+ * against creating them with no cache at all.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libspotify/api.h>
+
+#include "album.h"
+#include "artist.h"
+#include "decoder.h"
+#include "metacache.h"
+#include "sp_opaque.h"
+#include "strpool.h"
+#include "track.h"
+
+#include "harness.h"
+
+
+#define NUM_TRACKS	50000
+#define NUM_ADDED	1000
+#define TRACKS_PER_ALBUM	10
+
+
+static void make_id(unsigned char id[16], int kind, int n) {
+	memset(id, 0, 16);
+	id[0] = kind;
+	id[12] = n >> 24;
+	id[13] = n >> 16;
+	id[14] = n >> 8;
+	id[15] = n;
+}
+
+
+/* Tracks as a browse would have loaded them, each album by one artist */
+static void load_tracks(sp_session *session, int first, int num) {
+	unsigned char id[16];
+	char name[64];
+	sp_track *track;
+	sp_album *album;
+	sp_artist *artist;
+	int i;
+
+	for(i = first; i < first + num; i++) {
+		make_id(id, 1, i);
+		CHECK((track = osfy_track_add(session, id)) != NULL);
+
+		make_id(id, 2, i / TRACKS_PER_ALBUM);
+		CHECK((album = sp_album_add(session, id)) != NULL);
+		make_id(id, 3, i / TRACKS_PER_ALBUM);
+		CHECK((artist = osfy_artist_add(session, id)) != NULL);
+
+		if(!artist->is_loaded) {
+			sprintf(name, "Artist %d", i / TRACKS_PER_ALBUM);
+			strpool_set(session, &artist->name, name);
+			artist->is_loaded = 1;
+		}
+
+		if(!album->is_loaded) {
+			sprintf(name, "Album %d", i / TRACKS_PER_ALBUM);
+			strpool_set(session, &album->name, name);
+			album->artist = artist;
+			sp_artist_add_ref(artist);
+			album->year = 2009;
+			album->is_loaded = 1;
+		}
+
+		sprintf(name, "Track %d", i);
+		strpool_set(session, &track->name, name);
+		track->album = album;
+		track->artists = malloc(sizeof(sp_artist *));
+		track->artists[0] = artist;
+		track->num_artists = 1;
+		track->duration = 180000 + i;
+		track->is_available = 1;
+		track->is_loaded = 1;
+		track->error = SP_ERROR_OK;
+	}
+}
+
+
+/* Time the iothread's part of a save, and the whole of it */
+static void save(sp_session *session, const char *name) {
+	long long start, returned;
+
+	start = harness_usecs();
+	CHECK(metacache_save(session) == 0);
+	returned = harness_usecs();
+
+	while(session->metacache->saving) {
+		usleep(100);
+		decoder_process(session);
+	}
+
+	printf("%s\n", name);
+	harness_report("iothread busy", (returned - start) / 1000.0, "ms");
+	harness_report("until the file was replaced", (harness_usecs() - start) / 1000.0, "ms");
+}
+
+
+/* Create every track like a session that's starting up, with the cache at filename if any */
+static void startup(const char *name, const char *filename) {
+	unsigned char id[16];
+	sp_session *session;
+	sp_track *track;
+	long long start;
+	int i, num_loaded;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	start = harness_usecs();
+	if(filename != NULL)
+		CHECK(metacache_init(session, filename) == 0);
+
+	num_loaded = 0;
+	for(i = 0; i < NUM_TRACKS + NUM_ADDED; i++) {
+		make_id(id, 1, i);
+		CHECK((track = osfy_track_add(session, id)) != NULL);
+		num_loaded += track->is_loaded;
+	}
+
+	printf("%s\n", name);
+	harness_report("creating all tracks", (harness_usecs() - start) / 1000.0, "ms");
+	harness_report("tracks loaded", num_loaded, "");
+	CHECK(num_loaded == (filename != NULL? NUM_TRACKS + NUM_ADDED: 0));
+}
+
+
+/* Drop the file from the page cache, so that it's read from disk again */
+static void evict(const char *filename) {
+	int fd;
+
+	CHECK((fd = open(filename, O_RDONLY)) >= 0);
+	fsync(fd);
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(fd);
+}
+
+
+int main(void) {
+	char dir[] = "/tmp/bench_metacache.XXXXXX";
+	char filename[64];
+	sp_session *session;
+
+	CHECK(mkdtemp(dir) != NULL);
+	sprintf(filename, "%s/%s", dir, METACACHE_FILE);
+
+	CHECK((session = harness_session_new()) != NULL);
+	CHECK(metacache_init(session, filename) == 0);
+
+	load_tracks(session, 0, NUM_TRACKS);
+	save(session, "First save");
+
+	load_tracks(session, NUM_TRACKS, NUM_ADDED);
+	save(session, "Save after loading a few more tracks");
+
+	startup("Startup without a cache", NULL);
+
+	evict(filename);
+	startup("Startup with a cold cache", filename);
+	startup("Startup with a warm cache", filename);
+
+	remove(filename);
+	rmdir(dir);
+
+	return 0;
+}
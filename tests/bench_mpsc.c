@@ -0,0 +1,234 @@
+/*
+ * Passing packets to a consumer thread, see mpsc.c and player.c
+ *
+ * Producers push copies of substream-sized packets to a consumer that
+ * parks on a condition when there's nothing to do, like the iothread
+ * calling player_push() for the player thread. Compared are the FIFO
+ * player_push() used before, a list behind the player's mutex that's
+ * walked to the tail and signalled on every push, and the lock-free
+ * queue that only takes the mutex to wake a parked consumer.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "mpsc.h"
+
+#include "harness.h"
+
+
+#define NUM_PACKETS	200000
+#define PACKET_SIZE	512
+#define MAX_PRODUCERS	4
+
+
+struct item {
+	void *data;
+	int len;
+
+	/* The list used before */
+	struct item *next;
+
+	struct mpsc_node node;
+};
+
+
+struct fifo {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* The list used before */
+	struct item *items;
+
+	struct mpsc_queue queue;
+	int item_posted;
+	int parked;
+
+	int num_consumed;
+	long long producer_usecs;
+};
+
+
+static unsigned char packet[PACKET_SIZE];
+
+
+static struct item *item_new(void) {
+	struct item *item;
+
+	item = malloc(sizeof(struct item));
+	item->data = malloc(PACKET_SIZE);
+	memcpy(item->data, packet, PACKET_SIZE);
+	item->len = PACKET_SIZE;
+	item->next = NULL;
+
+	return item;
+}
+
+
+static void item_free(struct item *item) {
+	free(item->data);
+	free(item);
+}
+
+
+/* player_push() before */
+static void *list_producer(void *arg) {
+	struct fifo *fifo = (struct fifo *)arg;
+	struct item *item, *walker;
+	long long start;
+	int i;
+
+	start = harness_usecs();
+	for(i = 0; i < NUM_PACKETS; i++) {
+		item = item_new();
+
+		pthread_mutex_lock(&fifo->mutex);
+		if((walker = fifo->items) == NULL)
+			fifo->items = item;
+		else {
+			while(walker->next)
+				walker = walker->next;
+
+			walker->next = item;
+		}
+
+		fifo->item_posted = 1;
+		pthread_cond_signal(&fifo->cond);
+		pthread_mutex_unlock(&fifo->mutex);
+	}
+
+	pthread_mutex_lock(&fifo->mutex);
+	fifo->producer_usecs += harness_usecs() - start;
+	pthread_mutex_unlock(&fifo->mutex);
+
+	return NULL;
+}
+
+
+/* player_schedule() before, one item at a time under the mutex */
+static void list_consume(struct fifo *fifo, int num) {
+	struct item *item;
+
+	pthread_mutex_lock(&fifo->mutex);
+	while(fifo->num_consumed < num) {
+		while(!fifo->item_posted)
+			pthread_cond_wait(&fifo->cond, &fifo->mutex);
+
+		fifo->item_posted = 0;
+		while((item = fifo->items) != NULL) {
+			fifo->items = item->next;
+			pthread_mutex_unlock(&fifo->mutex);
+
+			item_free(item);
+			fifo->num_consumed++;
+
+			pthread_mutex_lock(&fifo->mutex);
+		}
+	}
+
+	pthread_mutex_unlock(&fifo->mutex);
+}
+
+
+/* player_push() */
+static void *mpsc_producer(void *arg) {
+	struct fifo *fifo = (struct fifo *)arg;
+	long long start;
+	int i;
+
+	start = harness_usecs();
+	for(i = 0; i < NUM_PACKETS; i++) {
+		mpsc_push(&fifo->queue, &item_new()->node);
+
+		if(osfy_atomic_xchg_int(&fifo->item_posted, 1) != 0
+			|| !osfy_atomic_load_int(&fifo->parked))
+			continue;
+
+		pthread_mutex_lock(&fifo->mutex);
+		pthread_cond_signal(&fifo->cond);
+		pthread_mutex_unlock(&fifo->mutex);
+	}
+
+	pthread_mutex_lock(&fifo->mutex);
+	fifo->producer_usecs += harness_usecs() - start;
+	pthread_mutex_unlock(&fifo->mutex);
+
+	return NULL;
+}
+
+
+/* player_schedule() */
+static void mpsc_consume(struct fifo *fifo, int num) {
+	struct mpsc_node *node;
+
+	while(fifo->num_consumed < num) {
+		pthread_mutex_lock(&fifo->mutex);
+		for(;;) {
+			osfy_atomic_store_int(&fifo->parked, 1);
+			if(osfy_atomic_load_int(&fifo->item_posted))
+				break;
+
+			pthread_cond_wait(&fifo->cond, &fifo->mutex);
+		}
+
+		osfy_atomic_store_int(&fifo->parked, 0);
+		pthread_mutex_unlock(&fifo->mutex);
+
+		osfy_atomic_store_int(&fifo->item_posted, 0);
+		while((node = mpsc_pop(&fifo->queue)) != NULL) {
+			item_free(mpsc_entry(node, struct item, node));
+			fifo->num_consumed++;
+		}
+	}
+}
+
+
+static void run(const char *name, void *(*producer)(void *),
+		void (*consume)(struct fifo *, int), int num_producers) {
+	pthread_t threads[MAX_PRODUCERS];
+	struct fifo fifo;
+	long long start, elapsed;
+	int i, num;
+
+	memset(&fifo, 0, sizeof(fifo));
+	pthread_mutex_init(&fifo.mutex, NULL);
+	pthread_cond_init(&fifo.cond, NULL);
+	mpsc_init(&fifo.queue);
+
+	num = num_producers * NUM_PACKETS;
+	start = harness_usecs();
+	for(i = 0; i < num_producers; i++)
+		pthread_create(&threads[i], NULL, producer, &fifo);
+
+	consume(&fifo, num);
+	elapsed = harness_usecs() - start;
+
+	for(i = 0; i < num_producers; i++)
+		pthread_join(threads[i], NULL);
+
+	CHECK(fifo.num_consumed == num);
+	CHECK(fifo.items == NULL && mpsc_is_empty(&fifo.queue));
+
+	printf("%s, %d producer%s\n", name, num_producers, num_producers > 1? "s": "");
+	harness_report("producer time per push", fifo.producer_usecs * 1000.0 / num, "ns");
+	harness_report("packets per second", num * 1000000.0 / elapsed, "");
+
+	pthread_mutex_destroy(&fifo.mutex);
+	pthread_cond_destroy(&fifo.cond);
+}
+
+
+int main(void) {
+	int n;
+
+	for(n = 1; n <= MAX_PRODUCERS; n *= 2) {
+		run("Mutex and list", list_producer, list_consume, n);
+		run("Lock-free queue", mpsc_producer, mpsc_consume, n);
+	}
+
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Cost of the request scheduler per request, see request.c
+ *
+ * Posts a growing number of requests and takes them through what the
+ * iothread and the main thread do with them: fetching new requests,
+ * parking them in the timer heap with a timeout in the future, fetching
+ * them when it expires, returning results and cleaning up. With the
+ * old linked list every step walked all outstanding requests, so the
+ * cost per request grew with their number. It should stay about flat,
+ * only the timer heap grows with the logarithm.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <libspotify/api.h>
+
+#include "request.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+#define MAX_REQUESTS	100000
+
+
+static void run(sp_session *session, int num) {
+	static struct request *reqs[MAX_REQUESTS];
+	struct request *req;
+	long long start, posted, parked, expired;
+	int now, next_timeout, i, n;
+
+	start = harness_usecs();
+	for(i = 0; i < num; i++)
+		CHECK(request_post(session, REQ_TYPE_SEARCH, NULL) == 0);
+
+	posted = harness_usecs();
+
+	/* Due right away, then wait for a minute at most */
+	now = get_millisecs();
+	request_begin_pass(session, now);
+	n = 0;
+	while((req = request_fetch_expired(session, now)) != NULL) {
+		req->next_timeout = now + 1000 + rand() % 60000;
+		reqs[n++] = req;
+	}
+
+	CHECK(n == num);
+	for(i = 0; i < n; i++)
+		request_reschedule(session, reqs[i]);
+
+	parked = harness_usecs();
+
+	/* As if the minute had passed, in order of next_timeout */
+	request_begin_pass(session, INT_MAX - 1);
+	n = 0;
+	now = 0;
+	while((req = request_fetch_expired(session, INT_MAX - 1)) != NULL) {
+		CHECK(req->next_timeout >= now);
+		now = req->next_timeout;
+
+		request_set_result(session, req, SP_ERROR_OK, NULL);
+		request_reschedule(session, req);
+		n++;
+	}
+
+	CHECK(n == num);
+	expired = harness_usecs();
+
+	n = 0;
+	while((req = request_fetch_next_result(session, &next_timeout)) != NULL) {
+		request_mark_processed(session, req);
+		n++;
+	}
+
+	request_cleanup(session);
+	CHECK(n == num);
+
+	printf("%d requests\n", num);
+	harness_report("post", (posted - start) * 1000.0 / num, "ns/request");
+	harness_report("fetch and park in the timer heap", (parked - posted) * 1000.0 / num, "ns/request");
+	harness_report("expire and return", (expired - parked) * 1000.0 / num, "ns/request");
+	harness_report("fetch result and clean up", (harness_usecs() - expired) * 1000.0 / num, "ns/request");
+}
+
+
+int main(void) {
+	sp_session *session;
+	int num;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	for(num = 1000; num <= MAX_REQUESTS; num *= 10)
+		run(session, num);
+
+	return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Throughput of the receive path, see packet.c
+ *
+ * Replays an encrypted stream of channel data packets, shaped like a
+ * substream download, over a socket pair and through handle_packet()
+ * to a channel. Compared are the receive ring, which decrypts in place
+ * and passes a pointer into the ring, and the buffer used before,
+ * which copied every packet out to a new buffer and moved what was
+ * left of the receive buffer down. Decryption takes most of the time,
+ * so what each path costs on top of decrypting the stream is reported
+ * as well.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <libspotify/api.h>
+
+#include "buf.h"
+#include "channel.h"
+#include "handlers.h"
+#include "packet.h"
+#include "ring.h"
+#include "shn.h"
+#include "sp_opaque.h"
+
+#include "harness.h"
+
+
+#define NUM_PACKETS	20000
+
+/* Channel data as the server sends it, the channel id and up to 4kB of a file */
+#define DATA_SIZE	4096
+#define CMD_CHANNELDATA	0x09
+
+#define WRITE_SIZE	16384
+
+
+static unsigned char key[32];
+
+static unsigned char *stream;
+static int stream_len;
+
+static long long num_bytes, num_data_bytes;
+
+/* Time it takes to decrypt the stream */
+static long long decrypt_usecs;
+
+
+static int data_callback(CHANNEL *ch, unsigned char *buf, unsigned short len) {
+	num_bytes += len;
+
+	return 0;
+}
+
+
+/* Encrypt a packet onto the end of the stream like packet_write() */
+static void append_packet(shn_ctx *shn, unsigned int iv, unsigned char *payload, int len) {
+	unsigned char nonce[4], *ptr;
+
+	nonce[0] = iv >> 24;
+	nonce[1] = iv >> 16;
+	nonce[2] = iv >> 8;
+	nonce[3] = iv;
+	shn_nonce(shn, nonce, 4);
+
+	ptr = stream + stream_len;
+	ptr[0] = CMD_CHANNELDATA;
+	ptr[1] = len >> 8;
+	ptr[2] = len & 0xff;
+	memcpy(ptr + 3, payload, len);
+
+	shn_encrypt(shn, ptr, 3 + len);
+	shn_finish(shn, ptr + 3 + len, 4);
+	stream_len += 3 + len + 4;
+}
+
+
+/* Channel 0 with no headers, then data, mostly full packets and a few shorter ones */
+static void make_stream(void) {
+	unsigned char payload[2 + DATA_SIZE];
+	shn_ctx shn;
+	int i, len;
+
+	memset(key, 7, sizeof(key));
+	shn_key(&shn, key, sizeof(key));
+
+	stream = malloc(NUM_PACKETS * (3 + sizeof(payload) + 4));
+	stream_len = 0;
+
+	memset(payload, 0, sizeof(payload));
+	append_packet(&shn, 0, payload, 4);
+
+	num_data_bytes = 0;
+	for(i = 1; i < NUM_PACKETS; i++) {
+		len = i % 16 == 0? 1 + rand() % DATA_SIZE: DATA_SIZE;
+		payload[2 + i % DATA_SIZE] = i;
+		append_packet(&shn, i, payload, 2 + len);
+		num_data_bytes += len;
+	}
+}
+
+
+/* Decrypt a copy of the stream, packet by packet, with nothing else going on */
+static void time_decrypt(void) {
+	unsigned char *copy, *ptr, nonce[4];
+	long long start;
+	shn_ctx shn;
+	int i, len;
+
+	copy = malloc(stream_len);
+	memcpy(copy, stream, stream_len);
+	shn_key(&shn, key, sizeof(key));
+
+	start = harness_usecs();
+	for(i = 0, ptr = copy; i < NUM_PACKETS; i++) {
+		nonce[0] = i >> 24;
+		nonce[1] = i >> 16;
+		nonce[2] = i >> 8;
+		nonce[3] = i;
+		shn_nonce(&shn, nonce, 4);
+
+		shn_decrypt(&shn, ptr, 3);
+		len = (ptr[1] << 8) | ptr[2];
+		shn_decrypt(&shn, ptr + 3, len);
+		ptr += 3 + len + 4;
+	}
+
+	decrypt_usecs = harness_usecs() - start;
+	free(copy);
+
+	printf("Decryption alone, %d packets\n", NUM_PACKETS);
+	harness_report("throughput", stream_len / (double)decrypt_usecs, "MB/s");
+}
+
+
+static void *writer(void *arg) {
+	int sock = *(int *)arg;
+	int pos, len;
+
+	for(pos = 0; pos < stream_len; pos += len) {
+		len = stream_len - pos < WRITE_SIZE? stream_len - pos: WRITE_SIZE;
+		CHECK(write(sock, stream + pos, len) == len);
+	}
+
+	return NULL;
+}
+
+
+/* packet_read_and_process() before the receive ring */
+static int buf_read_and_process(sp_session *session, struct buf *rx) {
+	struct buf *packet;
+	unsigned char header[3], nonce[4];
+	int ret, len;
+
+	if(rx->len == rx->size)
+		buf_extend(rx, rx->size);
+
+	ret = recv(session->sock, rx->ptr + rx->len, rx->size - rx->len, 0);
+	if(ret <= 0)
+		return -1;
+
+	rx->len += ret;
+	while(rx->len >= 3) {
+		nonce[0] = (session->key_recv_IV >> 24) & 0xff;
+		nonce[1] = (session->key_recv_IV >> 16) & 0xff;
+		nonce[2] = (session->key_recv_IV >> 8) & 0xff;
+		nonce[3] = session->key_recv_IV & 0xff;
+		shn_nonce(&session->shn_recv, nonce, 4);
+
+		memcpy(header, rx->ptr, 3);
+		shn_decrypt(&session->shn_recv, header, 3);
+
+		len = (header[1] << 8) | header[2];
+		if(rx->len < 3 + len + 4)
+			break;
+
+		packet = buf_consume(rx, 3 + len + 4);
+		memcpy(packet->ptr, header, 3);
+		shn_decrypt(&session->shn_recv, packet->ptr + 3, len);
+		session->key_recv_IV++;
+
+		ret = handle_packet(session, header[0], packet->ptr + 3, len);
+		buf_free(packet);
+		if(ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+static void run(sp_session *session, const char *name, int use_ring) {
+	struct buf *rx = NULL;
+	pthread_t thread;
+	long long start, elapsed;
+	int sv[2], ret;
+	CHANNEL *ch;
+
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	session->sock = sv[0];
+	shn_key(&session->shn_recv, key, sizeof(key));
+	session->key_recv_IV = 0;
+	packet_reset(session);
+
+	CHECK((ch = channel_register(session, "bench", data_callback, NULL)) != NULL);
+	CHECK(ch->channel_id == 0);
+
+	if(!use_ring) {
+		rx = buf_new();
+		buf_extend(rx, PACKET_MIN_READ);
+	}
+
+	num_bytes = 0;
+	start = harness_usecs();
+	pthread_create(&thread, NULL, writer, &sv[1]);
+	while(session->key_recv_IV < NUM_PACKETS) {
+		if(use_ring)
+			ret = packet_read_and_process(session);
+		else
+			ret = buf_read_and_process(session, rx);
+
+		CHECK(ret == 0);
+	}
+
+	elapsed = harness_usecs() - start;
+	pthread_join(thread, NULL);
+	CHECK(num_bytes == num_data_bytes);
+
+	printf("%s, %d packets\n", name, NUM_PACKETS);
+	harness_report("throughput", stream_len / (double)elapsed, "MB/s");
+	harness_report("per packet, beyond decryption", (elapsed - decrypt_usecs) * 1000.0 / NUM_PACKETS, "ns");
+
+	channel_unregister(session, ch);
+	if(rx != NULL)
+		buf_free(rx);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+
+int main(void) {
+	sp_session *session;
+
+	CHECK((session = harness_session_new()) != NULL);
+	make_stream();
+	time_decrypt();
+
+	run(session, "Receive ring", 1);
+	run(session, "Copied out of a buffer", 0);
+
+	return 0;
+}
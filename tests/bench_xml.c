@@ -0,0 +1,244 @@
+/*
+ * Decoding track XML, see xmlpull.c and sp_track.c
+ *
+ * Builds a track browse reply like the service sends, with a few
+ * artists, files and restrictions per track and some entities to
+ * decode, and gets the fields of every track from it. Compared are
+ * ezxml, which builds a DOM of the whole reply that the fields are then
+ * taken from in one pass, and the pull parser, which decodes each
+ * <track> element as it's handed over when the reply is inflated. Both
+ * are checked to find the same fields first.
+ *
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libspotify/api.h>
+
+#include "ezxml.h"
+#include "track.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+/* As many as browse.c asks for in a chunk */
+#define NUM_TRACKS	244
+#define NUM_RUNS	50
+
+
+static char *reply;
+static int reply_len;
+
+/* Where the <track> elements are, as xml_stream would hand them over */
+static int track_starts[NUM_TRACKS];
+static int track_lens[NUM_TRACKS];
+
+static struct track_xml ezxml_tracks[NUM_TRACKS];
+static struct track_xml pull_tracks[NUM_TRACKS];
+
+
+static char *make_hex(int len, int kind, int n) {
+	static char hex[4][41];
+	static int next;
+	unsigned char id[20];
+	char *ptr;
+	int i;
+
+	for(i = 0; i < len; i++)
+		id[i] = (unsigned char)((n + 1) * 2654435761U >> (i % 4 * 8)) ^ (kind * 16 + i);
+
+	ptr = hex[next++ % 4];
+	hex_bytes_to_ascii(id, ptr, len);
+
+	return ptr;
+}
+
+
+static void append(const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	reply_len += vsprintf(reply + reply_len, fmt, ap);
+	va_end(ap);
+}
+
+
+static void make_reply(void) {
+	int i;
+
+	reply = malloc(NUM_TRACKS * 4096);
+	reply_len = 0;
+
+	append("<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<result><tracks>\n");
+	for(i = 0; i < NUM_TRACKS; i++) {
+		track_starts[i] = reply_len;
+
+		append("<track>\n<id>%s</id>\n<redirect>%s</redirect>\n", make_hex(16, 1, i), make_hex(16, 6, i));
+		append("<title>Caf&#233; Night &amp; Day No. %d</title>\n<explicit>false</explicit>\n", i);
+		append("<artist-id>%s</artist-id>\n<artist>The Artist &amp; Band</artist>\n", make_hex(16, 2, i / 10));
+		append("<artist-id>%s</artist-id>\n<artist>Featured Artist</artist>\n", make_hex(16, 2, i / 10 + 1));
+		append("<album>Album &lt;Deluxe&gt; %d</album>\n<album-id>%s</album-id>\n", i / 10, make_hex(16, 3, i / 10));
+		append("<album-artist>The Artist &amp; Band</album-artist>\n<album-artist-id>%s</album-artist-id>\n",
+			make_hex(16, 2, i / 10));
+		append("<year>2009</year>\n<track-number>%d</track-number>\n<length>%d</length>\n", i % 10 + 1, 180000 + i);
+		append("<files>\n<file id=\"%s\" format=\"Ogg Vorbis,96000,1,32,4\"/>\n", make_hex(20, 4, i));
+		append("<file id=\"%s\" format=\"Ogg Vorbis,160000,1,32,4\"/>\n", make_hex(20, 5, i));
+		append("<file id=\"%s\" format=\"Ogg Vorbis,320000,1,32,4\"/>\n</files>\n", make_hex(20, 7, i));
+		append("<cover>%s</cover>\n<popularity>0.%02d</popularity>\n", make_hex(20, 8, i / 10), i % 100);
+		append("<external-ids>\n<external-id type=\"isrc\" id=\"USABC09%05d\"/>\n</external-ids>\n", i);
+		append("<restrictions>\n<restriction catalogues=\"free\" allowed=\"SE FI NO\"/>\n");
+		append("<restriction catalogues=\"premium\" forbidden=\"US JP\"/>\n</restrictions>\n</track>");
+
+		track_lens[i] = reply_len - track_starts[i];
+		append("\n");
+	}
+
+	append("</tracks></result>\n");
+}
+
+
+/* The reply copied, since both parsers modify it in place */
+static char *copy_reply(void) {
+	char *copy;
+
+	copy = malloc(reply_len);
+	memcpy(copy, reply, reply_len);
+
+	return copy;
+}
+
+
+static ezxml_t ezxml_decode(char *xml, struct track_xml *tracks) {
+	ezxml_t root, node;
+	int i;
+
+	CHECK((root = ezxml_parse_str(xml, reply_len)) != NULL);
+	for(node = ezxml_get(root, "tracks", 0, "track", -1), i = 0; node; node = node->next, i++) {
+		CHECK(i < NUM_TRACKS);
+		osfy_track_xml_from_ezxml(&tracks[i], node);
+	}
+
+	CHECK(i == NUM_TRACKS);
+
+	return root;
+}
+
+
+static void pull_decode(char *xml, struct track_xml *tracks) {
+	int i;
+
+	for(i = 0; i < NUM_TRACKS; i++)
+		CHECK(osfy_track_xml_parse(&tracks[i], xml + track_starts[i], track_lens[i]) == 0);
+}
+
+
+/* Including freeing the DOM, which the pull parser doesn't have */
+static long long ezxml_run(char *xml) {
+	long long start;
+
+	start = harness_usecs();
+	ezxml_free(ezxml_decode(xml, pull_tracks));
+
+	return harness_usecs() - start;
+}
+
+
+static long long pull_run(char *xml) {
+	long long start;
+
+	start = harness_usecs();
+	pull_decode(xml, pull_tracks);
+
+	return harness_usecs() - start;
+}
+
+
+static void check_field(const char *a, const char *b) {
+	CHECK((a == NULL) == (b == NULL));
+	CHECK(a == NULL || strcmp(a, b) == 0);
+}
+
+
+static void check_tracks(void) {
+	struct track_xml *a, *b;
+	char *ezxml_xml, *pull_xml;
+	ezxml_t root;
+	int i, j;
+
+	ezxml_xml = copy_reply();
+	root = ezxml_decode(ezxml_xml, ezxml_tracks);
+	pull_xml = copy_reply();
+	pull_decode(pull_xml, pull_tracks);
+
+	for(i = 0; i < NUM_TRACKS; i++) {
+		a = &ezxml_tracks[i];
+		b = &pull_tracks[i];
+
+		CHECK(a->id != NULL && a->file_id != NULL);
+		check_field(a->id, b->id);
+		check_field(a->title, b->title);
+		check_field(a->explicit_lyrics, b->explicit_lyrics);
+		check_field(a->popularity, b->popularity);
+		check_field(a->length, b->length);
+		check_field(a->file_id, b->file_id);
+		check_field(a->allowed, b->allowed);
+		check_field(a->forbidden, b->forbidden);
+		check_field(a->album_id, b->album_id);
+		check_field(a->album, b->album);
+		check_field(a->album_artist_id, b->album_artist_id);
+		check_field(a->album_artist, b->album_artist);
+		check_field(a->year, b->year);
+		check_field(a->cover, b->cover);
+
+		CHECK(a->num_redirects == 1 && b->num_redirects == 1);
+		check_field(a->redirects[0], b->redirects[0]);
+
+		CHECK(a->num_artists == 2 && b->num_artists == 2);
+		CHECK(a->num_artist_ids == 2 && b->num_artist_ids == 2);
+		for(j = 0; j < 2; j++) {
+			check_field(a->artists[j], b->artists[j]);
+			check_field(a->artist_ids[j], b->artist_ids[j]);
+		}
+	}
+
+	CHECK(strcmp(pull_tracks[0].title, "Caf\xc3\xa9 Night & Day No. 0") == 0);
+	CHECK(strcmp(pull_tracks[0].album, "Album <Deluxe> 0") == 0);
+
+	ezxml_free(root);
+	free(ezxml_xml);
+	free(pull_xml);
+}
+
+
+static void run(const char *name, long long (*decode)(char *)) {
+	long long usecs[NUM_RUNS];
+	char *xml;
+	int i;
+
+	for(i = 0; i < NUM_RUNS; i++) {
+		xml = copy_reply();
+		usecs[i] = decode(xml);
+		free(xml);
+	}
+
+	qsort(usecs, NUM_RUNS, sizeof(long long), harness_compare_usecs);
+
+	printf("%s, %d tracks of %d bytes\n", name, NUM_TRACKS, reply_len / NUM_TRACKS);
+	harness_report("per track, median", usecs[NUM_RUNS / 2] * 1000.0 / NUM_TRACKS, "ns");
+	harness_report("throughput", reply_len / (double)usecs[NUM_RUNS / 2], "MB/s");
+}
+
+
+int main(void) {
+	make_reply();
+	check_tracks();
+
+	run("ezxml", ezxml_run);
+	run("Pull parser", pull_run);
+
+	return 0;
+}
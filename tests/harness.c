@@ -0,0 +1,279 @@
+/*
+ * Shared code for the tests and benchmarks
+ *
+ * harness_session_new() sets up a session the way sp_session_init()
+ * does, except that neither the iothread nor the player thread are
+ * started and no cache is loaded. Tests run the request handlers and
+ * channel callbacks themselves, from the thread that made the session.
+ *
+ * Tests that need a connection log in to tools/mockap instead, with a
+ * real session, see harness_mockap_start() and harness_login().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include <libspotify/api.h>
+
+#include "browse.h"
+#include "buf.h"
+#include "channel.h"
+#include "decoder.h"
+#include "flowctl.h"
+#include "gc.h"
+#include "hashtable.h"
+#include "image.h"
+#include "ioloop.h"
+#include "memstats.h"
+#include "packet.h"
+#include "pool.h"
+#include "reclaim.h"
+#include "request.h"
+#include "ring.h"
+#include "sp_opaque.h"
+#include "strpool.h"
+
+#include "harness.h"
+
+
+#define HARNESS_LOGIN_TIMEOUT_MS	30000
+
+
+static sp_session_callbacks harness_callbacks;
+static int harness_logged_in;
+
+
+sp_session *harness_session_new(void) {
+	sp_session *session;
+
+	if((session = (sp_session *)malloc(sizeof(sp_session))) == NULL)
+		return NULL;
+
+	memset(session, 0, sizeof(sp_session));
+	session->callbacks = &harness_callbacks;
+
+	memstats_init(session);
+	pool_init(&session->pool_tracks, sizeof(sp_track));
+	pool_init(&session->pool_albums, sizeof(sp_album));
+	pool_init(&session->pool_artists, sizeof(sp_artist));
+	strpool_init(session);
+
+	session->connectionstate = SP_CONNECTION_STATE_LOGGED_IN;
+	memcpy(session->country, "SE", 3);
+
+	session->hashtable_albums = hashtable_create(16);
+	session->hashtable_artists = hashtable_create(16);
+	session->hashtable_images = hashtable_create(20);
+	session->hashtable_tracks = hashtable_create(16);
+	session->hashtable_users = hashtable_create(256);
+	image_lru_init(session);
+	reclaim_init(session);
+	gc_init(session);
+
+	session->sock = -1;
+	if(ring_init(&session->rx, PACKET_RX_RING_SIZE) < 0
+		|| ring_init(&session->tx, PACKET_TX_RING_SIZE) < 0)
+		return NULL;
+
+	session->rx_packet_len = -1;
+	session->tx_payload = buf_new();
+
+	request_scheduler_init(session);
+	browse_coalescer_init(session);
+	session->browse_max_chunks = BROWSE_MAX_CHUNKS;
+
+	channel_table_init(session);
+	flowctl_init(session);
+
+	if(ioloop_init(session) || decoder_init(session, DECODER_NUM_WORKERS))
+		return NULL;
+
+	pthread_mutex_init(&session->request_mutex, NULL);
+	pthread_cond_init(&session->idle_wakeup, NULL);
+	session->thread_main = pthread_self();
+	session->thread_io = pthread_self();
+
+	return session;
+}
+
+
+void harness_fail(const char *file, int line, const char *cond) {
+	fprintf(stderr, "%s:%d: check failed: %s\n", file, line, cond);
+	exit(1);
+}
+
+
+long long harness_usecs(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* Print a measurement in a format that's easy to compare between runs */
+void harness_report(const char *name, double value, const char *unit) {
+	printf("  %-40s %12.2f %s\n", name, value, unit);
+}
+
+
+/* For sorting latencies with qsort() to get percentiles */
+int harness_compare_usecs(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y? -1: x > y;
+}
+
+
+/*
+ * Start the mock serving the fixtures in dir, with extra command line
+ * options, and point the library to it. Its output goes to log_file.
+ * It's killed along with its connections by harness_fork().
+ *
+ */
+void harness_mockap_start(const char *dir, const char *log_file, const char **options) {
+	char port_str[32], address[64], line[256];
+	const char *argv[32];
+	FILE *fp;
+	int i, fd, port;
+	pid_t pid;
+
+	if(access(HARNESS_MOCKAP, X_OK) != 0) {
+		fprintf(stderr, "%s not found, build it first\n", HARNESS_MOCKAP);
+		exit(1);
+	}
+
+	port = 20000 + getpid() % 20000;
+	sprintf(port_str, "%d", port);
+
+	i = 0;
+	argv[i++] = HARNESS_MOCKAP;
+	argv[i++] = "-a";
+	argv[i++] = "127.0.0.1";
+	argv[i++] = "-p";
+	argv[i++] = port_str;
+	argv[i++] = "-f";
+	argv[i++] = dir;
+	while(*options != NULL && i < 31)
+		argv[i++] = *options++;
+
+	argv[i] = NULL;
+
+	if((pid = fork()) < 0)
+		harness_fail(__FILE__, __LINE__, "fork()");
+
+	if(pid == 0) {
+		fd = open(log_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		dup2(fd, 1);
+		dup2(fd, 2);
+
+		execv(HARNESS_MOCKAP, (char **)argv);
+		perror(HARNESS_MOCKAP);
+		_exit(1);
+	}
+
+	/* Wait until it's listening, without connecting as that would count as a connection */
+	for(i = 0; i < 100; i++) {
+		usleep(50000);
+		if((fp = fopen(log_file, "r")) == NULL)
+			continue;
+
+		line[0] = 0;
+		if(fgets(line, sizeof(line), fp) == NULL)
+			line[0] = 0;
+
+		fclose(fp);
+		if(strstr(line, "Listening") != NULL)
+			break;
+	}
+
+	if(i == 100)
+		harness_fail(__FILE__, __LINE__, "mockap listening");
+
+	sprintf(address, "127.0.0.1:%d", port);
+	setenv("OPENSPOTIFY_SERVER", address, 1);
+}
+
+
+static void SP_CALLCONV harness_logged_in_cb(sp_session *session, sp_error error) {
+	if(error != SP_ERROR_OK)
+		harness_fail(__FILE__, __LINE__, "error == SP_ERROR_OK");
+
+	harness_logged_in = 1;
+}
+
+
+/* Create a session and log in to the mock, with the other callbacks set by the caller */
+sp_session *harness_login(sp_session_callbacks *callbacks) {
+	static char appkey[321];
+	sp_session_config config;
+	sp_session *session;
+	long long start;
+	int next_timeout;
+
+	callbacks->logged_in = harness_logged_in_cb;
+
+	appkey[0] = 0x01;
+	memset(&config, 0, sizeof(config));
+	config.api_version = SPOTIFY_API_VERSION;
+	config.application_key = appkey;
+	config.application_key_size = sizeof(appkey);
+	config.user_agent = "harness";
+	config.callbacks = callbacks;
+
+	if(sp_session_init(&config, &session) != SP_ERROR_OK
+		|| sp_session_login(session, "test", "password") != SP_ERROR_OK)
+		harness_fail(__FILE__, __LINE__, "login");
+
+	start = harness_usecs();
+	while(!harness_logged_in) {
+		if(harness_usecs() - start > HARNESS_LOGIN_TIMEOUT_MS * 1000LL)
+			harness_fail(__FILE__, __LINE__, "logged in");
+
+		sp_session_process_events(session, &next_timeout);
+		usleep(10000);
+	}
+
+	return session;
+}
+
+
+/*
+ * Run a test in a process of its own, for a session and mock of its
+ * own. It's put in a process group that's killed afterwards, which
+ * takes the mock with it.
+ *
+ */
+void harness_fork(const char *name, void (*test)(void)) {
+	int status;
+	pid_t pid;
+
+	printf("  %s\n", name);
+	fflush(stdout);
+
+	if((pid = fork()) < 0)
+		harness_fail(__FILE__, __LINE__, "fork()");
+
+	if(pid == 0) {
+		setpgid(0, 0);
+		test();
+		fflush(stdout);
+		_exit(0);
+	}
+
+	setpgid(pid, pid);
+	waitpid(pid, &status, 0);
+	kill(-pid, SIGTERM);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		harness_fail(__FILE__, __LINE__, name);
+}
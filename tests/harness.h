@@ -0,0 +1,23 @@
+#ifndef OPENSPOTIFY_TESTS_HARNESS_H
+#define OPENSPOTIFY_TESTS_HARNESS_H
+
+#include <libspotify/api.h>
+
+
+/* Mock access point for tests that need a connection, built along with them */
+#define HARNESS_MOCKAP	"../tools/mockap/mockap"
+
+/* Fail the test, with the location and text of the check */
+#define CHECK(cond) { if(!(cond)) harness_fail(__FILE__, __LINE__, #cond); }
+
+
+sp_session *harness_session_new(void);
+void harness_fail(const char *file, int line, const char *cond);
+long long harness_usecs(void);
+void harness_report(const char *name, double value, const char *unit);
+int harness_compare_usecs(const void *a, const void *b);
+void harness_mockap_start(const char *dir, const char *log_file, const char **options);
+sp_session *harness_login(sp_session_callbacks *callbacks);
+void harness_fork(const char *name, void (*test)(void));
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Tests for coalesced track lookups whose browse fails, see browse.c
+ *
+ * Lookups coalesced into another request are only returned along with
+ * it, so they must be returned however that request ends, with its
+ * error, and the references taken for the tracks must be released.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libspotify/api.h>
+
+#include "browse.h"
+#include "channel.h"
+#include "decoder.h"
+#include "flowctl.h"
+#include "reclaim.h"
+#include "request.h"
+#include "sp_opaque.h"
+#include "track.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+#define NUM_TRACKS	3
+
+
+static sp_track *tracks[NUM_TRACKS];
+static struct request *leader;
+
+
+/* Run browse requests that are due, like the iothread does when logged in */
+static void run_requests(sp_session *session) {
+	struct request *req;
+	int now;
+
+	now = get_millisecs();
+	flowctl_unblock(session);
+	request_begin_pass(session, now);
+	while((req = request_fetch_expired(session, now)) != NULL) {
+		browse_process(session, req);
+		request_reschedule(session, req);
+	}
+}
+
+
+/* Like run_requests(), but fail them like the iothread does when logged out */
+static void fail_requests(sp_session *session) {
+	struct request *req;
+	int now;
+
+	now = get_millisecs();
+	request_begin_pass(session, now);
+	while((req = request_fetch_expired(session, now)) != NULL) {
+		browse_fail(session, req, SP_ERROR_OTHER_TRANSIENT);
+		request_reschedule(session, req);
+	}
+}
+
+
+/* Fail the channel of the chunk in flight, as CMD_CHANNELERR with an error code does */
+static void fail_channel(sp_session *session) {
+	unsigned char packet[4] = { 0, 0, 0, 1 };
+
+	CHECK(channel_by_id(session, 0) != NULL);
+	channel_process(session, packet, sizeof(packet), 1);
+
+	/* The failure is handled once the chunk's decoder jobs are applied */
+	while(session->decoder->first != NULL) {
+		usleep(1000);
+		decoder_process(session);
+	}
+}
+
+
+/* Check that all lookups were returned with the error, and nothing else */
+static void check_results(sp_session *session, int num, sp_error error) {
+	struct request *req;
+	int next_timeout;
+	int i;
+
+	for(i = 0; (req = request_fetch_next_result(session, &next_timeout)) != NULL; i++) {
+		CHECK(req->type == REQ_TYPE_BROWSE_TRACK);
+		CHECK(req->error == error);
+		request_mark_processed(session, req);
+	}
+
+	CHECK(i == num);
+	request_cleanup(session);
+
+	/* Only the references held by the test are left */
+	for(i = 0; i < NUM_TRACKS; i++)
+		CHECK(REFCOUNT_GET(&tracks[i]->ref_count) == 1);
+
+	CHECK(channel_by_id(session, 0) == NULL);
+}
+
+
+static void lookup_all(sp_session *session) {
+	int i;
+
+	for(i = 0; i < NUM_TRACKS; i++)
+		CHECK(osfy_track_browse(session, tracks[i]) == 0);
+
+	/* The first lookup waits for the others */
+	run_requests(session);
+	leader = session->browse.batches[BROWSE_BATCH_TRACKS].waiting[0];
+	usleep(2 * BROWSE_COALESCE_MS * 1000);
+}
+
+
+/* The browse fails on every attempt until it's given up on */
+static void test_channel_error(sp_session *session) {
+	int i;
+
+	lookup_all(session);
+	run_requests(session);
+
+	for(i = 0; i <= BROWSE_MAX_RETRIES; i++) {
+		fail_channel(session);
+		usleep(2 * BROWSE_RETRY_TIMEOUT * 1000);
+		run_requests(session);
+	}
+
+	check_results(session, NUM_TRACKS, SP_ERROR_OTHER_TRANSIENT);
+}
+
+
+/* Logged out before the batch was sent */
+static void test_logout_collecting(sp_session *session) {
+	lookup_all(session);
+	fail_requests(session);
+
+	check_results(session, NUM_TRACKS, SP_ERROR_OTHER_TRANSIENT);
+}
+
+
+/* Logged out while the batch was in flight, it's returned once the channel ends */
+static void test_logout_in_flight(sp_session *session) {
+	int next_timeout;
+
+	lookup_all(session);
+	run_requests(session);
+
+	request_set_timeout(session, leader, 0);
+	fail_requests(session);
+	CHECK(request_fetch_next_result(session, &next_timeout) == NULL);
+
+	fail_channel(session);
+	fail_requests(session);
+
+	check_results(session, NUM_TRACKS, SP_ERROR_OTHER_TRANSIENT);
+}
+
+
+int main(void) {
+	sp_session *session;
+	unsigned char id[16];
+	int i;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	for(i = 0; i < NUM_TRACKS; i++) {
+		memset(id, 0, sizeof(id));
+		id[15] = i + 1;
+		CHECK((tracks[i] = osfy_track_add(session, id)) != NULL);
+	}
+
+	test_channel_error(session);
+	test_logout_collecting(session);
+	test_logout_in_flight(session);
+
+	printf("ok\n");
+
+	return 0;
+}
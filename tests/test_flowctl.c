@@ -0,0 +1,89 @@
+/*
+ * Tests for the channel window, see flowctl.c
+ *
+ * Channels complete on a simulated link that gives each channel the
+ * same rate up to a number of channels, and shares a fixed throughput
+ * among them beyond that. The window must grow up to where the link is
+ * full and then stop growing, however far below or above it started.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <libspotify/api.h>
+
+#include "channel.h"
+#include "flowctl.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+/* Bytes per second through the link, and bytes per channel */
+#define LINK_RATE	8000000
+#define CHANNEL_SIZE	100000
+
+#define NUM_CHANNELS	10000
+
+
+/* Complete a channel that took as long as the link allows with this many channels in flight */
+static void complete_channel(sp_session *session, int knee) {
+	CHANNEL ch;
+	int in_flight, elapsed;
+
+	in_flight = session->flowctl.window > knee? session->flowctl.window: knee;
+	elapsed = (int)((double)CHANNEL_SIZE * in_flight * 1000 / LINK_RATE);
+
+	memset(&ch, 0, sizeof(ch));
+	ch.state = CHANNEL_END;
+	ch.open_ms = get_millisecs() - elapsed;
+	ch.reply_ms = ch.open_ms + 1;
+	ch.total_data_len = CHANNEL_SIZE;
+
+	flowctl_channel_done(session, &ch);
+}
+
+
+static void run_link(int knee, int min_window, int max_window) {
+	sp_session *session;
+	int i, lowest, highest;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	for(i = 0; i < NUM_CHANNELS; i++)
+		complete_channel(session, knee);
+
+	/* Settled, it may only move back and forth by one now */
+	lowest = highest = session->flowctl.window;
+	for(i = 0; i < NUM_CHANNELS; i++) {
+		complete_channel(session, knee);
+
+		if(session->flowctl.window < lowest)
+			lowest = session->flowctl.window;
+
+		if(session->flowctl.window > highest)
+			highest = session->flowctl.window;
+	}
+
+	printf("  link full at %d channels, window between %d and %d\n", knee, lowest, highest);
+	CHECK(lowest >= min_window && highest <= max_window);
+	CHECK(session->flowctl.num_decreases == 0);
+}
+
+
+int main(void) {
+	/* Grows past where it started, up to the link */
+	run_link(32, 32, 33);
+
+	/* Already full, it stops growing */
+	run_link(8, FLOWCTL_INIT_WINDOW, FLOWCTL_INIT_WINDOW + 1);
+
+	/* Never full, it grows to the maximum */
+	run_link(FLOWCTL_MAX_WINDOW * 2, FLOWCTL_MAX_WINDOW, FLOWCTL_MAX_WINDOW);
+
+	printf("ok\n");
+
+	return 0;
+}
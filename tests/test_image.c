@@ -0,0 +1,173 @@
+/*
+ * Tests for images read from the disk cache, see sp_image.c
+ *
+ * sp_image_create() must not read the file itself. The image is read
+ * by a decoder thread and returned straight to the main thread, with
+ * no request for the iothread. What's not in the cache is counted as a
+ * miss and downloaded.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libspotify/api.h>
+
+#include "buf.h"
+#include "decoder.h"
+#include "image.h"
+#include "imgcache.h"
+#include "mpsc.h"
+#include "request.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+static const char jpeg[] = "\xff\xd8\xff\xe0 not really a JPEG";
+
+static pthread_mutex_t gate = PTHREAD_MUTEX_INITIALIZER;
+static struct decode_job blockers[DECODER_NUM_WORKERS];
+
+
+static void wait_for_gate(struct decode_job *job) {
+	pthread_mutex_lock(&gate);
+	pthread_mutex_unlock(&gate);
+}
+
+
+/* Keep every decoder thread busy until the gate is unlocked */
+static void hold_decoder(sp_session *session) {
+	struct decode_job *queued;
+	int i;
+
+	pthread_mutex_lock(&gate);
+	for(i = 0; i < DECODER_NUM_WORKERS; i++) {
+		blockers[i].decode = wait_for_gate;
+		blockers[i].release = NULL;
+		decoder_submit_detached(session, &blockers[i]);
+	}
+
+	do {
+		usleep(1000);
+		pthread_mutex_lock(&session->decoder->mutex);
+		queued = session->decoder->queue_head;
+		pthread_mutex_unlock(&session->decoder->mutex);
+	} while(queued != NULL);
+}
+
+
+/* Run image requests that are due and apply what the decoder threads did, like the iothread */
+static void run_requests(sp_session *session) {
+	struct request *req;
+	int now, i;
+
+	for(i = 0; i < 100; i++) {
+		now = get_millisecs();
+		request_begin_pass(session, now);
+		while((req = request_fetch_expired(session, now)) != NULL) {
+			CHECK(req->type == REQ_TYPE_IMAGE);
+			osfy_image_process_request(session, req);
+			request_reschedule(session, req);
+		}
+
+		usleep(1000);
+		decoder_process(session);
+	}
+}
+
+
+static void test_disk_hit(sp_session *session) {
+	unsigned char id[20];
+	opensp_image_stats stats;
+	struct request *req;
+	struct buf *data;
+	sp_image *image;
+	const void *ptr;
+	size_t len;
+	int next_timeout, i;
+
+	memset(id, 1, sizeof(id));
+	data = buf_new();
+	buf_append_data(data, (void *)jpeg, sizeof(jpeg));
+	CHECK(imgcache_store(session, id, data) == 0);
+	buf_free(data);
+
+	/* Not read on this thread, the decoder threads can't take the job yet */
+	hold_decoder(session);
+	image = sp_image_create(session, id);
+	CHECK(!sp_image_is_loaded(image));
+	CHECK(sp_image_error(image) == SP_ERROR_IS_LOADING);
+	pthread_mutex_unlock(&gate);
+
+	/* Returned by the decoder thread while the iothread does nothing */
+	for(i = 0; i < 1000 && (req = request_fetch_next_result(session, &next_timeout)) == NULL; i++)
+		usleep(1000);
+
+	CHECK(mpsc_is_empty(&session->requests.incoming));
+	CHECK(req != NULL);
+	CHECK(req->type == REQ_TYPE_IMAGE);
+	CHECK(req->error == SP_ERROR_OK && req->output == image);
+	request_mark_processed(session, req);
+	request_cleanup(session);
+
+	CHECK(sp_image_is_loaded(image));
+	ptr = sp_image_data(image, &len);
+	CHECK(len == sizeof(jpeg) && memcmp(ptr, jpeg, len) == 0);
+
+	/* Loaded already */
+	sp_image_release(sp_image_create(session, id));
+
+	opensp_session_image_stats(session, &stats);
+	CHECK(stats.num_disk_hits == 1);
+	CHECK(stats.num_hits == 1);
+	CHECK(stats.num_misses == 0);
+
+	sp_image_release(image);
+	sp_image_release(image);
+}
+
+
+static void test_miss(sp_session *session) {
+	unsigned char id[20];
+	opensp_image_stats stats;
+	sp_image *image;
+
+	memset(id, 2, sizeof(id));
+	image = sp_image_create(session, id);
+
+	run_requests(session);
+
+	opensp_session_image_stats(session, &stats);
+	CHECK(stats.num_disk_hits == 1);
+	CHECK(stats.num_misses == 1);
+	CHECK(!sp_image_is_loaded(image));
+}
+
+
+int main(void) {
+	char dir[] = "/tmp/test_image.XXXXXX";
+	char path[128];
+	unsigned char id[20];
+	sp_session *session;
+
+	CHECK(mkdtemp(dir) != NULL);
+
+	CHECK((session = harness_session_new()) != NULL);
+	CHECK(imgcache_init(session, dir) == 0);
+
+	test_disk_hit(session);
+	test_miss(session);
+
+	memset(id, 1, sizeof(id));
+	hex_bytes_to_ascii(id, path + sprintf(path, "%s/", dir), 20);
+	remove(path);
+	rmdir(dir);
+
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Tests for the iothread's event loop, see ioloop.c
+ *
+ * A wakeup must end the wait whether it comes before or during it, and
+ * a new connection that got the descriptor number of the one it
+ * replaced must still be waited on.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <libspotify/api.h>
+
+#include "ioloop.h"
+#include "sp_opaque.h"
+
+#include "harness.h"
+
+
+static void *wake_later(void *arg) {
+	sp_session *session = (sp_session *)arg;
+
+	usleep(20000);
+	ioloop_wakeup(session);
+
+	return NULL;
+}
+
+
+static void test_wakeup(sp_session *session) {
+	pthread_t thread;
+	long long start;
+	int ret;
+
+	/* Flagged before the wait, which must not block */
+	ioloop_wakeup(session);
+	start = harness_usecs();
+	ret = ioloop_wait(session, 5000, 0);
+	CHECK(ret == 0 || ret == IOLOOP_WAKEUP);
+	CHECK(harness_usecs() - start < 1000000);
+
+	/* From another thread while parked */
+	pthread_create(&thread, NULL, wake_later, session);
+	start = harness_usecs();
+	ret = ioloop_wait(session, 5000, 0);
+	pthread_join(thread, NULL);
+	CHECK(ret == IOLOOP_WAKEUP);
+	CHECK(harness_usecs() - start < 1000000);
+
+	/* Nothing pending, the wait times out */
+	start = harness_usecs();
+	ret = ioloop_wait(session, 50, 0);
+	CHECK(ret == 0);
+	CHECK(harness_usecs() - start >= 40000);
+}
+
+
+static void test_reconnect(sp_session *session) {
+	int old[2], new[2];
+
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, old) == 0);
+	session->sock = old[0];
+	session->sock_generation++;
+
+	CHECK(write(old[1], "x", 1) == 1);
+	CHECK(ioloop_wait(session, 1000, 0) & IOLOOP_READABLE);
+
+	/* Drop the connection and make a new one with the same descriptor */
+	close(old[0]);
+	close(old[1]);
+	CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, new) == 0);
+	CHECK(new[0] == old[0]);
+	session->sock = new[0];
+	session->sock_generation++;
+
+	CHECK(write(new[1], "x", 1) == 1);
+	CHECK(ioloop_wait(session, 1000, 0) & IOLOOP_READABLE);
+
+	close(new[0]);
+	close(new[1]);
+	session->sock = -1;
+	CHECK(ioloop_wait(session, 0, 0) == 0);
+}
+
+
+int main(void) {
+	sp_session *session;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	test_wakeup(session);
+	test_reconnect(session);
+
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * Tests for the scheduling lanes, see request.c and flowctl.c
+ *
+ * Simulates the iothread while a large playlist loads: thousands of
+ * background requests for playlist tracks and images each open a
+ * channel, and the server replies after a fixed number of passes. The
+ * user then starts playback, which takes the key and then a substream.
+ * Time to first audio is measured in passes, with the flood in the
+ * background lane and with it in the same lane as the audio, which is
+ * how every request was served before there were lanes. Then that
+ * background requests still get their share while audio keeps coming.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <libspotify/api.h>
+
+#include "channel.h"
+#include "flowctl.h"
+#include "request.h"
+#include "sp_opaque.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+#define NUM_PLAYLIST_CHUNKS	21
+#define NUM_IMAGES	2000
+
+/* Passes before the server replies on a channel */
+#define RTT_PASSES	50
+
+/* When the user starts playback */
+#define PLAY_PASS	10
+
+#define MAX_PASSES	100000
+
+#define NUM_RESERVE_REQUESTS	100
+
+
+enum sim_kind {
+	SIM_FLOOD,
+	SIM_KEY,
+	SIM_SUBSTREAM
+};
+
+/* Input of the simulated requests, free'd with the request */
+struct sim_input {
+	enum sim_kind kind;
+	struct request *req;
+};
+
+
+static int pass;
+static int first_audio_pass;
+static int num_flood_done;
+
+static CHANNEL *open_channels[NUM_IMAGES + NUM_PLAYLIST_CHUNKS + 2];
+static int open_passes[NUM_IMAGES + NUM_PLAYLIST_CHUNKS + 2];
+static int num_open;
+
+
+static int sim_callback(CHANNEL *ch, unsigned char *buf, unsigned short len) {
+	struct sim_input *input = (struct sim_input *)ch->private;
+	sp_session *session = (sp_session *)input->req->output;
+	struct sim_input *substream;
+
+	if(ch->state == CHANNEL_DATA && input->kind == SIM_SUBSTREAM && first_audio_pass < 0)
+		first_audio_pass = pass;
+
+	if(ch->state != CHANNEL_END)
+		return 0;
+
+	if(input->kind == SIM_FLOOD)
+		num_flood_done++;
+
+	/* The player asks for the substream once it has the key */
+	if(input->kind == SIM_KEY) {
+		substream = malloc(sizeof(struct sim_input));
+		substream->kind = SIM_SUBSTREAM;
+		CHECK(request_post(session, REQ_TYPE_PLAYER_SUBSTREAM, substream) == 0);
+	}
+
+	request_set_result(session, input->req, SP_ERROR_OK, NULL);
+
+	return 0;
+}
+
+
+/* What a handler does, open a channel unless the window is full */
+static void process(sp_session *session, struct request *req) {
+	struct sim_input *input = (struct sim_input *)req->input;
+	CHANNEL *ch;
+
+	if(req->state == REQ_STATE_NEW)
+		req->state = REQ_STATE_RUNNING;
+
+	if(!flowctl_admit(session, req))
+		return;
+
+	/* Found again by the callback */
+	input->req = req;
+	req->output = session;
+
+	CHECK((ch = channel_register(session, "sim", sim_callback, input)) != NULL);
+	open_channels[num_open] = ch;
+	open_passes[num_open] = pass;
+	num_open++;
+
+	req->next_timeout = INT_MAX;
+}
+
+
+/* Reply on the channels opened RTT_PASSES ago, oldest first */
+static void reply(sp_session *session) {
+	unsigned char packet[6];
+	CHANNEL *ch;
+	int i, n;
+
+	for(i = n = 0; i < num_open; i++) {
+		if(pass - open_passes[i] < RTT_PASSES) {
+			open_channels[n] = open_channels[i];
+			open_passes[n] = open_passes[i];
+			n++;
+			continue;
+		}
+
+		ch = open_channels[i];
+		packet[0] = ch->channel_id >> 8;
+		packet[1] = ch->channel_id & 0xff;
+
+		/* No headers, some data, then the end */
+		packet[2] = packet[3] = 0;
+		channel_process(session, packet, 4, 0);
+		packet[2] = packet[3] = packet[4] = packet[5] = 1;
+		channel_process(session, packet, 6, 0);
+		channel_process(session, packet, 2, 0);
+	}
+
+	num_open = n;
+}
+
+
+/* Run until playback started and the flood is done, returns the time to first audio */
+static int run(request_type chunk_type, request_type image_type) {
+	struct sim_input *input;
+	struct request *req;
+	sp_session *session;
+	int now, next_timeout, i;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	for(i = 0; i < NUM_PLAYLIST_CHUNKS + NUM_IMAGES; i++) {
+		input = malloc(sizeof(struct sim_input));
+		input->kind = SIM_FLOOD;
+		CHECK(request_post(session, i < NUM_PLAYLIST_CHUNKS? chunk_type: image_type, input) == 0);
+	}
+
+	first_audio_pass = -1;
+	num_flood_done = 0;
+	num_open = 0;
+	for(pass = 0; first_audio_pass < 0 || num_flood_done < NUM_PLAYLIST_CHUNKS + NUM_IMAGES; pass++) {
+		CHECK(pass < MAX_PASSES);
+
+		if(pass == PLAY_PASS) {
+			input = malloc(sizeof(struct sim_input));
+			input->kind = SIM_KEY;
+			CHECK(request_post(session, REQ_TYPE_PLAYER_KEY, input) == 0);
+		}
+
+		/* Like the iothread */
+		now = get_millisecs();
+		flowctl_unblock(session);
+		request_begin_pass(session, now);
+		while((req = request_fetch_expired(session, now)) != NULL) {
+			process(session, req);
+			request_reschedule(session, req);
+		}
+
+		reply(session);
+
+		/* Like sp_session_process_events() */
+		while((req = request_fetch_next_result(session, &next_timeout)) != NULL)
+			request_mark_processed(session, req);
+
+		request_cleanup(session);
+	}
+
+	CHECK(session->num_channels == 0);
+	CHECK(session->requests.num_blocked == 0);
+
+	return first_audio_pass - PLAY_PASS;
+}
+
+
+/* A background request is served every few requests, even with realtime ones waiting */
+static void test_reserve(void) {
+	struct request *req;
+	sp_session *session;
+	int now, next_timeout, i, n, first_background, num_realtime;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	for(i = 0; i < NUM_RESERVE_REQUESTS; i++) {
+		CHECK(request_post(session, REQ_TYPE_PLAYER_SUBSTREAM, NULL) == 0);
+		CHECK(request_post(session, REQ_TYPE_IMAGE, NULL) == 0);
+	}
+
+	first_background = -1;
+	num_realtime = 0;
+	now = get_millisecs();
+	request_begin_pass(session, now);
+	for(n = 0; (req = request_fetch_expired(session, now)) != NULL; n++) {
+		if(req->priority == REQ_PRIO_BACKGROUND && first_background < 0)
+			first_background = n;
+
+		if(req->priority == REQ_PRIO_REALTIME && n < NUM_RESERVE_REQUESTS / 2)
+			num_realtime++;
+
+		request_set_result(session, req, SP_ERROR_OK, NULL);
+		request_reschedule(session, req);
+	}
+
+	CHECK(n == 2 * NUM_RESERVE_REQUESTS);
+	CHECK(first_background >= 0 && first_background < 10);
+	CHECK(num_realtime >= NUM_RESERVE_REQUESTS / 2 * 3 / 4);
+
+	while((req = request_fetch_next_result(session, &next_timeout)) != NULL)
+		request_mark_processed(session, req);
+
+	request_cleanup(session);
+}
+
+
+int main(void) {
+	int with_lanes, without_lanes;
+
+	with_lanes = run(REQ_TYPE_BROWSE_PLAYLIST_TRACKS, REQ_TYPE_IMAGE);
+
+	/* Posted with the key's type, so that they share its lane */
+	without_lanes = run(REQ_TYPE_PLAYER_KEY, REQ_TYPE_PLAYER_KEY);
+
+	printf("Time to first audio with %d playlist chunks and %d images loading, %d passes per round trip\n",
+		NUM_PLAYLIST_CHUNKS, NUM_IMAGES, RTT_PASSES);
+	harness_report("with lanes", with_lanes, "passes");
+	harness_report("all in one lane", without_lanes, "passes");
+
+	/* Key and substream, each behind at most one round trip of background channels */
+	CHECK(with_lanes <= 4 * RTT_PASSES);
+	CHECK(without_lanes > 4 * with_lanes);
+
+	test_reserve();
+
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Tests for saving the metadata cache, see metacache.c
+ *
+ * Objects loaded since the last save must make it to the file even if
+ * the garbage collector freed them in the meantime, and only once if
+ * they were loaded again after that.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libspotify/api.h>
+
+#include "album.h"
+#include "artist.h"
+#include "metacache.h"
+#include "reclaim.h"
+#include "sp_opaque.h"
+#include "strpool.h"
+#include "track.h"
+
+#include "harness.h"
+
+
+static char filename[64];
+
+
+static void make_id(unsigned char id[16], int n) {
+	memset(id, 0, 16);
+	id[15] = n;
+}
+
+
+/* A track as a browse would have loaded it, the caller gets a reference */
+static sp_track *load_track(sp_session *session, int n) {
+	unsigned char id[16];
+	char name[32];
+	sp_track *track;
+
+	make_id(id, n);
+	CHECK((track = osfy_track_add(session, id)) != NULL);
+	CHECK(!track->is_loaded);
+
+	sprintf(name, "Track %d", n);
+	strpool_set(session, &track->name, name);
+	track->duration = 1000 * n;
+	track->is_loaded = 1;
+	track->error = SP_ERROR_OK;
+
+	return track;
+}
+
+
+/* Free everything that's unreferenced */
+static void collect_all(sp_session *session) {
+	unsigned int cursor = 0;
+
+	while(!osfy_track_garbage_collect(session, &cursor, 16))
+		;
+
+	reclaim_process(session, -1);
+}
+
+
+/* Check that a new session loads the tracks from the file */
+static void check_saved(int first, int num) {
+	unsigned char id[16];
+	sp_session *session;
+	sp_track *track;
+	char name[32];
+	int i;
+
+	CHECK((session = harness_session_new()) != NULL);
+	CHECK(metacache_init(session, filename) == 0);
+	CHECK(session->metacache->num_tracks == (unsigned int)num);
+
+	for(i = first; i < first + num; i++) {
+		make_id(id, i);
+		CHECK((track = osfy_track_add(session, id)) != NULL);
+		CHECK(track->is_loaded);
+
+		sprintf(name, "Track %d", i);
+		CHECK(strcmp(track->name, name) == 0);
+		CHECK(track->duration == 1000 * i);
+	}
+}
+
+
+/* Freed before the session's saved on the way out */
+static void test_freed(sp_session *session) {
+	sp_track_release(load_track(session, 1));
+	sp_track_release(load_track(session, 2));
+	collect_all(session);
+	CHECK(session->memstats.categories[OPENSP_MEMORY_TRACKS].num_objects == 0);
+
+	CHECK(metacache_flush(session) == 0);
+	check_saved(1, 2);
+}
+
+
+/* Freed, then loaded again */
+static void test_reloaded(sp_session *session) {
+	sp_track *track;
+
+	sp_track_release(load_track(session, 3));
+	collect_all(session);
+	track = load_track(session, 3);
+
+	CHECK(metacache_flush(session) == 0);
+	check_saved(1, 3);
+
+	sp_track_release(track);
+}
+
+
+int main(void) {
+	char dir[] = "/tmp/test_metacache.XXXXXX";
+	sp_session *session;
+
+	CHECK(mkdtemp(dir) != NULL);
+	sprintf(filename, "%s/%s", dir, METACACHE_FILE);
+
+	CHECK((session = harness_session_new()) != NULL);
+	CHECK(metacache_init(session, filename) == 0);
+
+	test_freed(session);
+	test_reloaded(session);
+
+	remove(filename);
+	rmdir(dir);
+
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Tests for retiring and freeing objects, see reclaim.c
+ *
+ * Adding an object races with the garbage collector retiring the one
+ * with the same key. A lookup must either reference the object or not
+ * find it and add a new one. The hashtable must never end up with two
+ * objects for one key, no object may be freed while it's referenced,
+ * and every object must be freed once it's no longer referenced.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libspotify/api.h>
+
+#include "artist.h"
+#include "atomic.h"
+#include "hashtable.h"
+#include "memstats.h"
+#include "reclaim.h"
+#include "sp_opaque.h"
+
+#include "harness.h"
+
+
+#define NUM_THREADS	6
+#define NUM_IDS		64
+#define NUM_ROUNDS	1000
+#define NUM_HELD	4
+
+
+static sp_session *stress_session;
+static int stop;
+
+
+static void make_id(unsigned char id[16], int n) {
+	memset(id, 0, 16);
+	id[15] = n;
+}
+
+
+/* Free everything that's unreferenced */
+static void collect_all(sp_session *session) {
+	unsigned int cursor = 0;
+
+	while(!osfy_artist_garbage_collect(session, &cursor, 16))
+		;
+
+	reclaim_process(session, -1);
+}
+
+
+/* Check that no key is in the table twice */
+static int count_artists(sp_session *session) {
+	struct hashiterator *iter;
+	struct hashentry *entry;
+	unsigned char seen[NUM_IDS];
+	sp_artist *artist;
+	int num = 0;
+
+	memset(seen, 0, sizeof(seen));
+
+	iter = hashtable_iterator_init(session->hashtable_artists);
+	while((entry = hashtable_iterator_next(iter)) != NULL) {
+		artist = (sp_artist *)entry->value;
+		CHECK(artist->id[15] < NUM_IDS);
+		CHECK(!seen[artist->id[15]]);
+		seen[artist->id[15]] = 1;
+		num++;
+	}
+
+	hashtable_iterator_free(iter);
+
+	return num;
+}
+
+
+/* Retired artists can't be found anymore, referenced ones aren't retired */
+static void test_retire(sp_session *session) {
+	unsigned char id[16];
+	sp_artist *old, *new, *held;
+	unsigned int cursor = 0;
+
+	make_id(id, 1);
+	CHECK((old = osfy_artist_add(session, id)) != NULL);
+	sp_artist_release(old);
+
+	make_id(id, 2);
+	CHECK((held = osfy_artist_add(session, id)) != NULL);
+
+	while(!osfy_artist_garbage_collect(session, &cursor, 16))
+		;
+
+	CHECK(session->reclaim.num_entries == 1);
+	CHECK(count_artists(session) == 1);
+	CHECK(osfy_artist_add(session, id) == held);
+	sp_artist_release(held);
+
+	/* Added again, the retired one is freed on the next step */
+	make_id(id, 1);
+	CHECK((new = osfy_artist_add(session, id)) != NULL);
+	CHECK(new != old);
+	CHECK(count_artists(session) == 2);
+
+	CHECK(reclaim_process(session, -1) == 1);
+	CHECK(session->reclaim.num_entries == 0);
+	CHECK(session->reclaim.num_freed == 1);
+
+	sp_artist_release(held);
+	sp_artist_release(new);
+	collect_all(session);
+
+	CHECK(count_artists(session) == 0);
+	CHECK(session->memstats.categories[OPENSP_MEMORY_ARTISTS].num_objects == 0);
+}
+
+
+/*
+ * Adds artists and hands the reference on, like a browse does to the
+ * artists of its tracks. An artist found while a reference is held must
+ * be the same one, the collector can't have retired it.
+ *
+ */
+static void *worker(void *arg) {
+	sp_session *session = stress_session;
+	unsigned int seed = (unsigned int)(size_t)arg;
+	unsigned char id[16];
+	sp_artist *artist, *again;
+	sp_artist *held[NUM_HELD];
+	int i, n;
+
+	memset(held, 0, sizeof(held));
+
+	for(n = 0; !osfy_atomic_load_int(&stop); n++) {
+		make_id(id, rand_r(&seed) % NUM_IDS);
+
+		CHECK((artist = osfy_artist_add(session, id)) != NULL);
+		CHECK(memcmp(artist->id, id, 16) == 0);
+
+		/* Give the collector a chance to sweep while it's referenced */
+		usleep(50);
+		CHECK((again = osfy_artist_add(session, id)) == artist);
+		sp_artist_release(again);
+
+		/* A second reference through the first, as an owner taking one */
+		sp_artist_add_ref(artist);
+		sp_artist_release(artist);
+
+		/* Kept for a while, then released for the collector */
+		i = n % NUM_HELD;
+		if(held[i] != NULL)
+			sp_artist_release(held[i]);
+
+		held[i] = artist;
+	}
+
+	for(i = 0; i < NUM_HELD; i++) {
+		if(held[i] != NULL)
+			sp_artist_release(held[i]);
+	}
+
+	return NULL;
+}
+
+
+/* The garbage collector runs on this thread while the others add artists */
+static void test_stress(sp_session *session) {
+	pthread_t threads[NUM_THREADS];
+	unsigned int cursor = 0;
+	int i;
+
+	stress_session = session;
+	for(i = 0; i < NUM_THREADS; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)(size_t)(i + 1));
+
+	for(i = 0; i < NUM_ROUNDS; i++) {
+		usleep(100);
+
+		reclaim_process(session, 8);
+		osfy_artist_garbage_collect(session, &cursor, HASHTABLE_INIT_SIZE);
+	}
+
+	osfy_atomic_store_int(&stop, 1);
+	for(i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	CHECK(count_artists(session) <= NUM_IDS);
+	collect_all(session);
+
+	CHECK(session->reclaim.num_entries == 0);
+	CHECK(count_artists(session) == 0);
+	CHECK(session->memstats.categories[OPENSP_MEMORY_ARTISTS].num_objects == 0);
+
+	printf("  %u retired, %u freed\n", session->reclaim.num_retired, session->reclaim.num_freed);
+}
+
+
+int main(void) {
+	sp_session *session;
+
+	CHECK((session = harness_session_new()) != NULL);
+
+	test_retire(session);
+	test_stress(session);
+
+	printf("ok\n");
+
+	return 0;
+}
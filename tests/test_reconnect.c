@@ -0,0 +1,281 @@
+/*
+ * Tests for reconnecting after the connection is lost, see iothread.c
+ *
+ * Runs a session against tools/mockap, which drops the first connection
+ * in the middle of a reply. A browse must then be sent again from the
+ * start and complete as if nothing happened. A substream is resumed,
+ * but only after the play token and the key were asked for again on
+ * the new connection.
+ *
+ * Each case runs in a process of its own, see harness_fork().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libspotify/api.h>
+
+#include "album.h"
+#include "atomic.h"
+#include "player.h"
+#include "rbuf.h"
+#include "request.h"
+#include "sp_opaque.h"
+#include "track.h"
+#include "util.h"
+
+#include "harness.h"
+
+
+#define NUM_TRACKS	1000
+#define FILE_SIZE	(40 * 4096)
+
+/* Packets the mock sends before dropping the first connection, login takes 3 */
+#define BROWSE_DROP_PACKETS	8
+#define SUBSTREAM_DROP_PACKETS	20
+
+#define TIMEOUT_MS	30000
+
+
+static char dir[] = "/tmp/test_reconnect.XXXXXX";
+static char log_file[64];
+
+static sp_session_callbacks callbacks;
+static int browsed;
+
+
+static void make_id(unsigned char *id, int len, int kind, int n) {
+	int i;
+
+	/* Spread out, so the XML doesn't compress too well */
+	for(i = 0; i < len; i++)
+		id[i] = (unsigned char)((n + 1) * 2654435761U >> (i % 4 * 8)) ^ (kind * 16 + i);
+}
+
+
+static FILE *open_fixture(const char *name) {
+	char path[128];
+	FILE *fp;
+
+	sprintf(path, "%s/%s", dir, name);
+	CHECK((fp = fopen(path, "wb")) != NULL);
+
+	return fp;
+}
+
+
+static void write_fixture(const char *name, const void *data, int len) {
+	FILE *fp;
+
+	fp = open_fixture(name);
+	CHECK(fwrite(data, 1, len, fp) == (size_t)len);
+	fclose(fp);
+}
+
+
+/* Start the mock, dropping the first connection after some packets */
+static void start_mockap(int drop_packets) {
+	char drop_str[16];
+	const char *options[] = { "-k", drop_str, "-n", "1", "-v", NULL };
+
+	sprintf(drop_str, "%d", drop_packets);
+	sprintf(log_file, "%s/mockap-%d.log", dir, (int)getpid());
+	harness_mockap_start(dir, log_file, options);
+}
+
+
+/*
+ * Check that the commands were received in this order after the first
+ * connection was dropped, and return how often the first one was
+ * received in total
+ *
+ */
+static int check_log(const char **commands, int num) {
+	char line[256];
+	int dropped = 0, seen = 0, count = 0;
+	FILE *fp;
+
+	CHECK((fp = fopen(log_file, "r")) != NULL);
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		if(strstr(line, "Dropping connection") != NULL)
+			dropped = 1;
+
+		if(strstr(line, commands[0]) != NULL)
+			count++;
+
+		if(dropped && seen < num && strstr(line, commands[seen]) != NULL)
+			seen++;
+	}
+
+	fclose(fp);
+
+	CHECK(dropped);
+	CHECK(seen == num);
+
+	return count;
+}
+
+
+static void SP_CALLCONV albumbrowse_cb(sp_albumbrowse *alb, void *userdata) {
+	browsed = 1;
+}
+
+
+/* An album whose browse takes a few packets, dropped after the first of them */
+static void test_browse(void) {
+	static const char *commands[] = { "Got command 0x30" };
+	unsigned char album_id[16], artist_id[16], track_id[16];
+	char hex[33], artist_hex[33];
+	sp_session *session;
+	sp_albumbrowse *alb;
+	sp_album *album;
+	sp_track *track;
+	char name[64];
+	long long start;
+	int next_timeout;
+	FILE *fp;
+	int i;
+
+	make_id(album_id, 16, 1, 0);
+	make_id(artist_id, 16, 2, 0);
+	hex_bytes_to_ascii(album_id, hex, 16);
+	hex_bytes_to_ascii(artist_id, artist_hex, 16);
+
+	sprintf(name, "album-%s.xml", hex);
+	fp = open_fixture(name);
+	fprintf(fp, "<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<album><name>Album</name>"
+		"<id>%s</id><artist-id>%s</artist-id><artist>Artist</artist><year>2009</year>\n"
+		"<discs><disc><disc-number>1</disc-number>\n", hex, artist_hex);
+
+	for(i = 0; i < NUM_TRACKS; i++) {
+		make_id(track_id, 16, 3, i);
+		hex_bytes_to_ascii(track_id, hex, 16);
+		fprintf(fp, "<track><id>%s</id><title>Track %d</title><artist-id>%s</artist-id>"
+			"<artist>Artist</artist><length>%d</length><popularity>0.5</popularity></track>\n",
+			hex, i, artist_hex, 180000 + i);
+	}
+
+	fprintf(fp, "</disc></discs></album>\n");
+	fclose(fp);
+
+	start_mockap(BROWSE_DROP_PACKETS);
+	session = harness_login(&callbacks);
+
+	CHECK((album = sp_album_add(session, album_id)) != NULL);
+	CHECK((alb = sp_albumbrowse_create(session, album, albumbrowse_cb, NULL)) != NULL);
+
+	start = harness_usecs();
+	while(!browsed) {
+		CHECK(harness_usecs() - start < TIMEOUT_MS * 1000LL);
+		sp_session_process_events(session, &next_timeout);
+		usleep(10000);
+	}
+
+	/* Sent again on the new connection */
+	CHECK(check_log(commands, 1) == 2);
+
+	CHECK(sp_albumbrowse_error(alb) == SP_ERROR_OK);
+	CHECK(sp_albumbrowse_num_tracks(alb) == NUM_TRACKS);
+	for(i = 0; i < NUM_TRACKS; i++) {
+		track = sp_albumbrowse_track(alb, i);
+		make_id(track_id, 16, 3, i);
+		sprintf(name, "Track %d", i);
+
+		CHECK(memcmp(track->id, track_id, 16) == 0);
+		CHECK(strcmp(sp_track_name(track), name) == 0);
+	}
+
+}
+
+
+/* A substream of a track that's playing, dropped halfway through */
+static void test_substream(void) {
+	static const char *commands[] = {
+		"Got command 0x4f", "Got command 0x0c", "Got command 0x08"
+	};
+	unsigned char track_id[16], file_id[20], key[16];
+	static unsigned char data[FILE_SIZE], received[FILE_SIZE];
+	struct player_substream_ctx *psc;
+	struct player *player;
+	sp_session *session;
+	sp_track *track;
+	char hex[41], name[64];
+	long long start;
+	int next_timeout;
+	int i;
+
+	make_id(track_id, 16, 4, 0);
+	make_id(file_id, 20, 5, 0);
+	make_id(key, 16, 6, 0);
+	hex_bytes_to_ascii(file_id, hex, 20);
+
+	for(i = 0; i < FILE_SIZE; i++)
+		data[i] = (unsigned char)(i * 7 + i / 4096);
+
+	sprintf(name, "file-%s", hex);
+	write_fixture(name, data, FILE_SIZE);
+	sprintf(name, "key-%s", hex);
+	write_fixture(name, key, sizeof(key));
+
+	start_mockap(SUBSTREAM_DROP_PACKETS);
+	session = harness_login(&callbacks);
+	player = session->player;
+
+	CHECK((track = osfy_track_add(session, track_id)) != NULL);
+	memcpy(track->file_id, file_id, sizeof(file_id));
+
+	/*
+	 * As if the track was playing, with its key delivered. Set before
+	 * the request is posted, which makes them visible to the iothread.
+	 *
+	 */
+	player->key_track = track;
+	player->key_delivered = 1;
+	player->has_token = 1;
+	player->is_downloading = FILE_SIZE;
+
+	psc = malloc(sizeof(struct player_substream_ctx));
+	psc->track = track;
+	sp_track_add_ref(track);
+	psc->offset = 0;
+	psc->length = FILE_SIZE;
+	request_post(session, REQ_TYPE_PLAYER_SUBSTREAM, psc);
+
+	/* Cleared by the player thread once all of it was received */
+	start = harness_usecs();
+	while(osfy_atomic_load_int(&player->is_downloading)) {
+		CHECK(harness_usecs() - start < TIMEOUT_MS * 1000LL);
+		sp_session_process_events(session, &next_timeout);
+		usleep(10000);
+	}
+
+	/* Token and key asked for before the substream was sent again */
+	CHECK(check_log(commands, 3) == 1);
+
+	CHECK(!player->is_eof);
+	CHECK(rbuf_length(player->ogg) == FILE_SIZE);
+	rbuf_seek_reader(player->ogg, 0, SEEK_SET);
+	CHECK(rbuf_read(player->ogg, received, FILE_SIZE) == FILE_SIZE);
+	CHECK(memcmp(received, data, FILE_SIZE) == 0);
+
+}
+
+
+int main(void) {
+	char path[128];
+
+	CHECK(mkdtemp(dir) != NULL);
+
+	harness_fork("browse", test_browse);
+	harness_fork("substream", test_substream);
+
+	sprintf(path, "rm -rf %s", dir);
+	CHECK(system(path) == 0);
+
+	printf("ok\n");
+
+	return 0;
+}
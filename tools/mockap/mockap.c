@@ -0,0 +1,1097 @@
+/*
+ * Mock access point for running libopenspotify without Spotify's service
+ *
+ * Implements the server side of the key exchange in login.c and the
+ * Shannon packet framing in packet.c, and answers requests with canned
+ * replies read from a directory of fixture files:
+ *
+ *   CMD_BROWSE        artist-<id>.xml, album-<id>.xml and track-<id>.xml
+ *   CMD_SEARCH        search-<query>.xml, or search.xml if there's none
+ *   CMD_GETPLAYLIST   playlist-<id>.xml
+ *   CMD_IMAGE         image-<id>
+ *   CMD_REQKEY        key-<file id>, 16 bytes
+ *   CMD_GETSUBSTREAM  file-<file id>, sliced at the requested offset
+ *
+ * IDs are lowercase hex. Track browsing wraps the track-<id>.xml
+ * fragments of all tracks requested in a single <tracks> element.
+ * Browse and search replies are compressed like the real service's,
+ * playlists are sent as they are. Requests for missing fixtures are
+ * failed with CMD_CHANNELERR.
+ *
+ * The XML files saved by a DEBUG build of libopenspotify can be used
+ * as fixtures. Non-alphanumeric characters in search queries are
+ * replaced with '_' when looking up search-<query>.xml.
+ *
+ * Latency, bandwidth and loss can be set on the command line to see
+ * how the library copes with slow or unreliable connections. Since
+ * the transport is TCP, loss is simulated by failing a percentage of
+ * all channels, or by dropping the whole connection every N packets.
+ * The packets queued before a drop are still sent, so the client sees
+ * replies cut short. Drops can be limited to the first connections.
+ *
+ * Point the library to the mock with OPENSPOTIFY_SERVER=host:port
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/bn.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+
+#include "hmac.h"
+#include "sha1.h"
+#include "shn.h"
+
+
+/* Commands from commands.h, which can't be included without the rest of the library */
+#define CMD_SECRETBLK	0x02
+#define CMD_GETSUBSTREAM	0x08
+#define CMD_CHANNELDATA	0x09
+#define CMD_CHANNELERR	0x0a
+#define CMD_REQKEY	0x0c
+#define CMD_AESKEY	0x0d
+#define CMD_IMAGE	0x19
+#define CMD_COUNTRYCODE	0x1b
+#define CMD_BROWSE	0x30
+#define CMD_SEARCH	0x31
+#define CMD_GETPLAYLIST	0x35
+#define CMD_WELCOME	0x69
+
+#define BROWSE_ARTIST	1
+#define BROWSE_ALBUM	2
+
+
+#define MOCKAP_DEFAULT_PORT		"4070"
+#define MOCKAP_DEFAULT_PASSWORD		"password"
+
+/* Max size of a channel data packet, excluding the channel ID */
+#define MOCKAP_CHUNK_SIZE		4096
+
+/* Max number of bytes handed to send() at once when limiting bandwidth */
+#define MOCKAP_SEND_SIZE		1460
+
+/* Puzzle difficulty, the client tries 2^n solutions on average */
+#define MOCKAP_PUZZLE_DENOMINATOR	4
+#define MOCKAP_PUZZLE_MAGIC		0x4f70656e
+
+
+/* Queued encrypted data, sent once due */
+struct chunk {
+	struct chunk *next;
+	long long due_us;
+	int len;
+	int off;
+	unsigned char data[1];
+};
+
+
+struct conn {
+	int sock;
+
+	char username[256];
+
+	shn_ctx shn_send;
+	shn_ctx shn_recv;
+	unsigned int send_iv;
+	unsigned int recv_iv;
+
+	/* Received data, packets are decrypted in place */
+	unsigned char rx[3 + 65535 + 4];
+	int rx_len;
+	int rx_packet_len;
+
+	/* Send queue and when the next byte may be sent */
+	struct chunk *head;
+	struct chunk *tail;
+	long long next_send_us;
+
+	int num_packets;
+	int dropped;
+};
+
+
+/* Command line options */
+static char *opt_fixtures = ".";
+static char *opt_password = MOCKAP_DEFAULT_PASSWORD;
+static int opt_latency_ms;
+static int opt_bandwidth;
+static int opt_loss;
+static int opt_drop_packets;
+static int opt_drop_connections;
+static int opt_verbose;
+
+
+static unsigned char DH_prime[] = {
+	/* Well-known Group 1, 768-bit prime */
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xc9,
+	0x0f, 0xda, 0xa2, 0x21, 0x68, 0xc2, 0x34, 0xc4, 0xc6,
+	0x62, 0x8b, 0x80, 0xdc, 0x1c, 0xd1, 0x29, 0x02, 0x4e,
+	0x08, 0x8a, 0x67, 0xcc, 0x74, 0x02, 0x0b, 0xbe, 0xa6,
+	0x3b, 0x13, 0x9b, 0x22, 0x51, 0x4a, 0x08, 0x79, 0x8e,
+	0x34, 0x04, 0xdd, 0xef, 0x95, 0x19, 0xb3, 0xcd, 0x3a,
+	0x43, 0x1b, 0x30, 0x2b, 0x0a, 0x6d, 0xf2, 0x5f, 0x14,
+	0x37, 0x4f, 0xe1, 0x35, 0x6d, 0x6d, 0x51, 0xc2, 0x45,
+	0xe4, 0x85, 0xb5, 0x76, 0x62, 0x5e, 0x7e, 0xc6, 0xf4,
+	0x4c, 0x42, 0xe9, 0xa6, 0x3a, 0x36, 0x20, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+
+static void usage(char *progname) {
+	fprintf(stderr, "Usage: %s [options]\n", progname);
+	fprintf(stderr, "  -a <address>   Address to listen on (default: all)\n");
+	fprintf(stderr, "  -p <port>      Port to listen on (default: %s)\n", MOCKAP_DEFAULT_PORT);
+	fprintf(stderr, "  -f <dir>       Fixture directory (default: .)\n");
+	fprintf(stderr, "  -P <password>  Password accepted for any user (default: %s)\n", MOCKAP_DEFAULT_PASSWORD);
+	fprintf(stderr, "  -d <ms>        Latency added to every packet\n");
+	fprintf(stderr, "  -b <bytes>     Bandwidth limit in bytes per second\n");
+	fprintf(stderr, "  -l <percent>   Percentage of channels to fail\n");
+	fprintf(stderr, "  -k <packets>   Drop the connection every n packets sent\n");
+	fprintf(stderr, "  -n <count>     Only drop the first n connections\n");
+	fprintf(stderr, "  -v             Log every packet\n");
+	exit(1);
+}
+
+
+static long long now_us(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static void hex(unsigned char *bytes, int len, char *out) {
+	int i;
+
+	for(i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", bytes[i]);
+}
+
+
+static int read_full(int sock, unsigned char *buf, int len) {
+	int ret, off = 0;
+
+	while(off < len) {
+		ret = recv(sock, buf + off, len - off, 0);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		else if(ret <= 0)
+			return -1;
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+
+static int write_full(int sock, unsigned char *buf, int len) {
+	int ret, off = 0;
+
+	while(off < len) {
+		ret = send(sock, buf + off, len - off, 0);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		else if(ret < 0)
+			return -1;
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Load a fixture file into memory
+ * Returns NULL if it doesn't exist
+ *
+ */
+static unsigned char *fixture_load(char *name, int *len) {
+	char path[1024];
+	unsigned char *data;
+	FILE *fd;
+	long size;
+
+	snprintf(path, sizeof(path), "%s/%s", opt_fixtures, name);
+	if((fd = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "mockap: No fixture '%s'\n", path);
+		return NULL;
+	}
+
+	fseek(fd, 0, SEEK_END);
+	size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+
+	data = malloc(size + 1);
+	if(data == NULL || fread(data, 1, size, fd) != (size_t)size) {
+		free(data);
+		fclose(fd);
+		return NULL;
+	}
+
+	fclose(fd);
+	*len = size;
+
+	return data;
+}
+
+
+/*
+ * Compress data the way the service does, as a gzip stream
+ * The client skips the 10 byte header and inflates the rest
+ *
+ */
+static unsigned char *compress_gzip(unsigned char *data, int len, int *out_len) {
+	static unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	unsigned char *out;
+	unsigned long crc;
+	z_stream z;
+	int max;
+
+	memset(&z, 0, sizeof(z));
+	if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	max = deflateBound(&z, len);
+	out = malloc(10 + max + 8);
+	if(out == NULL) {
+		deflateEnd(&z);
+		return NULL;
+	}
+
+	memcpy(out, header, 10);
+
+	z.next_in = data;
+	z.avail_in = len;
+	z.next_out = out + 10;
+	z.avail_out = max;
+	if(deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		free(out);
+		return NULL;
+	}
+
+	*out_len = 10 + z.total_out;
+	deflateEnd(&z);
+
+	/* Trailer with CRC32 and uncompressed size, both little endian */
+	crc = crc32(crc32(0, Z_NULL, 0), data, len);
+	out[(*out_len)++] = crc & 0xff;
+	out[(*out_len)++] = (crc >> 8) & 0xff;
+	out[(*out_len)++] = (crc >> 16) & 0xff;
+	out[(*out_len)++] = (crc >> 24) & 0xff;
+	out[(*out_len)++] = len & 0xff;
+	out[(*out_len)++] = (len >> 8) & 0xff;
+	out[(*out_len)++] = (len >> 16) & 0xff;
+	out[(*out_len)++] = (len >> 24) & 0xff;
+
+	return out;
+}
+
+
+/*
+ * Encrypt a packet and append it to the send queue
+ * Returns -1 if the connection is to be dropped
+ *
+ */
+static int queue_packet(struct conn *c, unsigned char cmd, unsigned char *payload, int len) {
+	unsigned char nonce[4];
+	struct chunk *chunk;
+
+	if(opt_drop_packets && ++c->num_packets % opt_drop_packets == 0) {
+		fprintf(stderr, "mockap: Dropping connection after %d packets\n", c->num_packets);
+		c->dropped = 1;
+		return -1;
+	}
+
+	chunk = malloc(sizeof(struct chunk) + 3 + len + 4);
+	if(chunk == NULL)
+		return -1;
+
+	chunk->next = NULL;
+	chunk->due_us = now_us() + (long long)opt_latency_ms * 1000;
+	chunk->len = 3 + len + 4;
+	chunk->off = 0;
+
+	nonce[0] = (c->send_iv >> 24) & 0xff;
+	nonce[1] = (c->send_iv >> 16) & 0xff;
+	nonce[2] = (c->send_iv >> 8) & 0xff;
+	nonce[3] = c->send_iv & 0xff;
+	shn_nonce(&c->shn_send, nonce, 4);
+
+	chunk->data[0] = cmd;
+	chunk->data[1] = (len >> 8) & 0xff;
+	chunk->data[2] = len & 0xff;
+	if(len)
+		memcpy(chunk->data + 3, payload, len);
+
+	shn_encrypt(&c->shn_send, chunk->data, 3 + len);
+	shn_finish(&c->shn_send, chunk->data + 3 + len, 4);
+
+	c->send_iv++;
+
+	if(opt_verbose)
+		fprintf(stderr, "mockap: Queued command 0x%02x, %d bytes\n", cmd, len);
+
+	if(c->tail)
+		c->tail->next = chunk;
+	else
+		c->head = chunk;
+
+	c->tail = chunk;
+
+	return 0;
+}
+
+
+/*
+ * Send queued data that is due, within the bandwidth limit
+ * Returns the number of microseconds until more can be sent,
+ * -1 if the queue is empty and -2 on errors
+ *
+ */
+static long long flush_queue(struct conn *c) {
+	struct chunk *chunk;
+	long long now;
+	int len;
+
+	while((chunk = c->head) != NULL) {
+		now = now_us();
+		if(chunk->due_us > now)
+			return chunk->due_us - now;
+
+		len = chunk->len - chunk->off;
+		if(opt_bandwidth) {
+			if(c->next_send_us > now)
+				return c->next_send_us - now;
+
+			if(len > MOCKAP_SEND_SIZE)
+				len = MOCKAP_SEND_SIZE;
+
+			c->next_send_us = now + (long long)len * 1000000 / opt_bandwidth;
+		}
+
+		if(write_full(c->sock, chunk->data + chunk->off, len) < 0)
+			return -2;
+
+		chunk->off += len;
+		if(chunk->off < chunk->len)
+			continue;
+
+		c->head = chunk->next;
+		if(c->head == NULL)
+			c->tail = NULL;
+
+		free(chunk);
+	}
+
+	return -1;
+}
+
+
+/*
+ * Reply to a channel request with a single data stream, or fail
+ * the channel if data is NULL or the channel is chosen to be lost
+ *
+ */
+static int reply_channel(struct conn *c, int channel_id, unsigned char *data, int len) {
+	unsigned char payload[2 + MOCKAP_CHUNK_SIZE];
+	int off, n;
+
+	payload[0] = (channel_id >> 8) & 0xff;
+	payload[1] = channel_id & 0xff;
+
+	if(data == NULL || (opt_loss && random() % 100 < opt_loss)) {
+		if(data != NULL)
+			fprintf(stderr, "mockap: Failing channel %d\n", channel_id);
+
+		/* An error code is required, an empty payload means end of data */
+		payload[2] = 0;
+		payload[3] = 1;
+
+		return queue_packet(c, CMD_CHANNELERR, payload, 4);
+	}
+
+	/* No headers */
+	payload[2] = 0;
+	payload[3] = 0;
+	if(queue_packet(c, CMD_CHANNELDATA, payload, 4) < 0)
+		return -1;
+
+	for(off = 0; off < len; off += n) {
+		n = len - off;
+		if(n > MOCKAP_CHUNK_SIZE)
+			n = MOCKAP_CHUNK_SIZE;
+
+		memcpy(payload + 2, data + off, n);
+		if(queue_packet(c, CMD_CHANNELDATA, payload, 2 + n) < 0)
+			return -1;
+	}
+
+	/* End of data */
+	return queue_packet(c, CMD_CHANNELDATA, payload, 2);
+}
+
+
+/* Send a file compressed, or fail the channel if it couldn't be loaded */
+static int reply_compressed(struct conn *c, int channel_id, unsigned char *data, int len) {
+	unsigned char *compressed = NULL;
+	int ret;
+
+	if(data != NULL)
+		compressed = compress_gzip(data, len, &len);
+
+	ret = reply_channel(c, channel_id, compressed, len);
+	free(compressed);
+
+	return ret;
+}
+
+
+static int handle_browse(struct conn *c, unsigned char *payload, int len) {
+	static char *head = "<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<result><tracks>\n";
+	static char *tail = "</tracks></result>\n";
+	unsigned char *data, *track, *ptr;
+	char name[64];
+	int channel_id, kind, num, i;
+	int data_len, track_len;
+	int ret;
+
+	if(len < 3 + 16)
+		return -1;
+
+	channel_id = (payload[0] << 8) | payload[1];
+	kind = payload[2];
+
+	if(kind == BROWSE_ARTIST || kind == BROWSE_ALBUM) {
+		strcpy(name, kind == BROWSE_ARTIST? "artist-": "album-");
+		hex(payload + 3, 16, name + strlen(name));
+		strcat(name, ".xml");
+
+		data = fixture_load(name, &data_len);
+		ret = reply_compressed(c, channel_id, data, data_len);
+		free(data);
+
+		return ret;
+	}
+
+
+	/* Track browsing, collect all tracks requested */
+	num = (len - 3) / 16;
+	data_len = strlen(head);
+	data = malloc(data_len);
+	memcpy(data, head, data_len);
+
+	for(i = 0; i < num; i++) {
+		strcpy(name, "track-");
+		hex(payload + 3 + 16 * i, 16, name + 6);
+		strcat(name, ".xml");
+
+		if((track = fixture_load(name, &track_len)) == NULL) {
+			free(data);
+			return reply_channel(c, channel_id, NULL, 0);
+		}
+
+		ptr = realloc(data, data_len + track_len + strlen(tail));
+		if(ptr == NULL) {
+			free(track);
+			free(data);
+			return -1;
+		}
+
+		data = ptr;
+		memcpy(data + data_len, track, track_len);
+		data_len += track_len;
+		free(track);
+	}
+
+	memcpy(data + data_len, tail, strlen(tail));
+	data_len += strlen(tail);
+
+	ret = reply_compressed(c, channel_id, data, data_len);
+	free(data);
+
+	return ret;
+}
+
+
+static int handle_search(struct conn *c, unsigned char *payload, int len) {
+	unsigned char *data;
+	char name[512];
+	int channel_id, query_len, data_len;
+	int ret, i;
+
+	if(len < 13 || 13 + payload[12] > len)
+		return -1;
+
+	channel_id = (payload[0] << 8) | payload[1];
+	query_len = payload[12];
+
+	strcpy(name, "search-");
+	for(i = 0; i < query_len; i++)
+		name[7 + i] = isalnum(payload[13 + i])? payload[13 + i]: '_';
+
+	strcpy(name + 7 + query_len, ".xml");
+
+	if((data = fixture_load(name, &data_len)) == NULL)
+		data = fixture_load("search.xml", &data_len);
+
+	ret = reply_compressed(c, channel_id, data, data_len);
+	free(data);
+
+	return ret;
+}
+
+
+/* Serve playlists and images as they are */
+static int handle_plain(struct conn *c, char *prefix, char *suffix,
+		unsigned char *payload, int len, int id_len) {
+	unsigned char *data;
+	char name[128];
+	int channel_id, data_len;
+	int ret;
+
+	if(len < 2 + id_len)
+		return -1;
+
+	channel_id = (payload[0] << 8) | payload[1];
+
+	strcpy(name, prefix);
+	hex(payload + 2, id_len, name + strlen(name));
+	strcat(name, suffix);
+
+	data = fixture_load(name, &data_len);
+	ret = reply_channel(c, channel_id, data, data_len);
+	free(data);
+
+	return ret;
+}
+
+
+static int handle_reqkey(struct conn *c, unsigned char *payload, int len) {
+	unsigned char reply[4 + 16];
+	unsigned char *data;
+	char name[64];
+	int channel_id, data_len;
+
+	if(len < 40)
+		return -1;
+
+	channel_id = (payload[38] << 8) | payload[39];
+
+	strcpy(name, "key-");
+	hex(payload, 20, name + 4);
+
+	data = fixture_load(name, &data_len);
+	if(data == NULL || data_len != 16 || (opt_loss && random() % 100 < opt_loss)) {
+		free(data);
+		return reply_channel(c, channel_id, NULL, 0);
+	}
+
+	reply[0] = 0;
+	reply[1] = 0;
+	reply[2] = (channel_id >> 8) & 0xff;
+	reply[3] = channel_id & 0xff;
+	memcpy(reply + 4, data, 16);
+	free(data);
+
+	return queue_packet(c, CMD_AESKEY, reply, sizeof(reply));
+}
+
+
+static int handle_getsubstream(struct conn *c, unsigned char *payload, int len) {
+	unsigned char *data;
+	char name[64];
+	int channel_id, data_len;
+	unsigned int offset, end;
+	int ret;
+
+	if(len < 44)
+		return -1;
+
+	channel_id = (payload[0] << 8) | payload[1];
+
+	/* Offsets are in 32-bit words */
+	offset = ((payload[36] << 24) | (payload[37] << 16) | (payload[38] << 8) | payload[39]) << 2;
+	end = ((payload[40] << 24) | (payload[41] << 16) | (payload[42] << 8) | payload[43]) << 2;
+
+	strcpy(name, "file-");
+	hex(payload + 16, 20, name + 5);
+
+	data = fixture_load(name, &data_len);
+	if(data == NULL || offset >= (unsigned int)data_len || end < offset) {
+		free(data);
+		return reply_channel(c, channel_id, NULL, 0);
+	}
+
+	if(end > (unsigned int)data_len)
+		end = data_len;
+
+	ret = reply_channel(c, channel_id, data + offset, end - offset);
+	free(data);
+
+	return ret;
+}
+
+
+static int handle_command(struct conn *c, int cmd, unsigned char *payload, int len) {
+	if(opt_verbose)
+		fprintf(stderr, "mockap: Got command 0x%02x, %d bytes\n", cmd, len);
+
+	switch(cmd) {
+	case CMD_BROWSE:
+		return handle_browse(c, payload, len);
+
+	case CMD_SEARCH:
+		return handle_search(c, payload, len);
+
+	case CMD_GETPLAYLIST:
+		return handle_plain(c, "playlist-", ".xml", payload, len, 17);
+
+	case CMD_IMAGE:
+		return handle_plain(c, "image-", "", payload, len, 20);
+
+	case CMD_REQKEY:
+		return handle_reqkey(c, payload, len);
+
+	case CMD_GETSUBSTREAM:
+		return handle_getsubstream(c, payload, len);
+
+	default:
+		/* Pongs, cache hashes, logging and such are ignored */
+		break;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Receive and handle the packets available on the socket
+ * Returns -1 when the connection is to be closed
+ *
+ */
+static int read_packets(struct conn *c) {
+	unsigned char nonce[4];
+	unsigned char *ptr;
+	int ret, used;
+
+	ret = recv(c->sock, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+	if(ret < 0 && errno == EINTR)
+		return 0;
+	else if(ret <= 0)
+		return -1;
+
+	c->rx_len += ret;
+
+	for(used = 0;;) {
+		ptr = c->rx + used;
+
+		if(c->rx_packet_len < 0) {
+			if(c->rx_len - used < 3)
+				break;
+
+			nonce[0] = (c->recv_iv >> 24) & 0xff;
+			nonce[1] = (c->recv_iv >> 16) & 0xff;
+			nonce[2] = (c->recv_iv >> 8) & 0xff;
+			nonce[3] = c->recv_iv & 0xff;
+			shn_nonce(&c->shn_recv, nonce, 4);
+
+			shn_decrypt(&c->shn_recv, ptr, 3);
+			c->rx_packet_len = (ptr[1] << 8) | ptr[2];
+		}
+
+		if(c->rx_len - used < 3 + c->rx_packet_len + 4)
+			break;
+
+		shn_decrypt(&c->shn_recv, ptr + 3, c->rx_packet_len);
+		c->recv_iv++;
+
+		if(handle_command(c, ptr[0], ptr + 3, c->rx_packet_len) < 0)
+			return -1;
+
+		used += 3 + c->rx_packet_len + 4;
+		c->rx_packet_len = -1;
+	}
+
+	memmove(c->rx, c->rx + used, c->rx_len - used);
+	c->rx_len -= used;
+
+	return 0;
+}
+
+
+/*
+ * Compute the DH public and shared keys, retrying until both are
+ * exactly 96 bytes since the client doesn't handle shorter keys
+ *
+ */
+static int dh_exchange(unsigned char *client_pub, unsigned char *server_pub, unsigned char *shared_key) {
+	BN_CTX *ctx;
+	BIGNUM *p, *g, *remote, *priv, *pub, *key;
+	int ret = -1;
+
+	ctx = BN_CTX_new();
+	p = BN_bin2bn(DH_prime, sizeof(DH_prime), NULL);
+	g = BN_new();
+	remote = BN_bin2bn(client_pub, 96, NULL);
+	priv = BN_new();
+	pub = BN_new();
+	key = BN_new();
+	if(ctx == NULL || p == NULL || g == NULL || remote == NULL
+		|| priv == NULL || pub == NULL || key == NULL)
+		goto out;
+
+	BN_set_word(g, 2);
+	do {
+		if(!BN_rand(priv, 256, -1, 0)
+			|| !BN_mod_exp(pub, g, priv, p, ctx)
+			|| !BN_mod_exp(key, remote, priv, p, ctx))
+			goto out;
+	} while(BN_num_bytes(pub) != 96 || BN_num_bytes(key) != 96);
+
+	BN_bn2bin(pub, server_pub);
+	BN_bn2bin(key, shared_key);
+	ret = 0;
+
+out:
+	BN_free(key);
+	BN_free(pub);
+	BN_clear_free(priv);
+	BN_free(remote);
+	BN_free(g);
+	BN_free(p);
+	BN_CTX_free(ctx);
+
+	return ret;
+}
+
+
+static int puzzle_check(unsigned char *server_random, unsigned char *solution) {
+	unsigned char digest[20];
+	unsigned int value;
+	SHA1_CTX ctx;
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, server_random, 16);
+	SHA1Update(&ctx, solution, 8);
+	SHA1Final(digest, &ctx);
+
+	value = (digest[16] << 24) | (digest[17] << 16) | (digest[18] << 8) | digest[19];
+	value ^= MOCKAP_PUZZLE_MAGIC;
+
+	return (value & ((1 << MOCKAP_PUZZLE_DENOMINATOR) - 1)) == 0;
+}
+
+
+/*
+ * Run the server side of login_process()
+ * Returns 0 once the client is authenticated and the ciphers are keyed
+ *
+ */
+static int handshake(struct conn *c) {
+	static unsigned char auth_ok[] = { 0x00, 0x01, 0x00 };
+	static unsigned char auth_failed[] = { 0x01, 0x01 };
+	unsigned char client_params[1024], server_params[1024];
+	unsigned char *client_random, *server_random, *salt, *ptr;
+	unsigned char shared_key[96], auth_hash[20], message[53];
+	unsigned char keys[20 * 5], auth[36], digest[20];
+	unsigned char *hmac_msg;
+	int client_len, server_len, username_len, i;
+	unsigned char space = ' ';
+	SHA1_CTX ctx;
+
+	/* Client parameters */
+	if(read_full(c->sock, client_params, 4) < 0)
+		return -1;
+
+	client_len = (client_params[2] << 8) | client_params[3];
+	if(client_len < 277 || client_len > (int)sizeof(client_params)
+		|| read_full(c->sock, client_params + 4, client_len - 4) < 0)
+		return -1;
+
+	username_len = client_params[273];
+	if(276 + client_params[272] + username_len > client_len)
+		return -1;
+
+	memcpy(c->username, client_params + 276 + client_params[272], username_len);
+	c->username[username_len] = 0;
+	client_random = client_params + 32;
+
+
+	/* Server parameters */
+	ptr = server_params;
+	server_random = ptr;
+	RAND_bytes(ptr, 16);
+	ptr[0] = 0;	/* Status, non-zero for login errors */
+	ptr += 16;
+
+	if(dh_exchange(client_params + 48, ptr, shared_key) < 0)
+		return -1;
+
+	ptr += 96;
+
+	RAND_bytes(ptr, 256);	/* Unknown blob */
+	ptr += 256;
+
+	salt = ptr;
+	RAND_bytes(ptr, 10);
+	ptr += 10;
+
+	*ptr++ = 1;		/* Padding length */
+	*ptr++ = username_len;
+
+	/* Lengths of the puzzle and three unused challenges */
+	*ptr++ = 0;
+	*ptr++ = 6;
+	memset(ptr, 0, 6);
+	ptr += 6;
+
+	*ptr++ = 0;		/* Padding */
+
+	memcpy(ptr, c->username, username_len);
+	ptr += username_len;
+
+	*ptr++ = 1;
+	*ptr++ = MOCKAP_PUZZLE_DENOMINATOR;
+	*ptr++ = (MOCKAP_PUZZLE_MAGIC >> 24) & 0xff;
+	*ptr++ = (MOCKAP_PUZZLE_MAGIC >> 16) & 0xff;
+	*ptr++ = (MOCKAP_PUZZLE_MAGIC >> 8) & 0xff;
+	*ptr++ = MOCKAP_PUZZLE_MAGIC & 0xff;
+
+	server_len = ptr - server_params;
+	if(write_full(c->sock, server_params, server_len) < 0)
+		return -1;
+
+
+	/* Derive the same keys as key_init() in login.c */
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, salt, 10);
+	SHA1Update(&ctx, &space, 1);
+	SHA1Update(&ctx, (unsigned char *)opt_password, strlen(opt_password));
+	SHA1Final(auth_hash, &ctx);
+
+	memcpy(message, auth_hash, 20);
+	memcpy(message + 20, client_random, 16);
+	memcpy(message + 36, server_random, 16);
+	for(i = 1; i <= 5; i++) {
+		message[52] = i;
+		sha1_hmac(shared_key, 96, message, sizeof(message), keys + 20 * (i - 1));
+		memcpy(message, keys + 20 * (i - 1), 20);
+	}
+
+
+	/* Verify the client's puzzle solution and HMAC */
+	if(read_full(c->sock, auth, sizeof(auth)) < 0)
+		return -1;
+
+	hmac_msg = malloc(client_len + server_len + 16);
+	if(hmac_msg == NULL)
+		return -1;
+
+	memcpy(hmac_msg, client_params, client_len);
+	memcpy(hmac_msg + client_len, server_params, server_len);
+	memcpy(hmac_msg + client_len + server_len, auth + 20, 16);
+	sha1_hmac(keys, 20, hmac_msg, client_len + server_len + 16, digest);
+	free(hmac_msg);
+
+	if(!puzzle_check(server_random, auth + 28) || memcmp(digest, auth, 20) != 0) {
+		fprintf(stderr, "mockap: Authentication failed for user '%s'\n", c->username);
+		write_full(c->sock, auth_failed, sizeof(auth_failed));
+		return -1;
+	}
+
+	if(write_full(c->sock, auth_ok, sizeof(auth_ok)) < 0)
+		return -1;
+
+
+	/* The client's send key is our receive key and vice versa */
+	shn_key(&c->shn_recv, keys + 20, 32);
+	shn_key(&c->shn_send, keys + 52, 32);
+	c->send_iv = 0;
+	c->recv_iv = 0;
+
+	fprintf(stderr, "mockap: User '%s' logged in\n", c->username);
+
+	return 0;
+}
+
+
+static void serve(int sock) {
+	unsigned char secret_block[336];
+	unsigned int t;
+	struct pollfd pfd;
+	struct chunk *chunk;
+	struct conn *c;
+	long long wait;
+	int one = 1;
+
+	c = calloc(1, sizeof(struct conn));
+	if(c == NULL)
+		return;
+
+	c->sock = sock;
+	c->rx_packet_len = -1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if(handshake(c) < 0)
+		goto out;
+
+
+	/* Initial packets sent by the service after login */
+	memset(secret_block, 0, sizeof(secret_block));
+	t = time(NULL);
+	secret_block[0] = (t >> 24) & 0xff;
+	secret_block[1] = (t >> 16) & 0xff;
+	secret_block[2] = (t >> 8) & 0xff;
+	secret_block[3] = t & 0xff;
+	t += 86400;
+	secret_block[4] = (t >> 24) & 0xff;
+	secret_block[5] = (t >> 16) & 0xff;
+	secret_block[6] = (t >> 8) & 0xff;
+	secret_block[7] = t & 0xff;
+
+	if(queue_packet(c, CMD_SECRETBLK, secret_block, sizeof(secret_block)) < 0
+		|| queue_packet(c, CMD_COUNTRYCODE, (unsigned char *)"SE", 2) < 0
+		|| queue_packet(c, CMD_WELCOME, NULL, 0) < 0)
+		goto out;
+
+
+	for(;;) {
+		if((wait = flush_queue(c)) == -2)
+			break;
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, wait < 0? -1: (int)((wait + 999) / 1000)) < 0) {
+			if(errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		if(pfd.revents && read_packets(c) < 0)
+			break;
+	}
+
+out:
+	while((chunk = c->head) != NULL) {
+		/* Cut short, but what was queued before gets through */
+		if(c->dropped)
+			write_full(sock, chunk->data + chunk->off, chunk->len - chunk->off);
+
+		c->head = chunk->next;
+		free(chunk);
+	}
+
+	fprintf(stderr, "mockap: Closing connection for user '%s'\n", c->username);
+	free(c);
+}
+
+
+int main(int argc, char **argv) {
+	char *address = NULL, *port = MOCKAP_DEFAULT_PORT;
+	struct addrinfo hints, *ai;
+	int sock, client;
+	int opt, one = 1;
+	int num_connections = 0;
+
+	while((opt = getopt(argc, argv, "a:p:f:P:d:b:l:k:n:v")) != -1) {
+		switch(opt) {
+		case 'a': address = optarg; break;
+		case 'p': port = optarg; break;
+		case 'f': opt_fixtures = optarg; break;
+		case 'P': opt_password = optarg; break;
+		case 'd': opt_latency_ms = atoi(optarg); break;
+		case 'b': opt_bandwidth = atoi(optarg); break;
+		case 'l': opt_loss = atoi(optarg); break;
+		case 'k': opt_drop_packets = atoi(optarg); break;
+		case 'n': opt_drop_connections = atoi(optarg); break;
+		case 'v': opt_verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(address, port, &hints, &ai) != 0) {
+		fprintf(stderr, "mockap: Failed to lookup address to listen on\n");
+		return 1;
+	}
+
+	sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if(sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen(sock, 16) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	freeaddrinfo(ai);
+
+	/* Connections are served by child processes which needn't be waited for */
+	signal(SIGCHLD, SIG_IGN);
+
+	fprintf(stderr, "mockap: Listening on port %s, serving fixtures from '%s'\n",
+		port, opt_fixtures);
+
+	for(;;) {
+		client = accept(sock, NULL, NULL);
+		if(client < 0) {
+			if(errno == EINTR)
+				continue;
+
+			perror("accept");
+			return 1;
+		}
+
+		num_connections++;
+
+		switch(fork()) {
+		case -1:
+			perror("fork");
+			close(client);
+			break;
+
+		case 0:
+			close(sock);
+			srandom(time(NULL) ^ getpid());
+
+			if(opt_drop_connections && num_connections > opt_drop_connections)
+				opt_drop_packets = 0;
+
+			serve(client);
+			close(client);
+			exit(0);
+
+		default:
+			close(client);
+			break;
+		}
+	}
+
+	return 0;
+}